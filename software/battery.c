@@ -24,42 +24,41 @@
 #include "util.h"
 #include "settings.h"
 #include "statemachine.h"
+#include "scheduler.h"
 #include "types.h"
 
 extern BMS bms;
 extern Battery battery;
-extern State state;
 
 //
 // BMS
 //
 
 void bms_heartbeat() {
-    bms.lastHeartbeat = get_clock();
+    timestamp_store(&bms.heartbeatDeadline, deadline_in_ms(BMS_TTL));
 }
 
 /*
  * Return true if we have seen a message from the BMS within the last BMS_TTL
- * seconds. If we lose communication with the BMS we should stop any charging
+ * ms. If we lose communication with the BMS we should stop any charging
  * activity straight away.
  */
 bool bms_is_alive() {
-    return ( ((double)(get_clock() - bms.lastHeartbeat) / CLOCKS_PER_SEC) < BMS_TTL );
+    return ! deadline_passed(timestamp_load(&bms.heartbeatDeadline));
 }
 
 // Watch for no messages from BMS
 
-struct repeating_timer bmsLivenessCheckTimer;
-
-bool bms_liveness_check(struct repeating_timer *t) {
+void bms_liveness_check() {
     if ( ! bms_is_alive() ) {
-        state(E_BMS_LIVENESS_CHECK_FAILED);
+        post_event(E_BMS_LIVENESS_CHECK_FAILED);
     }
-    return true;
 }
 
+// The BMS gets BMS_TTL from here to say something
 void enable_bms_liveness_check() {
-    add_repeating_timer_ms(1000, bms_liveness_check, NULL, &bmsLivenessCheckTimer);
+    bms_heartbeat();
+    enable_task(TASK_BMS_LIVENESS);
 }
 
 
@@ -68,44 +67,64 @@ void enable_bms_liveness_check() {
 // Voltage
 //
 
-float battery_get_target_voltage() {
+uint16_t battery_get_target_voltage() {
     return battery.targetVoltage;
 }
 
 /*
- * Do a quick and dirty calculation to get battery voltage corresponding to SoC
+ * Do a quick and dirty calculation to get battery voltage (V) corresponding to
+ * SoC, interpolating linearly between the BMS's empty and full voltages.
  */
-uint8_t battery_get_voltage_from_soc(uint8_t soc) {
-    if ( bms.soc > 100 ) bms.soc = 100;
-    return ( ( bms.maximumVoltage - bms.minimumVoltage ) * bms.soc ) + bms.minimumVoltage;
+uint16_t battery_get_voltage_from_soc(uint8_t soc) {
+    if ( soc > 100 ) {
+        soc = 100;
+    }
+    DeciVolts range = bms.maximumVoltage - bms.minimumVoltage;
+    return WHOLE( bms.minimumVoltage + ( range * soc ) / 100 );
 }
 
 /*
  * Based on our SoC and a given charge current, calculate how many minutes we
- * think it will take to charge to the specified SoC.
+ * think it will take to charge to the specified SoC. 0x101 only has a byte for
+ * each, so anything past 255 minutes is sent as 255.
  */
 
+static uint8_t saturate_minutes(uint32_t minutes) {
+    return minutes > UINT8_MAX ? UINT8_MAX : (uint8_t)minutes;
+}
+
+static void set_charging_time_minutes(uint32_t minutes) {
+    battery.chargingTimeMinutes = saturate_minutes(minutes);
+    battery.chargingTimeMinutesMax = saturate_minutes(minutes * MAX_CHARGING_TIME_SCALING_PERCENT / 100);
+}
+
+static uint32_t soc_remaining(uint8_t targetSoc) {
+    return targetSoc > bms.soc ? targetSoc - bms.soc : 0;
+}
+
 // Calculate based on watt-hours
 void battery_recalculate_charging_time_minutes_by_wh(uint8_t current, uint8_t targetSoc) {
 
-    uint16_t whRemaining = battery.capacityWH - ( battery.capacityWH * bms.soc );
-
     /* Use the average voltage between the current pack voltage and the pack
      * voltage at the target SoC to get a more accurate estimate.
      */
     uint32_t chargingWatts = current * battery_get_voltage_from_soc( ( bms.soc + targetSoc ) / 2 );
+    if ( chargingWatts == 0 ) {
+        return;
+    }
 
-    battery.chargingTimeMinutes = (uint8_t)( whRemaining / chargingWatts / 60 );
-    battery.chargingTimeMinutesMax = battery.chargingTimeMinutes * MAX_CHARGING_TIME_SCALING_FACTOR;
+    // Wh x % x 60, divided down last so we don't lose the fraction
+    set_charging_time_minutes( (uint32_t)battery.capacityWH * soc_remaining(targetSoc) * 60 / 100 / chargingWatts );
 }
 
 // Calculate based on amp-hours
 void battery_recalculate_charging_time_minutes_by_ah(uint8_t current, uint8_t targetSoc) {
 
-    uint16_t ahRemaining = battery.capacityAH - ( battery.capacityAH * bms.soc );
+    if ( current == 0 ) {
+        return;
+    }
 
-    battery.chargingTimeMinutes = (uint8_t)( ahRemaining / current / 60 );
-    battery.chargingTimeMinutesMax = battery.chargingTimeMinutes * MAX_CHARGING_TIME_SCALING_FACTOR;
+    set_charging_time_minutes( (uint32_t)battery.capacityAH * soc_remaining(targetSoc) * 60 / 100 / current );
 }
 
 uint8_t get_charging_time_minutes() {
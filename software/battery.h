@@ -21,12 +21,14 @@
 #define BATTERY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 void bms_heartbeat();
 bool bms_is_alive();
+void bms_liveness_check();
 void enable_bms_liveness_check();
-float battery_get_target_voltage();
-uint8_t battery_get_voltage_from_soc(uint8_t soc);
+uint16_t battery_get_target_voltage();
+uint16_t battery_get_voltage_from_soc(uint8_t soc);
 void battery_recalculate_charging_time_minutes_by_wh(uint8_t current, uint8_t targetSoc);
 void battery_recalculate_charging_time_minutes_by_ah(uint8_t current, uint8_t targetSoc);
 uint8_t get_charging_time_minutes();
@@ -0,0 +1,172 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "hal.h"
+}
+
+#include "canbus.h"
+#include "canlog.h"
+#include "types.h"
+
+/*
+ * Alarm pool for the scheduler on the core that owns the CAN controllers.
+ * NULL means the default pool, which fires on core 0. In dual core mode core 1
+ * sets up a pool of its own.
+ */
+HALAlarmPool *canAlarmPool = NULL;
+
+/*
+ * Check whether the controller had to drop a frame because both receive
+ * buffers were full. clearRXnOVR() also wipes the RXnIF flags for any frame
+ * that arrived in the meantime, so clear the overflow and ERRIF flags on their
+ * own instead.
+ */
+static void check_CAN_overflow(MCP2515 *can, CANStats *stats) {
+    uint8_t eflg = can->getErrorFlags();
+    if ( eflg & ( MCP2515::EFLG_RX0OVR | MCP2515::EFLG_RX1OVR ) ) {
+        if ( eflg & MCP2515::EFLG_RX0OVR ) stats->overflows++;
+        if ( eflg & MCP2515::EFLG_RX1OVR ) stats->overflows++;
+        can->clearRXnOVRFlags();
+        can->clearERRIF();
+    }
+}
+
+/*
+ * Read and hand off every frame waiting in the controller's receive buffers,
+ * up to CAN_RX_BUDGET frames. Returns the number of frames read.
+ */
+uint8_t receive_CAN_messages(MCP2515 *can, struct can_frame *frame, CANMessageHandler handler, CANStats *stats) {
+
+    uint8_t frames = 0;
+
+    // If INT is wired, a high INT means we can stop without asking over SPI
+    while ( frames < CAN_RX_BUDGET && can->interruptPending() && can->readMessage(frame) == MCP2515::ERROR_OK ) {
+        handler(frame);
+        frames++;
+    }
+
+    stats->framesLastTick = frames;
+    stats->framesReceived += frames;
+    if ( frames > stats->maxFramesPerTick ) {
+        stats->maxFramesPerTick = frames;
+    }
+    if ( frames == CAN_RX_BUDGET ) {
+        stats->budgetExhausted++;
+    }
+
+    if ( frames > 0 ) {
+        check_CAN_overflow(can, stats);
+    }
+
+    return frames;
+}
+
+/*
+ * DMA version of receive_CAN_messages(). Queue a read of each full receive
+ * buffer and return. The frames are handed off from the DMA IRQ as each read
+ * completes.
+ */
+void queue_CAN_messages(MCP2515 *can, CANStats *stats) {
+
+    MCP2515::ERROR rc = can->queueReadMessages();
+
+    if ( rc == MCP2515::ERROR_QUEUEFULL ) {
+        stats->budgetExhausted++;
+    }
+
+    if ( rc != MCP2515::ERROR_NOMSG ) {
+        check_CAN_overflow(can, stats);
+    }
+}
+
+/*
+ * Producer side of the frame queue, called from the receive path. Returns
+ * false, and drops the frame, if the main loop has fallen a whole queue behind.
+ */
+bool push_CAN_frame(CANFrameQueue *queue, const struct can_frame *frame, CANStats *stats) {
+
+    uint32_t head = queue->head;
+    uint32_t queued = head - queue->tail;
+
+    if ( queued >= CAN_RX_QUEUE_SIZE ) {
+        stats->queueFull++;
+        return false;
+    }
+
+    CANQueuedFrame *slot = &queue->frames[head & ( CAN_RX_QUEUE_SIZE - 1 )];
+    slot->frame = *frame;
+    slot->timestamp = hal_time_us();
+
+    // The frame has to be in memory before the consumer can see the new head
+    hal_memory_barrier();
+    queue->head = head + 1;
+
+    if ( queued + 1 > stats->maxQueued ) {
+        stats->maxQueued = queued + 1;
+    }
+
+    // Wake the main loop if it's waiting for work
+    hal_signal_event();
+
+    return true;
+}
+
+/*
+ * Consumer side of the frame queue, called from the main loop. Hand every
+ * queued frame to the decoder. Returns the number of frames decoded.
+ */
+uint8_t drain_CAN_queue(CANFrameQueue *queue, CANMessageHandler handler, CANStats *stats, CANBusTiming *timing) {
+
+    uint8_t frames = 0;
+
+    while ( queue->tail != queue->head ) {
+
+        // Don't read the frame until we've seen the head that published it
+        hal_memory_barrier();
+
+        uint32_t tail = queue->tail;
+        CANQueuedFrame *slot = &queue->frames[tail & ( CAN_RX_QUEUE_SIZE - 1 )];
+
+        if ( CANLogEnabled ) {
+            log_CAN_frame(timing->name, &slot->frame, slot->timestamp);
+        }
+
+        handler(&slot->frame);
+
+        uint64_t handled = hal_time_us();
+        if ( handled - slot->timestamp > stats->maxLatency ) {
+            stats->maxLatency = handled - slot->timestamp;
+        }
+        record_CAN_timing(timing, slot->frame.can_id, slot->timestamp, handled);
+
+        // Done with the slot, let the producer have it back
+        hal_memory_barrier();
+        queue->tail = tail + 1;
+
+        frames++;
+    }
+
+    return frames;
+}
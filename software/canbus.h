@@ -0,0 +1,62 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANBUS_H
+#define CANBUS_H
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "hal.h"
+}
+
+#include "types.h"
+
+extern "C" {
+#include "cantiming.h"
+}
+
+typedef void (*CANMessageHandler)(struct can_frame *frame);
+
+extern HALAlarmPool *canAlarmPool;
+
+typedef struct {
+    struct can_frame frame;
+    uint64_t timestamp;     // us since boot, when it was read from the controller
+} CANQueuedFrame;
+
+/*
+ * Single producer, single consumer ring of received frames. The receive path
+ * pushes from interrupt context and the main loop pops. head is only written
+ * by the producer and tail only by the consumer, so no lock is needed. Both
+ * count up forever and are masked to index the ring.
+ */
+typedef struct {
+    CANQueuedFrame frames[CAN_RX_QUEUE_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} CANFrameQueue;
+
+uint8_t receive_CAN_messages(MCP2515 *can, struct can_frame *frame, CANMessageHandler handler, CANStats *stats);
+void queue_CAN_messages(MCP2515 *can, CANStats *stats);
+bool push_CAN_frame(CANFrameQueue *queue, const struct can_frame *frame, CANStats *stats);
+uint8_t drain_CAN_queue(CANFrameQueue *queue, CANMessageHandler handler, CANStats *stats, CANBusTiming *timing);
+
+#endif
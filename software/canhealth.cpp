@@ -0,0 +1,140 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "statemachine.h"
+#include "scheduler.h"
+#include "hal.h"
+#include "chademocomms.h"
+}
+
+#include "canbus.h"
+#include "canhealth.h"
+#include "comms.h"
+#include "types.h"
+
+extern MCP2515 mainCAN;
+extern MCP2515 chademoCAN;
+
+CANHealth mainCANHealth = { "main" };
+CANHealth chademoCANHealth = { "ChaDeMo" };
+
+static const char *CAN_error_state_name(CANErrorState errorState) {
+    switch ( errorState ) {
+        case CAN_ERROR_ACTIVE:  return "error active";
+        case CAN_ERROR_PASSIVE: return "error passive";
+        case CAN_BUS_OFF:       return "bus-off";
+    }
+    return "unknown";
+}
+
+/*
+ * Sample the controller's error counters and flags, and track which of the
+ * error active, error passive and bus-off states it's in. If it stays bus-off
+ * for longer than it should take to recover by itself, reset and reconfigure
+ * it. If that doesn't work after CAN_MAX_RESETS goes, flag the bus as faulted
+ * for report_CAN_faults() to pass on.
+ */
+void check_CAN_health(MCP2515 *can, CANHealth *health, CANConfigure configure) {
+
+    uint64_t now = hal_time_us();
+
+    health->eflg = can->getErrorFlags();
+    health->tec = can->errorCountTX();
+    health->rec = can->errorCountRX();
+
+    if ( health->tec > health->maxTec ) health->maxTec = health->tec;
+    if ( health->rec > health->maxRec ) health->maxRec = health->rec;
+
+    CANErrorState errorState = CAN_ERROR_ACTIVE;
+    if ( health->eflg & MCP2515::EFLG_TXBO ) {
+        errorState = CAN_BUS_OFF;
+    } else if ( health->eflg & ( MCP2515::EFLG_TXEP | MCP2515::EFLG_RXEP ) ) {
+        errorState = CAN_ERROR_PASSIVE;
+    }
+
+    if ( errorState != health->state ) {
+        printf("%s CAN bus : %s (TEC %d, REC %d)\n", health->name, CAN_error_state_name(errorState), health->tec, health->rec);
+        if ( errorState == CAN_ERROR_PASSIVE ) {
+            health->errorPassiveEvents++;
+        } else if ( errorState == CAN_BUS_OFF ) {
+            health->busOffEvents++;
+            health->busOffSince = now;
+        }
+        health->state = errorState;
+    }
+
+    if ( errorState == CAN_ERROR_ACTIVE ) {
+        health->failedResets = 0;
+        return;
+    }
+
+    if ( errorState != CAN_BUS_OFF || now - health->busOffSince < CAN_BUS_OFF_TIMEOUT * 1000 ) {
+        return;
+    }
+
+    if ( health->failedResets < CAN_MAX_RESETS ) {
+        printf("%s CAN bus : still bus-off, resetting controller\n", health->name);
+        configure();
+        health->resets++;
+        health->failedResets++;
+        health->busOffSince = now;
+    } else if ( ! health->faulted ) {
+        printf("%s CAN bus : giving up after %d resets\n", health->name, health->failedResets);
+        health->faulted = true;
+        health->faultPending = true;
+    }
+}
+
+void handle_CAN_health_check() {
+    check_CAN_health(&mainCAN, &mainCANHealth, configure_main_CAN);
+    check_CAN_health(&chademoCAN, &chademoCANHealth, configure_chademo_CAN);
+}
+
+void enable_CAN_health_monitor() {
+    enable_task(TASK_CAN_HEALTH);
+}
+
+/*
+ * Pass bus faults on to the state machine. Called from the main loop, as the
+ * monitor may be running on the other core.
+ */
+void report_CAN_faults() {
+    CANHealth *buses[] = { &mainCANHealth, &chademoCANHealth };
+    for ( int i = 0; i < 2; i++ ) {
+        if ( buses[i]->faultPending ) {
+            buses[i]->faultPending = false;
+            post_event(E_CAN_BUS_FAULT);
+        }
+    }
+}
+
+void print_CAN_health(const CANHealth *health) {
+    printf("%s CAN bus : %s, TEC %d (max %d), REC %d (max %d), EFLG 0x%02x\n",
+        health->name, CAN_error_state_name(health->state),
+        health->tec, health->maxTec, health->rec, health->maxRec, health->eflg);
+    printf("  error passive %lu, bus-off %lu, resets %lu%s\n",
+        (unsigned long)health->errorPassiveEvents, (unsigned long)health->busOffEvents,
+        (unsigned long)health->resets, health->faulted ? ", faulted" : "");
+}
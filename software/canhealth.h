@@ -0,0 +1,35 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANHEALTH_H
+#define CANHEALTH_H
+
+#include "mcp2515/mcp2515.h"
+
+#include "types.h"
+
+typedef void (*CANConfigure)();
+
+void check_CAN_health(MCP2515 *can, CANHealth *health, CANConfigure configure);
+void handle_CAN_health_check();
+void enable_CAN_health_monitor();
+void report_CAN_faults();
+void print_CAN_health(const CANHealth *health);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "mcp2515/mcp2515.h"
+
+#include "canbus.h"
+#include "canlog.h"
+#include "types.h"
+
+/*
+ * Log every frame we receive and send to the console, one per line, in the
+ * same format as candump -L:
+ *
+ *   (1.250000) main 351#0A0B0C0D0E0F0001
+ *
+ * The timestamp is seconds since boot. Received frames are logged by the main
+ * loop as it decodes them, with the time they were read off the controller.
+ * Sent frames are queued by the CAN core and logged by the main loop too, so
+ * nothing is printed from interrupt context. The log streams as it goes, so
+ * sessions of any length can be captured and replayed through
+ * process_*_CAN_message().
+ */
+
+volatile bool CANLogEnabled = false;
+
+// Frames we've sent, waiting to be logged
+CANFrameQueue CANTxLog;
+CANStats CANTxLogStats;
+
+static const char *const CANTxLogBus = "ChaDeMo";
+
+void log_CAN_frame(const char *bus, const struct can_frame *frame, uint64_t timestamp) {
+
+    if ( frame->can_id & CAN_EFF_FLAG ) {
+        printf("(%lu.%06lu) %s %08lX#", (unsigned long)( timestamp / 1000000 ), (unsigned long)( timestamp % 1000000 ),
+            bus, (unsigned long)( frame->can_id & CAN_EFF_MASK ));
+    } else {
+        printf("(%lu.%06lu) %s %03lX#", (unsigned long)( timestamp / 1000000 ), (unsigned long)( timestamp % 1000000 ),
+            bus, (unsigned long)( frame->can_id & CAN_SFF_MASK ));
+    }
+
+    for ( int i = 0; i < frame->can_dlc && i < CAN_MAX_DLEN; i++ ) {
+        printf("%02X", frame->data[i]);
+    }
+    printf("\n");
+}
+
+/*
+ * Called on the CAN core with each frame handed to the controller
+ */
+void log_sent_CAN_frame(const struct can_frame *frame) {
+    if ( CANLogEnabled ) {
+        push_CAN_frame(&CANTxLog, frame, &CANTxLogStats);
+    }
+}
+
+/*
+ * Log the frames sent since we last looked. Called from the main loop.
+ */
+void process_CAN_log() {
+
+    while ( CANTxLog.tail != CANTxLog.head ) {
+
+        // Don't read the frame until we've seen the head that published it
+        hal_memory_barrier();
+
+        uint32_t tail = CANTxLog.tail;
+        CANQueuedFrame *slot = &CANTxLog.frames[tail & ( CAN_RX_QUEUE_SIZE - 1 )];
+
+        if ( CANLogEnabled ) {
+            log_CAN_frame(CANTxLogBus, &slot->frame, slot->timestamp);
+        }
+
+        // Done with the slot, let the producer have it back
+        hal_memory_barrier();
+        CANTxLog.tail = tail + 1;
+    }
+}
+
+void toggle_CAN_log() {
+    CANLogEnabled = ! CANLogEnabled;
+    if ( ! CANLogEnabled ) {
+        printf("CAN log off, %lu sent frames not logged\n", (unsigned long)CANTxLogStats.queueFull);
+    }
+}
@@ -0,0 +1,141 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANMESSAGES_H
+#define CANMESSAGES_H
+
+extern "C" {
+#include "settings.h"
+}
+
+#include "types.h"
+#include "cansignal.h"
+
+/*
+ * Every message we send or receive, described once. The field comments give
+ * byte.bit positions as in the BMS and ChaDeMo documents. Inbound fields carry
+ * the dirty bit their decoder sets when the value changes, and raw limits
+ * where the signal's full range isn't plausible: SoC up to 100%, cell
+ * temperatures from -40 to 150 C, and voltages up to 1000 V, the most any
+ * ChaDeMo station can supply.
+ */
+
+
+//// ----
+//
+// Main bus, from the BMS
+//
+//// ----
+
+// 0x351. Charge voltage 0,1 / charge current limit 2,3 / discharge current limit 4,5 / discharge voltage 6,7. All 0.1 V or A/bit
+typedef CANMessage<BMS_LIMITS_MESSAGE_ID,
+    CANField<CANSignal< 0, 16>, &BMS::maximumVoltage, BMS_FIELD_MAXIMUM_VOLTAGE, 0, 10000>,
+    CANField<CANSignal<16, 16>, &BMS::maximumChargeCurrent, BMS_FIELD_MAXIMUM_CHARGE_CURRENT>,
+    CANField<CANSignal<32, 16>, &BMS::maximumDischargeCurrent, BMS_FIELD_MAXIMUM_DISCHARGE_CURRENT>,
+    CANField<CANSignal<48, 16>, &BMS::minimumVoltage, BMS_FIELD_MINIMUM_VOLTAGE, 0, 10000>
+> BMSLimitsCodec;
+
+// 0x355. SoC 0,1
+typedef CANMessage<BMS_SOC_MESSAGE_ID,
+    CANField<CANSignal< 0, 16>, &BMS::soc, BMS_FIELD_SOC, 0, 100>
+> BMSSocCodec;
+
+// 0x356. Voltage 0,1 (0.01 V/bit) / current 2,3 (0.1 A/bit, +ve is charging) / temperature 4,5 (0.1 C/bit) / shunt voltage 6,7 (0.01 V/bit)
+typedef CANMessage<BMS_STATUS_MESSAGE_ID,
+    CANField<CANSignal< 0, 16, false, 1, 10>, &BMS::voltage, BMS_FIELD_VOLTAGE>,
+    CANField<CANSignal<16, 16, true>,         &BMS::batteryCurrent, BMS_FIELD_BATTERY_CURRENT>,
+    CANField<CANSignal<32, 16, true>,         &BMS::batteryTemperature, BMS_FIELD_BATTERY_TEMPERATURE, -400, 1500>,
+    CANField<CANSignal<48, 16, false, 1, 10>, &BMS::measuredVoltage, BMS_FIELD_MEASURED_VOLTAGE>
+> BMSStatusCodec;
+
+// 0x35A. Alarms in bytes 0-3, warnings in bytes 4-7
+typedef CANMessage<BMS_ALARM_MESSAGE_ID,
+    CANField<CANSignal< 2, 1>, &BMS::highCellAlarm, BMS_FIELD_HIGH_CELL_ALARM>,    // 0.2
+    CANField<CANSignal< 4, 1>, &BMS::lowCellAlarm, BMS_FIELD_LOW_CELL_ALARM>,      // 0.4
+    CANField<CANSignal< 6, 1>, &BMS::highTempAlarm, BMS_FIELD_HIGH_TEMP_ALARM>,    // 0.6
+    CANField<CANSignal< 8, 8>, &BMS::lowTempAlarm, BMS_FIELD_LOW_TEMP_ALARM>,      // 1
+    CANField<CANSignal<24, 8>, &BMS::cellDeltaAlarm, BMS_FIELD_CELL_DELTA_ALARM>,  // 3
+    CANField<CANSignal<34, 1>, &BMS::highCellWarn, BMS_FIELD_HIGH_CELL_WARN>,      // 4.2
+    CANField<CANSignal<36, 1>, &BMS::lowCellWarn, BMS_FIELD_LOW_CELL_WARN>,        // 4.4
+    CANField<CANSignal<38, 1>, &BMS::highTempWarn, BMS_FIELD_HIGH_TEMP_WARN>,      // 4.6
+    CANField<CANSignal<40, 8>, &BMS::lowTempWarn, BMS_FIELD_LOW_TEMP_WARN>         // 5
+> BMSAlarmCodec;
+
+
+//// ----
+//
+// ChaDeMo bus, from the station
+//
+//// ----
+
+// 0x108
+typedef CANMessage<EVSE_CAPABILITIES_MESSAGE_ID,
+    CANField<CANSignal< 0, 8>,  &Station::weldDetectionSupported, STATION_FIELD_WELD_DETECTION_SUPPORTED>,             // 0
+    CANField<CANSignal< 8, 16>, &Station::maximumVoltageAvailable, STATION_FIELD_MAXIMUM_VOLTAGE_AVAILABLE, 0, 1000>,  // 1,2. 1 V/bit
+    CANField<CANSignal<24, 8>,  &Station::availableCurrent, STATION_FIELD_AVAILABLE_CURRENT>,                          // 3. 1 A/bit
+    CANField<CANSignal<32, 16>, &Station::thresholdVoltage, STATION_FIELD_THRESHOLD_VOLTAGE, 0, 1000>                  // 4,5. 1 V/bit
+> EVSECapabilitiesCodec;
+
+// 0x109
+typedef CANMessage<EVSE_STATUS_MESSAGE_ID,
+    CANField<CANSignal< 0, 8>,  &Station::controlProtocolNumber, STATION_FIELD_CONTROL_PROTOCOL_NUMBER>,          // 0
+    CANField<CANSignal< 8, 16>, &Station::outputVoltage, STATION_FIELD_OUTPUT_VOLTAGE, 0, 1000>,                  // 1,2. 1 V/bit
+    CANField<CANSignal<24, 8>,  &Station::outputCurrent, STATION_FIELD_OUTPUT_CURRENT>,                           // 3. 1 A/bit
+    CANField<CANSignal<40, 1>,  &Station::stationStatus, STATION_FIELD_STATION_STATUS>,                           // 5.0
+    CANField<CANSignal<41, 1>,  &Station::stationMalfunction, STATION_FIELD_STATION_MALFUNCTION>,                 // 5.1
+    CANField<CANSignal<42, 1>,  &Station::vehicleConnectorLock, STATION_FIELD_VEHICLE_CONNECTOR_LOCK>,            // 5.2
+    CANField<CANSignal<43, 1>,  &Station::batteryIncompatability, STATION_FIELD_BATTERY_INCOMPATABILITY>,         // 5.3
+    CANField<CANSignal<44, 1>,  &Station::chargingSystemMalfunction, STATION_FIELD_CHARGING_SYSTEM_MALFUNCTION>,  // 5.4
+    CANField<CANSignal<45, 1>,  &Station::chargerStopControl, STATION_FIELD_CHARGER_STOP_CONTROL>,                // 5.5
+    CANField<CANSignal<48, 8, false, 10>, &Station::timeRemainingSeconds, STATION_FIELD_TIME_REMAINING_SECONDS>,  // 6. 10 s/bit
+    CANField<CANSignal<56, 8>,  &Station::timeRemainingMinutes, STATION_FIELD_TIME_REMAINING_MINUTES>             // 7. 1 min/bit
+> EVSEStatusCodec;
+
+
+//// ----
+//
+// ChaDeMo bus, to the station
+//
+//// ----
+
+// 0x100
+typedef CANMessage<0x100,
+    CANField<CANSignal<32, 16>, &ChademoLimitsMessage::maximumBatteryVoltage>,  // 4,5. 1 V/bit
+    CANField<CANSignal<48, 8>,  &ChademoLimitsMessage::chargingRateIndication>  // 6. 1 %/bit
+> ChademoLimitsCodec;
+
+// 0x101
+typedef CANMessage<0x101,
+    CANField<CANSignal< 8, 8, false, 10>,   &ChademoChargeTimeMessage::chargingTimeSecondsMax>,  // 1. 10 s/bit
+    CANField<CANSignal<16, 8>,              &ChademoChargeTimeMessage::chargingTimeMinutesMax>,  // 2. 1 min/bit
+    CANField<CANSignal<24, 8>,              &ChademoChargeTimeMessage::chargingTimeMinutes>,     // 3. 1 min/bit
+    CANField<CANSignal<40, 16, false, 110>, &ChademoChargeTimeMessage::batteryCapacityWH>        // 5,6. 0.11 kWh/bit
+> ChademoChargeTimeCodec;
+
+// 0x102
+typedef CANMessage<0x102,
+    CANField<CANSignal< 0, 8>,  &ChademoStatusMessage::controlProtocolNumber>,   // 0
+    CANField<CANSignal< 8, 16>, &ChademoStatusMessage::targetVoltage>,           // 1,2. 1 V/bit
+    CANField<CANSignal<24, 8>,  &ChademoStatusMessage::chargingCurrentRequest>,  // 3. 1 A/bit
+    CANField<CANSignal<32, 8>,  &ChademoStatusMessage::batteryStatus>,           // 4
+    CANField<CANSignal<40, 8>,  &ChademoStatusMessage::vehicleStatus>,           // 5
+    CANField<CANSignal<48, 8>,  &ChademoStatusMessage::chargedRate>              // 6
+> ChademoStatusCodec;
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANSIGNAL_H
+#define CANSIGNAL_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <type_traits>
+
+#include "mcp2515/can.h"
+
+/*
+ * Compile time descriptions of the signals packed into a CAN frame, and the
+ * decode and encode code generated from them.
+ *
+ * All of our messages are little endian (Intel byte order) with 8 byte
+ * payloads. The payload is loaded once as a 64 bit word, and each signal is
+ * then a fixed shift and mask of that word. Start bits count up from bit 0 of
+ * byte 0.
+ */
+
+constexpr uint64_t can_payload_load(const uint8_t *data) {
+    return (uint64_t)data[0]         | (uint64_t)data[1] << 8  |
+           (uint64_t)data[2] << 16   | (uint64_t)data[3] << 24 |
+           (uint64_t)data[4] << 32   | (uint64_t)data[5] << 40 |
+           (uint64_t)data[6] << 48   | (uint64_t)data[7] << 56;
+}
+
+inline void can_payload_store(uint64_t payload, uint8_t *data) {
+    for ( int i = 0; i < CAN_MAX_DLEN; i++ ) {
+        data[i] = ( payload >> ( 8 * i ) ) & 0xFF;
+    }
+}
+
+/*
+ * One signal. The physical value is raw * SCALE_NUM / SCALE_DEN + OFFSET, so
+ * 0.1 V/bit is SCALE_NUM = 1, SCALE_DEN = 10.
+ *
+ * Integers are scaled in integer maths, rounding to the nearest step. The
+ * scale is a constant, so the compiler turns the division into a multiply and
+ * shift, and as long as the signal and scale are small enough it's done in 32
+ * bits. Only a float member goes through float. A decoded bool is true if any
+ * bit of the signal is set.
+ *
+ * Encoding rounds to the nearest step and saturates at the ends of the
+ * signal's range, so an out of range value doesn't wrap.
+ */
+template <uint8_t START, uint8_t LENGTH, bool SIGNED = false,
+          int32_t SCALE_NUM = 1, int32_t SCALE_DEN = 1, int32_t OFFSET = 0>
+struct CANSignal {
+
+    static_assert(LENGTH > 0 && LENGTH <= 32, "signals are 1 to 32 bits");
+    static_assert(START + LENGTH <= 64, "signal must fit in an 8 byte payload");
+    static_assert(SCALE_NUM > 0 && SCALE_DEN > 0, "scale must be positive");
+
+    static constexpr uint8_t END = START + LENGTH;
+    static constexpr uint64_t MASK = ( 1ULL << LENGTH ) - 1;
+    static constexpr int64_t MIN = SIGNED ? -( 1LL << ( LENGTH - 1 ) ) : 0;
+    static constexpr int64_t MAX = SIGNED ? ( 1LL << ( LENGTH - 1 ) ) - 1 : (int64_t)MASK;
+
+    typedef std::conditional_t<( LENGTH <= 16 && SCALE_NUM < 32768 && SCALE_DEN < 32768 ),
+                               int32_t, int64_t> Wide;
+
+    // n / d, rounded half away from zero. d is always positive.
+    static constexpr Wide divide_rounded(Wide n, Wide d) {
+        return ( n < 0 ? n - d / 2 : n + d / 2 ) / d;
+    }
+
+    static constexpr int64_t raw(uint64_t payload) {
+        uint64_t bits = ( payload >> START ) & MASK;
+        if constexpr ( SIGNED ) {
+            // Sign extend
+            return (int64_t)( bits << ( 64 - LENGTH ) ) >> ( 64 - LENGTH );
+        } else {
+            return (int64_t)bits;
+        }
+    }
+
+    template <typename T>
+    static constexpr T decode(uint64_t payload) {
+        if constexpr ( std::is_same_v<T, bool> ) {
+            return raw(payload) != 0;
+        } else if constexpr ( std::is_integral_v<T> && SCALE_DEN == 1 ) {
+            return (T)( raw(payload) * SCALE_NUM + OFFSET );
+        } else if constexpr ( std::is_integral_v<T> ) {
+            return (T)( divide_rounded( (Wide)raw(payload) * SCALE_NUM, SCALE_DEN ) + OFFSET );
+        } else {
+            return (T)( (float)raw(payload) * ( (float)SCALE_NUM / SCALE_DEN ) + OFFSET );
+        }
+    }
+
+    template <typename T>
+    static constexpr uint64_t encode(uint64_t payload, T value) {
+        int64_t r;
+        if constexpr ( std::is_integral_v<T> && SCALE_NUM == 1 && SCALE_DEN == 1 ) {
+            r = (int64_t)value - OFFSET;
+        } else if constexpr ( std::is_integral_v<T> ) {
+            r = divide_rounded( ( (Wide)value - OFFSET ) * SCALE_DEN, SCALE_NUM );
+        } else {
+            float steps = ( (float)value - OFFSET ) * ( (float)SCALE_DEN / SCALE_NUM );
+            if ( steps <= (float)MIN ) {
+                r = MIN;
+            } else if ( steps >= (float)MAX ) {
+                r = MAX;
+            } else {
+                r = (int64_t)( steps < 0 ? steps - 0.5f : steps + 0.5f );
+            }
+        }
+        r = r < MIN ? MIN : ( r > MAX ? MAX : r );
+        return ( payload & ~( MASK << START ) ) | ( ( (uint64_t)r & MASK ) << START );
+    }
+};
+
+template <typename> struct CANMemberTraits;
+
+template <typename S, typename T>
+struct CANMemberTraits<T S::*> {
+    typedef S Struct;
+    typedef T Type;
+};
+
+/*
+ * A signal bound to the struct member it's decoded into, or encoded from.
+ * decode() returns DIRTY if the member's value changed, 0 if not.
+ *
+ * RAW_MIN and RAW_MAX bound the raw values we accept from the bus, for
+ * signals whose full range isn't physically plausible. They don't apply when
+ * encoding.
+ */
+template <typename SIGNAL, auto MEMBER, uint32_t DIRTY = 0,
+          int64_t RAW_MIN = SIGNAL::MIN, int64_t RAW_MAX = SIGNAL::MAX>
+struct CANField {
+
+    typedef typename CANMemberTraits<decltype(MEMBER)>::Struct Struct;
+    typedef typename CANMemberTraits<decltype(MEMBER)>::Type Type;
+
+    static_assert(RAW_MIN >= SIGNAL::MIN && RAW_MAX <= SIGNAL::MAX && RAW_MIN <= RAW_MAX,
+                  "limits must be within the signal's range");
+
+    static constexpr uint8_t END = SIGNAL::END;
+
+    static constexpr bool valid(uint64_t payload) {
+        int64_t raw = SIGNAL::raw(payload);
+        return raw >= RAW_MIN && raw <= RAW_MAX;
+    }
+
+    static constexpr uint32_t decode(uint64_t payload, Struct *out) {
+        Type value = SIGNAL::template decode<Type>(payload);
+        uint32_t changed = ( out->*MEMBER != value ) ? DIRTY : 0;
+        out->*MEMBER = value;
+        return changed;
+    }
+
+    static constexpr uint64_t encode(uint64_t payload, const Struct *in) {
+        return SIGNAL::encode(payload, in->*MEMBER);
+    }
+};
+
+/*
+ * A whole message: its ID and the fields in it. decode() loads the payload
+ * once and then unpacks every field, with no branches on the frame contents.
+ * It returns the DIRTY bits of the fields whose values changed.
+ * encode() builds a full 8 byte frame, with any bits not covered by a field
+ * left as 0.
+ *
+ * decode() trusts the frame, so check it with valid() first. A frame is
+ * valid if it's long enough to hold every field, and every field is within
+ * its limits. The bytes past the DLC are whatever the last frame left
+ * behind, so a short frame must never be decoded.
+ */
+template <uint32_t ID, typename... FIELDS>
+struct CANMessage {
+
+    static_assert(sizeof...(FIELDS) > 0, "a message needs at least one field");
+
+    static constexpr uint32_t id = ID;
+    static constexpr uint8_t LENGTH = ( std::max({ FIELDS::END... }) + 7 ) / 8;
+
+    static bool valid(const struct can_frame *frame) {
+        if ( frame->can_dlc < LENGTH || frame->can_dlc > CAN_MAX_DLEN ) {
+            return false;
+        }
+        uint64_t payload = can_payload_load(frame->data);
+        return ( FIELDS::valid(payload) && ... );
+    }
+
+    template <typename S>
+    static uint32_t decode(const struct can_frame *frame, S *out) {
+        uint64_t payload = can_payload_load(frame->data);
+        return ( FIELDS::decode(payload, out) | ... | 0u );
+    }
+
+    template <typename S>
+    static void encode(const S *in, struct can_frame *frame) {
+        uint64_t payload = 0;
+        ( ( payload = FIELDS::encode(payload, in) ), ... );
+        frame->can_id = ID;
+        frame->can_dlc = CAN_MAX_DLEN;
+        can_payload_store(payload, frame->data);
+    }
+};
+
+#endif
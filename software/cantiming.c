@@ -0,0 +1,138 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cantiming.h"
+#include "types.h"
+
+/*
+ * Histogram bucket for a time in us. Bucket n counts times from 2^n us up to
+ * 2^(n+1) us, with bucket 0 also taking 0 us and the last bucket taking
+ * anything longer.
+ */
+static uint8_t timing_bucket(uint64_t us) {
+    if ( us <= 1 ) {
+        return 0;
+    }
+    uint8_t bucket = 63 - __builtin_clzll(us);
+    return bucket < CAN_TIMING_BUCKETS ? bucket : CAN_TIMING_BUCKETS - 1;
+}
+
+static CANIdTiming *find_CAN_id_timing(CANBusTiming *timing, uint32_t id) {
+    for ( int i = 0; i < timing->n; i++ ) {
+        if ( timing->ids[i].id == id ) {
+            return &timing->ids[i];
+        }
+    }
+    // First frame with this ID. With the acceptance filters on we only ever
+    // see handled IDs, so there's room for all of them.
+    if ( timing->n < CAN_TIMING_MAX_IDS ) {
+        CANIdTiming *idTiming = &timing->ids[timing->n++];
+        memset(idTiming, 0, sizeof(*idTiming));
+        idTiming->id = id;
+        return idTiming;
+    }
+    return NULL;
+}
+
+/*
+ * Record a frame's time between arrivals, and the time from it being read off
+ * the controller to it being handled.
+ */
+void record_CAN_timing(CANBusTiming *timing, uint32_t id, uint64_t arrival, uint64_t handled) {
+
+    CANIdTiming *idTiming = find_CAN_id_timing(timing, id);
+    if ( idTiming == NULL ) {
+        return;
+    }
+
+    if ( idTiming->frames > 0 ) {
+        uint64_t interval = arrival - idTiming->lastArrival;
+        if ( interval > UINT32_MAX ) {
+            interval = UINT32_MAX;
+        }
+        idTiming->interval[timing_bucket(interval)]++;
+        if ( interval > idTiming->maxInterval ) {
+            idTiming->maxInterval = interval;
+        }
+    }
+    idTiming->lastArrival = arrival;
+    idTiming->frames++;
+
+    uint64_t latency = handled - arrival;
+    if ( latency > UINT32_MAX ) {
+        latency = UINT32_MAX;
+    }
+    idTiming->latency[timing_bucket(latency)]++;
+    if ( latency > idTiming->maxLatency ) {
+        idTiming->maxLatency = latency;
+    }
+}
+
+/*
+ * Only the non-empty buckets, each as " <bucket>:<count>"
+ */
+static int format_histogram(const uint32_t histogram[], char *result, size_t max_result_len) {
+    int len = 0;
+    for ( int i = 0; i < CAN_TIMING_BUCKETS; i++ ) {
+        if ( histogram[i] > 0 && (size_t)len < max_result_len ) {
+            len += snprintf(result + len, max_result_len - len, " %d:%lu", i, (unsigned long)histogram[i]);
+        }
+    }
+    return len;
+}
+
+/*
+ * Plain text report of the timing of every ID seen on the bus. Returns the
+ * length of the report, as snprintf() would.
+ */
+int format_CAN_timing(const CANBusTiming *timing, char *result, size_t max_result_len) {
+
+    int len = snprintf(result, max_result_len, "%s bus (histogram buckets are log2 us)\n", timing->name);
+
+    for ( int i = 0; i < timing->n && (size_t)len < max_result_len; i++ ) {
+        const CANIdTiming *idTiming = &timing->ids[i];
+        len += snprintf(result + len, max_result_len - len,
+            "  0x%03lx frames %lu, max interval %lu us, max latency %lu us\n    interval",
+            (unsigned long)idTiming->id, (unsigned long)idTiming->frames,
+            (unsigned long)idTiming->maxInterval, (unsigned long)idTiming->maxLatency);
+        if ( (size_t)len < max_result_len ) {
+            len += format_histogram(idTiming->interval, result + len, max_result_len - len);
+        }
+        if ( (size_t)len < max_result_len ) {
+            len += snprintf(result + len, max_result_len - len, "\n    latency ");
+        }
+        if ( (size_t)len < max_result_len ) {
+            len += format_histogram(idTiming->latency, result + len, max_result_len - len);
+        }
+        if ( (size_t)len < max_result_len ) {
+            len += snprintf(result + len, max_result_len - len, "\n");
+        }
+    }
+
+    return len;
+}
+
+void print_CAN_timing(const CANBusTiming *timing) {
+    char report[1024];
+    format_CAN_timing(timing, report, sizeof(report));
+    printf("%s", report);
+}
@@ -0,0 +1,32 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANTIMING_H
+#define CANTIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+void record_CAN_timing(CANBusTiming *timing, uint32_t id, uint64_t arrival, uint64_t handled);
+int format_CAN_timing(const CANBusTiming *timing, char *result, size_t max_result_len);
+void print_CAN_timing(const CANBusTiming *timing);
+
+#endif
@@ -18,15 +18,17 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
-#include "hardware/gpio.h"
-#include "tgmath.h"
 
 #include "chademo.h"
 #include "util.h"
+#include "hal.h"
 #include "battery.h"
 #include "station.h"
 #include "settings.h"
+#include "statemachine.h"
+#include "scheduler.h"
 
 #include "types.h"
 
@@ -38,15 +40,18 @@ extern BMS bms;
 void chademo_reinitialise() {
     // Start at zero. We only update this from handshaking onward.
     chademo.chargingCurrentRequest = 0;
+    chademo.currentCommand = 0;
+    chademo.currentIntegral = 0;
 
     // Vehicle status flags
     chademo.vehicleChargingEnabled = false;
     chademo.vehicleNotInPark = false;
     chademo.vehicleRequestingStop = false;
 
-    // Set the target state-of-charge and voltage
+    /* Set the target state-of-charge. The target voltage follows from it once
+     * we have the BMS limits, in chademo_update_max_voltage_value().
+     */
     chademo.targetSoc = BATTERY_FAST_CHARGE_DEFAULT_SOC_MAX;
-    //chademo.targetVoltage = battery_get_voltage_from_soc(BATTERY_FAST_CHARGE_DEFAULT_SOC_MAX);
 
     // Will be updated with value from BMS
     chademo.maximumVoltage = 0;
@@ -58,18 +63,15 @@ void chademo_reinitialise() {
 //
 
 
-// The output voltage of the station is below target (plus margin)
+// The output voltage of the station is more than CC_CV_MARGIN below target
 bool in_constant_current_window() {
-    return ( ( station.outputVoltage - CC_CV_MARGIN ) < battery_get_target_voltage() );
+    return ( ( station.outputVoltage + CC_CV_MARGIN ) < chademo_get_target_voltage() );
 }
 
 
-// The output voltage of the station is within CC_CV_MARGIN of the target voltage
+// The output voltage of the station is within CC_CV_MARGIN of the target voltage, or over it
 bool in_constant_voltage_window() {
-    return (
-        ( ( station.outputVoltage - CC_CV_MARGIN ) > battery_get_target_voltage() ) && \
-        ( station.outputVoltage < battery_get_target_voltage() )
-    );
+    return ! in_constant_current_window();
 }
 
 
@@ -78,18 +80,19 @@ bool in_constant_voltage_window() {
 //
 
 
-float chademo_get_target_voltage() {
+uint16_t chademo_get_target_voltage() {
     return chademo.targetVoltage;
 }
 
 void chademo_update_max_voltage_value() {
-    chademo.maximumVoltage = bms.maximumVoltage;
+    chademo.maximumVoltage = WHOLE(bms.maximumVoltage);
+    chademo.targetVoltage = battery_get_voltage_from_soc(chademo.targetSoc);
 }
 
 // Can the station provide enough voltage to charge out battery?
 bool chademo_station_voltage_sufficient() {
     // FIXME should this be based on voltage at our target SOC?
-    return ( bms.maximumVoltage < station.maximumVoltageAvailable );
+    return ( bms.maximumVoltage < DECI(station.maximumVoltageAvailable) );
 }
 
 
@@ -99,131 +102,80 @@ bool chademo_station_voltage_sufficient() {
 
 /*
  * Calculate a new value for the charge current (chargingCurrentRequest) that we
- * are asking the station to provide us with. Factor in the limits the BMS is
- * requiring, the maximum current the station can provide right now, and the
- * maximum rate at which the the current request may change (ramp rate).
+ * are asking the station to provide us with. Called every
+ * CHADEMO_CONTROL_INTERVAL during energy transfer.
+ *
+ * This is a PI loop on the station's output voltage against the target
+ * voltage, less CHADEMO_CV_HEADROOM. Well below the target its output is
+ * pinned at the ceiling, the lower of the BMS limit and the current available
+ * at the station, and that's the constant current phase. Near the target it
+ * backs the current off to hold the voltage there, and that's the constant
+ * voltage phase. The output is then limited to the ceiling, and can't move by
+ * more than CHADEMO_RAMP_RATE per CHADEMO_RAMP_INTERVAL.
+ *
+ * The integral is recalculated from the output we actually used, so it can't
+ * wind up while the output is held at a limit.
  */
 void recalculate_charging_current_request() {
 
-    clock_t now = get_clock();
-
     // Get the new limits from the BMS and station
-    uint8_t chargingCurrentCeiling = fmin(bms.maximumChargeCurrent, station.availableCurrent);
-
-    /*
-     * If the output voltage being reported by the station is less than the
-     * target voltage, then we're in the constant current phase. Just max out
-     * the amps.
-     */
-
-    if ( in_constant_current_window() ) {
-
-        // No change required. Hold at the current level.
-        if ( chademo.chargingCurrentRequest == chargingCurrentCeiling ) {
-            return;
-        }
-
-        // We need to ramp up the current request
-        if ( chademo.chargingCurrentRequest < chargingCurrentCeiling ) {
-
-            // Enough time has passed that we can bump up the current request
-            if ( chademo.lastCurrentRequestChange > ( now + CHADEMO_RAMP_INTERVAL ) ) {
-                // Next step would be more than max, so just increment by max
-                if ( ( chargingCurrentCeiling - chademo.chargingCurrentRequest ) > CHADEMO_RAMP_RATE ) {
-                    chademo.chargingCurrentRequest += CHADEMO_RAMP_RATE;
-                    chademo.lastCurrentRequestChange = now;
-                    return;
-                }
-                // Next step is less than max, so go directly
-                else {
-                    chademo.chargingCurrentRequest = chargingCurrentCeiling;
-                    chademo.lastCurrentRequestChange = now;
-                    return;
-                }
-            }
-
-            // Need to wait longer before we can bump up further
-            else {
-                return;
-            }
-        }
-
-        // We need to ramp down the current requests
-        else if ( chademo.chargingCurrentRequest > chargingCurrentCeiling ) {
-
-            // Enough time has passed that we can reduce the current request
-            if ( chademo.lastCurrentRequestChange > ( now + CHADEMO_RAMP_INTERVAL ) ) {
-                // Next step would be more than max, so just decrement by max
-                if ( ( chademo.chargingCurrentRequest - chargingCurrentCeiling ) > CHADEMO_RAMP_RATE ) {
-                    chademo.chargingCurrentRequest -= CHADEMO_RAMP_RATE;
-                    chademo.lastCurrentRequestChange = now;
-                    return;
-                }
-                // Next step is less than max, so go directly
-                else {
-                    chademo.chargingCurrentRequest = chargingCurrentCeiling;
-                    chademo.lastCurrentRequestChange = now;
-                    return;
-                }
-            }
-
-            // Need to wait longer before we can reduce further
-            else {
-                return;
-            }
-        }
+    DeciAmps ceiling = DECI(station.availableCurrent);
+    if ( bms.maximumChargeCurrent < ceiling ) {
+        ceiling = bms.maximumChargeCurrent;
     }
 
-    /*
-     * If the output voltage reported by the station is at the target voltage
-     * then we're in the constant voltage phase.
-     *
-     * Here we're aiming to keep the voltage at the target voltage by adjusting
-     * the current request.
-     */
+    DeciVolts error = DECI(chademo_get_target_voltage() - CHADEMO_CV_HEADROOM) - DECI(station.outputVoltage);
+    DeciAmps proportional = CHADEMO_CV_KP * error;
+    chademo.currentIntegral += CHADEMO_CV_KI * error * CHADEMO_CONTROL_INTERVAL;
+    DeciAmps command = proportional + chademo.currentIntegral / 1000;
 
-    else if ( in_constant_voltage_window() ) {
-
-        // We need to ramp down the current requests
-        if ( chademo.chargingCurrentRequest > chargingCurrentCeiling ) {
-
-            // Enough time has passed that we can reduce the current request
-            if ( chademo.lastCurrentRequestChange > ( now + CHADEMO_RAMP_INTERVAL ) ) {
-                // Next step would be more than max, so just decrement by max
-                if ( ( chademo.chargingCurrentRequest - chargingCurrentCeiling ) > CHADEMO_RAMP_RATE ) {
-                    chademo.chargingCurrentRequest -= CHADEMO_RAMP_RATE;
-                    chademo.lastCurrentRequestChange = now;
-                    return;
-                }
-                // Next step is less than max, so go directly
-                else {
-                    chademo.chargingCurrentRequest = chargingCurrentCeiling;
-                    chademo.lastCurrentRequestChange = now;
-                    return;
-                }
-            }
-
-            // Need to wait longer before we can reduce further
-            else {
-                return;
-            }
-        }
+    if ( command > ceiling ) {
+        command = ceiling;
+    }
+    if ( command < 0 ) {
+        command = 0;
+    }
 
-        // FIXME any reason to increase here?
+    DeciAmps step = DECI(CHADEMO_RAMP_RATE) * CHADEMO_CONTROL_INTERVAL / CHADEMO_RAMP_INTERVAL;
+    if ( command > chademo.currentCommand + step ) {
+        command = chademo.currentCommand + step;
+    }
+    if ( command < chademo.currentCommand - step ) {
+        command = chademo.currentCommand - step;
+    }
 
-        return;
+    chademo.currentIntegral = ( command - proportional ) * 1000;
+    chademo.currentCommand = command;
 
+    uint8_t request = WHOLE(command);
+    if ( request != chademo.chargingCurrentRequest ) {
+        chademo.chargingCurrentRequest = request;
+        chademo.nextRampStep = deadline_in_ms(CHADEMO_RAMP_INTERVAL);
     }
+}
 
-    /*
-     * If the output voltage reported by the station is over the target voltage
-     * then ramp down the amps until we get back to the target voltage;.
-     */
+/*
+ * In the constant voltage phase, with the current request tapered down to
+ * TERMINATION_CURRENT. Charging is complete.
+ */
+bool chademo_taper_complete() {
+    return in_constant_voltage_window() && chademo.chargingCurrentRequest <= TERMINATION_CURRENT;
+}
 
-    else {
-        chademo.chargingCurrentRequest--;
-    }
+// The scheduler wakes the controller up through the state machine
+void current_control_tick() {
+    post_event(E_CONTROL_TICK);
+}
+
+// Start the controller from whatever we're requesting now
+void enable_current_control() {
+    chademo.currentCommand = DECI(chademo.chargingCurrentRequest);
+    chademo.currentIntegral = 0;
+    enable_task(TASK_CURRENT_CONTROL);
+}
 
+void disable_current_control() {
+    disable_task(TASK_CURRENT_CONTROL);
 }
 
 /*
@@ -231,10 +183,15 @@ void recalculate_charging_current_request() {
  * zero at the normal rate.
  */
 void ramp_down_current_request() {
-    clock_t now = get_clock();
-    if ( chademo.lastCurrentRequestChange > ( now + CHADEMO_RAMP_INTERVAL ) ) {
+    if ( chademo.chargingCurrentRequest == 0 || ! deadline_passed(chademo.nextRampStep) ) {
+        return;
+    }
+    if ( chademo.chargingCurrentRequest > CHADEMO_RAMP_RATE ) {
         chademo.chargingCurrentRequest -= CHADEMO_RAMP_RATE;
+    } else {
+        chademo.chargingCurrentRequest = 0;
     }
+    chademo.nextRampStep = deadline_in_ms(CHADEMO_RAMP_INTERVAL);
 }
 
 uint8_t get_charging_current_request() {
@@ -305,17 +262,17 @@ uint8_t generate_vehicle_status_byte() {
 
 // Return true if plug is inserted in car.
 bool plug_is_in() {
-    return ( gpio_get(CHADEMO_CS_PIN) == 0 );
+    return ( hal_gpio_get(CHADEMO_CS_PIN) == 0 );
 }
 
 // Return true if IN1 signal is active (high)
 bool in1_is_active() {
-    return ( gpio_get(CHADEMO_IN1_PIN) == 1 );
+    return ( hal_gpio_get(CHADEMO_IN1_PIN) == 1 );
 }
 
 // Return true if IN2 signal is active (low)
 bool in2_is_active() {
-    return ( gpio_get(CHADEMO_IN2_PIN) == 0 );
+    return ( hal_gpio_get(CHADEMO_IN2_PIN) == 0 );
 }
 
 bool contactors_are_closed() {
@@ -325,29 +282,29 @@ bool contactors_are_closed() {
 // OUT1 (CP3)
 
 void activate_out1() {
-    gpio_put(CHADEMO_OUT1_PIN, 1);
+    hal_gpio_put(CHADEMO_OUT1_PIN, 1);
 }
 
 void deactivate_out1() {
-    gpio_put(CHADEMO_OUT1_PIN, 0);
+    hal_gpio_put(CHADEMO_OUT1_PIN, 0);
 }
 
 bool out1_is_active() {
-    return ( gpio_get(CHADEMO_OUT1_PIN) == 0 );
+    return ( hal_gpio_get(CHADEMO_OUT1_PIN) == 0 );
 }
 
 // OUT2 (contactor relay)
 
 void permit_contactor_close() {
-    gpio_put(CHADEMO_OUT2_PIN, 1);
+    hal_gpio_put(CHADEMO_OUT2_PIN, 1);
 }
 
 void inhibit_contactor_close() {
-    gpio_put(CHADEMO_OUT2_PIN, 0);
+    hal_gpio_put(CHADEMO_OUT2_PIN, 0);
 }
 
 bool contactors_are_allowed_to_close() {
-    return ( gpio_get(CHADEMO_OUT2_PIN) == 1 );
+    return ( hal_gpio_get(CHADEMO_OUT2_PIN) == 1 );
 }
 
 /*
@@ -396,7 +353,7 @@ void check_for_current_deviation_error() {
         // If we're getting 12A more than we ask for, that's an error state
         if ( station.outputCurrent < ( chademo.chargingCurrentRequest + 12 ) ) {
             // reset the counter
-            chademo.currentDeviationErrorTimer = get_clock();
+            chademo.currentDeviationDeadline = deadline_in_ms(CHADEMO_DEVIATION_TIME);
         }
     }
 
@@ -406,12 +363,12 @@ void check_for_current_deviation_error() {
         if ( station.outputCurrent < ( chademo.chargingCurrentRequest + 12 ) && 
              station.outputCurrent > ( chademo.chargingCurrentRequest - 12 )) {
             // reset the counter
-            chademo.currentDeviationErrorTimer = get_clock();
+            chademo.currentDeviationDeadline = deadline_in_ms(CHADEMO_DEVIATION_TIME);
         }
     }
 
     // Current has deviated for more than 5 seconds, trigger error state
-    if ( ( chademo.currentDeviationErrorTimer - get_clock() ) > 1000 ) {
+    if ( deadline_passed(chademo.currentDeviationDeadline) ) {
         chademo.currentDeviationError = true;
     } else {
         chademo.currentDeviationError = false;
@@ -425,12 +382,13 @@ void check_for_current_deviation_error() {
  */
 void check_for_voltage_deviation_error() {
     // Reset the counter
-    if ( ( bms.measuredVoltage < ( station.outputVoltage + 10 ) ) &&
-         ( bms.measuredVoltage > ( station.outputVoltage - 10 ) ) ) {
-        chademo.voltageDeviationErrorTimer = get_clock();
+    DeciVolts outputVoltage = DECI(station.outputVoltage);
+    if ( ( bms.measuredVoltage < ( outputVoltage + DECI(10) ) ) &&
+         ( bms.measuredVoltage > ( outputVoltage - DECI(10) ) ) ) {
+        chademo.voltageDeviationDeadline = deadline_in_ms(CHADEMO_DEVIATION_TIME);
     }
     // Flag the fault if the deviation has been happening for > 5 secs
-    if ( chademo.voltageDeviationErrorTimer < ( get_clock() - 5000 ) ) {
+    if ( deadline_passed(chademo.voltageDeviationDeadline) ) {
         chademo.voltageDeviationError = true;
     }
 }
@@ -18,6 +18,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 
 #ifndef CHADEMO_H
@@ -28,15 +29,22 @@
 void chademo_reinitialise();
 bool in_constant_current_window();
 bool in_constant_voltage_window();
-float chademo_get_target_voltage();
+uint16_t chademo_get_target_voltage();
 void chademo_update_max_voltage_value();
 bool chademo_station_voltage_sufficient();
 void recalculate_charging_current_request();
 void ramp_down_current_request();
+bool chademo_taper_complete();
+void current_control_tick();
+void enable_current_control();
+void disable_current_control();
 uint8_t get_charging_current_request();
 void recalculate_charging_time();
 uint8_t generate_battery_status_byte();
 uint8_t generate_vehicle_status_byte();
+bool plug_is_in();
+bool in1_is_active();
+bool in2_is_active();
 bool contactors_are_closed();
 void activate_out1();
 void deactivate_out1();
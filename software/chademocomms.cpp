@@ -18,7 +18,7 @@
  */
 
 #include <stdio.h>
-#include "pico/stdlib.h"
+#include <string.h>
 
 #include "mcp2515/mcp2515.h"
 
@@ -28,15 +28,22 @@ extern "C" {
 #include "settings.h"
 #include "chademo.h"
 #include "battery.h"
+#include "scheduler.h"
+#include "session.h"
+#include "chademocomms.h"
 }
 
+#include "canbus.h"
+#include "canlog.h"
+#include "canmessages.h"
 #include "types.h"
 
 extern Battery battery;
 extern MCP2515 chademoCAN;
 extern Station station;
 extern BMS bms;
-extern State state;
+
+extern CANStats chademoCANStats;
 
 /*
  * ID : 0x100
@@ -44,22 +51,13 @@ extern State state;
  * byte 4 + 5 : maximum battery voltage (V). 1 V/bit
  * byte 6     : Charging rate indication (%). 1% bit, 100%
  */
-void send_limits_message() {
-
-    struct can_frame frame;
+void build_limits_message(struct can_frame *frame) {
 
-    frame.can_id = 0x100;
-    frame.can_dlc = 8;
-    frame.data[0] = 0x00;
-    frame.data[1] = 0x00;
-    frame.data[2] = 0x00;
-    frame.data[3] = 0x00;
-    frame.data[4] = (uint8_t)chademo_get_target_voltage() & 0xFF;
-    frame.data[5] = (uint8_t)chademo_get_target_voltage() >> 8;
-    frame.data[6] = (uint8_t)bms.soc;
-    frame.data[7] = 0x00;
+    ChademoLimitsMessage message = {};
+    message.maximumBatteryVoltage = chademo_get_target_voltage();
+    message.chargingRateIndication = (uint8_t)bms.soc;
 
-    chademoCAN.sendMessage(&frame);
+    ChademoLimitsCodec::encode(&message, frame);
 
 }
 
@@ -74,22 +72,15 @@ void send_limits_message() {
  * byte 3     : Estimated charging time remaining.  1 min/bit (0 -> 254min)
  * byte 5 + 6 : capacity of battery (kWh). 0.11 kWh/bit
  */
-void send_charge_time_message() {
-
-    struct can_frame frame;
+void build_charge_time_message(struct can_frame *frame) {
 
-    frame.can_id = 0x101;
-    frame.can_dlc = 8;
-    frame.data[0] = 0x00; // unused
-    frame.data[1] = 0xFF; // Don't declare max charge time in seconds
-    frame.data[2] = get_charging_time_minutes_max();
-    frame.data[3] = get_charging_time_minutes();
-    frame.data[4] = 0x00; // unused
-    frame.data[5] = (uint8_t)( battery.capacityWH / 1000 / 0.11 ) & 0xFF;
-    frame.data[6] = (uint8_t)( battery.capacityWH / 1000 / 0.11 ) >> 8;
-    frame.data[7] = 0x00; // unused
+    ChademoChargeTimeMessage message = {};
+    message.chargingTimeSecondsMax = 2550; // 0xFF, don't declare max charge time in seconds
+    message.chargingTimeMinutesMax = get_charging_time_minutes_max();
+    message.chargingTimeMinutes = get_charging_time_minutes();
+    message.batteryCapacityWH = battery.capacityWH;
 
-    chademoCAN.sendMessage(&frame);
+    ChademoChargeTimeCodec::encode(&message, frame);
 
 }
 
@@ -115,41 +106,128 @@ void send_charge_time_message() {
  *   bit 4    : Normal stop request before charging. 0:no request, 1:request to stop
  * byte 6     : Charging rate. 1 %/bit (0% -> 100%)
  */
-void send_status_message() {
+void build_status_message(struct can_frame *frame) {
 
-    struct can_frame frame;
+    ChademoStatusMessage message = {};
+    message.controlProtocolNumber = CHADEMO_PROTOCOL_VERSION;
+    message.targetVoltage = chademo_get_target_voltage();
+    message.chargingCurrentRequest = get_charging_current_request();
+    message.batteryStatus = generate_battery_status_byte();
+    message.vehicleStatus = generate_vehicle_status_byte();
+    message.chargedRate = 0; // how full is the battery in kWh
 
-    frame.can_id = 0x102;
-    frame.can_dlc = 8;
-    frame.data[0] = CHADEMO_PROTOCOL_VERSION;
-    frame.data[1] = (uint8_t)chademo_get_target_voltage() & 0xFF;
-    frame.data[2] = (uint8_t)chademo_get_target_voltage() >> 8;
-    frame.data[3] = get_charging_current_request();
-    frame.data[4] = generate_battery_status_byte();
-    frame.data[5] = generate_vehicle_status_byte();
-    frame.data[6] = 0x00; // how full is the battery in kWh
-    frame.data[7] = 0x00; // unused
+    ChademoStatusCodec::encode(&message, frame);
+
+}
+
+
+// One cycle: 0x100, 0x101 and 0x102, in the order they're sent
+#define N_OUTBOUND_FRAMES 3
+
+static void build_outbound_CAN_messages(struct can_frame *frames) {
+    build_limits_message(&frames[0]);
+    build_charge_time_message(&frames[1]);
+    build_status_message(&frames[2]);
+}
 
-    chademoCAN.sendMessage(&frame);
+#if CAN_DUAL_CORE
+/*
+ * In dual core mode the CAN core doesn't read the charge state, as core 0 may
+ * be halfway through changing it. Core 0 builds the frames after each round
+ * of events and publishes them here, and the CAN core sends the latest copy.
+ */
+static struct can_frame publishedFrames[N_OUTBOUND_FRAMES];
+static HALLock *publishedFramesLock;
+
+void init_outbound_CAN_messages() {
+    publishedFramesLock = hal_lock_create();
+}
+
+static void store_outbound_CAN_messages() {
+    struct can_frame frames[N_OUTBOUND_FRAMES];
+    build_outbound_CAN_messages(frames);
+    hal_lock_enter(publishedFramesLock);
+    memcpy(publishedFrames, frames, sizeof(publishedFrames));
+    hal_lock_exit(publishedFramesLock);
+}
+
+// Called by the main loop on core 0
+void publish_outbound_CAN_messages() {
+    if ( task_enabled(TASK_CHADEMO_OUTBOUND) ) {
+        store_outbound_CAN_messages();
+    }
+}
 
+static void load_outbound_CAN_messages(struct can_frame *frames) {
+    hal_lock_enter(publishedFramesLock);
+    memcpy(frames, publishedFrames, sizeof(publishedFrames));
+    hal_lock_exit(publishedFramesLock);
 }
+#endif
 
+bool outboundCyclePending = false;
+uint8_t outboundTicks = 0;
 
-struct repeating_timer outboundCANMessageTimer;
+/*
+ * Send 0x100, 0x101 and 0x102 as one burst, one frame per transmit buffer, in
+ * that order. If the buffers are still busy with the last cycle, leave the
+ * cycle pending and try again on the next tick, with fresh data.
+ */
+void send_outbound_CAN_messages() {
 
-bool send_outbound_CAN_messages(struct repeating_timer *t) {
-    send_limits_message();
-    send_charge_time_message();
-    send_status_message();
-    return true;
+    chademoCANStats.framesSent += chademoCAN.checkTransmitted();
+
+    if ( ++outboundTicks >= CHADEMO_OUTBOUND_INTERVAL / CHADEMO_OUTBOUND_RETRY_INTERVAL ) {
+        outboundTicks = 0;
+        outboundCyclePending = true;
+    }
+
+    if ( ! outboundCyclePending ) {
+        return;
+    }
+
+    struct can_frame cycle[N_OUTBOUND_FRAMES];
+    #if CAN_DUAL_CORE
+    load_outbound_CAN_messages(cycle);
+    #else
+    build_outbound_CAN_messages(cycle);
+    #endif
+    const struct can_frame *frames[] = { &cycle[0], &cycle[1], &cycle[2] };
+
+    switch ( chademoCAN.sendMessages(frames, N_OUTBOUND_FRAMES) ) {
+        case MCP2515::ERROR_OK:
+            chademoCANStats.framesQueued += N_OUTBOUND_FRAMES;
+            outboundCyclePending = false;
+            for ( int i = 0; i < N_OUTBOUND_FRAMES; i++ ) {
+                log_sent_CAN_frame(&cycle[i]);
+            }
+            break;
+        case MCP2515::ERROR_ALLTXBUSY:
+        case MCP2515::ERROR_QUEUEFULL:
+            chademoCANStats.txBusy++;
+            break;
+        default:
+            chademoCANStats.txFailed++;
+            outboundCyclePending = false;
+            break;
+    }
 }
 
+/*
+ * Start and stop the outbound message cycle. The task runs on whichever core
+ * owns the CAN controllers, and the state machine just switches it on and
+ * off, so it doesn't matter which core that is. In dual core mode the first
+ * frames are published before the task can send them.
+ */
 void enable_send_outbound_CAN_messages() {
-    add_repeating_timer_ms(100, send_outbound_CAN_messages, NULL, &outboundCANMessageTimer);
+    #if CAN_DUAL_CORE
+    store_outbound_CAN_messages();
+    #endif
+    enable_task(TASK_CHADEMO_OUTBOUND);
 }
 
 void disable_send_outbound_CAN_messages() {
-    //
+    disable_task(TASK_CHADEMO_OUTBOUND);
 }
 
 
@@ -161,57 +239,151 @@ void disable_send_outbound_CAN_messages() {
 //// ----
 
 struct can_frame chademoInboundFrame;
-struct repeating_timer handleChademoCANMessageTimer;
+CANStats chademoCANStats;
+CANFrameQueue chademoCANQueue;
+CANBusTiming chademoCANTiming = { "ChaDeMo" };
 
-bool handle_chademo_CAN_messages(struct repeating_timer *t) {
+// Everything process_chademo_CAN_message() handles
+static const uint32_t chademoCANHandledIds[] = {
+    EVSE_CAPABILITIES_MESSAGE_ID,
+    EVSE_STATUS_MESSAGE_ID
+};
+
+/*
+ * Only let the frames we handle into the controller's receive buffers. Call
+ * while the controller is in config mode, before setNormalMode().
+ */
+static void set_chademo_CAN_filters() {
+    #if CAN_HARDWARE_FILTERS
+    if ( chademoCAN.setAcceptanceFilters(chademoCANHandledIds, sizeof(chademoCANHandledIds) / sizeof(chademoCANHandledIds[0])) != MCP2515::ERROR_OK ) {
+        printf("Failed to set ChaDeMo CAN acceptance filters\n");
+    }
+    #endif
+}
 
-    if ( chademoCAN.readMessage(&chademoInboundFrame) == MCP2515::ERROR_OK ) {
+/*
+ * Reset the controller and set it up for the ChaDeMo bus. Also used by the bus
+ * health monitor to recover the controller.
+ */
+void configure_chademo_CAN() {
+    chademoCAN.reset();
+    chademoCAN.setBitrate(CAN_500KBPS, MCP_8MHZ);
+    set_chademo_CAN_filters();
+    chademoCAN.setNormalMode();
+}
 
-        switch ( chademoInboundFrame.can_id ) {
+/*
+ * Decode a single inbound message from the ChaDeMo CANbus
+ */
+void process_chademo_CAN_message(struct can_frame *frame) {
 
-            case EVSE_CAPABILITIES_MESSAGE_ID:
-                station.weldDetectionSupported = chademoInboundFrame.data[0];
-                // 1V/bit (0 to 600V)
-                station.maximumVoltageAvailable = chademoInboundFrame.data[1] + chademoInboundFrame.data[2] << 8;
-                // 1A/bit (0 to 255A)
-                station.availableCurrent = chademoInboundFrame.data[3];
-                // 1V/bit (0 to 600V)
-                station.thresholdVoltage = chademoInboundFrame.data[4] + chademoInboundFrame.data[5] << 8;
+    switch ( frame->can_id ) {
 
-                station_heartbeat();
-                state(E_STATION_CAPABILITIES_UPDATED);
+        case EVSE_CAPABILITIES_MESSAGE_ID:
+            if ( ! EVSECapabilitiesCodec::valid(frame) ) {
+                chademoCANStats.rejected++;
                 break;
-
-            case EVSE_STATUS_MESSAGE_ID:
-                station.controlProtocolNumber = chademoInboundFrame.data[0]; // chademo protocol version
-                // 1V/bit (0 to 600V)
-                station.outputVoltage = chademoInboundFrame.data[1] + chademoInboundFrame.data[2] << 8;
-                // 1A/bit (0 to 255A)
-                station.outputCurrent = chademoInboundFrame.data[3];
-                // 10s/bit (0 to 2540s)
-                station.timeRemainingSeconds = 10 * chademoInboundFrame.data[6];
-                // 1min/bit (0 to 255min)
-                station.timeRemainingMinutes = chademoInboundFrame.data[7];
-                station.stationStatus = chademoInboundFrame.data[5] & 1;                             // bit 0
-                station.stationMalfunction = (chademoInboundFrame.data[5] & ( 1 << 1 )) >> 1;        // bit 1
-                station.vehicleConnectorLock = (chademoInboundFrame.data[5] & ( 1 << 2 )) >> 2;      // bit 2
-                station.batteryIncompatability = (chademoInboundFrame.data[5] & ( 1 << 3 )) >> 3;    // bit 3
-                station.chargingSystemMalfunction = (chademoInboundFrame.data[5] & ( 1 << 4 )) >> 4; // bit 4
-                station.chargerStopControl = (chademoInboundFrame.data[5] & ( 1 << 5 )) >> 5;        // bit 5
-
-                station_heartbeat();
-                state(E_STATION_STATUS_UPDATED);
+            }
+            station.dirty |= EVSECapabilitiesCodec::decode(frame, &station);
+            station_heartbeat();
+            post_event(E_STATION_CAPABILITIES_UPDATED);
+            break;
+
+        case EVSE_STATUS_MESSAGE_ID:
+            if ( ! EVSEStatusCodec::valid(frame) ) {
+                chademoCANStats.rejected++;
                 break;
+            }
+            station.dirty |= EVSEStatusCodec::decode(frame, &station);
+            station_heartbeat();
+            session_sample();
+            post_event(E_STATION_STATUS_UPDATED);
+            break;
+
+        default:
+            chademoCANStats.unhandled++;
+            break;
+
+    }
+}
+
+/*
+ * Hand a received frame over to the main loop for decoding
+ */
+void queue_chademo_CAN_message(struct can_frame *frame) {
+    push_CAN_frame(&chademoCANQueue, frame, &chademoCANStats);
+}
+
+/*
+ * Decode the frames received on the ChaDeMo bus since we last looked. Called from
+ * the main loop.
+ */
+void process_chademo_CAN_messages() {
+    drain_CAN_queue(&chademoCANQueue, process_chademo_CAN_message, &chademoCANStats, &chademoCANTiming);
+}
 
-        }
+#if CAN_DMA
+/*
+ * Called from the DMA IRQ with each frame read from the ChaDeMo bus
+ */
+void receive_chademo_CAN_DMA_message(struct can_frame *frame) {
+    chademoCANStats.framesReceived++;
+    queue_chademo_CAN_message(frame);
+}
+#endif
 
+/*
+ * Read the frames waiting on the ChaDeMo bus controller, or queue them for DMA
+ */
+static void read_chademo_CAN_messages() {
+    #if CAN_DMA
+    queue_CAN_messages(&chademoCAN, &chademoCANStats);
+    #else
+    receive_CAN_messages(&chademoCAN, &chademoInboundFrame, queue_chademo_CAN_message, &chademoCANStats);
+    #endif
+}
+
+void handle_chademo_CAN_messages() {
+
+    // Nothing waiting, don't bother asking the controller over SPI
+    if ( ! chademoCAN.interruptPending() ) {
+        return;
     }
 
-    return true;
+    read_chademo_CAN_messages();
+
+    // Or we'd be back here asking over SPI every poll until the next frame
+    chademoCAN.releaseInterrupt();
+}
+
+/*
+ * Called from the GPIO IRQ when the ChaDeMo bus controller pulls INT low. Read
+ * until both receive buffers are empty so that INT goes high again and the
+ * next frame gives us a fresh edge. If we run out of budget first, INT stays
+ * low and the poll timer picks up the rest.
+ */
+void handle_chademo_CAN_interrupt() {
+
+    if ( ! chademoCAN.acknowledgeInterrupt() ) {
+        return;
+    }
+
+    read_chademo_CAN_messages();
+
+    // INT is also held low by the error flags. Clear them or we'll miss edges.
+    chademoCAN.releaseInterrupt();
 }
 
 void enable_handle_chademo_CAN_messages() {
-    add_repeating_timer_ms(10, handle_chademo_CAN_messages, NULL, &handleChademoCANMessageTimer);
+    #if CAN_RX_INTERRUPTS
+    chademoCAN.setInterruptPin(CHADEMO_CAN_INT);
+    chademoCAN.enableInterrupt(handle_chademo_CAN_interrupt);
+    #endif
+    #if CAN_DMA
+    chademoCAN.enableDMA(receive_chademo_CAN_DMA_message);
+    #endif
+    // Always keep polling, in case an edge is missed
+    enable_task(TASK_CHADEMO_CAN_RX);
 }
 
 
@@ -21,12 +21,22 @@
 #define CHADEMOCOMMS_H
 
 #include <stdbool.h>
-#include "pico/stdlib.h"
 
-bool handle_chademo_CAN_messages(struct repeating_timer *t);
+struct can_frame;
+
+void configure_chademo_CAN();
+void process_chademo_CAN_message(struct can_frame *frame);
+void queue_chademo_CAN_message(struct can_frame *frame);
+void process_chademo_CAN_messages();
+void handle_chademo_CAN_messages();
+void handle_chademo_CAN_interrupt();
 void enable_handle_chademo_CAN_messages();
+void send_outbound_CAN_messages();
 void enable_send_outbound_CAN_messages();
 void disable_send_outbound_CAN_messages();
-void enable_handle_chademo_CAN_messages();
+
+// CAN_DUAL_CORE only
+void init_outbound_CAN_messages();
+void publish_outbound_CAN_messages();
 
 #endif
\ No newline at end of file
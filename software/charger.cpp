@@ -32,6 +32,8 @@ using namespace std;
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
 #include "hardware/watchdog.h"
+#include "hardware/sync.h"
+#include "pico/multicore.h"
 
 extern "C" {
     #include "led.h"
@@ -42,42 +44,92 @@ extern "C" {
     #include "dhcpserver.h"
     #include "dnsserver.h"
     #include "wifi.h"
+    #include "cantiming.h"
+    #include "scheduler.h"
+    #include "session.h"
+    #include "flightrecorder.h"
+    #include "chademocomms.h"
+    #include "util.h"
 }
 
 #include "mcp2515/mcp2515.h"
+#include "canbus.h"
+#include "canhealth.h"
+#include "canlog.h"
 #include "comms.h"
-#include "chademocomms.h"
 
 #include "charger.h"
 #include "types.h"
 
 
 
-MCP2515 mainCAN(SPI_PORT, MAIN_CAN_CS, SPI_MISO, SPI_MOSI, SPI_CLK, 500000);
-MCP2515 chademoCAN(SPI_PORT, CHADEMO_CAN_CS, SPI_MISO, SPI_MOSI, SPI_CLK, 500000);
+// Both controllers share SPI_PORT. The ChaDeMo bus is the safety critical one,
+// so its transfers go first.
+SPIBus spiBus(SPI_PORT, SPI_MOSI, SPI_MISO, SPI_CLK, 500000);
+MCP2515 mainCAN(&spiBus, MAIN_CAN_CS, SPIDevice::PRIORITY_NORMAL);
+MCP2515 chademoCAN(&spiBus, CHADEMO_CAN_CS, SPIDevice::PRIORITY_HIGH);
 
 
 Charger charger;
-State state;
 Station station;
 BMS bms;
 Battery battery;
 StatusLED led;
 Chademo chademo;
 
+extern CANBusTiming mainCANTiming;
+extern CANBusTiming chademoCANTiming;
+extern CANHealth mainCANHealth;
+extern CANHealth chademoCANHealth;
 
-// Watchdog
 
-struct repeating_timer watchdogKeepaliveTimer;
+// Watchdog
 
-bool watchdog_keepalive(struct repeating_timer *t) {
+void watchdog_keepalive() {
     watchdog_update();
-    return true;
 }
 
 void enable_watchdog_keepalive() {
-    add_repeating_timer_ms(5000, watchdog_keepalive, NULL, &watchdogKeepaliveTimer);
+    enable_task(TASK_WATCHDOG);
+}
+
+
+// CAN
+
+/*
+ * Bring up both CAN controllers and start servicing them. Timers and IRQs fire
+ * on the core that sets them up, so in dual core mode this runs on core 1.
+ */
+void setup_CAN() {
+    printf("Setting up main CAN port (BITRATE:%d:%d)\n", CAN_500KBPS, MCP_8MHZ);
+    configure_main_CAN();
+    printf("Enabling handling of inbound CAN messages on main bus\n");
+    enable_handle_main_CAN_messages();
+
+    printf("Setting up Chademo CAN port (BITRATE:%d:%d)\n", CAN_500KBPS, MCP_8MHZ);
+    configure_chademo_CAN();
+    printf("Enabling handling of inbound CAN messages on chademo bus\n");
+    enable_handle_chademo_CAN_messages();
+
+    enable_CAN_health_monitor();
+}
+
+#if CAN_DUAL_CORE
+/*
+ * Core 1 does nothing but CAN I/O. Received frames are queued for core 0 to
+ * decode, and the outbound messages are built from the state core 0 keeps.
+ */
+void CAN_core_main() {
+    canAlarmPool = hal_alarm_pool_create(CAN_CORE_ALARM);
+    start_scheduler(canAlarmPool);
+
+    setup_CAN();
+
+    while (true) {
+        __wfi();
+    }
 }
+#endif
 
 
 int main() {
@@ -92,6 +144,18 @@ int main() {
 
     printf("Charger starting up ...\n");
 
+    // Locks shared between the cores, before either uses them
+    init_timestamps();
+    init_scheduler();
+    #if CAN_DUAL_CORE
+    init_outbound_CAN_messages();
+    #endif
+
+    init_state_machine();
+
+    // Periodic work for core 0. In dual core mode core 1 starts its own.
+    start_scheduler(NULL);
+
     chademo_reinitialise();
 
     // Set up blinky LED
@@ -103,22 +167,15 @@ int main() {
     // 8MHz clock for CAN oscillator
     clock_gpio_init(CAN_CLK_PIN, CLOCKS_CLK_GPOUT0_CTRL_AUXSRC_VALUE_CLK_SYS, 10);
 
-    printf("Setting up main CAN port (BITRATE:%d:%d)\n", CAN_500KBPS, MCP_8MHZ);
-    mainCAN.reset();
-    mainCAN.setBitrate(CAN_500KBPS, MCP_8MHZ);
-    mainCAN.setNormalMode();
-    printf("Enabling handling of inbound CAN messages on main bus\n");
-    enable_handle_main_CAN_messages();
+    #if CAN_DUAL_CORE
+    printf("Starting CAN I/O on core 1\n");
+    multicore_launch_core1(CAN_core_main);
+    #else
+    setup_CAN();
+    #endif
 
     enable_bms_liveness_check();
 
-    printf("Setting up Chademo CAN port (BITRATE:%d:%d)\n", CAN_500KBPS, MCP_8MHZ);
-    chademoCAN.reset();
-    chademoCAN.setBitrate(CAN_500KBPS, MCP_8MHZ);
-    chademoCAN.setNormalMode();
-    printf("Enabling handling of inbound CAN messages on chademo bus\n");
-    enable_handle_chademo_CAN_messages();
-
     printf("Starting web server\n");
     TCP_SERVER_T *tcpState = new TCP_SERVER_T;
 
@@ -146,9 +203,45 @@ int main() {
 
     tcpState->complete = false;
 
+    printf("Press 't' for CAN frame timing, 'h' for CAN bus health, 'e' for state machine events, 's' for scheduler, 'c' for charging sessions, 'l' to log CAN frames, 'f' for the flight recorder\n");
+
     while(!tcpState->complete) {
         cyw43_arch_poll();
-        cyw43_arch_wait_for_work_until(make_timeout_time_ms(1000));
+        process_main_CAN_messages();
+        process_chademo_CAN_messages();
+        report_CAN_faults();
+        dispatch_events();
+        #if CAN_DUAL_CORE
+        publish_outbound_CAN_messages();
+        #endif
+        process_CAN_log();
+        switch (getchar_timeout_us(0)) {
+            case 't':
+                print_CAN_timing(&mainCANTiming);
+                print_CAN_timing(&chademoCANTiming);
+                break;
+            case 'h':
+                print_CAN_health(&mainCANHealth);
+                print_CAN_health(&chademoCANHealth);
+                break;
+            case 'e':
+                print_event_stats();
+                break;
+            case 's':
+                print_scheduler_stats();
+                break;
+            case 'c':
+                print_session_stats();
+                break;
+            case 'l':
+                toggle_CAN_log();
+                break;
+            case 'f':
+                print_flight_recorder();
+                break;
+        }
+        // Sleeps until the next interrupt, so a queued frame or event wakes us up
+        cyw43_arch_wait_for_work_until(make_timeout_time_ms(CAN_RX_POLL_INTERVAL));
     }
 
     return 0;
@@ -22,5 +22,8 @@
 
 #include <stdbool.h>
 
+void watchdog_keepalive();
+void enable_watchdog_keepalive();
+
 
 #endif
\ No newline at end of file
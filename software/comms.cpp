@@ -20,7 +20,6 @@
 using namespace std;
 
 #include <stdio.h>
-#include "pico/stdlib.h"
 
 #include "mcp2515/mcp2515.h"
 
@@ -28,74 +27,185 @@ extern "C" {
 #include "settings.h"
 #include "battery.h"
 #include "statemachine.h"
+#include "scheduler.h"
 }
 
+#include "canbus.h"
+#include "canmessages.h"
 #include "types.h"
 
 extern MCP2515 mainCAN;
-extern State state;
 extern BMS bms;
 
 struct can_frame mainCANInboundFrame;
-struct repeating_timer handleMainCANMessageTimer;
+CANStats mainCANStats;
+CANFrameQueue mainCANQueue;
+CANBusTiming mainCANTiming = { "main" };
+
+// Everything process_main_CAN_message() handles
+static const uint32_t mainCANHandledIds[] = {
+    BMS_LIMITS_MESSAGE_ID,
+    BMS_SOC_MESSAGE_ID,
+    BMS_STATUS_MESSAGE_ID,
+    BMS_ALARM_MESSAGE_ID
+};
 
 /*
- * Process inbound messages on the main CANbus
+ * Only let the frames we handle into the controller's receive buffers. Call
+ * while the controller is in config mode, before setNormalMode().
  */
-bool handle_main_CAN_message(struct repeating_timer *t) {
+static void set_main_CAN_filters() {
+    #if CAN_HARDWARE_FILTERS
+    if ( mainCAN.setAcceptanceFilters(mainCANHandledIds, sizeof(mainCANHandledIds) / sizeof(mainCANHandledIds[0])) != MCP2515::ERROR_OK ) {
+        printf("Failed to set main CAN acceptance filters\n");
+    }
+    #endif
+}
 
-    if ( mainCAN.readMessage(&mainCANInboundFrame) == MCP2515::ERROR_OK ) {
+/*
+ * Reset the controller and set it up for the main bus. Also used by the bus
+ * health monitor to recover the controller.
+ */
+void configure_main_CAN() {
+    mainCAN.reset();
+    mainCAN.setBitrate(CAN_500KBPS, MCP_8MHZ);
+    set_main_CAN_filters();
+    mainCAN.setNormalMode();
+}
 
-        switch ( mainCANInboundFrame.can_id ) {
+/*
+ * Decode a single inbound message from the main CANbus
+ */
+void process_main_CAN_message(struct can_frame *frame) {
 
-            case BMS_LIMITS_MESSAGE_ID:
-                bms.maximumVoltage = ( mainCANInboundFrame.data[0] | mainCANInboundFrame.data[1] << 8 ) / 10;
-                bms.maximumChargeCurrent = ( mainCANInboundFrame.data[2] | mainCANInboundFrame.data[3] << 8 ) / 10;
-                bms.maximumDischargeCurrent = ( mainCANInboundFrame.data[4] | mainCANInboundFrame.data[5] << 8 ) / 10;
-                bms.minimumVoltage = ( mainCANInboundFrame.data[6] | mainCANInboundFrame.data[7] << 8 ) / 10;
-                state(E_BMS_UPDATE_RECEIVED);
-                bms_heartbeat();
-                break;
+    switch ( frame->can_id ) {
 
-            case BMS_SOC_MESSAGE_ID:
-                bms.soc = mainCANInboundFrame.data[0] | mainCANInboundFrame.data[1] << 8;
-                state(E_BMS_UPDATE_RECEIVED);
-                bms_heartbeat();
+        case BMS_LIMITS_MESSAGE_ID:
+            if ( ! BMSLimitsCodec::valid(frame) ) {
+                mainCANStats.rejected++;
                 break;
-
-            case BMS_STATUS_MESSAGE_ID:            
-                bms.voltage = ( mainCANInboundFrame.data[0] | mainCANInboundFrame.data[1] << 8 ) / 100;
-                bms.batteryCurrent = ( mainCANInboundFrame.data[2] | mainCANInboundFrame.data[3] << 8 ) / 10;
-                bms.batteryTemperature = ( mainCANInboundFrame.data[4] | mainCANInboundFrame.data[5] << 8 ) / 10;
-                bms.measuredVoltage = ( mainCANInboundFrame.data[6] | mainCANInboundFrame.data[7] << 8 ) / 100;
-                state(E_BMS_UPDATE_RECEIVED);
-                bms_heartbeat();
+            }
+            bms.dirty |= BMSLimitsCodec::decode(frame, &bms);
+            post_event(E_BMS_UPDATE_RECEIVED);
+            bms_heartbeat();
+            break;
+
+        case BMS_SOC_MESSAGE_ID:
+            if ( ! BMSSocCodec::valid(frame) ) {
+                mainCANStats.rejected++;
                 break;
-
-            case BMS_ALARM_MESSAGE_ID:
-                bms.highCellAlarm = (mainCANInboundFrame.data[0] & ( 1 << 2 )) >> 2;
-                bms.lowCellAlarm = (mainCANInboundFrame.data[0] & ( 1 << 4 )) >> 4;
-                bms.highTempAlarm = (mainCANInboundFrame.data[0] & ( 1 << 6 )) >> 6;
-                bms.lowTempAlarm = mainCANInboundFrame.data[1];
-                bms.cellDeltaAlarm = mainCANInboundFrame.data[3];
-                bms.highCellWarn = (mainCANInboundFrame.data[4] & ( 1 << 2 )) >> 2;
-                bms.lowCellWarn = (mainCANInboundFrame.data[4] & ( 1 << 4 )) >> 4;
-                bms.highTempWarn = (mainCANInboundFrame.data[4] & ( 1 << 6 )) >> 6;
-                bms.lowTempWarn = mainCANInboundFrame.data[5];
-                state(E_BMS_UPDATE_RECEIVED);
-                bms_heartbeat();
+            }
+            bms.dirty |= BMSSocCodec::decode(frame, &bms);
+            post_event(E_BMS_UPDATE_RECEIVED);
+            bms_heartbeat();
+            break;
+
+        case BMS_STATUS_MESSAGE_ID:
+            if ( ! BMSStatusCodec::valid(frame) ) {
+                mainCANStats.rejected++;
                 break;
-
-            default:
+            }
+            bms.dirty |= BMSStatusCodec::decode(frame, &bms);
+            post_event(E_BMS_UPDATE_RECEIVED);
+            bms_heartbeat();
+            break;
+
+        case BMS_ALARM_MESSAGE_ID:
+            if ( ! BMSAlarmCodec::valid(frame) ) {
+                mainCANStats.rejected++;
                 break;
+            }
+            bms.dirty |= BMSAlarmCodec::decode(frame, &bms);
+            post_event(E_BMS_UPDATE_RECEIVED);
+            bms_heartbeat();
+            break;
+
+        default:
+            mainCANStats.unhandled++;
+            break;
 
-        }
     }
+}
+
+/*
+ * Hand a received frame over to the main loop for decoding
+ */
+void queue_main_CAN_message(struct can_frame *frame) {
+    push_CAN_frame(&mainCANQueue, frame, &mainCANStats);
+}
+
+/*
+ * Decode the frames received on the main bus since we last looked. Called from
+ * the main loop.
+ */
+void process_main_CAN_messages() {
+    drain_CAN_queue(&mainCANQueue, process_main_CAN_message, &mainCANStats, &mainCANTiming);
+}
+
+#if CAN_DMA
+/*
+ * Called from the DMA IRQ with each frame read from the main bus
+ */
+void receive_main_CAN_DMA_message(struct can_frame *frame) {
+    mainCANStats.framesReceived++;
+    queue_main_CAN_message(frame);
+}
+#endif
+
+/*
+ * Read the frames waiting on the main bus controller, or queue them for DMA
+ */
+static void read_main_CAN_messages() {
+    #if CAN_DMA
+    queue_CAN_messages(&mainCAN, &mainCANStats);
+    #else
+    receive_CAN_messages(&mainCAN, &mainCANInboundFrame, queue_main_CAN_message, &mainCANStats);
+    #endif
+}
+
+/*
+ * Process inbound messages on the main CANbus
+ */
+void handle_main_CAN_message() {
+
+    // Nothing waiting, don't bother asking the controller over SPI
+    if ( ! mainCAN.interruptPending() ) {
+        return;
+    }
+
+    read_main_CAN_messages();
+
+    // Or we'd be back here asking over SPI every poll until the next frame
+    mainCAN.releaseInterrupt();
+}
+
+/*
+ * Called from the GPIO IRQ when the main bus controller pulls INT low. Read
+ * until both receive buffers are empty so that INT goes high again and the
+ * next frame gives us a fresh edge. If we run out of budget first, INT stays
+ * low and the poll timer picks up the rest.
+ */
+void handle_main_CAN_interrupt() {
+
+    if ( ! mainCAN.acknowledgeInterrupt() ) {
+        return;
+    }
+
+    read_main_CAN_messages();
 
-    return true;
+    // INT is also held low by the error flags. Clear them or we'll miss edges.
+    mainCAN.releaseInterrupt();
 }
 
 void enable_handle_main_CAN_messages() {
-    add_repeating_timer_ms(10, handle_main_CAN_message, NULL, &handleMainCANMessageTimer);
+    #if CAN_RX_INTERRUPTS
+    mainCAN.setInterruptPin(MAIN_CAN_INT);
+    mainCAN.enableInterrupt(handle_main_CAN_interrupt);
+    #endif
+    #if CAN_DMA
+    mainCAN.enableDMA(receive_main_CAN_DMA_message);
+    #endif
+    // Always keep polling, in case an edge is missed
+    enable_task(TASK_MAIN_CAN_RX);
 }
 
@@ -20,7 +20,12 @@
 #ifndef COMMS_H
 #define COMMS_H
 
-bool handle_main_CAN_messages(struct repeating_timer *t);
+void configure_main_CAN();
+void process_main_CAN_message(struct can_frame *frame);
+void queue_main_CAN_message(struct can_frame *frame);
+void process_main_CAN_messages();
+void handle_main_CAN_message();
+void handle_main_CAN_interrupt();
 void enable_handle_main_CAN_messages();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,165 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "flightrecorder.h"
+#include "chademo.h"
+#include "hal.h"
+#include "settings.h"
+#include "types.h"
+
+extern BMS bms;
+extern Station station;
+extern Chademo chademo;
+
+/*
+ * Flight recorder. A ring of the last FLIGHT_RECORDER_SIZE state changes, each
+ * with a snapshot of the station, BMS and ChaDeMo fields that decide where the
+ * state machine goes next. Recording is a struct fill with no I/O, so it can
+ * stay on all the time.
+ *
+ * When we go to the error state, we keep recording for another
+ * FLIGHT_RECORDER_POST_TRIGGER changes and then freeze, so the lead up to the
+ * abort survives until someone dumps it. Dumping over the console re-arms the
+ * recorder.
+ *
+ * The dump is a header line followed by one line per record, oldest first,
+ * each the record's bytes in hex, so a host tool can unpack them with the
+ * FlightRecord layout.
+ *
+ * Records are only written by the state machine, from the main loop, and only
+ * read from the main loop, so there's no locking.
+ */
+
+static FlightRecord records[FLIGHT_RECORDER_SIZE];
+static uint32_t recorded;   // Records ever written. The next goes in recorded % FLIGHT_RECORDER_SIZE
+static uint32_t stopAt;     // Freeze once recorded reaches this, 0 if not triggered
+static uint32_t missed;     // State changes not recorded while frozen
+
+static uint8_t station_flags() {
+    return ( station.stationStatus             ? FR_STATION_STATUS                      : 0 ) |
+           ( station.stationMalfunction        ? FR_STATION_MALFUNCTION                 : 0 ) |
+           ( station.vehicleConnectorLock      ? FR_STATION_CONNECTOR_LOCKED            : 0 ) |
+           ( station.batteryIncompatability    ? FR_STATION_BATTERY_INCOMPATIBLE        : 0 ) |
+           ( station.chargingSystemMalfunction ? FR_STATION_CHARGING_SYSTEM_MALFUNCTION : 0 ) |
+           ( station.chargerStopControl        ? FR_STATION_STOP_CONTROL                : 0 );
+}
+
+static uint8_t bms_alarms() {
+    return ( bms.highCellAlarm  ? FR_BMS_HIGH_CELL_ALARM  : 0 ) |
+           ( bms.lowCellAlarm   ? FR_BMS_LOW_CELL_ALARM   : 0 ) |
+           ( bms.highTempAlarm  ? FR_BMS_HIGH_TEMP_ALARM  : 0 ) |
+           ( bms.lowTempAlarm   ? FR_BMS_LOW_TEMP_ALARM   : 0 ) |
+           ( bms.cellDeltaAlarm ? FR_BMS_CELL_DELTA_ALARM : 0 );
+}
+
+static uint8_t pins() {
+    return ( plug_is_in()                       ? FR_PIN_CS   : 0 ) |
+           ( in1_is_active()                    ? FR_PIN_IN1  : 0 ) |
+           ( in2_is_active()                    ? FR_PIN_IN2  : 0 ) |
+           ( out1_is_active()                   ? FR_PIN_OUT1 : 0 ) |
+           ( contactors_are_allowed_to_close()  ? FR_PIN_OUT2 : 0 );
+}
+
+void flight_record(State from, State to, Event event) {
+
+    if ( stopAt != 0 && recorded >= stopAt ) {
+        missed++;
+        return;
+    }
+
+    FlightRecord *record = &records[recorded % FLIGHT_RECORDER_SIZE];
+
+    record->timestamp = hal_time_us();
+    record->from = from;
+    record->to = to;
+    record->event = event;
+    record->pins = pins();
+    record->stationOutputVoltage = station.outputVoltage;
+    record->stationOutputCurrent = station.outputCurrent;
+    record->stationAvailableCurrent = station.availableCurrent;
+    record->station = station_flags();
+    record->bmsAlarms = bms_alarms();
+    record->bmsSoc = bms.soc;
+    record->chargingCurrentRequest = chademo.chargingCurrentRequest;
+    record->bmsVoltage = bms.voltage;
+    record->bmsTemperature = bms.batteryTemperature;
+    record->bmsMaximumChargeCurrent = bms.maximumChargeCurrent;
+    record->targetVoltage = chademo.targetVoltage;
+
+    recorded++;
+
+    if ( to == S_ERROR && stopAt == 0 ) {
+        stopAt = recorded + FLIGHT_RECORDER_POST_TRIGGER;
+    }
+}
+
+static uint32_t first_record() {
+    return recorded > FLIGHT_RECORDER_SIZE ? recorded - FLIGHT_RECORDER_SIZE : 0;
+}
+
+static int format_header(char *result, size_t max_result_len) {
+    return snprintf(result, max_result_len, "flight recorder v%d, %u byte records, %lu of %lu, %s, %lu missed\n",
+        FLIGHT_RECORDER_VERSION, (unsigned)sizeof(FlightRecord),
+        (unsigned long)( recorded - first_record() ), (unsigned long)recorded,
+        ( stopAt != 0 && recorded >= stopAt ) ? "frozen" : "recording", (unsigned long)missed);
+}
+
+static int format_record(uint32_t n, char *result, size_t max_result_len) {
+    const uint8_t *bytes = (const uint8_t *)&records[n % FLIGHT_RECORDER_SIZE];
+    int len = 0;
+    for ( size_t i = 0; i < sizeof(FlightRecord) && (size_t)len < max_result_len; i++ ) {
+        len += snprintf(result + len, max_result_len - len, "%02x", bytes[i]);
+    }
+    if ( (size_t)len < max_result_len ) {
+        len += snprintf(result + len, max_result_len - len, "\n");
+    }
+    return len;
+}
+
+/*
+ * The whole dump. Returns the length of the dump, as snprintf() would.
+ */
+int format_flight_recorder(char *result, size_t max_result_len) {
+    int len = format_header(result, max_result_len);
+    for ( uint32_t n = first_record(); n < recorded && (size_t)len < max_result_len; n++ ) {
+        len += format_record(n, result + len, max_result_len - len);
+    }
+    return len;
+}
+
+/*
+ * Dump to the console a line at a time, then re-arm
+ */
+void print_flight_recorder() {
+    char line[2 * sizeof(FlightRecord) + 2];
+    char header[128];
+
+    format_header(header, sizeof(header));
+    printf("%s", header);
+    for ( uint32_t n = first_record(); n < recorded; n++ ) {
+        format_record(n, line, sizeof(line));
+        printf("%s", line);
+    }
+
+    stopAt = 0;
+    missed = 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLIGHTRECORDER_H
+#define FLIGHTRECORDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "statemachine.h"
+
+#define FLIGHT_RECORDER_VERSION 1
+
+// Bits in FlightRecord.station
+#define FR_STATION_STATUS                      ( 1 << 0 )
+#define FR_STATION_MALFUNCTION                 ( 1 << 1 )
+#define FR_STATION_CONNECTOR_LOCKED            ( 1 << 2 )
+#define FR_STATION_BATTERY_INCOMPATIBLE        ( 1 << 3 )
+#define FR_STATION_CHARGING_SYSTEM_MALFUNCTION ( 1 << 4 )
+#define FR_STATION_STOP_CONTROL                ( 1 << 5 )
+
+// Bits in FlightRecord.bmsAlarms
+#define FR_BMS_HIGH_CELL_ALARM   ( 1 << 0 )
+#define FR_BMS_LOW_CELL_ALARM    ( 1 << 1 )
+#define FR_BMS_HIGH_TEMP_ALARM   ( 1 << 2 )
+#define FR_BMS_LOW_TEMP_ALARM    ( 1 << 3 )
+#define FR_BMS_CELL_DELTA_ALARM  ( 1 << 4 )
+
+// Bits in FlightRecord.pins
+#define FR_PIN_CS    ( 1 << 0 )  // Plug in
+#define FR_PIN_IN1   ( 1 << 1 )
+#define FR_PIN_IN2   ( 1 << 2 )
+#define FR_PIN_OUT1  ( 1 << 3 )
+#define FR_PIN_OUT2  ( 1 << 4 )  // Contactors permitted to close
+
+/*
+ * One state change, and what the charger looked like when it happened. The
+ * layout is fixed, little endian and packed, as this is what gets dumped.
+ * Any change to it must bump FLIGHT_RECORDER_VERSION.
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t timestamp;                // us since boot
+    uint8_t from;                      // State
+    uint8_t to;                        // State
+    uint8_t event;                     // Event that caused the change
+    uint8_t pins;                      // FR_PIN_*, active or not
+    uint16_t stationOutputVoltage;     // V
+    uint8_t stationOutputCurrent;      // A
+    uint8_t stationAvailableCurrent;   // A
+    uint8_t station;                   // FR_STATION_*
+    uint8_t bmsAlarms;                 // FR_BMS_*
+    uint8_t bmsSoc;                    // %
+    uint8_t chargingCurrentRequest;    // A
+    uint16_t bmsVoltage;               // 0.1 V
+    int16_t bmsTemperature;            // 0.1 C
+    uint16_t bmsMaximumChargeCurrent;  // 0.1 A
+    uint16_t targetVoltage;            // V
+} FlightRecord;
+
+void flight_record(State from, State to, Event event);
+int format_flight_recorder(char *result, size_t max_result_len);
+void print_flight_recorder();
+
+#endif
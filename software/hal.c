@@ -0,0 +1,113 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+
+#include "hal.h"
+
+uint64_t hal_time_us() {
+    return time_us_64();
+}
+
+uint32_t hal_disable_interrupts() {
+    return save_and_disable_interrupts();
+}
+
+void hal_restore_interrupts(uint32_t state) {
+    restore_interrupts(state);
+}
+
+bool hal_gpio_get(uint8_t pin) {
+    return gpio_get(pin);
+}
+
+void hal_gpio_put(uint8_t pin, bool value) {
+    gpio_put(pin, value);
+}
+
+static HALEdgeCallback edgeCallback;
+
+static void gpio_irq(uint gpio, uint32_t events) {
+    edgeCallback(gpio);
+}
+
+void hal_gpio_on_edge(uint8_t pin, HALEdgeCallback callback) {
+    edgeCallback = callback;
+    gpio_set_irq_enabled_with_callback(pin, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &gpio_irq);
+}
+
+// A HALLock is a critical section, from a fixed pool
+#define HAL_MAX_LOCKS 4
+
+static critical_section_t locks[HAL_MAX_LOCKS];
+static uint8_t locksUsed;
+
+HALLock *hal_lock_create() {
+    if ( locksUsed == HAL_MAX_LOCKS ) {
+        panic("Out of HAL locks");
+    }
+    critical_section_t *lock = &locks[locksUsed++];
+    critical_section_init(lock);
+    return (HALLock *)lock;
+}
+
+void hal_lock_enter(HALLock *lock) {
+    critical_section_enter_blocking((critical_section_t *)lock);
+}
+
+void hal_lock_exit(HALLock *lock) {
+    critical_section_exit((critical_section_t *)lock);
+}
+
+void hal_memory_barrier() {
+    __dmb();
+}
+
+void hal_signal_event() {
+    __sev();
+}
+
+uint8_t hal_core_num() {
+    return get_core_num();
+}
+
+// A HALAlarmPool is an alarm_pool_t
+HALAlarmPool *hal_alarm_pool_create(uint8_t hardwareAlarm) {
+    return (HALAlarmPool *)alarm_pool_create(hardwareAlarm, 16);
+}
+
+static repeating_timer_t tickers[NUM_CORES];
+
+static bool ticker_callback(repeating_timer_t *t) {
+    ((void (*)())t->user_data)();
+    return true;
+}
+
+void hal_start_ticker(HALAlarmPool *pool, uint32_t periodMs, void (*tick)()) {
+    repeating_timer_t *ticker = &tickers[get_core_num()];
+    // Negative, so the ticks are a fixed time apart however long the work takes
+    if ( pool == NULL ) {
+        add_repeating_timer_ms(-(int32_t)periodMs, ticker_callback, (void *)tick, ticker);
+    } else {
+        alarm_pool_add_repeating_timer_ms((alarm_pool_t *)pool, -(int32_t)periodMs, ticker_callback, (void *)tick, ticker);
+    }
+}
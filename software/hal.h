@@ -0,0 +1,76 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The protocol logic (state machine, ChaDeMo, BMS, station and the CAN decode
+ * path) reaches the hardware only through these functions. hal.c implements
+ * them on the Pico. Another build can link its own implementation instead,
+ * e.g. on a host with a virtual clock and simulated pins.
+ */
+
+// Microseconds since boot
+uint64_t hal_time_us();
+
+// Mask interrupts on this core, returning the state to restore
+uint32_t hal_disable_interrupts();
+void hal_restore_interrupts(uint32_t state);
+
+bool hal_gpio_get(uint8_t pin);
+void hal_gpio_put(uint8_t pin, bool value);
+
+/*
+ * Call back from the GPIO IRQ on both edges of pin. The Pico has a single GPIO
+ * callback per core, so every pin has to be given the same one.
+ */
+typedef void (*HALEdgeCallback)(uint8_t pin);
+void hal_gpio_on_edge(uint8_t pin, HALEdgeCallback callback);
+
+/*
+ * Lock shared between IRQs and both cores. Create them at startup, before
+ * anything can contend for them.
+ */
+typedef struct HALLock HALLock;
+HALLock *hal_lock_create();
+void hal_lock_enter(HALLock *lock);
+void hal_lock_exit(HALLock *lock);
+
+// Complete the memory accesses before this one before any after it
+void hal_memory_barrier();
+
+// Wake the main loop if it's waiting for work
+void hal_signal_event();
+
+uint8_t hal_core_num();
+
+/*
+ * Repeating tick, every periodMs, on the core that starts it. It's driven by
+ * the given alarm pool, or the default one if pool is NULL, and runs in
+ * interrupt context.
+ */
+typedef struct HALAlarmPool HALAlarmPool;
+HALAlarmPool *hal_alarm_pool_create(uint8_t hardwareAlarm);
+void hal_start_ticker(HALAlarmPool *pool, uint32_t periodMs, void (*tick)());
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Timing for the host benchmarks. Each runs a loop of calls enough times to
+ * time, and reports ns per call. On x86 it reports TSC ticks per call too.
+ *
+ * These compare two ways of doing the same thing on the build machine, so
+ * they show which way wins and roughly by how much. They're not a measure of
+ * the RP2040, which has no FPU, no cache and a much slower SPI bus.
+ *
+ *   bench_<name> [-n iterations]
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TICKS() __rdtsc()
+#else
+#define BENCH_TICKS() 0ull
+#endif
+
+// Keep the compiler from throwing a result away
+#define BENCH_KEEP(value) do { \
+    __typeof__(value) benchKept = (value); \
+    __asm__ volatile ( "" : : "r"( benchKept ) : "memory" ); \
+} while ( 0 )
+
+static inline uint64_t bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static inline uint32_t bench_iterations(int argc, char **argv, uint32_t fallback) {
+    for ( int i = 1; i + 1 < argc; i++ ) {
+        if ( strcmp(argv[i], "-n") == 0 ) {
+            return strtoul(argv[i + 1], NULL, 0);
+        }
+    }
+    return fallback;
+}
+
+/*
+ * Time iterations calls of body(i), and print the result as one line of the
+ * report. Returns ns per call.
+ */
+template <typename Body>
+static double bench(const char *name, uint32_t iterations, Body body) {
+    uint64_t ticks = BENCH_TICKS();
+    uint64_t start = bench_now_ns();
+    for ( uint32_t i = 0; i < iterations; i++ ) {
+        body(i);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    ticks = BENCH_TICKS() - ticks;
+    double ns = iterations ? (double)elapsed / iterations : 0;
+    printf("  %-40s %9.2f ns", name, ns);
+    if ( ticks != 0 ) {
+        printf(" %9.1f ticks", (double)ticks / iterations);
+    }
+    printf("\n");
+    return ns;
+}
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "types.h"
+#include "canmessages.h"
+#include "bench.h"
+
+/*
+ * Decode throughput of the message codecs, against hand written byte by byte
+ * decoding of the same BMS frames, as comms.cpp did before the codecs (with
+ * its bugs fixed, so both produce the same values). The codec path includes
+ * valid(), which the hand written one never had, and compares each field with
+ * its old value to set the dirty bits. On the build machine that comparison is
+ * most of the difference. Each frame goes through the same switch on its ID
+ * that the decoders use.
+ */
+
+#define N_FRAMES 64
+
+static struct can_frame frames[N_FRAMES];
+
+// Out of line, like process_main_CAN_message(). VALIDATE = false skips valid()
+// to show what it costs.
+template <bool VALIDATE>
+__attribute__((noinline)) static bool codec_decode(const struct can_frame *frame, BMS *bms) {
+    switch ( frame->can_id ) {
+        case BMS_LIMITS_MESSAGE_ID:
+            if ( VALIDATE && ! BMSLimitsCodec::valid(frame) ) return false;
+            bms->dirty |= BMSLimitsCodec::decode(frame, bms);
+            return true;
+        case BMS_SOC_MESSAGE_ID:
+            if ( VALIDATE && ! BMSSocCodec::valid(frame) ) return false;
+            bms->dirty |= BMSSocCodec::decode(frame, bms);
+            return true;
+        case BMS_STATUS_MESSAGE_ID:
+            if ( VALIDATE && ! BMSStatusCodec::valid(frame) ) return false;
+            bms->dirty |= BMSStatusCodec::decode(frame, bms);
+            return true;
+        case BMS_ALARM_MESSAGE_ID:
+            if ( VALIDATE && ! BMSAlarmCodec::valid(frame) ) return false;
+            bms->dirty |= BMSAlarmCodec::decode(frame, bms);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline uint16_t u16(const uint8_t *data, int byte) {
+    return data[byte] | data[byte + 1] << 8;
+}
+
+// 0.01 V to 0.1 V, rounded as the codec does
+static inline int32_t centi_to_deci(uint16_t value) {
+    return ( value + 5 ) / 10;
+}
+
+__attribute__((noinline)) static bool hand_decode(const struct can_frame *frame, BMS *bms) {
+    const uint8_t *data = frame->data;
+    switch ( frame->can_id ) {
+        case BMS_LIMITS_MESSAGE_ID:
+            bms->maximumVoltage = u16(data, 0);
+            bms->maximumChargeCurrent = u16(data, 2);
+            bms->maximumDischargeCurrent = u16(data, 4);
+            bms->minimumVoltage = u16(data, 6);
+            return true;
+        case BMS_SOC_MESSAGE_ID:
+            bms->soc = u16(data, 0);
+            return true;
+        case BMS_STATUS_MESSAGE_ID:
+            bms->voltage = centi_to_deci(u16(data, 0));
+            bms->batteryCurrent = (int16_t)u16(data, 2);
+            bms->batteryTemperature = (int16_t)u16(data, 4);
+            bms->measuredVoltage = centi_to_deci(u16(data, 6));
+            return true;
+        case BMS_ALARM_MESSAGE_ID:
+            bms->highCellAlarm = ( data[0] >> 2 ) & 1;
+            bms->lowCellAlarm = ( data[0] >> 4 ) & 1;
+            bms->highTempAlarm = ( data[0] >> 6 ) & 1;
+            bms->lowTempAlarm = data[1] != 0;
+            bms->cellDeltaAlarm = data[3] != 0;
+            bms->highCellWarn = ( data[4] >> 2 ) & 1;
+            bms->lowCellWarn = ( data[4] >> 4 ) & 1;
+            bms->highTempWarn = ( data[4] >> 6 ) & 1;
+            bms->lowTempWarn = data[5] != 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The four BMS frames in turn, with plausible values that move a little
+static void make_frames() {
+    static const canid_t ids[] = { BMS_LIMITS_MESSAGE_ID, BMS_SOC_MESSAGE_ID, BMS_STATUS_MESSAGE_ID, BMS_ALARM_MESSAGE_ID };
+    for ( int i = 0; i < N_FRAMES; i++ ) {
+        BMS bms = {};
+        bms.maximumVoltage = 4000 + i;
+        bms.maximumChargeCurrent = 1250;
+        bms.maximumDischargeCurrent = 2000;
+        bms.minimumVoltage = 3000;
+        bms.soc = 40 + i % 20;
+        bms.voltage = 3600 + i;
+        bms.batteryCurrent = -100 + i;
+        bms.batteryTemperature = 250;
+        bms.measuredVoltage = 3600 + i;
+        bms.lowCellWarn = i % 7 == 0;
+        switch ( ids[i % 4] ) {
+            case BMS_LIMITS_MESSAGE_ID: BMSLimitsCodec::encode(&bms, &frames[i]); break;
+            case BMS_SOC_MESSAGE_ID:    BMSSocCodec::encode(&bms, &frames[i]); break;
+            case BMS_STATUS_MESSAGE_ID: BMSStatusCodec::encode(&bms, &frames[i]); break;
+            case BMS_ALARM_MESSAGE_ID:  BMSAlarmCodec::encode(&bms, &frames[i]); break;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+
+    uint32_t n = bench_iterations(argc, argv, 20000000);
+
+    make_frames();
+
+    // Both paths have to agree before their times mean anything
+    for ( int i = 0; i < N_FRAMES; i++ ) {
+        BMS codec = {};
+        BMS hand = {};
+        codec_decode<true>(&frames[i], &codec);
+        hand_decode(&frames[i], &hand);
+        codec.dirty = 0;
+        if ( memcmp(&codec, &hand, sizeof(BMS)) != 0 ) {
+            printf("Frame %d (0x%03X) decodes differently\n", i, (unsigned)frames[i].can_id);
+            return 1;
+        }
+    }
+
+    printf("BMS frame decode, %lu frames\n", (unsigned long)n);
+
+    BMS bms = {};
+    double codec = bench("codec, with valid()", n, [&](uint32_t i) {
+        BENCH_KEEP(codec_decode<true>(&frames[i % N_FRAMES], &bms));
+    });
+    bench("codec, decode only", n, [&](uint32_t i) {
+        BENCH_KEEP(codec_decode<false>(&frames[i % N_FRAMES], &bms));
+    });
+    double hand = bench("hand written, unchecked", n, [&](uint32_t i) {
+        BENCH_KEEP(hand_decode(&frames[i % N_FRAMES], &bms));
+    });
+
+    printf("Codec: %.1f Mframes/s, hand written: %.1f Mframes/s\n", 1000.0 / codec, 1000.0 / hand);
+
+    ChademoStatusMessage status = { 2, 410, 125, 0, 0x09, 60 };
+    struct can_frame out;
+    bench("0x102 encode", n, [&](uint32_t i) {
+        status.chargingCurrentRequest = i;
+        ChademoStatusCodec::encode(&status, &out);
+        BENCH_KEEP(out.data[3]);
+    });
+
+    return 0;
+}
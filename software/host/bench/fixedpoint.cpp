@@ -0,0 +1,120 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+extern "C" {
+#include "settings.h"
+#include "battery.h"
+}
+
+#include "types.h"
+#include "cansignal.h"
+#include "bench.h"
+
+/*
+ * The charging estimate and the BMS decode, in the integer maths the firmware
+ * uses and in the float maths it replaced. The build machine has an FPU, so
+ * here the two come out close, and float can win where the integer path
+ * divides. The M0+ has no FPU, so each float operation there is a call into
+ * the soft float library, while the RP2040 divides integers in hardware. Read
+ * these as a check that the integer path hasn't grown more work, not as the
+ * gain on the car.
+ */
+
+extern BMS bms;
+extern Battery battery;
+
+// The float versions, as the code stood before it went to integers. Out of
+// line, as the firmware's are in another file.
+static struct {
+    float minimumVoltage;
+    float maximumVoltage;
+    float soc;
+    float capacityAH;
+    float capacityWH;
+} floatBMS = { 300.0f, 400.0f, 0.0f, 120.0f, 42000.0f };
+
+__attribute__((noinline)) static float float_voltage_from_soc(float soc) {
+    return floatBMS.minimumVoltage + ( floatBMS.maximumVoltage - floatBMS.minimumVoltage ) * soc / 100.0f;
+}
+
+__attribute__((noinline)) static uint8_t float_minutes_by_ah(float current, float targetSoc) {
+    float ah = floatBMS.capacityAH * fmaxf(targetSoc - floatBMS.soc, 0) / 100.0f;
+    float minutes = ah / current * 60.0f;
+    return minutes >= 255.0f ? 255 : (uint8_t)minutes;
+}
+
+__attribute__((noinline)) static uint8_t float_minutes_by_wh(float current, float targetSoc) {
+    float wh = floatBMS.capacityWH * fmaxf(targetSoc - floatBMS.soc, 0) / 100.0f;
+    float minutes = wh / ( current * float_voltage_from_soc(( floatBMS.soc + targetSoc ) / 2) ) * 60.0f;
+    return minutes >= 255.0f ? 255 : (uint8_t)minutes;
+}
+
+typedef CANSignal<0, 16, false, 1, 10> PackVoltage;  // 0x356, 0.01 V/bit
+
+int main(int argc, char **argv) {
+
+    uint32_t n = bench_iterations(argc, argv, 10000000);
+
+    bms.minimumVoltage = DECI(300);
+    bms.maximumVoltage = DECI(400);
+    battery.capacityAH = 120;
+    battery.capacityWH = 42000;
+
+    printf("Fixed point against float, %lu iterations\n", (unsigned long)n);
+
+    double fixedVoltage = bench("voltage from SoC, integer", n, [](uint32_t i) {
+        BENCH_KEEP(battery_get_voltage_from_soc(i % 101));
+    });
+    double floatVoltage = bench("voltage from SoC, float", n, [](uint32_t i) {
+        BENCH_KEEP(float_voltage_from_soc((float)( i % 101 )));
+    });
+
+    double fixedAh = bench("charging time by Ah, integer", n, [](uint32_t i) {
+        bms.soc = i % 80;
+        battery_recalculate_charging_time_minutes_by_ah(1 + i % 200, 80);
+        BENCH_KEEP(get_charging_time_minutes());
+    });
+    double floatAh = bench("charging time by Ah, float", n, [](uint32_t i) {
+        floatBMS.soc = (float)( i % 80 );
+        BENCH_KEEP(float_minutes_by_ah((float)( 1 + i % 200 ), 80.0f));
+    });
+
+    double fixedWh = bench("charging time by Wh, integer", n, [](uint32_t i) {
+        bms.soc = i % 80;
+        battery_recalculate_charging_time_minutes_by_wh(1 + i % 200, 80);
+        BENCH_KEEP(get_charging_time_minutes());
+    });
+    double floatWh = bench("charging time by Wh, float", n, [](uint32_t i) {
+        floatBMS.soc = (float)( i % 80 );
+        BENCH_KEEP(float_minutes_by_wh((float)( 1 + i % 200 ), 80.0f));
+    });
+
+    double fixedDecode = bench("0x356 voltage decode, integer", n, [](uint32_t i) {
+        BENCH_KEEP(PackVoltage::decode<DeciVolts>(i & 0xFFFF));
+    });
+    double floatDecode = bench("0x356 voltage decode, float", n, [](uint32_t i) {
+        BENCH_KEEP(PackVoltage::decode<float>(i & 0xFFFF));
+    });
+
+    printf("Float / integer: voltage %.2f, Ah %.2f, Wh %.2f, decode %.2f\n",
+        floatVoltage / fixedVoltage, floatAh / fixedAh, floatWh / fixedWh, floatDecode / fixedDecode);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+extern "C" {
+#include "sim.h"
+#include "statemachine.h"
+#include "types.h"
+}
+
+#include "world.h"
+#include "bench.h"
+
+/*
+ * How many guard evaluations the guard cache saves in a charging session, at
+ * the rates the BMS and the station send at. Each guard's result is kept
+ * until a decoder changes a field it reads, so most of the ones asked for on
+ * each event are answered without running. The session is the world's
+ * default, from 75% to full, and the report splits it by state.
+ *
+ *   bench_guards [-n ms]
+ *
+ * The counts are what the firmware would see. The time per ms step is only
+ * the host's, for the whole simulation.
+ */
+
+extern EventQueueStats eventStats;
+extern CANStats mainCANStats;
+extern CANStats chademoCANStats;
+
+typedef struct {
+    uint32_t ms;
+    uint32_t frames;
+    uint32_t evaluated;
+    uint32_t cached;
+} StateTotals;
+
+static void report(const char *name, const StateTotals *totals) {
+    double seconds = totals->ms / 1000.0;
+    uint32_t asked = totals->evaluated + totals->cached;
+    printf("  %-24s %9lu %8.1f %10.1f %10.1f %10.1f %8.1f%%\n", name, (unsigned long)totals->ms,
+        totals->frames / seconds, asked / seconds, totals->evaluated / seconds, totals->cached / seconds,
+        asked ? 100.0 * totals->cached / asked : 0.0);
+}
+
+int main(int argc, char **argv) {
+
+    uint32_t n = bench_iterations(argc, argv, 1200000);
+
+    World world;
+    world_init(&world);
+    world.pack.soc = 75;
+    world_start(&world);
+
+    StateTotals byState[N_STATES] = {};
+    bool finished = false;
+
+    printf("Guards asked for and run per second of a session, %lu ms at most\n", (unsigned long)n);
+
+    bench("session, per ms step", n, [&](uint32_t i) {
+        if ( finished ) {
+            return;
+        }
+        State state = get_state();
+        uint32_t frames = mainCANStats.framesReceived + chademoCANStats.framesReceived;
+        uint32_t evaluated = eventStats.guardsEvaluated;
+        uint32_t cached = eventStats.guardsCached;
+
+        world_step(&world);
+
+        StateTotals *totals = &byState[state];
+        totals->ms++;
+        totals->frames += mainCANStats.framesReceived + chademoCANStats.framesReceived - frames;
+        totals->evaluated += eventStats.guardsEvaluated - evaluated;
+        totals->cached += eventStats.guardsCached - cached;
+        finished = world_finished(&world);
+    });
+
+    printf("  %-24s %9s %8s %10s %10s %10s %9s\n", "", "ms", "frames/s", "asked/s", "run/s", "avoided/s", "avoided");
+    StateTotals session = {};
+    for ( int state = 0; state < N_STATES; state++ ) {
+        StateTotals *totals = &byState[state];
+        if ( totals->ms == 0 ) {
+            continue;
+        }
+        report(state_name((State)state), totals);
+        session.ms += totals->ms;
+        session.frames += totals->frames;
+        session.evaluated += totals->evaluated;
+        session.cached += totals->cached;
+    }
+    report("whole session", &session);
+
+    printf("Session %s after %.1f s\n", finished ? "finished" : "unfinished", session.ms / 1000.0);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+
+extern "C" {
+#include "settings.h"
+}
+
+#include "types.h"
+#include "canbus.h"
+#include "bench.h"
+
+/*
+ * Stress for the receive ring between the CAN ingress and the main loop.
+ * Here the producer and the consumer are two threads, which is harder on the
+ * ring than the firmware is, where the producer is an IRQ. The producer
+ * pushes numbered frames as fast as it can, retrying when the ring is full.
+ * The consumer checks that every frame comes out once, in order and intact.
+ * Both yield while they wait, so it still runs on a single core, though the
+ * ring only sees both sides at once where there are two.
+ *
+ * It's run with the consumer doing more work per frame each time, to show how
+ * full the ring gets as the main loop falls behind.
+ */
+
+static CANFrameQueue queue;
+static CANStats stats;
+static CANBusTiming timing;
+
+static uint32_t expected;
+static uint32_t corrupt;
+static volatile uint32_t work;
+static uint32_t workPerFrame;
+
+static void encode(struct can_frame *frame, uint32_t sequence) {
+    frame->can_id = sequence & CAN_SFF_MASK;
+    frame->can_dlc = 8;
+    memcpy(&frame->data[0], &sequence, 4);
+    uint32_t check = ~sequence;
+    memcpy(&frame->data[4], &check, 4);
+}
+
+static void consume(struct can_frame *frame) {
+    uint32_t sequence;
+    uint32_t check;
+    memcpy(&sequence, &frame->data[0], 4);
+    memcpy(&check, &frame->data[4], 4);
+    if ( sequence != expected || check != ~sequence || frame->can_id != ( sequence & CAN_SFF_MASK ) ) {
+        corrupt++;
+    }
+    expected = sequence + 1;
+    for ( uint32_t i = 0; i < workPerFrame; i++ ) {
+        work++;
+    }
+}
+
+static void run(uint32_t n, uint32_t consumerWork) {
+    memset(&queue, 0, sizeof(queue));
+    memset(&stats, 0, sizeof(stats));
+    memset(&timing, 0, sizeof(timing));
+    expected = 0;
+    corrupt = 0;
+    workPerFrame = consumerWork;
+
+    uint64_t start = bench_now_ns();
+
+    std::thread producer([n]() {
+        struct can_frame frame;
+        for ( uint32_t i = 0; i < n; i++ ) {
+            encode(&frame, i);
+            while ( ! push_CAN_frame(&queue, &frame, &stats) ) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t drained = 0;
+    while ( drained < n ) {
+        uint8_t frames = drain_CAN_queue(&queue, consume, &stats, &timing);
+        if ( frames == 0 ) {
+            std::this_thread::yield();
+        }
+        drained += frames;
+    }
+    producer.join();
+
+    uint64_t elapsed = bench_now_ns() - start;
+    printf("  consumer work %5lu: %7.2f Mframes/s %7.1f ns/frame, ring at most %2u of %u, found full %lu times, %lu bad\n",
+           (unsigned long)consumerWork,
+           elapsed ? n * 1000.0 / elapsed : 0, (double)elapsed / n,
+           stats.maxQueued, CAN_RX_QUEUE_SIZE,
+           (unsigned long)stats.queueFull, (unsigned long)( corrupt + ( expected != n ) ));
+}
+
+int main(int argc, char **argv) {
+
+    uint32_t n = bench_iterations(argc, argv, 1000000);
+
+    printf("Receive ring, producer and consumer on two threads, %lu frames\n", (unsigned long)n);
+
+    static const uint32_t consumerWork[] = { 0, 10, 100, 1000 };
+    uint32_t bad = 0;
+    for ( uint32_t work : consumerWork ) {
+        run(n, work);
+        bad += corrupt + ( expected != n );
+    }
+
+    return bad == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "sim.h"
+}
+
+#include "board.h"
+#include "bench.h"
+
+/*
+ * SPI transactions per frame on the mock bus, for the driver's receive and
+ * send paths against the register by register sequence they replaced: read
+ * SIDH..DLC, then CTRL, then the data, then clear RXnIF on the way in, and
+ * check TXREQ, load, request and read back CTRL on the way out. The counts
+ * are what the real bus would see. The times are only the mock's.
+ */
+
+extern MCP2515 mainCAN;
+
+#define CS MAIN_CAN_CS
+
+// The old path, a chip select at a time, as the driver used to clock it
+#define READ        0x03
+#define WRITE       0x02
+#define BIT_MODIFY  0x05
+#define READ_STATUS 0xA0
+
+#define CANINTF     0x2C
+#define TXB0CTRL    0x30
+#define TXB0SIDH    0x31
+#define TXB_TXREQ   0x08
+
+static const uint8_t rxSIDH[2] = { 0x61, 0x71 };
+static const uint8_t rxCTRL[2] = { 0x60, 0x70 };
+static const uint8_t rxDATA[2] = { 0x66, 0x76 };
+
+static void transaction(const uint8_t *out, size_t outLen, uint8_t *in, size_t inLen) {
+    gpio_put(CS, 0);
+    spi_write_blocking(SPI_PORT, out, outLen);
+    if ( inLen ) {
+        spi_read_blocking(SPI_PORT, 0x00, in, inLen);
+    }
+    gpio_put(CS, 1);
+}
+
+static uint8_t old_read_register(uint8_t reg) {
+    uint8_t out[2] = { READ, reg };
+    uint8_t value;
+    transaction(out, 2, &value, 1);
+    return value;
+}
+
+static bool old_read_message(struct can_frame *frame) {
+    uint8_t status;
+    uint8_t instruction = READ_STATUS;
+    transaction(&instruction, 1, &status, 1);
+    int n = ( status & 0x01 ) ? 0 : ( status & 0x02 ) ? 1 : -1;
+    if ( n < 0 ) {
+        return false;
+    }
+
+    uint8_t header[5];
+    uint8_t out[4] = { READ, rxSIDH[n] };
+    transaction(out, 2, header, 5);
+    frame->can_id = ( header[0] << 3 ) | ( header[1] >> 5 );
+    frame->can_dlc = header[4] & 0x0F;
+
+    old_read_register(rxCTRL[n]);
+
+    out[1] = rxDATA[n];
+    transaction(out, 2, frame->data, frame->can_dlc);
+
+    uint8_t clear[4] = { BIT_MODIFY, CANINTF, (uint8_t)( 0x01 << n ), 0 };
+    transaction(clear, 4, NULL, 0);
+    return true;
+}
+
+static bool old_send_message(const struct can_frame *frame) {
+    if ( old_read_register(TXB0CTRL) & TXB_TXREQ ) {
+        return false;
+    }
+
+    uint8_t load[2 + 5 + CAN_MAX_DLEN] = {
+        WRITE, TXB0SIDH,
+        (uint8_t)( frame->can_id >> 3 ), (uint8_t)( ( frame->can_id & 0x07 ) << 5 ), 0, 0, frame->can_dlc
+    };
+    memcpy(&load[7], frame->data, frame->can_dlc);
+    transaction(load, 7 + frame->can_dlc, NULL, 0);
+
+    uint8_t request[4] = { BIT_MODIFY, TXB0CTRL, TXB_TXREQ, TXB_TXREQ };
+    transaction(request, 4, NULL, 0);
+
+    old_read_register(TXB0CTRL);
+    return true;
+}
+
+static struct can_frame bmsFrame() {
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = 0x351;
+    frame.can_dlc = 8;
+    return frame;
+}
+
+/*
+ * Run a path n times and report SPI transactions and bytes per frame, and the
+ * time per frame. Returns transactions per frame.
+ */
+template <typename Body>
+static double measure(const char *name, uint32_t n, Body body) {
+    sdk_spi_reset_stats();
+    bench(name, n, body);
+    const SDKSPIStats *stats = sdk_spi_stats(CS);
+    double transactions = n ? (double)stats->transactions / n : 0;
+    printf("  %-40s %9.2f transactions %6.1f bytes\n", "", transactions, n ? (double)stats->bytes / n : 0);
+    return transactions;
+}
+
+int main(int argc, char **argv) {
+
+    uint32_t n = bench_iterations(argc, argv, 1000000);
+
+    sim_reset();
+    board_start();
+
+    struct can_frame in = bmsFrame();
+    struct can_frame out = bmsFrame();
+    uint32_t lost = 0;
+
+    printf("SPI transactions per frame on the main bus, %lu frames\n", (unsigned long)n);
+
+    double oldRead = measure("receive, register by register", n, [&](uint32_t i) {
+        mainCANChip.receive(&in);
+        lost += ! old_read_message(&out);
+    });
+    double newRead = measure("receive, READ RX BUFFER", n, [&](uint32_t i) {
+        mainCANChip.receive(&in);
+        lost += mainCAN.readMessage(&out) != MCP2515::ERROR_OK;
+    });
+
+    double oldSend = measure("send, register by register", n, [&](uint32_t i) {
+        lost += ! old_send_message(&out);
+    });
+    double newSend = measure("send, LOAD TX BUFFER and RTS", n, [&](uint32_t i) {
+        lost += mainCAN.sendMessage(&out) != MCP2515::ERROR_OK;
+    });
+
+    printf("Receive: %.2f transactions per frame, was %.2f\n", newRead, oldRead);
+    printf("Send: %.2f transactions per frame, was %.2f\n", newSend, oldSend);
+
+    if ( lost ) {
+        printf("%lu frames lost\n", (unsigned long)lost);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "led.h"
+#include "battery.h"
+#include "settings.h"
+#include "chademo.h"
+#include "statemachine.h"
+#include "inputs.h"
+#include "scheduler.h"
+#include "sim.h"
+#include "chademocomms.h"
+#include "util.h"
+}
+
+#include "canbus.h"
+#include "canhealth.h"
+#include "canlog.h"
+#include "comms.h"
+
+#include "charger.h"
+#include "types.h"
+
+#include "board.h"
+
+// Chips first, so the driver finds them on the bus
+MCP2515Sim mainCANChip(MAIN_CAN_CS, CAN_RX_INTERRUPTS ? MAIN_CAN_INT : MCP2515Sim::NO_INT_PIN);
+MCP2515Sim chademoCANChip(CHADEMO_CAN_CS, CAN_RX_INTERRUPTS ? CHADEMO_CAN_INT : MCP2515Sim::NO_INT_PIN);
+
+SPIBus spiBus(SPI_PORT, SPI_MOSI, SPI_MISO, SPI_CLK, 500000);
+MCP2515 mainCAN(&spiBus, MAIN_CAN_CS, SPIDevice::PRIORITY_NORMAL);
+MCP2515 chademoCAN(&spiBus, CHADEMO_CAN_CS, SPIDevice::PRIORITY_HIGH);
+
+Charger charger;
+Station station;
+BMS bms;
+Battery battery;
+StatusLED led;
+Chademo chademo;
+
+void watchdog_keepalive() {
+}
+
+void enable_watchdog_keepalive() {
+    enable_task(TASK_WATCHDOG);
+}
+
+static void setup_CAN() {
+    configure_main_CAN();
+    enable_handle_main_CAN_messages();
+    configure_chademo_CAN();
+    enable_handle_chademo_CAN_messages();
+    enable_CAN_health_monitor();
+}
+
+void board_start() {
+
+    // The station's signals, all inactive
+    sim_set_pin(CHADEMO_CS_PIN, 1);
+    sim_set_pin(CHADEMO_IN1_PIN, 0);
+    sim_set_pin(CHADEMO_IN2_PIN, 1);
+    sim_set_pin(CHARGE_INHIBIT_PIN, 1);
+
+    init_timestamps();
+    init_scheduler();
+    #if CAN_DUAL_CORE
+    init_outbound_CAN_messages();
+    #endif
+
+    init_state_machine();
+    start_scheduler(NULL);
+    chademo_reinitialise();
+    led_set_mode(STANDBY);
+    enable_led_blink();
+
+    #if CAN_DUAL_CORE
+    // What CAN_core_main() does, with core 1's ticker running core 1's tasks
+    sim_set_core(1);
+    start_scheduler(hal_alarm_pool_create(CAN_CORE_ALARM));
+    setup_CAN();
+    sim_set_core(0);
+    #else
+    setup_CAN();
+    #endif
+
+    enable_bms_liveness_check();
+
+    enable_listen_for_IN1_signal();
+    enable_listen_for_IN2_signal();
+    enable_listen_for_CS_signal();
+}
+
+void board_poll() {
+    process_main_CAN_messages();
+    process_chademo_CAN_messages();
+    report_CAN_faults();
+    dispatch_events();
+    #if CAN_DUAL_CORE
+    publish_outbound_CAN_messages();
+    #endif
+    process_CAN_log();
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOARD_H
+#define BOARD_H
+
+#include "mcp2515sim.h"
+
+/*
+ * The charger board on the host: the globals and bring-up from charger.cpp,
+ * with simulated MCP2515s on the SPI bus in place of the real ones. Connect
+ * the chips' onTransmit and receive() to whatever sits on the other end of
+ * each bus.
+ */
+
+extern MCP2515Sim mainCANChip;
+extern MCP2515Sim chademoCANChip;
+
+// What main() does before its loop. Call sim_reset() first.
+void board_start();
+
+// One pass of the main loop
+void board_poll();
+
+#endif
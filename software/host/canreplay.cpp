@@ -0,0 +1,430 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include "settings.h"
+#include "statemachine.h"
+#include "sim.h"
+}
+
+#include "board.h"
+#include "types.h"
+
+extern Battery battery;
+
+/*
+ * Replay a CAN log through the firmware on the host.
+ *
+ * The log is candump -L format, as our own CAN log writes it:
+ *
+ *   (1.250000) main 351#0A0B0C0D0E0F0001
+ *
+ * BMS frames on the main bus and station frames (0x108, 0x109) on the ChaDeMo
+ * bus go in through the simulated MCP2515s at their logged times, so they
+ * take the same decode paths as on the car. The car's own frames (0x100 to
+ * 0x102) in the log are what the firmware sent at the time, and are compared
+ * with what it sends now. Any other lines are ignored, so a whole console
+ * capture will do.
+ *
+ * The log has no record of the station's signal lines, so they're inferred
+ * from what it says on the bus: plugged in with IN1 on from its first frame,
+ * IN2 on while it reports charging (109.5.0), IN1 and IN2 off when it unlocks
+ * (109.5.2), and unplugged once it's said nothing for STATION_GONE_MS.
+ *
+ * The battery's capacity is the car's configuration rather than anything on
+ * the bus, so it's given with -W and -A. If there's no -W and the log is a
+ * file, the Wh are taken from the first recorded 0x101 before the replay
+ * starts. The Ah never go on the bus, so without -A the charging time will
+ * differ if it's worked out from them (CALCULATE_TIME_REMAINING_BASED_ON).
+ *
+ * The log is read a line at a time, so logs of any length run in constant
+ * memory.
+ *
+ *   canreplay [-x speed] [-w window ms] [-m main bus] [-c ChaDeMo bus]
+ *             [-W capacity Wh] [-A capacity Ah] [-v] [log]
+ *
+ * Speed is a multiple of real time, 0 (the default) for as fast as it'll go.
+ * A recorded car frame diverges if the replay sent nothing the same within
+ * the window either side of it. Exits 1 if anything diverged.
+ */
+
+#define START_US 1000000     // Boot this long before the log's first frame
+#define STATION_GONE_MS 500
+#define HISTORY 16           // Frames kept per ID, at least the window's worth
+#define N_CAR_FRAMES 3       // 0x100 to 0x102
+
+typedef struct {
+    uint64_t at;
+    struct can_frame frame;
+} TimedFrame;
+
+typedef struct {
+    TimedFrame sent[HISTORY];       // What the replay sent, a ring
+    uint32_t nSent;
+    TimedFrame recorded[HISTORY];   // Recorded, waiting for the window to pass, a ring
+    uint32_t recordedHead, recordedTail;
+    uint32_t compared;
+    uint32_t diverged;
+    uint32_t run;                   // Diverging frames in a row
+    uint64_t firstDivergedAt;
+} CarFrameHistory;
+
+static CarFrameHistory carFrames[N_CAR_FRAMES];
+
+static FILE *out;
+static uint64_t window = 250000;
+static const char *mainBus = "main";
+static const char *chademoBus = "ChaDeMo";
+
+// What the station's signals are doing, as far as we can tell
+static bool pluggedIn, in2Active, locked;
+static uint64_t lastStationFrameAt;
+
+static void print_frame(uint64_t at, const char *bus, const struct can_frame *frame) {
+    fprintf(out, "(%lu.%06lu) %s %03lX#", (unsigned long)( at / 1000000 ), (unsigned long)( at % 1000000 ),
+        bus, (unsigned long)( frame->can_id & CAN_SFF_MASK ));
+    for ( int i = 0; i < frame->can_dlc && i < CAN_MAX_DLEN; i++ ) {
+        fprintf(out, "%02X", frame->data[i]);
+    }
+}
+
+static bool same_frame(const struct can_frame *a, const struct can_frame *b) {
+    return a->can_dlc == b->can_dlc && memcmp(a->data, b->data, a->can_dlc) == 0;
+}
+
+static CarFrameHistory *car_frame_history(canid_t id) {
+    return id >= 0x100 && id < 0x100 + N_CAR_FRAMES ? &carFrames[id - 0x100] : NULL;
+}
+
+// Everything the firmware sends on the ChaDeMo bus
+static void sent(const struct can_frame *frame, void *context) {
+    uint64_t now = sim_time_us();
+    print_frame(now, "replay", frame);
+    fprintf(out, "\n");
+    CarFrameHistory *history = car_frame_history(frame->can_id);
+    if ( history != NULL ) {
+        history->sent[history->nSent++ % HISTORY] = { now, *frame };
+    }
+}
+
+// Compare the recorded frames whose windows have closed
+static void compare(uint64_t now) {
+    for ( CarFrameHistory *history = carFrames; history < carFrames + N_CAR_FRAMES; history++ ) {
+        while ( history->recordedTail != history->recordedHead ) {
+
+            TimedFrame *recorded = &history->recorded[history->recordedTail % HISTORY];
+            if ( recorded->at + window > now ) {
+                break;
+            }
+
+            const TimedFrame *nearest = NULL;
+            bool matched = false;
+            for ( uint32_t i = 0; i < HISTORY && i < history->nSent; i++ ) {
+                const TimedFrame *candidate = &history->sent[i];
+                uint64_t distance = candidate->at > recorded->at ? candidate->at - recorded->at : recorded->at - candidate->at;
+                if ( distance > window ) {
+                    continue;
+                }
+                if ( same_frame(&candidate->frame, &recorded->frame) ) {
+                    matched = true;
+                    break;
+                }
+                if ( nearest == NULL || distance < ( nearest->at > recorded->at ? nearest->at - recorded->at : recorded->at - nearest->at ) ) {
+                    nearest = candidate;
+                }
+            }
+
+            history->compared++;
+            if ( ! matched ) {
+                history->diverged++;
+                if ( history->firstDivergedAt == 0 ) {
+                    history->firstDivergedAt = recorded->at;
+                }
+                // Just the first of each run
+                if ( history->run++ == 0 ) {
+                    fprintf(out, "DIVERGED ");
+                    print_frame(recorded->at, "recorded", &recorded->frame);
+                    if ( nearest != NULL ) {
+                        fprintf(out, " replay ");
+                        print_frame(nearest->at, "sent", &nearest->frame);
+                    } else {
+                        fprintf(out, " replay sent nothing");
+                    }
+                    fprintf(out, "\n");
+                }
+            } else if ( history->run > 0 ) {
+                fprintf(out, "AGREED (%lu.%06lu) %03lX again after %lu frames\n",
+                    (unsigned long)( recorded->at / 1000000 ), (unsigned long)( recorded->at % 1000000 ),
+                    (unsigned long)recorded->frame.can_id, (unsigned long)history->run);
+                history->run = 0;
+            }
+            history->recordedTail++;
+        }
+    }
+}
+
+static void set_station_signals(bool plugged, bool in1, bool in2) {
+    if ( plugged && ! pluggedIn ) {
+        sim_set_pin(CHADEMO_CS_PIN, 0);
+    }
+    sim_set_pin(CHADEMO_IN1_PIN, in1);
+    sim_set_pin(CHADEMO_IN2_PIN, ! in2);
+    if ( ! plugged && pluggedIn ) {
+        sim_set_pin(CHADEMO_CS_PIN, 1);
+    }
+    pluggedIn = plugged;
+    in2Active = in2;
+}
+
+static void station_frame(const struct can_frame *frame, uint64_t now) {
+
+    lastStationFrameAt = now;
+    if ( ! pluggedIn ) {
+        locked = false;
+        set_station_signals(true, true, false);
+    }
+
+    if ( frame->can_id == EVSE_STATUS_MESSAGE_ID && frame->can_dlc > 5 ) {
+        bool charging = frame->data[5] & 0x01;
+        bool nowLocked = frame->data[5] & 0x04;
+        if ( charging && ! in2Active ) {
+            set_station_signals(true, true, true);
+        }
+        if ( locked && ! nowLocked ) {
+            set_station_signals(true, false, false);
+        }
+        locked = nowLocked;
+    }
+}
+
+static State lastState;
+
+// One millisecond of the firmware, and what came of it
+static void step(double speed, const struct timespec *wallStart) {
+
+    sim_advance_us(1000);
+    board_poll();
+
+    uint64_t now = sim_time_us();
+
+    if ( pluggedIn && now - lastStationFrameAt > STATION_GONE_MS * 1000 ) {
+        set_station_signals(false, false, false);
+    }
+
+    State state = get_state();
+    if ( state != lastState ) {
+        fprintf(out, "(%lu.%06lu) state %s -> %s\n", (unsigned long)( now / 1000000 ), (unsigned long)( now % 1000000 ),
+            state_name(lastState), state_name(state));
+        lastState = state;
+    }
+
+    compare(now);
+
+    // Every 10 ms of the log, catch up with the wall clock
+    static uint64_t throttledAt;
+    if ( speed > 0 && now - throttledAt >= 10000 ) {
+        throttledAt = now;
+        struct timespec wall;
+        clock_gettime(CLOCK_MONOTONIC, &wall);
+        double elapsed = ( wall.tv_sec - wallStart->tv_sec ) + ( wall.tv_nsec - wallStart->tv_nsec ) / 1e9;
+        double ahead = ( now - START_US ) / 1e6 / speed - elapsed;
+        if ( ahead > 0 ) {
+            usleep((useconds_t)( ahead * 1e6 ));
+        }
+    }
+}
+
+static bool parse_line(const char *line, uint64_t *at, char *bus, size_t busSize, struct can_frame *frame);
+
+// Look ahead for the capacity the car was sending, then rewind
+static bool find_capacity(FILE *log) {
+
+    char line[256], bus[32];
+    uint64_t at;
+    struct can_frame frame;
+    bool found = false;
+
+    if ( fseek(log, 0, SEEK_SET) != 0 ) {
+        return false;
+    }
+    while ( ! found && fgets(line, sizeof(line), log) != NULL ) {
+        if ( parse_line(line, &at, bus, sizeof(bus), &frame) && frame.can_id == 0x101 && frame.can_dlc > 6 && strcmp(bus, chademoBus) == 0 ) {
+            battery.capacityWH = ( frame.data[5] | frame.data[6] << 8 ) * 110;
+            found = true;
+        }
+    }
+    fseek(log, 0, SEEK_SET);
+    return found;
+}
+
+// "(1.250000) main 351#0A0B0C0D0E0F0001"
+static bool parse_line(const char *line, uint64_t *at, char *bus, size_t busSize, struct can_frame *frame) {
+
+    unsigned long seconds, micros;
+    char busName[32], payload[64];
+    if ( sscanf(line, " (%lu.%lu) %31s %63s", &seconds, &micros, busName, payload) != 4 ) {
+        return false;
+    }
+
+    char *hash = strchr(payload, '#');
+    if ( hash == NULL ) {
+        return false;
+    }
+    *hash = '\0';
+    memset(frame, 0, sizeof(*frame));
+    frame->can_id = strtoul(payload, NULL, 16);
+    if ( strlen(payload) > 3 ) {
+        frame->can_id |= CAN_EFF_FLAG;
+    }
+
+    const char *data = hash + 1;
+    while ( data[0] && data[1] && frame->can_dlc < CAN_MAX_DLEN ) {
+        char byte[3] = { data[0], data[1], '\0' };
+        frame->data[frame->can_dlc++] = strtoul(byte, NULL, 16);
+        data += 2;
+    }
+
+    *at = (uint64_t)seconds * 1000000 + micros;
+    snprintf(bus, busSize, "%s", busName);
+    return true;
+}
+
+int main(int argc, char **argv) {
+
+    double speed = 0;
+    bool verbose = false;
+    long capacityWH = -1, capacityAH = -1;
+
+    int opt;
+    while ( ( opt = getopt(argc, argv, "x:w:m:c:W:A:v") ) != -1 ) {
+        switch ( opt ) {
+            case 'x': speed = atof(optarg); break;
+            case 'w': window = strtoull(optarg, NULL, 0) * 1000; break;
+            case 'm': mainBus = optarg; break;
+            case 'c': chademoBus = optarg; break;
+            case 'W': capacityWH = atol(optarg); break;
+            case 'A': capacityAH = atol(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-x speed] [-w window ms] [-m main bus] [-c ChaDeMo bus] [-W Wh] [-A Ah] [-v] [log]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    FILE *log = stdin;
+    if ( optind < argc && ( log = fopen(argv[optind], "r") ) == NULL ) {
+        perror(argv[optind]);
+        return 2;
+    }
+
+    // Ours on stdout, and the firmware's only with -v
+    out = fdopen(dup(fileno(stdout)), "w");
+    if ( ! verbose && freopen("/dev/null", "w", stdout) == NULL ) {
+        return 2;
+    }
+
+    sim_reset();
+    board_start();
+    chademoCANChip.onTransmit = sent;
+    mainCANChip.onTransmit = NULL;
+    lastState = get_state();
+
+    // After bring up, which clears them
+    if ( capacityAH >= 0 ) {
+        battery.capacityAH = capacityAH;
+    }
+    if ( capacityWH >= 0 ) {
+        battery.capacityWH = capacityWH;
+    } else if ( ! find_capacity(log) ) {
+        fprintf(stderr, "No battery capacity in the log, so the charging time may differ. Give it with -W\n");
+    }
+    if ( capacityAH < 0 && strcmp(CALCULATE_TIME_REMAINING_BASED_ON, "ah") == 0 ) {
+        fprintf(stderr, "The charging time is worked out from the capacity in Ah, so it will differ. Give it with -A\n");
+    }
+
+    struct timespec wallStart;
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+    while ( sim_time_us() < START_US ) {
+        step(0, &wallStart);
+    }
+
+    char line[256], bus[32];
+    uint64_t at, offset = 0;
+    bool first = true;
+    uint32_t lines = 0, frames = 0;
+    struct can_frame frame;
+
+    while ( fgets(line, sizeof(line), log) != NULL ) {
+
+        lines++;
+        if ( ! parse_line(line, &at, bus, sizeof(bus), &frame) ) {
+            continue;
+        }
+        if ( first ) {
+            offset = START_US - at;
+            first = false;
+        }
+        at += offset;
+        frames++;
+
+        while ( sim_time_us() < at ) {
+            step(speed, &wallStart);
+        }
+
+        CarFrameHistory *history = car_frame_history(frame.can_id);
+        if ( strcmp(bus, mainBus) == 0 ) {
+            mainCANChip.receive(&frame);
+        } else if ( strcmp(bus, chademoBus) != 0 ) {
+            continue;
+        } else if ( history != NULL ) {
+            if ( history->recordedHead - history->recordedTail < HISTORY ) {
+                history->recorded[history->recordedHead++ % HISTORY] = { at, frame };
+            }
+        } else if ( frame.can_id == EVSE_CAPABILITIES_MESSAGE_ID || frame.can_id == EVSE_STATUS_MESSAGE_ID ) {
+            station_frame(&frame, sim_time_us());
+            chademoCANChip.receive(&frame);
+        }
+    }
+
+    // Let the last windows close, and the station go
+    uint64_t end = sim_time_us() + window + STATION_GONE_MS * 1000 + 1000000;
+    while ( sim_time_us() < end ) {
+        step(speed, &wallStart);
+    }
+
+    uint32_t diverged = 0;
+    fprintf(out, "Replayed %lu frames from %lu lines, %.1f s\n", (unsigned long)frames, (unsigned long)lines, ( sim_time_us() - START_US ) / 1e6);
+    for ( int i = 0; i < N_CAR_FRAMES; i++ ) {
+        const CarFrameHistory *history = &carFrames[i];
+        fprintf(out, "  %03X : compared %lu, diverged %lu", 0x100 + i, (unsigned long)history->compared, (unsigned long)history->diverged);
+        if ( history->diverged ) {
+            fprintf(out, ", first at %.6f s", history->firstDivergedAt / 1e6);
+        }
+        fprintf(out, "\n");
+        diverged += history->diverged;
+    }
+    fflush(out);
+    return diverged > 0 ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include "session.h"
+#include "statemachine.h"
+}
+
+#include "canlog.h"
+#include "world.h"
+
+/*
+ * Run one charging session from plug in to unplug with the default car and
+ * station, and report on it. Fails if the session doesn't finish, the car
+ * never gets to energy transfer, OUT2 was ever on outside it, the output went
+ * over the target voltage in constant voltage, or the station stopped on its
+ * output going over the car's maximum voltage once current was flowing. A
+ * pack that starts over the target is already over the maximum in 0x100, and
+ * the station refusing to charge it is what should happen.
+ *
+ * With -l, everything the firmware prints goes to the file, with the CAN log
+ * on, so it can be fed to canreplay.
+ *
+ *   chargesim [-l log] [soc%] [limit s]
+ */
+int main(int argc, char **argv) {
+
+    const char *log = NULL;
+    int opt;
+    while ( ( opt = getopt(argc, argv, "l:") ) != -1 ) {
+        switch ( opt ) {
+            case 'l': log = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-l log] [soc%%] [limit s]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    World world;
+    world_init(&world);
+    if ( optind < argc ) {
+        world.pack.soc = atof(argv[optind]);
+    }
+    uint32_t limit = optind + 1 < argc ? atoi(argv[optind + 1]) * 1000 : 4 * 3600 * 1000;
+
+    FILE *out = stdout;
+    if ( log != NULL ) {
+        out = fdopen(dup(fileno(stdout)), "w");
+        if ( freopen(log, "w", stdout) == NULL ) {
+            perror(log);
+            return 2;
+        }
+        CANLogEnabled = true;
+    }
+
+    clock_t start = clock();
+    world_start(&world);
+    bool finished = world_run(&world, limit);
+    double wall = (double)( clock() - start ) / CLOCKS_PER_SEC;
+
+    if ( log != NULL ) {
+        fflush(stdout);
+        dup2(fileno(out), fileno(stdout));
+    }
+
+    world_report(&world);
+    print_session_stats();
+    print_event_stats();
+    printf("%.2f s wall time\n", wall);
+
+    bool charged = world.statesVisited & 1 << S_ENERGY_TRANSFER;
+    bool overVoltage = world.evse.overVoltage && world.peakCurrent > 0;
+    bool ok = finished && charged && world.contactorViolations == 0 && world.overshoot == 0
+        && ! world.evse.carLost && ! overVoltage;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
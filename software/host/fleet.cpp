@@ -0,0 +1,419 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include "session.h"
+#include "statemachine.h"
+#include "sim.h"
+}
+
+#include "world.h"
+
+/*
+ * Monte-Carlo fleet runner. Runs a batch of randomised charging sessions and
+ * aggregates what happened, to tune ramp and termination behaviour against
+ * thousands of sessions rather than a handful on a real car.
+ *
+ * Each session varies the pack, the station's available current and when it
+ * derates, the BMS charge current limit and when it derates, the IN1 and IN2
+ * timing, dropped frames on both buses, and whether the plug gets pulled out
+ * part way through. All of it comes from the seed and the session's number,
+ * so any one session can be run again on its own with -r.
+ *
+ * The firmware's state is all globals, so each session runs in a process of
+ * its own, forked fresh, with up to one per core running at a time.
+ *
+ *   fleet [-n sessions] [-j jobs] [-s seed] [-r session]
+ */
+
+#define SESSION_LIMIT_MS ( 8 * 3600 * 1000 )
+
+typedef struct {
+    uint32_t index;
+    double capacityAh;
+    double soc;
+    double resistance;
+    uint8_t availableCurrent;      // A, from the station
+    uint32_t stationDerateAt;      // ms, 0 for never
+    uint8_t stationDeratedCurrent;
+    uint32_t bmsDerateAt;          // ms, 0 for never
+    double bmsDeratedCurrent;
+    uint32_t dropPermille;
+    uint32_t startDelay;           // IN1, ms after plug in
+    uint32_t lockDelay;
+    uint32_t insulationTestTime;   // IN2, ms after lock
+    uint32_t unplugAt;             // ms, 0 for never
+} Scenario;
+
+// Written down the pipe by each session, in one write
+typedef struct {
+    uint32_t index;
+    bool finished;
+    bool charged;                  // got as far as energy transfer
+    bool carLost;                  // the station stopped hearing from the car
+    uint32_t contactorViolations;  // ms with OUT2 on outside energy transfer
+    const char *abortReason;       // a literal from the transition table, valid in the parent as it's a fork
+    uint32_t timeToFirstAmp;       // ms, 0 if there was no current
+    double energyWh;
+    double socGained;
+    uint16_t rampViolations;
+    uint8_t maxCurrent;
+    uint32_t duration;             // ms
+    uint32_t framesDropped;
+    bool reachedCV;
+    uint32_t overshoot;            // 0.1 V over the target voltage, rounded up
+    uint32_t settlingTime;         // ms
+    bool overVoltage;              // the station stopped on it, with current flowing
+} Outcome;
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = ( x ^ ( x >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94D049BB133111EBULL;
+    return x ^ ( x >> 31 );
+}
+
+// splitmix64, one stream per session
+typedef struct {
+    uint64_t state;
+} Random;
+
+static double uniform(Random *r, double low, double high) {
+    r->state = mix(r->state);
+    return low + ( high - low ) * ( r->state >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+static bool chance(Random *r, double p) {
+    return uniform(r, 0, 1) < p;
+}
+
+static Scenario make_scenario(uint64_t seed, uint32_t index) {
+
+    Random r = { mix(seed) ^ index };
+    Scenario s = {};
+
+    s.index = index;
+    s.capacityAh = uniform(&r, 40, 160);
+    s.soc = uniform(&r, 5, 90);
+    s.resistance = uniform(&r, 0.02, 0.15);
+    s.availableCurrent = (uint8_t)uniform(&r, 40, 200);
+    if ( chance(&r, 0.3) ) {
+        s.stationDerateAt = (uint32_t)uniform(&r, 5000, 900000);
+        s.stationDeratedCurrent = (uint8_t)uniform(&r, 10, s.availableCurrent);
+    }
+    if ( chance(&r, 0.3) ) {
+        s.bmsDerateAt = (uint32_t)uniform(&r, 5000, 900000);
+        s.bmsDeratedCurrent = uniform(&r, 5, 100);
+    }
+    if ( chance(&r, 0.5) ) {
+        s.dropPermille = (uint32_t)uniform(&r, 1, 30);
+    }
+    s.startDelay = (uint32_t)uniform(&r, 100, 2000);
+    s.lockDelay = (uint32_t)uniform(&r, 100, 1500);
+    // Now and then, slow enough to run into the insulation test timeout
+    s.insulationTestTime = chance(&r, 0.05) ? (uint32_t)uniform(&r, 25000, 35000) : (uint32_t)uniform(&r, 500, 8000);
+    if ( chance(&r, 0.1) ) {
+        s.unplugAt = (uint32_t)uniform(&r, 1000, 600000);
+    }
+    return s;
+}
+
+static Outcome run_session(const Scenario *s) {
+
+    World world;
+    world_init(&world);
+    world.pack.capacityAh = s->capacityAh;
+    world.pack.soc = s->soc;
+    world.pack.resistance = s->resistance;
+    world.evse.availableCurrent = s->availableCurrent;
+    world.evse.startDelay = s->startDelay;
+    world.evse.lockDelay = s->lockDelay;
+    world.evse.insulationTestTime = s->insulationTestTime;
+    world.dropPermille = s->dropPermille;
+    world.random = mix(s->index) | 1;
+
+    world_start(&world);
+
+    for ( uint32_t ms = 1; ms <= SESSION_LIMIT_MS && ! world_finished(&world); ms++ ) {
+        if ( ms == s->stationDerateAt ) {
+            world.evse.availableCurrent = s->stationDeratedCurrent;
+        }
+        if ( ms == s->bmsDerateAt ) {
+            world.bms.maximumChargeCurrent = s->bmsDeratedCurrent;
+        }
+        if ( ms == s->unplugAt && world.evse.phase != EVSE_UNPLUGGED ) {
+            evse_model_unplug(&world.evse, sim_time_us());
+        }
+        world_step(&world);
+    }
+
+    Outcome o = {};
+    o.index = s->index;
+    o.finished = world.finishedAt != 0;
+    o.charged = world.statesVisited & 1 << S_ENERGY_TRANSFER;
+    o.carLost = world.evse.carLost;
+    o.contactorViolations = world.contactorViolations;
+    o.energyWh = world.pack.chargedWh;
+    o.socGained = world.pack.soc - s->soc;
+    o.duration = (uint32_t)( sim_time_us() / 1000 );
+    o.framesDropped = world.framesDropped;
+    o.reachedCV = world.cvAt != 0;
+    o.overshoot = (uint32_t)ceil(world.overshoot * 10);
+    o.settlingTime = (uint32_t)( world_settling_time(&world) / 1000 );
+    o.overVoltage = world.evse.overVoltage && world.peakCurrent > 0;
+
+    const Session *session = o.finished ? get_last_session() : get_current_session();
+    o.abortReason = session->abortReason;
+    o.rampViolations = session->rampViolations;
+    o.maxCurrent = session->maxCurrent;
+    if ( session->firstAmpAt != 0 ) {
+        o.timeToFirstAmp = (uint32_t)( ( session->firstAmpAt - session->startedAt ) / 1000 );
+    }
+
+    if ( ! o.finished ) {
+        world_report(&world);
+    }
+    return o;
+}
+
+static bool failed(const Outcome *o) {
+    return ! o->finished || o->contactorViolations > 0 || o->overshoot > 0 || o->overVoltage;
+}
+
+static void print_scenario(const Scenario *s) {
+    printf("Session %lu : %.0f Ah from %.0f%%, %.3f ohm, station %u A", (unsigned long)s->index, s->capacityAh, s->soc, s->resistance, s->availableCurrent);
+    if ( s->stationDerateAt ) {
+        printf(" then %u A at %.0f s", s->stationDeratedCurrent, s->stationDerateAt / 1000.0);
+    }
+    if ( s->bmsDerateAt ) {
+        printf(", BMS %.0f A at %.0f s", s->bmsDeratedCurrent, s->bmsDerateAt / 1000.0);
+    }
+    printf(", IN1 +%lu ms, lock +%lu ms, IN2 +%lu ms", (unsigned long)s->startDelay, (unsigned long)s->lockDelay, (unsigned long)s->insulationTestTime);
+    if ( s->dropPermille ) {
+        printf(", dropping %lu/1000 frames", (unsigned long)s->dropPermille);
+    }
+    if ( s->unplugAt ) {
+        printf(", pulled out at %.0f s", s->unplugAt / 1000.0);
+    }
+    printf("\n");
+}
+
+static uint32_t percentile(std::vector<uint32_t> &values, double p) {
+    if ( values.empty() ) {
+        return 0;
+    }
+    size_t i = (size_t)( p * ( values.size() - 1 ) );
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+typedef struct {
+    const char *reason;
+    uint32_t count;
+} ReasonCount;
+
+static void report(const std::vector<Outcome> &outcomes, uint32_t crashed) {
+
+    uint32_t finished = 0, charged = 0, aborted = 0, carLost = 0, rampSessions = 0, rampViolations = 0, contactor = 0, overVoltage = 0;
+    double energy = 0, socGained = 0;
+    std::vector<uint32_t> firstAmp, overshoot, settling;
+    std::vector<ReasonCount> reasons;
+
+    for ( const Outcome &o : outcomes ) {
+        finished += o.finished;
+        charged += o.charged;
+        carLost += o.carLost;
+        contactor += o.contactorViolations > 0;
+        overVoltage += o.overVoltage;
+        if ( o.reachedCV ) {
+            overshoot.push_back(o.overshoot);
+            settling.push_back(o.settlingTime);
+        }
+        energy += o.energyWh;
+        socGained += o.socGained;
+        if ( o.rampViolations ) {
+            rampSessions++;
+            rampViolations += o.rampViolations;
+        }
+        if ( o.timeToFirstAmp ) {
+            firstAmp.push_back(o.timeToFirstAmp);
+        }
+        if ( o.abortReason != NULL ) {
+            aborted++;
+            auto entry = std::find_if(reasons.begin(), reasons.end(), [&](const ReasonCount &r) { return r.reason == o.abortReason; });
+            if ( entry == reasons.end() ) {
+                reasons.push_back({ o.abortReason, 1 });
+            } else {
+                entry->count++;
+            }
+        }
+    }
+
+    uint32_t n = outcomes.size();
+    printf("  finished %lu, charged %lu, aborted %lu, unfinished %lu, crashed %lu\n",
+        (unsigned long)finished, (unsigned long)charged, (unsigned long)aborted,
+        (unsigned long)( n - finished ), (unsigned long)crashed);
+    if ( ! firstAmp.empty() ) {
+        uint32_t p50 = percentile(firstAmp, 0.5);
+        uint32_t p95 = percentile(firstAmp, 0.95);
+        uint32_t max = percentile(firstAmp, 1);
+        printf("  time to first amp p50 %lu ms, p95 %lu ms, max %lu ms\n", (unsigned long)p50, (unsigned long)p95, (unsigned long)max);
+    }
+    if ( ! overshoot.empty() ) {
+        printf("  CV overshoot p50 %.1f V, p95 %.1f V, max %.1f V in %lu sessions\n",
+            percentile(overshoot, 0.5) / 10.0, percentile(overshoot, 0.95) / 10.0, percentile(overshoot, 1) / 10.0,
+            (unsigned long)overshoot.size());
+        printf("  settled to within %.1f V p50 %lu ms, p95 %lu ms, max %lu ms\n", WORLD_SETTLING_BAND,
+            (unsigned long)percentile(settling, 0.5), (unsigned long)percentile(settling, 0.95),
+            (unsigned long)percentile(settling, 1));
+    }
+    if ( n > 0 ) {
+        printf("  energy %.0f kWh, %.0f Wh and %.1f%% SoC per session\n", energy / 1000, energy / n, socGained / n);
+    }
+    printf("  ramp violations %lu in %lu sessions\n", (unsigned long)rampViolations, (unsigned long)rampSessions);
+    printf("  OUT2 on outside energy transfer in %lu sessions\n", (unsigned long)contactor);
+    printf("  station stopped on over voltage while charging in %lu sessions\n", (unsigned long)overVoltage);
+    printf("  station lost the car in %lu sessions\n", (unsigned long)carLost);
+    for ( const ReasonCount &r : reasons ) {
+        printf("  aborted %lu x %s\n", (unsigned long)r.count, r.reason);
+    }
+}
+
+int main(int argc, char **argv) {
+
+    uint32_t sessions = 1000;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = 1;
+    long only = -1;
+
+    int opt;
+    while ( ( opt = getopt(argc, argv, "n:j:s:r:") ) != -1 ) {
+        switch ( opt ) {
+            case 'n': sessions = strtoul(optarg, NULL, 0); break;
+            case 'j': jobs = strtol(optarg, NULL, 0); break;
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'r': only = strtol(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n sessions] [-j jobs] [-s seed] [-r session]\n", argv[0]);
+                return 2;
+        }
+    }
+    if ( jobs < 1 ) {
+        jobs = 1;
+    }
+
+    // Just the one, in this process, with the firmware's output
+    if ( only >= 0 ) {
+        Scenario s = make_scenario(seed, only);
+        print_scenario(&s);
+        Outcome o = run_session(&s);
+        print_session_stats();
+        print_event_stats();
+        return failed(&o) ? 1 : 0;
+    }
+
+    int results[2];
+    if ( pipe(results) != 0 ) {
+        perror("pipe");
+        return 2;
+    }
+    fcntl(results[0], F_SETFL, O_NONBLOCK);
+    fflush(stdout);
+
+    std::vector<Outcome> outcomes;
+    std::vector<std::pair<pid_t, uint32_t>> running;
+    std::vector<uint32_t> crashes;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t launched = 0;
+    while ( launched < sessions || ! running.empty() ) {
+
+        if ( launched < sessions && running.size() < (size_t)jobs ) {
+            Scenario s = make_scenario(seed, launched);
+            pid_t pid = fork();
+            if ( pid == 0 ) {
+                close(results[0]);
+                if ( freopen("/dev/null", "w", stdout) == NULL ) {
+                    _exit(2);
+                }
+                Outcome o = run_session(&s);
+                _exit(write(results[1], &o, sizeof(o)) == sizeof(o) ? 0 : 2);
+            }
+            if ( pid < 0 ) {
+                perror("fork");
+                return 2;
+            }
+            running.push_back({ pid, launched++ });
+            continue;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        auto child = std::find_if(running.begin(), running.end(), [&](const std::pair<pid_t, uint32_t> &c) { return c.first == pid; });
+        if ( child == running.end() ) {
+            continue;
+        }
+        if ( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+            crashes.push_back(child->second);
+        }
+        running.erase(child);
+
+        // Its result went down the pipe before it exited
+        Outcome o;
+        while ( read(results[0], &o, sizeof(o)) == sizeof(o) ) {
+            outcomes.push_back(o);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+
+    printf("Fleet : %lu sessions, seed %llu, %ld jobs, %.1f s, %.1f sessions/s\n", (unsigned long)sessions,
+        (unsigned long long)seed, jobs, wall, sessions / wall);
+    report(outcomes, crashes.size());
+
+    std::sort(outcomes.begin(), outcomes.end(), [](const Outcome &a, const Outcome &b) { return a.index < b.index; });
+    uint32_t failures = crashes.size();
+    for ( const Outcome &o : outcomes ) {
+        if ( failed(&o) ) {
+            failures++;
+            Scenario s = make_scenario(seed, o.index);
+            print_scenario(&s);
+        }
+    }
+    for ( uint32_t index : crashes ) {
+        printf("Session %lu crashed\n", (unsigned long)index);
+    }
+    if ( failures > 0 ) {
+        printf("%lu sessions failed. Run one again with -s %llu -r <session>\n", (unsigned long)failures, (unsigned long long)seed);
+    }
+    return failures > 0 ? 1 : 0;
+}
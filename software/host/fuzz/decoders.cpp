@@ -0,0 +1,79 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+extern "C" {
+#include "statemachine.h"
+#include "chademocomms.h"
+}
+
+#include "comms.h"
+#include "types.h"
+#include "harness.h"
+
+extern BMS bms;
+extern Station station;
+
+/*
+ * Arbitrary frames straight into the decoders, one after another, with the
+ * state machine dispatching whatever events they post. Whatever's in the
+ * frames, the decoded values stay within the codecs' limits, and the state
+ * machine's own assertions hold.
+ *
+ * The input is a sequence of frames, as fuzz_frame() reads them. The top bit
+ * of the first byte of each picks the bus.
+ */
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    // The firmware chatters on stdout
+    return freopen("/dev/null", "w", stdout) == NULL;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+    FuzzInput in = { data, size };
+    fuzz_boot();
+
+    while ( fuzz_more(&in) ) {
+
+        bool chademoBus = fuzz_byte(&in) & 0x80;
+        struct can_frame frame;
+        fuzz_frame(&in, &frame);
+
+        if ( chademoBus ) {
+            process_chademo_CAN_message(&frame);
+        } else {
+            process_main_CAN_message(&frame);
+        }
+        while ( dispatch_events() > 0 ) {
+        }
+
+        FUZZ_CHECK(bms.maximumVoltage <= 10000 && bms.minimumVoltage <= 10000, "BMS voltage limits out of range");
+        FUZZ_CHECK(bms.soc <= 100, "SoC %u", bms.soc);
+        FUZZ_CHECK(bms.batteryTemperature >= -400 && bms.batteryTemperature <= 1500, "temperature %d", bms.batteryTemperature);
+        FUZZ_CHECK(station.maximumVoltageAvailable <= 1000, "station voltage available %u", station.maximumVoltageAvailable);
+        FUZZ_CHECK(station.thresholdVoltage <= 1000, "station threshold voltage %u", station.thresholdVoltage);
+        FUZZ_CHECK(station.outputVoltage <= 1000, "station output voltage %u", station.outputVoltage);
+        FUZZ_CHECK(get_state() < N_STATES, "state %d", get_state());
+        fuzz_check_contactors();
+    }
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+extern "C" {
+#include "settings.h"
+#include "statemachine.h"
+#include "sim.h"
+}
+
+#include "types.h"
+#include "board.h"
+#include "snapshot.h"
+#include "harness.h"
+
+extern Station station;
+extern EventQueueStats eventStats;
+
+void fuzz_boot() {
+
+    static bool snapshotTaken;
+    if ( ! snapshotTaken ) {
+        snapshot_take((const void *)board_start);
+        snapshotTaken = true;
+    } else {
+        snapshot_restore();
+    }
+
+    board_start();
+}
+
+bool fuzz_more(const FuzzInput *in) {
+    return in->size > 0;
+}
+
+uint8_t fuzz_byte(FuzzInput *in) {
+    if ( in->size == 0 ) {
+        return 0;
+    }
+    in->size--;
+    return *in->data++;
+}
+
+void fuzz_frame(FuzzInput *in, struct can_frame *frame) {
+
+    static const canid_t ids[] = {
+        BMS_LIMITS_MESSAGE_ID, BMS_SOC_MESSAGE_ID, BMS_STATUS_MESSAGE_ID, BMS_ALARM_MESSAGE_ID,
+        EVSE_CAPABILITIES_MESSAGE_ID, EVSE_STATUS_MESSAGE_ID, 0x100, 0x102
+    };
+
+    uint8_t selector = fuzz_byte(in);
+    memset(frame, 0, sizeof(*frame));
+    if ( selector & 0x80 ) {
+        frame->can_id = ( ( selector & 0x07 ) << 8 | fuzz_byte(in) ) & CAN_SFF_MASK;
+    } else {
+        frame->can_id = ids[selector & 0x07];
+    }
+    frame->can_dlc = fuzz_byte(in) % ( CAN_MAX_DLEN + 1 );
+    for ( int i = 0; i < CAN_MAX_DLEN; i++ ) {
+        frame->data[i] = fuzz_byte(in);
+    }
+}
+
+/*
+ * The state machine asserts this after every event. Between events, while a
+ * frame that changes the lock is still on its way to being dispatched, it
+ * can briefly not hold, so only check once everything's been dispatched.
+ */
+void fuzz_check_contactors() {
+
+    if ( eventStats.depth != 0 || ! sim_get_pin(CHADEMO_OUT2_PIN) ) {
+        return;
+    }
+
+    State state = get_state();
+    FUZZ_CHECK(state == S_ENERGY_TRANSFER || state == S_WINDING_DOWN, "OUT2 on in state %s", state_name(state));
+    FUZZ_CHECK(station.vehicleConnectorLock, "OUT2 on in state %s with the connector unlocked", state_name(state));
+}
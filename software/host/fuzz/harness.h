@@ -0,0 +1,67 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mcp2515/can.h"
+
+/*
+ * What the fuzz targets have in common: bringing the board up from power on
+ * for each input, and taking frames and numbers off the input.
+ */
+
+// Fail the input, with a reason
+#define FUZZ_CHECK(condition, ...) do { \
+    if ( ! ( condition ) ) { \
+        fprintf(stderr, "FUZZ_CHECK failed: " __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        abort(); \
+    } \
+} while ( 0 )
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} FuzzInput;
+
+// Power on: back to the firmware's initial globals, then board_start()
+void fuzz_boot();
+
+bool fuzz_more(const FuzzInput *in);
+
+// The next byte, or zero once the input's used up
+uint8_t fuzz_byte(FuzzInput *in);
+
+/*
+ * A frame: which ID (one of the frames we handle, picked by the low three
+ * bits, or with the top bit set, any standard ID), the length, then eight
+ * data bytes.
+ */
+void fuzz_frame(FuzzInput *in, struct can_frame *frame);
+
+// Check the OUT2 invariant from outside, between events
+void fuzz_check_contactors();
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+extern "C" {
+#include "settings.h"
+#include "statemachine.h"
+#include "sim.h"
+}
+
+#include "board.h"
+#include "harness.h"
+
+/*
+ * Whole sessions on the simulated board: the station's signal lines, frames
+ * on both buses through the MCP2515s, and time passing, in any order. The
+ * state machine asserts after every event that OUT2 is only permitted during
+ * energy transfer and winding down with the connector locked, and this
+ * checks the same between events.
+ *
+ * The input is a sequence of operations, each a byte and its arguments:
+ *
+ *   0 : drive a line. Next byte, CS, IN1, IN2 or CHARGE_INHIBIT by its low two
+ *       bits, high if the top bit's set
+ *   1 : a frame on the main bus, as fuzz_frame() reads it
+ *   2 : a frame on the ChaDeMo bus
+ *   3 : run for (next byte + 1) x 10 ms
+ *   anything else : run for 1 ms
+ *
+ * After the last operation, it runs on long enough for the liveness checks
+ * and state timeouts to have their say.
+ */
+
+#define RUN_OUT_MS ( CHADEMO_STATION_TTL + BMS_TTL + 1000 )
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    return freopen("/dev/null", "w", stdout) == NULL;
+}
+
+static void run(uint32_t ms) {
+    for ( uint32_t i = 0; i < ms; i++ ) {
+        sim_advance_us(1000);
+        board_poll();
+        fuzz_check_contactors();
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+    static const uint8_t lines[] = { CHADEMO_CS_PIN, CHADEMO_IN1_PIN, CHADEMO_IN2_PIN, CHARGE_INHIBIT_PIN };
+
+    FuzzInput in = { data, size };
+    fuzz_boot();
+
+    while ( fuzz_more(&in) ) {
+
+        struct can_frame frame;
+        uint8_t argument;
+
+        switch ( fuzz_byte(&in) ) {
+            case 0:
+                argument = fuzz_byte(&in);
+                sim_set_pin(lines[argument & 0x03], argument & 0x80);
+                break;
+            case 1:
+                fuzz_frame(&in, &frame);
+                mainCANChip.receive(&frame);
+                break;
+            case 2:
+                fuzz_frame(&in, &frame);
+                chademoCANChip.receive(&frame);
+                break;
+            case 3:
+                run(( fuzz_byte(&in) + 1 ) * 10);
+                break;
+            default:
+                run(1);
+                break;
+        }
+    }
+
+    run(RUN_OUT_MS);
+    return 0;
+}
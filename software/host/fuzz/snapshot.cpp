@@ -0,0 +1,101 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <link.h>
+
+#include "snapshot.h"
+
+typedef struct {
+    uintptr_t base;      // load address of the library we want
+    uintptr_t start;     // writable, after any RELRO
+    uintptr_t end;
+} Segment;
+
+static Segment segment;
+static uint8_t *copy;
+
+static int find_segment(struct dl_phdr_info *info, size_t size, void *data) {
+
+    Segment *found = (Segment *)data;
+    if ( info->dlpi_addr != found->base ) {
+        return 0;
+    }
+
+    uintptr_t relroEnd = 0;
+    for ( int i = 0; i < info->dlpi_phnum; i++ ) {
+        const ElfW(Phdr) *header = &info->dlpi_phdr[i];
+        if ( header->p_type == PT_GNU_RELRO ) {
+            relroEnd = info->dlpi_addr + header->p_vaddr + header->p_memsz;
+        }
+    }
+
+    for ( int i = 0; i < info->dlpi_phnum; i++ ) {
+        const ElfW(Phdr) *header = &info->dlpi_phdr[i];
+        if ( header->p_type == PT_LOAD && ( header->p_flags & PF_W ) ) {
+            found->start = info->dlpi_addr + header->p_vaddr;
+            found->end = found->start + header->p_memsz;
+            // The dynamic linker made the pages before that read only
+            if ( relroEnd > found->start && relroEnd < found->end ) {
+                found->start = relroEnd & ~(uintptr_t)0xFFF;
+            }
+        }
+    }
+    return 1;
+}
+
+// Byte by byte, so the sanitizers don't object to the gaps between globals
+__attribute__((no_sanitize("address")))
+static void copy_bytes(volatile uint8_t *to, const volatile uint8_t *from, size_t n) {
+    for ( size_t i = 0; i < n; i++ ) {
+        to[i] = from[i];
+    }
+}
+
+void snapshot_take(const void *address) {
+
+    Dl_info info;
+    if ( dladdr(address, &info) == 0 || info.dli_fbase == NULL ) {
+        fprintf(stderr, "snapshot: can't find the library\n");
+        abort();
+    }
+
+    // The main program's globals include the fuzzer's own
+    Dl_info self;
+    if ( dladdr((const void *)snapshot_take, &self) != 0 && self.dli_fbase == info.dli_fbase ) {
+        fprintf(stderr, "snapshot: the firmware has to be a shared library\n");
+        abort();
+    }
+
+    segment.base = (uintptr_t)info.dli_fbase;
+    if ( dl_iterate_phdr(find_segment, &segment) == 0 || segment.end <= segment.start ) {
+        fprintf(stderr, "snapshot: no writable segment in %s\n", info.dli_fname);
+        abort();
+    }
+
+    copy = (uint8_t *)malloc(segment.end - segment.start);
+    copy_bytes(copy, (const uint8_t *)segment.start, segment.end - segment.start);
+}
+
+void snapshot_restore() {
+    copy_bytes((uint8_t *)segment.start, copy, segment.end - segment.start);
+}
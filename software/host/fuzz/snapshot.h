@@ -0,0 +1,37 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * All of the firmware's state is in its globals. With the firmware built as a
+ * shared library, those are its writable segment, so a copy of that taken
+ * before it's started, put back later, takes it back to power on. The fuzz
+ * targets do that before every input, which keeps them in process, as
+ * libFuzzer needs, without one input leaking into the next.
+ */
+
+// Copy the writable segment of the shared library holding address
+void snapshot_take(const void *address);
+
+// Put it back
+void snapshot_restore();
+
+#endif
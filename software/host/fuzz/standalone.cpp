@@ -0,0 +1,266 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/*
+ * Drives the fuzz targets where libFuzzer isn't available, which is with gcc.
+ * It takes the same arguments as a libFuzzer binary, so the tests and anyone
+ * running them by hand don't need to know which they've got:
+ *
+ *   fuzz_session [-runs=N] [-seed=S] [-max_len=N] corpus...
+ *
+ * Every file in the corpus runs first, then N inputs made by mutating corpus
+ * entries, or from nothing if the corpus is empty. There's no coverage
+ * feedback, so it's no substitute for libFuzzer, but with the sanitizers
+ * it'll find the shallow stuff and it keeps the corpus honest. An input that
+ * crashes is written to crash-<n>.
+ */
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+extern "C" __attribute__((weak)) int LLVMFuzzerInitialize(int *argc, char ***argv);
+
+static std::vector<uint8_t> current;
+static uint64_t inputNumber;
+
+static uint64_t random_state;
+
+static uint64_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static uint64_t random_below(uint64_t n) {
+    return n == 0 ? 0 : next_random() % n;
+}
+
+/*
+ * Write out what we were running when it died. Only async-signal-safe calls
+ * in here.
+ */
+static void on_crash(int sig) {
+
+    char name[32] = "crash-";
+    char digits[21];
+    int n = 0;
+    uint64_t number = inputNumber;
+    do {
+        digits[n++] = '0' + number % 10;
+        number /= 10;
+    } while ( number > 0 );
+    size_t length = strlen(name);
+    while ( n > 0 ) {
+        name[length++] = digits[--n];
+    }
+    name[length] = '\0';
+
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd >= 0 ) {
+        if ( write(fd, current.data(), current.size()) < 0 ) {
+        }
+        close(fd);
+    }
+    static const char message[] = "==standalone== crashed, input written to ";
+    if ( write(2, message, sizeof(message) - 1) < 0 || write(2, name, length) < 0 || write(2, "\n", 1) < 0 ) {
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static bool read_file(const std::string &path, std::vector<uint8_t> *contents) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if ( file == NULL ) {
+        return false;
+    }
+    contents->clear();
+    uint8_t buffer[4096];
+    size_t n;
+    while ( ( n = fread(buffer, 1, sizeof(buffer), file) ) > 0 ) {
+        contents->insert(contents->end(), buffer, buffer + n);
+    }
+    fclose(file);
+    return true;
+}
+
+static void load_corpus(const char *path, std::vector<std::vector<uint8_t>> *corpus) {
+
+    struct stat info;
+    if ( stat(path, &info) != 0 ) {
+        fprintf(stderr, "%s: no such file or directory\n", path);
+        exit(1);
+    }
+
+    std::vector<uint8_t> contents;
+    if ( ! S_ISDIR(info.st_mode) ) {
+        if ( read_file(path, &contents) ) {
+            corpus->push_back(contents);
+        }
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if ( dir == NULL ) {
+        return;
+    }
+    std::vector<std::string> names;
+    struct dirent *entry;
+    while ( ( entry = readdir(dir) ) != NULL ) {
+        if ( entry->d_name[0] != '.' ) {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    // Same order every time, so a seed means the same thing on every machine
+    std::sort(names.begin(), names.end());
+    for ( const std::string &name : names ) {
+        if ( read_file(std::string(path) + "/" + name, &contents) ) {
+            corpus->push_back(contents);
+        }
+    }
+}
+
+static void mutate(std::vector<uint8_t> *input, const std::vector<std::vector<uint8_t>> &corpus, size_t maxLength) {
+
+    uint64_t mutations = 1 + random_below(8);
+    for ( uint64_t i = 0; i < mutations; i++ ) {
+        size_t size = input->size();
+        switch ( random_below(6) ) {
+            case 0: // flip a bit
+                if ( size > 0 ) {
+                    (*input)[random_below(size)] ^= 1 << random_below(8);
+                }
+                break;
+            case 1: // set a byte
+                if ( size > 0 ) {
+                    (*input)[random_below(size)] = next_random();
+                }
+                break;
+            case 2: // insert a byte
+                input->insert(input->begin() + random_below(size + 1), (uint8_t)next_random());
+                break;
+            case 3: // erase a run
+                if ( size > 0 ) {
+                    size_t at = random_below(size);
+                    size_t length = 1 + random_below(std::min<size_t>(size - at, 16));
+                    input->erase(input->begin() + at, input->begin() + at + length);
+                }
+                break;
+            case 4: // splice in a run from another entry
+                if ( ! corpus.empty() ) {
+                    const std::vector<uint8_t> &other = corpus[random_below(corpus.size())];
+                    if ( ! other.empty() ) {
+                        size_t at = random_below(other.size());
+                        size_t length = 1 + random_below(std::min<size_t>(other.size() - at, 32));
+                        input->insert(input->begin() + random_below(size + 1), other.begin() + at, other.begin() + at + length);
+                    }
+                }
+                break;
+            default: // interesting values
+                if ( size > 0 ) {
+                    static const uint8_t interesting[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+                    (*input)[random_below(size)] = interesting[random_below(sizeof(interesting))];
+                }
+                break;
+        }
+    }
+
+    if ( input->size() > maxLength ) {
+        input->resize(maxLength);
+    }
+}
+
+static void run_one(const std::vector<uint8_t> &input) {
+    current = input;
+    inputNumber++;
+    LLVMFuzzerTestOneInput(current.data(), current.size());
+}
+
+int main(int argc, char **argv) {
+
+    if ( LLVMFuzzerInitialize != NULL ) {
+        LLVMFuzzerInitialize(&argc, &argv);
+    }
+
+    uint64_t runs = 0;
+    uint64_t seed = 1;
+    size_t maxLength = 4096;
+    std::vector<std::vector<uint8_t>> corpus;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strncmp(argv[i], "-runs=", 6) == 0 ) {
+            runs = strtoull(argv[i] + 6, NULL, 10);
+        } else if ( strncmp(argv[i], "-seed=", 6) == 0 ) {
+            seed = strtoull(argv[i] + 6, NULL, 10);
+        } else if ( strncmp(argv[i], "-max_len=", 9) == 0 ) {
+            maxLength = strtoull(argv[i] + 9, NULL, 10);
+        } else if ( argv[i][0] == '-' ) {
+            fprintf(stderr, "Ignoring %s\n", argv[i]);
+        } else {
+            load_corpus(argv[i], &corpus);
+        }
+    }
+
+    // xorshift gets stuck at zero
+    random_state = seed * 0x9E3779B97F4A7C15ull | 1;
+
+    signal(SIGABRT, on_crash);
+    signal(SIGSEGV, on_crash);
+    signal(SIGFPE, on_crash);
+    signal(SIGILL, on_crash);
+    signal(SIGBUS, on_crash);
+
+    for ( const std::vector<uint8_t> &entry : corpus ) {
+        run_one(entry);
+    }
+    fprintf(stderr, "==standalone== ran %zu corpus inputs\n", corpus.size());
+
+    std::vector<uint8_t> input;
+    for ( uint64_t run = 0; run < runs; run++ ) {
+        if ( corpus.empty() ) {
+            input.resize(random_below(std::min<size_t>(maxLength, 256) + 1));
+            for ( uint8_t &byte : input ) {
+                byte = next_random();
+            }
+        } else {
+            input = corpus[random_below(corpus.size())];
+            mutate(&input, corpus, maxLength);
+        }
+        run_one(input);
+    }
+    fprintf(stderr, "==standalone== ran %llu mutated inputs from seed %llu\n",
+        (unsigned long long)runs, (unsigned long long)seed);
+
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal.h"
+#include "sim.h"
+
+/*
+ * hal.h on the host, for the simulator and tests. See sim.h.
+ */
+
+static uint64_t now;  // us
+
+static bool pins[SIM_N_PINS];
+static HALEdgeCallback edgeCallbacks[SIM_N_PINS];
+
+static bool interruptsEnabled = true;
+
+static uint8_t core;
+
+#define SIM_MAX_PENDING_IRQS 16
+
+static struct {
+    SimIRQ handler;
+    void *context;
+} pendingIRQs[SIM_MAX_PENDING_IRQS];
+static uint8_t nPendingIRQs;
+
+#define SIM_MAX_TICKERS 2
+
+typedef struct {
+    void (*tick)();
+    uint32_t period;  // us
+    uint64_t due;     // us
+    uint8_t core;     // the one that started it
+} SimTicker;
+
+static SimTicker tickers[SIM_MAX_TICKERS];
+static uint8_t nTickers;
+
+struct HALLock {
+    uint32_t interrupts;
+    bool held;
+};
+
+#define SIM_MAX_LOCKS 4
+
+static HALLock locks[SIM_MAX_LOCKS];
+static uint8_t nLocks;
+
+
+//// ----
+//
+// HAL
+//
+//// ----
+
+uint64_t hal_time_us() {
+    return now;
+}
+
+// Run IRQs raised while interrupts were masked, oldest first, one at a time
+static void run_pending_irqs() {
+    while ( nPendingIRQs > 0 && interruptsEnabled ) {
+        SimIRQ handler = pendingIRQs[0].handler;
+        void *context = pendingIRQs[0].context;
+        nPendingIRQs--;
+        memmove(&pendingIRQs[0], &pendingIRQs[1], nPendingIRQs * sizeof(pendingIRQs[0]));
+        interruptsEnabled = false;
+        handler(context);
+        interruptsEnabled = true;
+    }
+}
+
+uint32_t hal_disable_interrupts() {
+    uint32_t state = interruptsEnabled;
+    interruptsEnabled = false;
+    return state;
+}
+
+void hal_restore_interrupts(uint32_t state) {
+    interruptsEnabled = state;
+    if ( interruptsEnabled && nPendingIRQs > 0 ) {
+        run_pending_irqs();
+    }
+}
+
+bool hal_gpio_get(uint8_t pin) {
+    return pin < SIM_N_PINS && pins[pin];
+}
+
+void hal_gpio_put(uint8_t pin, bool value) {
+    if ( pin < SIM_N_PINS ) {
+        pins[pin] = value;
+    }
+}
+
+void hal_gpio_on_edge(uint8_t pin, HALEdgeCallback callback) {
+    if ( pin < SIM_N_PINS ) {
+        edgeCallbacks[pin] = callback;
+    }
+}
+
+HALLock *hal_lock_create() {
+    if ( nLocks == SIM_MAX_LOCKS ) {
+        fprintf(stderr, "Out of HAL locks\n");
+        abort();
+    }
+    return &locks[nLocks++];
+}
+
+/*
+ * Only one core runs at a time, so the only thing that could get in is an
+ * IRQ, and those are masked. Taking a lock we already hold would spin forever
+ * on the Pico.
+ */
+void hal_lock_enter(HALLock *lock) {
+    uint32_t interrupts = hal_disable_interrupts();
+    if ( lock->held ) {
+        fprintf(stderr, "HAL lock taken twice\n");
+        abort();
+    }
+    lock->held = true;
+    lock->interrupts = interrupts;
+}
+
+void hal_lock_exit(HALLock *lock) {
+    lock->held = false;
+    hal_restore_interrupts(lock->interrupts);
+}
+
+void hal_memory_barrier() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void hal_signal_event() {
+}
+
+uint8_t hal_core_num() {
+    return core;
+}
+
+// There's only the one pool
+HALAlarmPool *hal_alarm_pool_create(uint8_t hardwareAlarm) {
+    return NULL;
+}
+
+void hal_start_ticker(HALAlarmPool *pool, uint32_t periodMs, void (*tick)()) {
+    if ( nTickers == SIM_MAX_TICKERS ) {
+        fprintf(stderr, "Out of tickers\n");
+        abort();
+    }
+    tickers[nTickers].tick = tick;
+    tickers[nTickers].period = periodMs * 1000;
+    tickers[nTickers].due = now + periodMs * 1000;
+    tickers[nTickers].core = core;
+    nTickers++;
+}
+
+
+//// ----
+//
+// Simulation
+//
+//// ----
+
+void sim_reset() {
+    now = 0;
+    memset(pins, 0, sizeof(pins));
+    memset(edgeCallbacks, 0, sizeof(edgeCallbacks));
+    interruptsEnabled = true;
+    nPendingIRQs = 0;
+    nTickers = 0;
+    core = 0;
+    memset(locks, 0, sizeof(locks));
+    nLocks = 0;
+}
+
+uint64_t sim_time_us() {
+    return now;
+}
+
+void sim_set_core(uint8_t num) {
+    core = num;
+}
+
+// A tick runs on the core that started the ticker, as its alarm IRQ would
+static void run_ticker(void *context) {
+    SimTicker *ticker = (SimTicker *)context;
+    uint8_t interrupted = core;
+    core = ticker->core;
+    ticker->tick();
+    core = interrupted;
+}
+
+void sim_advance_us(uint64_t us) {
+
+    uint64_t end = now + us;
+
+    while ( true ) {
+
+        // The next ticker to fall due before the end, if any
+        int next = -1;
+        for ( int i = 0; i < nTickers; i++ ) {
+            if ( tickers[i].due <= end && ( next < 0 || tickers[i].due < tickers[next].due ) ) {
+                next = i;
+            }
+        }
+        if ( next < 0 ) {
+            break;
+        }
+
+        if ( tickers[next].due > now ) {
+            now = tickers[next].due;
+        }
+        tickers[next].due = now + tickers[next].period;
+        sim_raise_irq(run_ticker, &tickers[next]);
+    }
+
+    now = end;
+}
+
+void sim_sleep_us(uint64_t us) {
+    now += us;
+}
+
+static void run_edge_callback(void *context) {
+    uint8_t pin = (uint8_t)(uintptr_t)context;
+    edgeCallbacks[pin](pin);
+}
+
+void sim_set_pin(uint8_t pin, bool level) {
+    if ( pin >= SIM_N_PINS || pins[pin] == level ) {
+        return;
+    }
+    pins[pin] = level;
+    if ( edgeCallbacks[pin] != NULL ) {
+        sim_raise_irq(run_edge_callback, (void *)(uintptr_t)pin);
+    }
+}
+
+bool sim_get_pin(uint8_t pin) {
+    return hal_gpio_get(pin);
+}
+
+void sim_raise_irq(SimIRQ handler, void *context) {
+    if ( nPendingIRQs == SIM_MAX_PENDING_IRQS ) {
+        fprintf(stderr, "Too many pending IRQs\n");
+        abort();
+    }
+    pendingIRQs[nPendingIRQs].handler = handler;
+    pendingIRQs[nPendingIRQs].context = context;
+    nPendingIRQs++;
+    run_pending_irqs();
+}
+
+bool sim_interrupts_enabled() {
+    return interruptsEnabled;
+}
@@ -0,0 +1,427 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "mcp2515sim.h"
+
+// Registers and bits, from the MCP2515 data sheet
+#define REG_CANSTAT   0x0E
+#define REG_CANCTRL   0x0F
+#define REG_TEC       0x1C
+#define REG_REC       0x1D
+#define REG_CANINTE   0x2B
+#define REG_CANINTF   0x2C
+#define REG_EFLG      0x2D
+#define REG_TXB0CTRL  0x30
+#define REG_RXB0CTRL  0x60
+
+#define TXB(n)   ( REG_TXB0CTRL + 0x10 * (n) )
+#define RXB(n)   ( REG_RXB0CTRL + 0x10 * (n) )
+
+#define OPMOD_NORMAL     0x00
+#define OPMOD_LOOPBACK   0x40
+#define OPMOD_LISTENONLY 0x60
+#define OPMOD_CONFIG     0x80
+#define OPMOD_MASK       0xE0
+
+#define INTF_RX0IF 0x01
+#define INTF_TX0IF 0x04
+#define INTF_ERRIF 0x20
+
+#define EFLG_RX0OVR 0x40
+#define EFLG_RX1OVR 0x80
+
+#define TXB_TXREQ 0x08
+#define TXB_TXP   0x03
+
+#define RXB_RXM_ANY 0x60
+#define RXB0_BUKT   0x04
+
+#define SIDL_EXIDE 0x08
+#define SIDL_SRR   0x10
+#define DLC_RTR    0x40
+
+#define INSTRUCTION_WRITE       0x02
+#define INSTRUCTION_READ        0x03
+#define INSTRUCTION_BITMOD      0x05
+#define INSTRUCTION_READ_STATUS 0xA0
+#define INSTRUCTION_RX_STATUS   0xB0
+#define INSTRUCTION_RESET       0xC0
+
+static bool is_load_tx(uint8_t i)  { return i >= 0x40 && i <= 0x45; }
+static bool is_read_rx(uint8_t i)  { return ( i & 0xF9 ) == 0x90; }
+static bool is_rts(uint8_t i)      { return ( i & 0xF8 ) == 0x80; }
+
+// Filter and mask registers, which can only be written in config mode
+static bool is_config_register(uint8_t address) {
+    return address <= 0x0B || ( address >= 0x10 && address <= 0x1B ) || ( address >= 0x20 && address <= 0x2A );
+}
+
+static const uint8_t RXB0_FILTERS[] = { 0x00, 0x04 };
+static const uint8_t RXB1_FILTERS[] = { 0x08, 0x10, 0x14, 0x18 };
+static const uint8_t MASKS[] = { 0x20, 0x24 };
+
+MCP2515Sim::MCP2515Sim(uint8_t csPin, uint8_t intPin) : SDKSPIDevice(csPin) {
+    this->intPin = intPin;
+    this->onTransmit = NULL;
+    this->onTransmitContext = NULL;
+    memset(this->instructions, 0, sizeof(this->instructions));
+    this->framesReceived = 0;
+    this->framesFiltered = 0;
+    this->framesOverflowed = 0;
+    this->framesSent = 0;
+    this->instruction = 0;
+    this->index = 0;
+    this->address = 0;
+    this->mask = 0;
+    reset();
+}
+
+void MCP2515Sim::reset() {
+    memset(this->regs, 0, sizeof(this->regs));
+    this->regs[REG_CANCTRL] = 0x87;
+    this->regs[REG_CANSTAT] = OPMOD_CONFIG;
+    updateInt();
+}
+
+void MCP2515Sim::setInterruptPin(uint8_t intPin) {
+    this->intPin = intPin;
+    updateInt();
+}
+
+uint8_t MCP2515Sim::getRegister(uint8_t address) const {
+    return this->regs[address & 0x7F];
+}
+
+void MCP2515Sim::setRegister(uint8_t address, uint8_t value) {
+    this->regs[address & 0x7F] = value;
+    updateInt();
+}
+
+bool MCP2515Sim::intAsserted() const {
+    return ( this->regs[REG_CANINTF] & this->regs[REG_CANINTE] ) != 0;
+}
+
+void MCP2515Sim::updateInt() {
+    if ( this->intPin != NO_INT_PIN ) {
+        sdk_gpio_drive(this->intPin, ! intAsserted());
+    }
+}
+
+uint8_t MCP2515Sim::readStatus() const {
+    uint8_t intf = this->regs[REG_CANINTF];
+    uint8_t status = intf & 0x03;
+    for ( int n = 0; n < 3; n++ ) {
+        if ( this->regs[TXB(n)] & TXB_TXREQ ) {
+            status |= 0x04 << ( 2 * n );
+        }
+        if ( intf & ( INTF_TX0IF << n ) ) {
+            status |= 0x08 << ( 2 * n );
+        }
+    }
+    return status;
+}
+
+uint8_t MCP2515Sim::rxStatus() const {
+    uint8_t intf = this->regs[REG_CANINTF];
+    uint8_t status = ( intf & 0x01 ? 0x40 : 0 ) | ( intf & 0x02 ? 0x80 : 0 );
+    int n = ( intf & 0x01 ) ? 0 : 1;
+    if ( intf & 0x03 ) {
+        if ( this->regs[RXB(n) + 2] & SIDL_EXIDE ) {
+            status |= 0x10;
+        }
+        if ( this->regs[RXB(n) + 5] & DLC_RTR || this->regs[RXB(n) + 2] & SIDL_SRR ) {
+            status |= 0x08;
+        }
+        status |= this->regs[RXB(n)] & ( n == 0 ? 0x01 : 0x07 );
+    }
+    return status;
+}
+
+void MCP2515Sim::write(uint8_t address, uint8_t value) {
+
+    address &= 0x7F;
+    uint8_t opmod = this->regs[REG_CANSTAT] & OPMOD_MASK;
+
+    if ( is_config_register(address) && opmod != OPMOD_CONFIG ) {
+        return;
+    }
+
+    switch ( address ) {
+
+        case REG_CANSTAT:
+        case REG_TEC:
+        case REG_REC:
+            return;
+
+        case REG_CANCTRL:
+            this->regs[REG_CANCTRL] = value;
+            // Mode changes take effect straight away
+            this->regs[REG_CANSTAT] = ( this->regs[REG_CANSTAT] & ~OPMOD_MASK ) | ( value & OPMOD_MASK );
+            return;
+
+        case TXB(0):
+        case TXB(1):
+        case TXB(2):
+            this->regs[address] = ( this->regs[address] & ~( TXB_TXREQ | TXB_TXP ) ) | ( value & ( TXB_TXREQ | TXB_TXP ) );
+            if ( value & TXB_TXREQ ) {
+                transmit(( address - REG_TXB0CTRL ) >> 4);
+            }
+            return;
+
+        default:
+            this->regs[address] = value;
+            if ( address == REG_CANINTF || address == REG_CANINTE ) {
+                updateInt();
+            }
+            return;
+    }
+}
+
+void MCP2515Sim::transmit(int n) {
+
+    uint8_t opmod = this->regs[REG_CANSTAT] & OPMOD_MASK;
+    if ( opmod != OPMOD_NORMAL && opmod != OPMOD_LOOPBACK ) {
+        // Stays pending until the mode changes, which we don't model
+        return;
+    }
+
+    const uint8_t *b = &this->regs[TXB(n)];
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+
+    uint32_t id = ( b[1] << 3 ) | ( b[2] >> 5 );
+    if ( b[2] & SIDL_EXIDE ) {
+        id = ( id << 2 ) | ( b[2] & 0x03 );
+        id = ( id << 8 ) | b[3];
+        id = ( id << 8 ) | b[4];
+        id |= CAN_EFF_FLAG;
+    }
+    if ( b[5] & DLC_RTR ) {
+        id |= CAN_RTR_FLAG;
+    }
+    frame.can_id = id;
+    frame.can_dlc = b[5] & 0x0F;
+    if ( frame.can_dlc > CAN_MAX_DLEN ) {
+        frame.can_dlc = CAN_MAX_DLEN;
+    }
+    memcpy(frame.data, &b[6], frame.can_dlc);
+
+    this->regs[TXB(n)] &= ~TXB_TXREQ;
+    this->regs[REG_CANINTF] |= INTF_TX0IF << n;
+    this->framesSent++;
+    updateInt();
+
+    if ( opmod == OPMOD_LOOPBACK ) {
+        receive(&frame);
+    } else if ( this->onTransmit != NULL ) {
+        this->onTransmit(&frame, this->onTransmitContext);
+    }
+}
+
+bool MCP2515Sim::accepts(int n, const uint8_t id[4], bool ext, uint8_t *filhit) const {
+
+    if ( ( this->regs[RXB(n)] & RXB_RXM_ANY ) == RXB_RXM_ANY ) {
+        *filhit = 0;
+        return true;
+    }
+
+    const uint8_t *filters = n == 0 ? RXB0_FILTERS : RXB1_FILTERS;
+    int nFilters = n == 0 ? 2 : 4;
+    const uint8_t *m = &this->regs[MASKS[n]];
+
+    for ( int i = 0; i < nFilters; i++ ) {
+        const uint8_t *f = &this->regs[filters[i]];
+        if ( ( ( f[1] & SIDL_EXIDE ) != 0 ) != ext ) {
+            continue;
+        }
+        bool match = ( ( id[0] ^ f[0] ) & m[0] ) == 0 &&
+                     ( ( id[1] ^ f[1] ) & m[1] & 0xE0 ) == 0;
+        if ( ext ) {
+            match = match && ( ( id[1] ^ f[1] ) & m[1] & 0x03 ) == 0 &&
+                             ( ( id[2] ^ f[2] ) & m[2] ) == 0 &&
+                             ( ( id[3] ^ f[3] ) & m[3] ) == 0;
+        }
+        if ( match ) {
+            *filhit = n == 0 ? i : i + 2;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MCP2515Sim::receive(const struct can_frame *frame) {
+
+    uint8_t opmod = this->regs[REG_CANSTAT] & OPMOD_MASK;
+    if ( opmod != OPMOD_NORMAL && opmod != OPMOD_LISTENONLY && opmod != OPMOD_LOOPBACK ) {
+        this->framesFiltered++;
+        return false;
+    }
+
+    bool ext = frame->can_id & CAN_EFF_FLAG;
+    bool rtr = frame->can_id & CAN_RTR_FLAG;
+    uint8_t id[4];
+    if ( ext ) {
+        uint32_t eid = frame->can_id & CAN_EFF_MASK;
+        id[0] = eid >> 21;
+        id[1] = ( ( ( eid >> 18 ) & 0x07 ) << 5 ) | SIDL_EXIDE | ( ( eid >> 16 ) & 0x03 );
+        id[2] = eid >> 8;
+        id[3] = eid;
+    } else {
+        uint32_t sid = frame->can_id & CAN_SFF_MASK;
+        id[0] = sid >> 3;
+        id[1] = ( ( sid & 0x07 ) << 5 ) | ( rtr ? SIDL_SRR : 0 );
+        id[2] = 0;
+        id[3] = 0;
+    }
+
+    uint8_t intf = this->regs[REG_CANINTF];
+    uint8_t filhit;
+    int n;
+
+    if ( accepts(0, id, ext, &filhit) ) {
+        if ( ! ( intf & 0x01 ) ) {
+            n = 0;
+        } else if ( ( this->regs[RXB(0)] & RXB0_BUKT ) && ! ( intf & 0x02 ) ) {
+            // Rolled over into RXB1, which reports the RXB0 filter hit
+            n = 1;
+        } else {
+            this->regs[REG_EFLG] |= ( this->regs[RXB(0)] & RXB0_BUKT ) ? EFLG_RX1OVR : EFLG_RX0OVR;
+            this->regs[REG_CANINTF] |= INTF_ERRIF;
+            this->framesOverflowed++;
+            updateInt();
+            return false;
+        }
+    } else if ( accepts(1, id, ext, &filhit) ) {
+        if ( intf & 0x02 ) {
+            this->regs[REG_EFLG] |= EFLG_RX1OVR;
+            this->regs[REG_CANINTF] |= INTF_ERRIF;
+            this->framesOverflowed++;
+            updateInt();
+            return false;
+        }
+        n = 1;
+    } else {
+        this->framesFiltered++;
+        return false;
+    }
+
+    uint8_t *b = &this->regs[RXB(n)];
+    b[0] = ( b[0] & ~( n == 0 ? 0x01 : 0x07 ) ) | filhit;
+    memcpy(&b[1], id, 4);
+    b[5] = frame->can_dlc | ( ext && rtr ? DLC_RTR : 0 );
+    memset(&b[6], 0, CAN_MAX_DLEN);
+    memcpy(&b[6], frame->data, frame->can_dlc <= CAN_MAX_DLEN ? frame->can_dlc : CAN_MAX_DLEN);
+
+    this->regs[REG_CANINTF] |= INTF_RX0IF << n;
+    this->framesReceived++;
+    updateInt();
+
+    return true;
+}
+
+
+//// ----
+//
+// SPI
+//
+//// ----
+
+void MCP2515Sim::select() {
+    this->instruction = 0;
+    this->index = 0;
+}
+
+uint8_t MCP2515Sim::transfer(uint8_t out) {
+
+    uint8_t in = 0xFF;
+
+    if ( this->index == 0 ) {
+
+        this->instruction = out;
+        this->instructions[out]++;
+
+        if ( out == INSTRUCTION_RESET ) {
+            reset();
+        } else if ( is_rts(out) ) {
+            for ( int n = 0; n < 3; n++ ) {
+                if ( out & ( 1 << n ) ) {
+                    write(TXB(n), this->regs[TXB(n)] | TXB_TXREQ);
+                }
+            }
+        } else if ( is_read_rx(out) ) {
+            this->address = RXB(( out & 0x04 ) ? 1 : 0) + ( ( out & 0x02 ) ? 6 : 1 );
+        } else if ( is_load_tx(out) ) {
+            this->address = TXB(( out - 0x40 ) >> 1) + ( ( out & 0x01 ) ? 6 : 1 );
+        }
+
+    } else if ( this->instruction == INSTRUCTION_READ ) {
+        if ( this->index == 1 ) {
+            this->address = out;
+        } else {
+            in = this->regs[this->address++ & 0x7F];
+        }
+
+    } else if ( this->instruction == INSTRUCTION_WRITE ) {
+        if ( this->index == 1 ) {
+            this->address = out;
+        } else {
+            write(this->address++, out);
+        }
+
+    } else if ( this->instruction == INSTRUCTION_BITMOD ) {
+        if ( this->index == 1 ) {
+            this->address = out;
+        } else if ( this->index == 2 ) {
+            this->mask = out;
+        } else if ( this->index == 3 ) {
+            uint8_t current = this->regs[this->address & 0x7F];
+            write(this->address, ( current & ~this->mask ) | ( out & this->mask ));
+        }
+
+    } else if ( this->instruction == INSTRUCTION_READ_STATUS ) {
+        in = readStatus();
+
+    } else if ( this->instruction == INSTRUCTION_RX_STATUS ) {
+        in = rxStatus();
+
+    } else if ( is_read_rx(this->instruction) ) {
+        in = this->regs[this->address++ & 0x7F];
+
+    } else if ( is_load_tx(this->instruction) ) {
+        this->regs[this->address++ & 0x7F] = out;
+    }
+
+    if ( this->index < 255 ) {
+        this->index++;
+    }
+
+    return in;
+}
+
+void MCP2515Sim::deselect() {
+    // READ RX BUFFER frees the buffer when CS goes high
+    if ( is_read_rx(this->instruction) && this->index > 0 ) {
+        this->regs[REG_CANINTF] &= ~( INTF_RX0IF << ( ( this->instruction & 0x04 ) ? 1 : 0 ) );
+        updateInt();
+    }
+    this->instruction = 0;
+    this->index = 0;
+}
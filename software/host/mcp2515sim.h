@@ -0,0 +1,85 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MCP2515SIM_H
+#define MCP2515SIM_H
+
+#include <stdint.h>
+
+#include "picosdk.h"
+#include "mcp2515/can.h"
+
+/*
+ * An MCP2515 on the simulated SPI bus, as far as the driver uses one: the
+ * SPI instruction set, the register file, acceptance filters and masks,
+ * receive buffer rollover and overflow, the transmit buffers and the INT
+ * line. Frames go out on the wire the moment they're requested, and come in
+ * through receive().
+ */
+class MCP2515Sim : public SDKSPIDevice {
+    public:
+        static const uint8_t NO_INT_PIN = 0xFF;
+
+        MCP2515Sim(uint8_t csPin, uint8_t intPin = NO_INT_PIN);
+
+        // A frame on the wire. Returns false if it's filtered out or overflows.
+        bool receive(const struct can_frame *frame);
+
+        // Called with each frame the controller puts on the wire
+        void (*onTransmit)(const struct can_frame *frame, void *context);
+        void *onTransmitContext;
+
+        // Wire INT to a GPIO after the fact, as the jumpers on the board do
+        void setInterruptPin(uint8_t intPin);
+
+        uint8_t getRegister(uint8_t address) const;
+        void setRegister(uint8_t address, uint8_t value);
+        bool intAsserted() const;
+
+        // How many times each instruction was sent, by its first byte
+        uint32_t instructions[256];
+        uint32_t framesReceived;
+        uint32_t framesFiltered;
+        uint32_t framesOverflowed;
+        uint32_t framesSent;
+
+        void select() override;
+        uint8_t transfer(uint8_t out) override;
+        void deselect() override;
+
+    private:
+        uint8_t regs[128];
+        uint8_t intPin;
+
+        // The transaction in progress
+        uint8_t instruction;
+        uint8_t index;      // bytes clocked so far
+        uint8_t address;
+        uint8_t mask;       // BIT MODIFY
+
+        void reset();
+        void write(uint8_t address, uint8_t value);
+        void transmit(int txbn);
+        bool accepts(int rxbn, const uint8_t id[4], bool ext, uint8_t *filhit) const;
+        void updateInt();
+        uint8_t readStatus() const;
+        uint8_t rxStatus() const;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "settings.h"
+
+#include "bms.h"
+
+void bms_model_init(BMSModel *bms, Pack *pack) {
+    memset(bms, 0, sizeof(*bms));
+    bms->pack = pack;
+    bms->maximumVoltage = pack->fullVoltage;
+    bms->minimumVoltage = pack->emptyVoltage;
+    bms->maximumChargeCurrent = 150;
+    bms->maximumDischargeCurrent = 300;
+    bms->interval = 100;
+}
+
+/*
+ * Each message goes out on its own, spread across the interval, as most BMSs
+ * send them. Their phase within it is the message's position in the list.
+ */
+#define BMS_MODEL_MESSAGES 4
+
+static void send_message(BMSModel *bms, int message) {
+
+    const Pack *pack = bms->pack;
+    double voltage = pack_terminal_voltage(pack, bms->current);
+    struct can_frame frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_dlc = 8;
+
+    switch ( message ) {
+        case 0:
+            frame.can_id = BMS_LIMITS_MESSAGE_ID;
+            frame_put16(&frame, 0, (uint16_t)( bms->maximumVoltage * 10 ));
+            frame_put16(&frame, 2, (uint16_t)( bms->maximumChargeCurrent * 10 ));
+            frame_put16(&frame, 4, (uint16_t)( bms->maximumDischargeCurrent * 10 ));
+            frame_put16(&frame, 6, (uint16_t)( bms->minimumVoltage * 10 ));
+            break;
+        case 1:
+            frame.can_id = BMS_SOC_MESSAGE_ID;
+            frame_put16(&frame, 0, (uint16_t)pack->soc);
+            break;
+        case 2:
+            frame.can_id = BMS_STATUS_MESSAGE_ID;
+            frame_put16(&frame, 0, (uint16_t)( voltage * 100 ));
+            frame_put16(&frame, 2, (uint16_t)(int16_t)( bms->current * 10 ));
+            frame_put16(&frame, 4, (uint16_t)(int16_t)( pack->temperature * 10 ));
+            frame_put16(&frame, 6, (uint16_t)( voltage * 100 ));
+            break;
+        default:
+            frame.can_id = BMS_ALARM_MESSAGE_ID;
+            break;
+    }
+
+    bms->framesSent++;
+    if ( bms->send != NULL ) {
+        bms->send(&frame, bms->sendContext);
+    }
+}
+
+void bms_model_step(BMSModel *bms, uint64_t now) {
+    if ( bms->silent || now < bms->nextSend ) {
+        return;
+    }
+    send_message(bms, bms->nextMessage);
+    bms->nextMessage = ( bms->nextMessage + 1 ) % BMS_MODEL_MESSAGES;
+    bms->nextSend = now + (uint64_t)bms->interval * 1000 / BMS_MODEL_MESSAGES;
+}
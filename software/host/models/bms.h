@@ -0,0 +1,56 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_MODEL_H
+#define BMS_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "models.h"
+#include "pack.h"
+
+/*
+ * The car's BMS on the main bus. It reports the pack's limits, SoC, voltage,
+ * current and temperature, and no alarms, as 0x351, 0x355, 0x356 and 0x35A.
+ */
+typedef struct {
+    // Parameters
+    double maximumVoltage;        // V, the charge voltage limit
+    double minimumVoltage;        // V, the discharge voltage limit
+    double maximumChargeCurrent;  // A
+    double maximumDischargeCurrent;
+    uint32_t interval;            // ms between each message
+
+    // State
+    Pack *pack;
+    double current;               // A into the pack
+    uint64_t nextSend;            // us
+    int nextMessage;
+    bool silent;                  // stop sending, as if it had died
+    uint32_t framesSent;
+
+    FrameSink send;
+    void *sendContext;
+} BMSModel;
+
+void bms_model_init(BMSModel *bms, Pack *pack);
+void bms_model_step(BMSModel *bms, uint64_t now);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "settings.h"
+#include "sim.h"
+
+#include "evse.h"
+
+void evse_model_init(EVSEModel *evse, Pack *pack) {
+    memset(evse, 0, sizeof(*evse));
+    evse->pack = pack;
+    evse->maximumVoltage = 500;
+    evse->availableCurrent = 125;
+    evse->protocolNumber = 2;
+    evse->rampRate = 20;
+    evse->stopRate = 100;
+    evse->lag = 0.5;
+    evse->plugInAt = 100;
+    evse->startDelay = 500;
+    evse->lockDelay = 300;
+    evse->insulationTestTime = 2000;
+    evse->unplugDelay = 1000;
+    evse->carTimeout = 1000;
+    evse->interval = 100;
+    evse->phase = EVSE_WAITING;
+}
+
+const char *evse_phase_name(EVSEPhase phase) {
+    static const char *names[] = {
+        "waiting", "plugged in", "handshaking", "locking", "insulation test",
+        "charging", "stopping", "unlocking", "unplugged"
+    };
+    return names[phase];
+}
+
+void evse_model_receive(EVSEModel *evse, const struct can_frame *frame, uint64_t now) {
+    switch ( frame->can_id ) {
+        case 0x100:
+            evse->car.maximumBatteryVoltage = frame_get16(frame, 4);
+            break;
+        case 0x102:
+            evse->car.targetVoltage = frame_get16(frame, 1);
+            evse->car.currentRequest = frame->data[3];
+            evse->car.vehicleStatus = frame->data[5];
+            break;
+        default:
+            return;
+    }
+    evse->car.frames++;
+    evse->car.lastHeard = now;
+}
+
+static void go(EVSEModel *evse, EVSEPhase phase, uint64_t now) {
+    evse->phase = phase;
+    evse->phaseSince = now;
+}
+
+static bool waited(EVSEModel *evse, uint64_t now, uint32_t ms) {
+    return now - evse->phaseSince >= (uint64_t)ms * 1000;
+}
+
+// Pulled out mid session, without stopping first
+void evse_model_unplug(EVSEModel *evse, uint64_t now) {
+    sim_set_pin(CHADEMO_IN2_PIN, 1);
+    sim_set_pin(CHADEMO_IN1_PIN, 0);
+    sim_set_pin(CHADEMO_CS_PIN, 1);
+    evse->locked = false;
+    evse->setpoint = 0;
+    evse->outputCurrent = 0;
+    evse->deliveredCurrent = 0;
+    evse->outputVoltage = 0;
+    go(evse, EVSE_UNPLUGGED, now);
+}
+
+static void send_status(EVSEModel *evse) {
+
+    struct can_frame frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = EVSE_CAPABILITIES_MESSAGE_ID;
+    frame.can_dlc = 8;
+    frame.data[0] = 1; // weld detection supported
+    frame_put16(&frame, 1, evse->maximumVoltage);
+    frame.data[3] = evse->availableCurrent;
+    frame_put16(&frame, 4, evse->maximumVoltage);
+    evse->send(&frame, evse->sendContext);
+
+    // Charging from IN2 until the current's back to zero
+    bool charging = evse->phase == EVSE_CHARGING || ( evse->phase == EVSE_STOPPING && evse->outputCurrent > 0 );
+    bool stopping = evse->phase >= EVSE_STOPPING;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = EVSE_STATUS_MESSAGE_ID;
+    frame.can_dlc = 8;
+    frame.data[0] = evse->protocolNumber;
+    frame_put16(&frame, 1, (uint16_t)( evse->outputVoltage + 0.5 ));
+    frame.data[3] = (uint8_t)( evse->outputCurrent + 0.5 );
+    frame.data[5] =
+        charging |                  // 5.0 station status
+        evse->locked << 2 |         // 5.2 connector lock
+        ( ! stopping ) << 5;        // 5.5 stop control, which the car reads as "allowing charge"
+    frame.data[7] = 60;
+    evse->send(&frame, evse->sendContext);
+}
+
+static void ramp(EVSEModel *evse, double target, double rate, double seconds) {
+    double step = rate * seconds;
+    if ( evse->setpoint < target ) {
+        evse->setpoint = evse->setpoint + step > target ? target : evse->setpoint + step;
+    } else {
+        evse->setpoint = evse->setpoint - step < target ? target : evse->setpoint - step;
+    }
+    if ( evse->lag > seconds ) {
+        evse->outputCurrent += ( evse->setpoint - evse->outputCurrent ) * seconds / evse->lag;
+    } else {
+        evse->outputCurrent = evse->setpoint;
+    }
+    // Close enough to stop, or the lag never quite gets there
+    if ( evse->setpoint == 0 && evse->outputCurrent < 0.05 ) {
+        evse->outputCurrent = 0;
+    }
+}
+
+void evse_model_step(EVSEModel *evse, uint64_t now, double seconds) {
+
+    bool chargingEnabled = evse->car.vehicleStatus & 0x01;
+    bool contactorPermitted = sim_get_pin(CHADEMO_OUT2_PIN);
+
+    if (
+        evse->phase >= EVSE_HANDSHAKING && evse->phase <= EVSE_CHARGING &&
+        evse->car.frames > 0 && now - evse->car.lastHeard > (uint64_t)evse->carTimeout * 1000
+    ) {
+        evse->carLost = true;
+        go(evse, EVSE_STOPPING, now);
+    }
+
+    switch ( evse->phase ) {
+        case EVSE_WAITING:
+            if ( now >= (uint64_t)evse->plugInAt * 1000 ) {
+                sim_set_pin(CHADEMO_CS_PIN, 0);
+                go(evse, EVSE_PLUGGED_IN, now);
+            }
+            break;
+        case EVSE_PLUGGED_IN:
+            if ( waited(evse, now, evse->startDelay) ) {
+                sim_set_pin(CHADEMO_IN1_PIN, 1);
+                evse->nextSend = now;
+                go(evse, EVSE_HANDSHAKING, now);
+            }
+            break;
+        case EVSE_HANDSHAKING:
+            if ( chargingEnabled ) {
+                go(evse, EVSE_LOCKING, now);
+            }
+            break;
+        case EVSE_LOCKING:
+            if ( waited(evse, now, evse->lockDelay) ) {
+                evse->locked = true;
+                go(evse, EVSE_INSULATION_TEST, now);
+            }
+            break;
+        case EVSE_INSULATION_TEST:
+            if ( ! chargingEnabled ) {
+                go(evse, EVSE_STOPPING, now);
+            } else if ( waited(evse, now, evse->insulationTestTime) ) {
+                sim_set_pin(CHADEMO_IN2_PIN, 0);
+                go(evse, EVSE_CHARGING, now);
+            }
+            break;
+        case EVSE_CHARGING: {
+            double target = evse->car.currentRequest < evse->availableCurrent ? evse->car.currentRequest : evse->availableCurrent;
+            ramp(evse, contactorPermitted ? target : 0, evse->rampRate, seconds);
+            if ( evse->car.maximumBatteryVoltage != 0 && evse->outputVoltage > evse->car.maximumBatteryVoltage ) {
+                evse->overVoltage = true;
+                go(evse, EVSE_STOPPING, now);
+            } else if ( ! chargingEnabled ) {
+                go(evse, EVSE_STOPPING, now);
+            }
+            break;
+        }
+        case EVSE_STOPPING:
+            // Lost the car or over voltage, cut the output rather than ramp it down
+            if ( evse->carLost || evse->overVoltage ) {
+                evse->setpoint = 0;
+                evse->outputCurrent = 0;
+            } else {
+                ramp(evse, 0, evse->stopRate, seconds);
+            }
+            if ( evse->outputCurrent == 0 && ( ! contactorPermitted || evse->carLost ) && waited(evse, now, 500) ) {
+                sim_set_pin(CHADEMO_IN2_PIN, 1);
+                sim_set_pin(CHADEMO_IN1_PIN, 0);
+                evse->locked = false;
+                go(evse, EVSE_UNLOCKING, now);
+            }
+            break;
+        case EVSE_UNLOCKING:
+            if ( waited(evse, now, evse->unplugDelay) ) {
+                sim_set_pin(CHADEMO_CS_PIN, 1);
+                go(evse, EVSE_UNPLUGGED, now);
+            }
+            break;
+        case EVSE_UNPLUGGED:
+            break;
+    }
+
+    bool connected = evse->phase >= EVSE_CHARGING && evse->phase <= EVSE_STOPPING && contactorPermitted;
+    evse->deliveredCurrent = connected ? evse->outputCurrent : 0;
+    evse->outputVoltage = connected ? pack_terminal_voltage(evse->pack, evse->deliveredCurrent) : 0;
+
+    if ( evse->phase >= EVSE_HANDSHAKING && evse->phase <= EVSE_UNLOCKING && now >= evse->nextSend ) {
+        evse->nextSend = now + (uint64_t)evse->interval * 1000;
+        send_status(evse);
+    }
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVSE_MODEL_H
+#define EVSE_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "models.h"
+#include "pack.h"
+
+/*
+ * A ChaDeMo station, driving the car's CS, IN1 and IN2 lines and the ChaDeMo
+ * bus, following the sequence in the spec. The output current follows the
+ * car's request at a limited ramp rate and through a first order lag, into
+ * the pack while the car permits its contactors to close (OUT2). It reports
+ * its output in whole volts and amps, and stops if the output goes over the
+ * maximum battery voltage the car sent in 0x100, as a real station would.
+ */
+typedef enum {
+    EVSE_WAITING,             // Not plugged in yet
+    EVSE_PLUGGED_IN,          // Plugged in, but not started
+    EVSE_HANDSHAKING,         // IN1 on, exchanging parameters
+    EVSE_LOCKING,             // The car has enabled charging
+    EVSE_INSULATION_TEST,     // Locked, testing the cable
+    EVSE_CHARGING,            // IN2 on, delivering current
+    EVSE_STOPPING,            // Ramping down to zero
+    EVSE_UNLOCKING,           // Stopped and unlocked, waiting to be unplugged
+    EVSE_UNPLUGGED            // All done
+} EVSEPhase;
+
+typedef struct {
+    // Parameters
+    uint16_t maximumVoltage;      // V available
+    uint8_t availableCurrent;     // A
+    uint8_t protocolNumber;
+    double rampRate;              // A/s, following the car's request
+    double stopRate;              // A/s, ramping down to stop
+    double lag;                   // s, time constant from the ramp to the output
+    uint32_t plugInAt;            // ms
+    uint32_t startDelay;          // ms from plug in to IN1
+    uint32_t lockDelay;           // ms from charge enable to lock
+    uint32_t insulationTestTime;  // ms from lock to IN2
+    uint32_t unplugDelay;         // ms from unlock to unplug
+    uint32_t carTimeout;          // ms of silence from the car before we give up
+    uint32_t interval;            // ms between status bursts
+
+    // The car's last 0x100 and 0x102
+    struct {
+        uint16_t maximumBatteryVoltage;
+        uint16_t targetVoltage;
+        uint8_t currentRequest;
+        uint8_t vehicleStatus;
+        uint32_t frames;
+        uint64_t lastHeard;       // us
+    } car;
+
+    // State
+    EVSEPhase phase;
+    uint64_t phaseSince;          // us
+    double setpoint;              // A, the ramp towards the car's request
+    double outputCurrent;         // A, what the charger is trying to deliver
+    double deliveredCurrent;      // A, what's flowing into the pack
+    double outputVoltage;         // V
+    bool locked;
+    bool carLost;                 // The car stopped talking while we were running
+    bool overVoltage;             // We stopped with the output over the car's maximum
+    uint64_t nextSend;            // us
+    Pack *pack;
+
+    FrameSink send;
+    void *sendContext;
+} EVSEModel;
+
+void evse_model_init(EVSEModel *evse, Pack *pack);
+void evse_model_receive(EVSEModel *evse, const struct can_frame *frame, uint64_t now);
+void evse_model_step(EVSEModel *evse, uint64_t now, double seconds);
+void evse_model_unplug(EVSEModel *evse, uint64_t now);
+const char *evse_phase_name(EVSEPhase phase);
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MODELS_H
+#define MODELS_H
+
+#include "mcp2515/can.h"
+
+// Where a model puts the frames it sends
+typedef void (*FrameSink)(const struct can_frame *frame, void *context);
+
+// Little endian, as all our messages are
+static inline void frame_put16(struct can_frame *frame, int byte, uint16_t value) {
+    frame->data[byte] = value & 0xFF;
+    frame->data[byte + 1] = value >> 8;
+}
+
+static inline uint16_t frame_get16(const struct can_frame *frame, int byte) {
+    return frame->data[byte] | frame->data[byte + 1] << 8;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pack.h"
+
+// About 42 kWh, half charged at 350 V
+void pack_init(Pack *pack) {
+    pack->capacityAh = 120;
+    pack->emptyVoltage = 300;
+    pack->fullVoltage = 400;
+    pack->resistance = 0.05;
+    pack->soc = 25;
+    pack->temperature = 25;
+    pack->chargedAh = 0;
+    pack->chargedWh = 0;
+}
+
+double pack_open_circuit_voltage(const Pack *pack) {
+    return pack->emptyVoltage + ( pack->fullVoltage - pack->emptyVoltage ) * pack->soc / 100;
+}
+
+double pack_terminal_voltage(const Pack *pack, double current) {
+    return pack_open_circuit_voltage(pack) + current * pack->resistance;
+}
+
+void pack_charge(Pack *pack, double current, double seconds) {
+    double ah = current * seconds / 3600;
+    pack->chargedWh += ah * pack_terminal_voltage(pack, current);
+    pack->chargedAh += ah;
+    pack->soc += 100 * ah / pack->capacityAh;
+    if ( pack->soc > 100 ) {
+        pack->soc = 100;
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+/*
+ * The car's traction battery, as a plant for the charge controller: an open
+ * circuit voltage rising linearly with SoC, behind a fixed internal
+ * resistance.
+ */
+typedef struct {
+    double capacityAh;
+    double emptyVoltage;   // V, open circuit at 0% SoC
+    double fullVoltage;    // V, open circuit at 100% SoC
+    double resistance;     // ohms
+    double soc;            // %
+    double temperature;    // C
+    double chargedAh;      // put in so far
+    double chargedWh;
+} Pack;
+
+void pack_init(Pack *pack);
+double pack_open_circuit_voltage(const Pack *pack);
+double pack_terminal_voltage(const Pack *pack, double current);
+void pack_charge(Pack *pack, double current, double seconds);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HOST_SDK_BOARDS_PICO_H
+#define HOST_SDK_BOARDS_PICO_H
+
+#include "picosdk.h"
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HOST_SDK_HARDWARE_IRQ_H
+#define HOST_SDK_HARDWARE_IRQ_H
+
+#include "picosdk.h"
+
+#endif
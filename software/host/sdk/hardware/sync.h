@@ -0,0 +1,6 @@
+#ifndef HOST_SDK_HARDWARE_SYNC_H
+#define HOST_SDK_HARDWARE_SYNC_H
+
+#include "picosdk.h"
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HOST_SDK_PICO_STDLIB_H
+#define HOST_SDK_PICO_STDLIB_H
+
+#include "picosdk.h"
+
+#endif
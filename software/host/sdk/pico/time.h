@@ -0,0 +1,6 @@
+#ifndef HOST_SDK_PICO_TIME_H
+#define HOST_SDK_PICO_TIME_H
+
+#include "picosdk.h"
+
+#endif
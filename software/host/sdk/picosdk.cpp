@@ -0,0 +1,521 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "picosdk.h"
+
+extern "C" {
+#include "hal.h"
+#include "sim.h"
+}
+
+/*
+ * The simulated SDK. See picosdk.h.
+ */
+
+spi_inst_t sdk_spi0;
+spi_inst_t sdk_spi1;
+
+
+//// ----
+//
+// GPIO and IRQ
+//
+//// ----
+
+static bool levels[SDK_N_GPIOS];
+static bool outputs[SDK_N_GPIOS];
+static bool driven[SDK_N_GPIOS];          // by a simulated device, see sdk_gpio_drive()
+static uint32_t irqEnabled[SDK_N_GPIOS];  // gpio_irq_level bits
+static uint32_t irqEvents[SDK_N_GPIOS];   // latched edges
+static irq_handler_t rawHandlers[SDK_N_GPIOS];
+static irq_handler_t dmaHandler;          // DMA_IRQ_0
+
+static SDKSPIDevice *devices[SDK_N_GPIOS];  // by chip select
+static SDKSPIStats spiStats[SDK_N_GPIOS];
+static void (*transferHook)();
+
+// Chip selects and pins driven from outside keep their level
+void gpio_init(uint gpio) {
+    outputs[gpio] = false;
+    if ( devices[gpio] == NULL && ! driven[gpio] ) {
+        levels[gpio] = false;
+    }
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+    outputs[gpio] = out;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+}
+
+void gpio_pull_up(uint gpio) {
+    if ( ! outputs[gpio] && devices[gpio] == NULL && ! driven[gpio] ) {
+        levels[gpio] = true;
+    }
+}
+
+static void select_device(uint8_t cs) {
+    for ( int i = 0; i < SDK_N_GPIOS; i++ ) {
+        if ( i != cs && devices[i] != NULL && ! levels[i] ) {
+            spiStats[cs].overlaps++;
+        }
+    }
+    spiStats[cs].transactions++;
+    devices[cs]->select();
+}
+
+void gpio_put(uint gpio, bool value) {
+    bool was = levels[gpio];
+    levels[gpio] = value;
+    if ( devices[gpio] != NULL && was != value ) {
+        if ( value ) {
+            devices[gpio]->deselect();
+        } else {
+            select_device(gpio);
+        }
+    }
+}
+
+bool gpio_get(uint gpio) {
+    return levels[gpio];
+}
+
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled) {
+    if ( enabled ) {
+        irqEnabled[gpio] |= events;
+    } else {
+        irqEnabled[gpio] &= ~events;
+    }
+}
+
+uint32_t gpio_get_irq_event_mask(uint gpio) {
+    return irqEvents[gpio] & irqEnabled[gpio];
+}
+
+void gpio_acknowledge_irq(uint gpio, uint32_t events) {
+    irqEvents[gpio] &= ~events;
+}
+
+void gpio_add_raw_irq_handler(uint gpio, irq_handler_t handler) {
+    rawHandlers[gpio] = handler;
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+}
+
+void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order) {
+    if ( num == DMA_IRQ_0 ) {
+        dmaHandler = handler;
+    }
+}
+
+static void run_raw_handler(void *context) {
+    ((irq_handler_t)context)();
+}
+
+void sdk_gpio_drive(uint gpio, bool level) {
+    driven[gpio] = true;
+    bool was = levels[gpio];
+    levels[gpio] = level;
+    if ( was == level ) {
+        return;
+    }
+    uint32_t edge = level ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
+    irqEvents[gpio] |= edge;
+    if ( ( irqEnabled[gpio] & edge ) && rawHandlers[gpio] != NULL ) {
+        sim_raise_irq(run_raw_handler, (void *)rawHandlers[gpio]);
+    }
+}
+
+
+//// ----
+//
+// Sync
+//
+//// ----
+
+static spin_lock_t spinLocks[32];
+static uint nSpinLocks;
+
+uint32_t save_and_disable_interrupts(void) {
+    return hal_disable_interrupts();
+}
+
+void restore_interrupts(uint32_t status) {
+    hal_restore_interrupts(status);
+}
+
+uint spin_lock_claim_unused(bool required) {
+    return nSpinLocks++;
+}
+
+spin_lock_t *spin_lock_init(uint lock) {
+    spinLocks[lock] = 0;
+    return &spinLocks[lock];
+}
+
+// With one core and interrupts masked, a lock that's already held never frees
+uint32_t spin_lock_blocking(spin_lock_t *lock) {
+    uint32_t saved = hal_disable_interrupts();
+    if ( *lock ) {
+        fprintf(stderr, "Deadlock on spin lock %d\n", (int)( lock - spinLocks ));
+        abort();
+    }
+    *lock = 1;
+    return saved;
+}
+
+void spin_unlock(spin_lock_t *lock, uint32_t saved) {
+    *lock = 0;
+    hal_restore_interrupts(saved);
+}
+
+
+//// ----
+//
+// Time
+//
+//// ----
+
+uint32_t time_us_32(void) {
+    return (uint32_t)hal_time_us();
+}
+
+uint64_t time_us_64(void) {
+    return hal_time_us();
+}
+
+// Only busy waits read this, so let a little time pass each time they look
+absolute_time_t get_absolute_time(void) {
+    sim_sleep_us(1);
+    return hal_time_us();
+}
+
+uint32_t to_ms_since_boot(absolute_time_t t) {
+    return (uint32_t)( t / 1000 );
+}
+
+void sleep_ms(uint32_t ms) {
+    sim_sleep_us((uint64_t)ms * 1000);
+}
+
+
+//// ----
+//
+// SPI
+//
+//// ----
+
+uint spi_init(spi_inst_t *spi, uint baudrate) {
+    spi->baudrate = baudrate;
+    return baudrate;
+}
+
+void spi_set_format(spi_inst_t *spi, uint dataBits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order) {
+}
+
+// Clock a byte out to every selected device. The bus reads the AND of their outputs.
+static uint8_t transfer(uint8_t out) {
+    uint8_t in = 0xFF;
+    for ( int i = 0; i < SDK_N_GPIOS; i++ ) {
+        if ( devices[i] != NULL && ! levels[i] ) {
+            in &= devices[i]->transfer(out);
+            spiStats[i].bytes++;
+        }
+    }
+    if ( transferHook != NULL ) {
+        transferHook();
+    }
+    return in;
+}
+
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len) {
+    for ( size_t i = 0; i < len; i++ ) {
+        transfer(src[i]);
+    }
+    return (int)len;
+}
+
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeatedTxData, uint8_t *dst, size_t len) {
+    for ( size_t i = 0; i < len; i++ ) {
+        dst[i] = transfer(repeatedTxData);
+    }
+    return (int)len;
+}
+
+uint spi_get_dreq(spi_inst_t *spi, bool isTx) {
+    return 0;
+}
+
+SDKSPIDevice::SDKSPIDevice(uint8_t csPin) {
+    this->csPin = csPin;
+    devices[csPin] = this;
+    levels[csPin] = true;
+}
+
+SDKSPIDevice::~SDKSPIDevice() {
+    if ( devices[this->csPin] == this ) {
+        devices[this->csPin] = NULL;
+    }
+}
+
+const SDKSPIStats *sdk_spi_stats(uint8_t csPin) {
+    return &spiStats[csPin];
+}
+
+void sdk_spi_reset_stats() {
+    memset(spiStats, 0, sizeof(spiStats));
+}
+
+void sdk_set_transfer_hook(void (*hook)()) {
+    transferHook = hook;
+}
+
+
+//// ----
+//
+// DMA
+//
+//// ----
+
+/*
+ * Channels that move bytes between memory and an SPI data register. A pair
+ * started together, one feeding the data register and one draining it, is a
+ * transfer. It takes as long as its bytes take to clock at the port's baud
+ * rate, and they go over the bus in one go as it finishes, with the chip
+ * selects as the CPU left them. It finishes when a busy poll sees that time
+ * pass, or when sdk_dma_complete() moves the clock on to it, as the hardware
+ * would with nobody looking. Channels with IRQ 0 enabled then raise
+ * DMA_IRQ_0.
+ */
+
+#define SDK_N_DMA_CHANNELS 12
+
+#define CONFIG_READ_INCREMENT  0x1u
+#define CONFIG_WRITE_INCREMENT 0x2u
+
+static struct {
+    bool claimed;
+    uint32_t ctrl;
+    const volatile void *read;
+    volatile void *write;
+    uint32_t count;
+    bool busy;
+    bool irq0Enabled;
+    bool irq0Status;
+} dmaChannels[SDK_N_DMA_CHANNELS];
+
+static uint64_t dmaDoneAt;  // us, when the transfer in flight finishes
+
+static spi_inst_t *spi_of(const volatile void *address) {
+    if ( address == &sdk_spi0.hw.dr ) {
+        return &sdk_spi0;
+    }
+    if ( address == &sdk_spi1.hw.dr ) {
+        return &sdk_spi1;
+    }
+    return NULL;
+}
+
+static bool dma_in_flight() {
+    for ( int i = 0; i < SDK_N_DMA_CHANNELS; i++ ) {
+        if ( dmaChannels[i].busy ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void finish_dma_transfer() {
+
+    int tx = -1;
+    int rx = -1;
+    uint32_t n = 0;
+    for ( int i = 0; i < SDK_N_DMA_CHANNELS; i++ ) {
+        if ( ! dmaChannels[i].busy ) {
+            continue;
+        }
+        if ( spi_of(dmaChannels[i].write) != NULL ) {
+            tx = i;
+        } else if ( spi_of(dmaChannels[i].read) != NULL ) {
+            rx = i;
+        }
+        if ( dmaChannels[i].count > n ) {
+            n = dmaChannels[i].count;
+        }
+    }
+
+    for ( uint32_t i = 0; i < n; i++ ) {
+        uint8_t out = 0;
+        if ( tx >= 0 ) {
+            const volatile uint8_t *read = (const volatile uint8_t *)dmaChannels[tx].read;
+            out = read[( dmaChannels[tx].ctrl & CONFIG_READ_INCREMENT ) ? i : 0];
+        }
+        uint8_t in = transfer(out);
+        if ( rx >= 0 ) {
+            volatile uint8_t *write = (volatile uint8_t *)dmaChannels[rx].write;
+            write[( dmaChannels[rx].ctrl & CONFIG_WRITE_INCREMENT ) ? i : 0] = in;
+        }
+    }
+
+    bool raise = false;
+    for ( int i = 0; i < SDK_N_DMA_CHANNELS; i++ ) {
+        if ( dmaChannels[i].busy ) {
+            dmaChannels[i].busy = false;
+            if ( dmaChannels[i].irq0Enabled ) {
+                dmaChannels[i].irq0Status = true;
+                raise = true;
+            }
+        }
+    }
+    if ( raise && dmaHandler != NULL ) {
+        sim_raise_irq(run_raw_handler, (void *)dmaHandler);
+    }
+}
+
+int dma_claim_unused_channel(bool required) {
+    for ( int i = 0; i < SDK_N_DMA_CHANNELS; i++ ) {
+        if ( ! dmaChannels[i].claimed ) {
+            dmaChannels[i].claimed = true;
+            return i;
+        }
+    }
+    if ( required ) {
+        fprintf(stderr, "Out of DMA channels\n");
+        abort();
+    }
+    return -1;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+    dma_channel_config c = { CONFIG_READ_INCREMENT };
+    return c;
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size) {
+    if ( size != DMA_SIZE_8 ) {
+        fprintf(stderr, "Only byte DMA transfers are simulated\n");
+        abort();
+    }
+}
+
+void channel_config_set_dreq(dma_channel_config *c, uint dreq) {
+}
+
+void channel_config_set_read_increment(dma_channel_config *c, bool incr) {
+    c->ctrl = incr ? ( c->ctrl | CONFIG_READ_INCREMENT ) : ( c->ctrl & ~CONFIG_READ_INCREMENT );
+}
+
+void channel_config_set_write_increment(dma_channel_config *c, bool incr) {
+    c->ctrl = incr ? ( c->ctrl | CONFIG_WRITE_INCREMENT ) : ( c->ctrl & ~CONFIG_WRITE_INCREMENT );
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *writeAddr,
+                           const volatile void *readAddr, uint transferCount, bool trigger) {
+    dmaChannels[channel].ctrl = config->ctrl;
+    dmaChannels[channel].write = writeAddr;
+    dmaChannels[channel].read = readAddr;
+    dmaChannels[channel].count = transferCount;
+    if ( trigger ) {
+        dma_start_channel_mask(1u << channel);
+    }
+}
+
+void dma_channel_set_read_addr(uint channel, const volatile void *readAddr, bool trigger) {
+    dmaChannels[channel].read = readAddr;
+    if ( trigger ) {
+        dma_start_channel_mask(1u << channel);
+    }
+}
+
+void dma_channel_set_write_addr(uint channel, volatile void *writeAddr, bool trigger) {
+    dmaChannels[channel].write = writeAddr;
+    if ( trigger ) {
+        dma_start_channel_mask(1u << channel);
+    }
+}
+
+void dma_channel_set_trans_count(uint channel, uint32_t count, bool trigger) {
+    dmaChannels[channel].count = count;
+    if ( trigger ) {
+        dma_start_channel_mask(1u << channel);
+    }
+}
+
+void dma_start_channel_mask(uint32_t mask) {
+
+    if ( dma_in_flight() ) {
+        fprintf(stderr, "DMA transfer started with another in flight\n");
+        abort();
+    }
+
+    uint64_t us = 1;
+    for ( int i = 0; i < SDK_N_DMA_CHANNELS; i++ ) {
+        if ( ! ( mask & ( 1u << i ) ) ) {
+            continue;
+        }
+        dmaChannels[i].busy = true;
+        spi_inst_t *spi = spi_of(dmaChannels[i].write);
+        if ( spi != NULL && spi->baudrate != 0 ) {
+            uint64_t clocked = ( (uint64_t)dmaChannels[i].count * 8 * 1000000 + spi->baudrate - 1 ) / spi->baudrate;
+            if ( clocked > us ) {
+                us = clocked;
+            }
+        }
+    }
+    dmaDoneAt = hal_time_us() + us;
+}
+
+// Only busy waits poll this, so let a little time pass each time they look
+bool dma_channel_is_busy(uint channel) {
+    if ( ! dmaChannels[channel].busy ) {
+        return false;
+    }
+    sim_sleep_us(1);
+    if ( hal_time_us() >= dmaDoneAt ) {
+        finish_dma_transfer();
+    }
+    return dmaChannels[channel].busy;
+}
+
+void dma_channel_set_irq0_enabled(uint channel, bool enabled) {
+    dmaChannels[channel].irq0Enabled = enabled;
+}
+
+bool dma_channel_get_irq0_status(uint channel) {
+    return dmaChannels[channel].irq0Status;
+}
+
+void dma_channel_acknowledge_irq0(uint channel) {
+    dmaChannels[channel].irq0Status = false;
+}
+
+bool sdk_dma_complete() {
+    if ( ! dma_in_flight() ) {
+        return false;
+    }
+    if ( hal_time_us() < dmaDoneAt ) {
+        sim_sleep_us(dmaDoneAt - hal_time_us());
+    }
+    finish_dma_transfer();
+    return true;
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PICOSDK_H
+#define PICOSDK_H
+
+/*
+ * Just enough of the Pico SDK, on the host, for the MCP2515 driver and the
+ * SPI bus arbiter to build and run unchanged. SPI transfers go to whichever
+ * simulated device (see SDKSPIDevice) has its chip select low, and time and
+ * interrupt masking come from the simulated HAL, so the driver sees the same
+ * clock as the rest of the firmware. DMA transfers to and from the SPI ports
+ * take the time their bytes would, and raise DMA_IRQ_0 when they're done.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef unsigned int uint;
+
+
+// GPIO
+
+enum gpio_function { GPIO_FUNC_SPI = 1, GPIO_FUNC_UART = 2, GPIO_FUNC_SIO = 5 };
+
+#define GPIO_IN  false
+#define GPIO_OUT true
+
+enum gpio_irq_level {
+    GPIO_IRQ_LEVEL_LOW  = 0x1u,
+    GPIO_IRQ_LEVEL_HIGH = 0x2u,
+    GPIO_IRQ_EDGE_FALL  = 0x4u,
+    GPIO_IRQ_EDGE_RISE  = 0x8u
+};
+
+#define SDK_N_GPIOS 32
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+void gpio_pull_up(uint gpio);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled);
+uint32_t gpio_get_irq_event_mask(uint gpio);
+void gpio_acknowledge_irq(uint gpio, uint32_t events);
+
+
+// IRQ
+
+typedef void (*irq_handler_t)(void);
+
+enum irq_number { IO_IRQ_BANK0 = 13, DMA_IRQ_0 = 11 };
+
+#define PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY 0x80
+
+void irq_set_enabled(uint num, bool enabled);
+void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order);
+void gpio_add_raw_irq_handler(uint gpio, irq_handler_t handler);
+
+
+// Sync
+
+typedef volatile uint32_t spin_lock_t;
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+uint spin_lock_claim_unused(bool required);
+spin_lock_t *spin_lock_init(uint lock);
+uint32_t spin_lock_blocking(spin_lock_t *lock);
+void spin_unlock(spin_lock_t *lock, uint32_t saved);
+
+
+// Time
+
+typedef uint64_t absolute_time_t;
+
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+absolute_time_t get_absolute_time(void);
+uint32_t to_ms_since_boot(absolute_time_t t);
+void sleep_ms(uint32_t ms);
+
+
+// SPI
+
+typedef struct {
+    volatile uint32_t dr;
+} spi_hw_t;
+
+typedef struct spi_inst {
+    spi_hw_t hw;
+    uint baudrate;
+} spi_inst_t;
+
+extern spi_inst_t sdk_spi0;
+extern spi_inst_t sdk_spi1;
+#define spi0 (&sdk_spi0)
+#define spi1 (&sdk_spi1)
+
+typedef enum { SPI_CPOL_0 = 0, SPI_CPOL_1 = 1 } spi_cpol_t;
+typedef enum { SPI_CPHA_0 = 0, SPI_CPHA_1 = 1 } spi_cpha_t;
+typedef enum { SPI_LSB_FIRST = 0, SPI_MSB_FIRST = 1 } spi_order_t;
+
+uint spi_init(spi_inst_t *spi, uint baudrate);
+void spi_set_format(spi_inst_t *spi, uint dataBits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order);
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len);
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeatedTxData, uint8_t *dst, size_t len);
+uint spi_get_dreq(spi_inst_t *spi, bool isTx);
+
+static inline spi_hw_t *spi_get_hw(spi_inst_t *spi) {
+    return &spi->hw;
+}
+
+
+// DMA
+
+typedef struct {
+    uint32_t ctrl;
+} dma_channel_config;
+
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 };
+
+int dma_claim_unused_channel(bool required);
+dma_channel_config dma_channel_get_default_config(uint channel);
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size);
+void channel_config_set_dreq(dma_channel_config *c, uint dreq);
+void channel_config_set_read_increment(dma_channel_config *c, bool incr);
+void channel_config_set_write_increment(dma_channel_config *c, bool incr);
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *writeAddr,
+                           const volatile void *readAddr, uint transferCount, bool trigger);
+void dma_channel_set_read_addr(uint channel, const volatile void *readAddr, bool trigger);
+void dma_channel_set_write_addr(uint channel, volatile void *writeAddr, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t count, bool trigger);
+void dma_start_channel_mask(uint32_t mask);
+bool dma_channel_is_busy(uint channel);
+void dma_channel_set_irq0_enabled(uint channel, bool enabled);
+bool dma_channel_get_irq0_status(uint channel);
+void dma_channel_acknowledge_irq0(uint channel);
+
+
+// Board
+
+#define PICO_DEFAULT_SPI_SCK_PIN 18
+#define PICO_DEFAULT_SPI_TX_PIN  19
+#define PICO_DEFAULT_SPI_RX_PIN  16
+#define PICO_DEFAULT_SPI_CSN_PIN 17
+
+
+#ifdef __cplusplus
+
+/*
+ * A simulated device on the SPI bus. It's selected while the GPIO given as its
+ * chip select is low, and sees every byte clocked while it's selected.
+ */
+class SDKSPIDevice {
+    public:
+        SDKSPIDevice(uint8_t csPin);
+        virtual ~SDKSPIDevice();
+        virtual void select() {}
+        virtual uint8_t transfer(uint8_t out) = 0;
+        virtual void deselect() {}
+        uint8_t csPin;
+};
+
+/*
+ * What the bus saw. A transaction is one chip select low period. An overlap is
+ * a device being selected while another one on the bus still is.
+ */
+struct SDKSPIStats {
+    uint32_t transactions;
+    uint32_t bytes;
+    uint32_t overlaps;
+};
+
+const SDKSPIStats *sdk_spi_stats(uint8_t csPin);
+void sdk_spi_reset_stats();
+
+// Called after every byte on the bus, e.g. to raise an interrupt mid transaction
+void sdk_set_transfer_hook(void (*hook)());
+
+// Drive a GPIO input from outside, firing its raw IRQ handler on a falling edge
+void sdk_gpio_drive(uint gpio, bool level);
+
+// Let the DMA transfer in flight finish, moving the clock on to when it would.
+// Returns false if there isn't one.
+bool sdk_dma_complete();
+
+#endif
+
+#endif
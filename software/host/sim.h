@@ -0,0 +1,72 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Control of the simulated hardware behind hal.h. Time is virtual. It only
+ * moves when the simulation moves it, so a charging session of any length
+ * runs as fast as the code under test can go, and every run is repeatable.
+ *
+ * Interrupts are modelled as far as the code under test can see them: an IRQ
+ * raised while they're masked runs as soon as they're restored. The two cores
+ * take turns rather than running at once. hal_core_num() is whichever one the
+ * caller has set, and each ticker runs on the core that started it, so the
+ * tasks of either core can be driven on their own.
+ */
+
+#define SIM_N_PINS 128
+
+typedef void (*SimIRQ)(void *context);
+
+// Back to time zero, pins low, no tickers, callbacks or pending IRQs
+void sim_reset();
+
+uint64_t sim_time_us();
+
+// Move the clock on, running each ticker as it falls due
+void sim_advance_us(uint64_t us);
+
+// Move the clock on without running the tickers, as a busy wait would
+void sim_sleep_us(uint64_t us);
+
+// Drive a pin, calling its edge callback if it changes
+void sim_set_pin(uint8_t pin, bool level);
+bool sim_get_pin(uint8_t pin);
+
+// Run what follows as the given core, until set back
+void sim_set_core(uint8_t num);
+
+// Run the handler now, or once interrupts are unmasked
+void sim_raise_irq(SimIRQ handler, void *context);
+bool sim_interrupts_enabled();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "sim.h"
+#include "chademocomms.h"
+}
+
+#include "comms.h"
+#include "types.h"
+#include "board.h"
+#include "check.h"
+
+/*
+ * The receive path with the MCP2515 INT lines wired, against the simulated
+ * controllers on the mock SPI bus. A poll should only touch the bus when INT
+ * is low, and whatever holds INT low has to be cleared, or every poll after it
+ * goes back to asking the controller over SPI.
+ */
+
+// First bytes of the SPI instructions, as counted by MCP2515Sim
+#define RX_STATUS   0xB0
+#define BIT_MODIFY  0x05
+#define READ_RX0    0x90
+#define READ_RX1    0x94
+
+#define CANINTF     0x2C
+#define CANINTF_ERRIF 0x20
+#define CANINTF_MERRF 0x80
+
+#define POLLS 20
+
+extern MCP2515 mainCAN;
+extern MCP2515 chademoCAN;
+extern CANStats mainCANStats;
+extern CANStats chademoCANStats;
+
+typedef struct {
+    MCP2515 *driver;
+    MCP2515Sim *chip;
+    uint8_t intPin;
+    void (*poll)();
+    void (*interrupt)();
+    CANStats *stats;
+    canid_t id;         // a frame the bus's filters let through
+} Bus;
+
+static const Bus mainBus = {
+    &mainCAN, &mainCANChip, MAIN_CAN_INT,
+    handle_main_CAN_message, handle_main_CAN_interrupt, &mainCANStats, 0x351
+};
+
+static const Bus chademoBus = {
+    &chademoCAN, &chademoCANChip, CHADEMO_CAN_INT,
+    handle_chademo_CAN_messages, handle_chademo_CAN_interrupt, &chademoCANStats, 0x108
+};
+
+// Start the board and jumper INT, as CAN_RX_INTERRUPTS expects
+static void start(const Bus *bus) {
+    sim_reset();
+    board_start();
+    bus->chip->setInterruptPin(bus->intPin);
+    bus->driver->setInterruptPin(bus->intPin);
+    memset(bus->chip->instructions, 0, sizeof(bus->chip->instructions));
+}
+
+static uint32_t spi_instructions(const Bus *bus) {
+    uint32_t n = 0;
+    for ( int i = 0; i < 256; i++ ) {
+        n += bus->chip->instructions[i];
+    }
+    return n;
+}
+
+static void receive(const Bus *bus) {
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = bus->id;
+    frame.can_dlc = 8;
+    CHECK(bus->chip->receive(&frame));
+}
+
+static void poll(const Bus *bus, int n) {
+    for ( int i = 0; i < n; i++ ) {
+        bus->poll();
+    }
+}
+
+
+//// ----
+//
+// Polling
+//
+//// ----
+
+static void check_idle_poll_stays_off_the_bus(const Bus *bus) {
+    start(bus);
+    CHECK(gpio_get(bus->intPin));
+    poll(bus, POLLS);
+    CHECK_EQUAL(spi_instructions(bus), 0);
+}
+
+static void check_poll_reads_frames(const Bus *bus) {
+    start(bus);
+    receive(bus);
+    CHECK(! gpio_get(bus->intPin));
+    poll(bus, 1);
+    CHECK_EQUAL(bus->stats->framesReceived, 1);
+    CHECK_EQUAL(bus->chip->instructions[READ_RX0], 1);
+    CHECK(gpio_get(bus->intPin));
+
+    uint32_t after = spi_instructions(bus);
+    poll(bus, POLLS);
+    CHECK_EQUAL(spi_instructions(bus), after);
+}
+
+// INT held low by an error flag alone. Only the first poll should ask the controller.
+static void check_poll_clears_error_flag(const Bus *bus, uint8_t flag) {
+    start(bus);
+    bus->chip->setRegister(CANINTF, flag);
+    CHECK(! gpio_get(bus->intPin));
+
+    poll(bus, POLLS);
+    CHECK(gpio_get(bus->intPin));
+    CHECK_EQUAL(bus->chip->getRegister(CANINTF) & flag, 0);
+    CHECK_EQUAL(bus->chip->instructions[RX_STATUS], 1);
+    CHECK_EQUAL(bus->stats->framesReceived, 0);
+
+    // And the flag didn't cost us the next frame
+    receive(bus);
+    poll(bus, 1);
+    CHECK_EQUAL(bus->stats->framesReceived, 1);
+}
+
+static void main_idle_poll() { check_idle_poll_stays_off_the_bus(&mainBus); }
+static void chademo_idle_poll() { check_idle_poll_stays_off_the_bus(&chademoBus); }
+static void main_poll_reads_frames() { check_poll_reads_frames(&mainBus); }
+static void chademo_poll_reads_frames() { check_poll_reads_frames(&chademoBus); }
+static void main_poll_clears_errif() { check_poll_clears_error_flag(&mainBus, CANINTF_ERRIF); }
+static void chademo_poll_clears_errif() { check_poll_clears_error_flag(&chademoBus, CANINTF_ERRIF); }
+static void main_poll_clears_merrf() { check_poll_clears_error_flag(&mainBus, CANINTF_MERRF); }
+static void chademo_poll_clears_merrf() { check_poll_clears_error_flag(&chademoBus, CANINTF_MERRF); }
+
+
+//// ----
+//
+// Interrupts
+//
+//// ----
+
+// Two frames land while interrupts are masked, one in each receive buffer. The
+// one edge has to drain both, or INT stays low and no more edges come.
+static void check_interrupt_drains_both_buffers(const Bus *bus) {
+    start(bus);
+    bus->driver->enableInterrupt(bus->interrupt);
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    receive(bus);
+    receive(bus);
+    CHECK_EQUAL(bus->stats->framesReceived, 0);
+    restore_interrupts(interrupts);
+
+    CHECK_EQUAL(bus->stats->framesReceived, 2);
+    CHECK_EQUAL(bus->chip->instructions[READ_RX0], 1);
+    CHECK_EQUAL(bus->chip->instructions[READ_RX1], 1);
+    CHECK(gpio_get(bus->intPin));
+
+    receive(bus);
+    CHECK_EQUAL(bus->stats->framesReceived, 3);
+}
+
+// An error edge is handled and cleared, so the next frame gets an edge of its own
+static void check_interrupt_after_error_flag(const Bus *bus) {
+    start(bus);
+    bus->driver->enableInterrupt(bus->interrupt);
+
+    bus->chip->setRegister(CANINTF, CANINTF_ERRIF);
+    CHECK(gpio_get(bus->intPin));
+
+    receive(bus);
+    CHECK_EQUAL(bus->stats->framesReceived, 1);
+    CHECK(gpio_get(bus->intPin));
+}
+
+static void main_interrupt_drains_both_buffers() { check_interrupt_drains_both_buffers(&mainBus); }
+static void chademo_interrupt_drains_both_buffers() { check_interrupt_drains_both_buffers(&chademoBus); }
+static void main_interrupt_after_errif() { check_interrupt_after_error_flag(&mainBus); }
+static void chademo_interrupt_after_errif() { check_interrupt_after_error_flag(&chademoBus); }
+
+
+int main() {
+    RUN(main_idle_poll);
+    RUN(chademo_idle_poll);
+    RUN(main_poll_reads_frames);
+    RUN(chademo_poll_reads_frames);
+    RUN(main_poll_clears_errif);
+    RUN(chademo_poll_clears_errif);
+    RUN(main_poll_clears_merrf);
+    RUN(chademo_poll_clears_merrf);
+    RUN(main_interrupt_drains_both_buffers);
+    RUN(chademo_interrupt_drains_both_buffers);
+    RUN(main_interrupt_after_errif);
+    RUN(chademo_interrupt_after_errif);
+    return check_result();
+}
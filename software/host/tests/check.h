@@ -0,0 +1,78 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * Just enough of a test framework for the host tests, each of which is a
+ * single file. A test is a function that CHECKs things. A failed CHECK is
+ * reported and counted, and the test carries on. main() runs the tests with
+ * RUN and returns check_result().
+ *
+ * The firmware keeps its state in module globals, so each test runs in a
+ * process of its own, forked from one that hasn't started the board.
+ */
+
+static int checkFailures;
+
+#define CHECK(condition) do { \
+    if ( ! ( condition ) ) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        checkFailures++; \
+    } \
+} while ( 0 )
+
+// CHECK with the values, for comparisons where that helps
+#define CHECK_EQUAL(actual, expected) do { \
+    long long checkActual = (long long)( actual ); \
+    long long checkExpected = (long long)( expected ); \
+    if ( checkActual != checkExpected ) { \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, checkActual, checkExpected); \
+        checkFailures++; \
+    } \
+} while ( 0 )
+
+#define RUN(test) do { \
+    fflush(stdout); \
+    pid_t child = fork(); \
+    if ( child == 0 ) { \
+        checkFailures = 0; \
+        test(); \
+        fflush(stdout); \
+        _exit(checkFailures == 0 ? 0 : 1); \
+    } \
+    int status = 0; \
+    bool passed = child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0; \
+    if ( ! passed ) { \
+        checkFailures++; \
+    } \
+    fprintf(stderr, "%s %s\n", passed ? "pass" : "FAIL", #test); \
+} while ( 0 )
+
+static inline int check_result() {
+    return checkFailures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,490 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "types.h"
+#include "canmessages.h"
+#include "check.h"
+
+/*
+ * The message codecs in canmessages.h. Known frames decode to the values in
+ * the BMS and ChaDeMo documents, and known values encode to the right bytes.
+ * Any value a field can carry survives an encode and decode, and any valid
+ * frame decodes to values that encode back to a frame that decodes the same.
+ */
+
+#define ROUND_TRIPS 100000
+
+// Deterministic, so a failure can be reproduced
+static uint64_t randomState = 0x9E3779B97F4A7C15ull;
+
+static uint32_t random32() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return (uint32_t)( randomState >> 32 );
+}
+
+// A value from lo to hi inclusive, in multiples of step
+static int32_t random_value(int32_t lo, int32_t hi, int32_t step = 1) {
+    return lo + (int32_t)( random32() % ( ( hi - lo ) / step + 1 ) ) * step;
+}
+
+static struct can_frame frame_of(canid_t id, const uint8_t (&data)[8]) {
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = id;
+    frame.can_dlc = 8;
+    memcpy(frame.data, data, 8);
+    return frame;
+}
+
+static struct can_frame random_frame(canid_t id) {
+    struct can_frame frame;
+    frame.can_id = id;
+    frame.can_dlc = 8;
+    uint64_t payload = (uint64_t)random32() << 32 | random32();
+    can_payload_store(payload, frame.data);
+    return frame;
+}
+
+#define CHECK_BYTES(frame, ...) do { \
+    const uint8_t expected[8] = { __VA_ARGS__ }; \
+    for ( int byte = 0; byte < 8; byte++ ) { \
+        CHECK_EQUAL((frame).data[byte], expected[byte]); \
+    } \
+} while ( 0 )
+
+
+//// ----
+//
+// Known frames
+//
+//// ----
+
+static void bms_limits_frame() {
+    // 400.0 V, 125.0 A, 200.0 A, 300.0 V
+    struct can_frame frame = frame_of(0x351, { 0xA0, 0x0F, 0xE2, 0x04, 0xD0, 0x07, 0xB8, 0x0B });
+    BMS bms = {};
+    CHECK(BMSLimitsCodec::valid(&frame));
+    CHECK_EQUAL(BMSLimitsCodec::decode(&frame, &bms), BMS_FIELD_MAXIMUM_VOLTAGE | BMS_FIELD_MAXIMUM_CHARGE_CURRENT |
+                                                      BMS_FIELD_MAXIMUM_DISCHARGE_CURRENT | BMS_FIELD_MINIMUM_VOLTAGE);
+    CHECK_EQUAL(bms.maximumVoltage, 4000);
+    CHECK_EQUAL(bms.maximumChargeCurrent, 1250);
+    CHECK_EQUAL(bms.maximumDischargeCurrent, 2000);
+    CHECK_EQUAL(bms.minimumVoltage, 3000);
+}
+
+static void bms_soc_frame() {
+    struct can_frame frame = frame_of(0x355, { 0x4B, 0x00, 0, 0, 0, 0, 0, 0 });
+    BMS bms = {};
+    CHECK(BMSSocCodec::valid(&frame));
+    BMSSocCodec::decode(&frame, &bms);
+    CHECK_EQUAL(bms.soc, 75);
+}
+
+static void bms_status_frame() {
+    // 355.67 V, -12.5 A, 25.3 C, 355.61 V
+    struct can_frame frame = frame_of(0x356, { 0xEF, 0x8A, 0x83, 0xFF, 0xFD, 0x00, 0xE9, 0x8A });
+    BMS bms = {};
+    CHECK(BMSStatusCodec::valid(&frame));
+    BMSStatusCodec::decode(&frame, &bms);
+    CHECK_EQUAL(bms.voltage, 3557);
+    CHECK_EQUAL(bms.batteryCurrent, -125);
+    CHECK_EQUAL(bms.batteryTemperature, 253);
+    CHECK_EQUAL(bms.measuredVoltage, 3556);
+}
+
+static void bms_alarm_frame() {
+    // High cell alarm 0.2, low temp alarm byte 1, low cell warn 4.4, low temp warn byte 5
+    struct can_frame frame = frame_of(0x35A, { 0x04, 0x01, 0, 0, 0x10, 0x01, 0, 0 });
+    BMS bms = {};
+    CHECK(BMSAlarmCodec::valid(&frame));
+    CHECK_EQUAL(BMSAlarmCodec::decode(&frame, &bms), BMS_FIELD_HIGH_CELL_ALARM | BMS_FIELD_LOW_TEMP_ALARM |
+                                                     BMS_FIELD_LOW_CELL_WARN | BMS_FIELD_LOW_TEMP_WARN);
+    CHECK(bms.highCellAlarm);
+    CHECK(! bms.lowCellAlarm);
+    CHECK(! bms.highTempAlarm);
+    CHECK(bms.lowTempAlarm);
+    CHECK(! bms.cellDeltaAlarm);
+    CHECK(! bms.highCellWarn);
+    CHECK(bms.lowCellWarn);
+    CHECK(! bms.highTempWarn);
+    CHECK(bms.lowTempWarn);
+}
+
+// Bytes 1 and 2 make one little endian value, not data[1] + data[2] << 8
+static void station_capabilities_frame() {
+    struct can_frame frame = frame_of(0x108, { 0x01, 0xF4, 0x01, 0x7D, 0xDC, 0x01, 0, 0 });
+    Station station = {};
+    CHECK(EVSECapabilitiesCodec::valid(&frame));
+    EVSECapabilitiesCodec::decode(&frame, &station);
+    CHECK(station.weldDetectionSupported);
+    CHECK_EQUAL(station.maximumVoltageAvailable, 500);
+    CHECK_EQUAL(station.availableCurrent, 125);
+    CHECK_EQUAL(station.thresholdVoltage, 476);
+}
+
+static void station_status_frame() {
+    // Protocol 2, 380 V, 100 A, charging with the connector locked, 1200 s, 20 min
+    struct can_frame frame = frame_of(0x109, { 0x02, 0x7C, 0x01, 0x64, 0, 0x05, 0x78, 0x14 });
+    Station station = {};
+    CHECK(EVSEStatusCodec::valid(&frame));
+    EVSEStatusCodec::decode(&frame, &station);
+    CHECK_EQUAL(station.controlProtocolNumber, 2);
+    CHECK_EQUAL(station.outputVoltage, 380);
+    CHECK_EQUAL(station.outputCurrent, 100);
+    CHECK(station.stationStatus);
+    CHECK(! station.stationMalfunction);
+    CHECK(station.vehicleConnectorLock);
+    CHECK(! station.batteryIncompatability);
+    CHECK(! station.chargingSystemMalfunction);
+    CHECK(! station.chargerStopControl);
+    CHECK_EQUAL(station.timeRemainingSeconds, 1200);
+    CHECK_EQUAL(station.timeRemainingMinutes, 20);
+}
+
+static void car_limits_frame() {
+    ChademoLimitsMessage message = { 410, 90 };
+    struct can_frame frame;
+    ChademoLimitsCodec::encode(&message, &frame);
+    CHECK_EQUAL(frame.can_id, 0x100);
+    CHECK_EQUAL(frame.can_dlc, 8);
+    CHECK_BYTES(frame, 0, 0, 0, 0, 0x9A, 0x01, 0x5A, 0);
+}
+
+static void car_charge_time_frame() {
+    // 2550 s means not declared. 42 kWh is 381.8 steps of 0.11 kWh.
+    ChademoChargeTimeMessage message = { 2550, 72, 60, 42000 };
+    struct can_frame frame;
+    ChademoChargeTimeCodec::encode(&message, &frame);
+    CHECK_EQUAL(frame.can_id, 0x101);
+    CHECK_BYTES(frame, 0, 0xFF, 0x48, 0x3C, 0, 0x7E, 0x01, 0);
+}
+
+static void car_status_frame() {
+    ChademoStatusMessage message = { 2, 410, 125, 0x00, 0x09, 60 };
+    struct can_frame frame;
+    ChademoStatusCodec::encode(&message, &frame);
+    CHECK_EQUAL(frame.can_id, 0x102);
+    CHECK_BYTES(frame, 0x02, 0x9A, 0x01, 0x7D, 0x00, 0x09, 0x3C, 0);
+}
+
+
+//// ----
+//
+// Round trips
+//
+//// ----
+
+static BMS random_bms() {
+    BMS bms = {};
+    bms.maximumVoltage = random_value(0, 10000);
+    bms.maximumChargeCurrent = random_value(0, 65535);
+    bms.maximumDischargeCurrent = random_value(0, 65535);
+    bms.minimumVoltage = random_value(0, 10000);
+    bms.soc = random_value(0, 100);
+    bms.voltage = random_value(0, 6553);           // 0.01 V/bit on the wire
+    bms.batteryCurrent = random_value(-32768, 32767);
+    bms.batteryTemperature = random_value(-400, 1500);
+    bms.measuredVoltage = random_value(0, 6553);
+    bms.highCellAlarm = random32() & 1;
+    bms.lowCellAlarm = random32() & 1;
+    bms.highTempAlarm = random32() & 1;
+    bms.lowTempAlarm = random32() & 1;
+    bms.cellDeltaAlarm = random32() & 1;
+    bms.highCellWarn = random32() & 1;
+    bms.lowCellWarn = random32() & 1;
+    bms.highTempWarn = random32() & 1;
+    bms.lowTempWarn = random32() & 1;
+    return bms;
+}
+
+static Station random_station() {
+    Station station = {};
+    station.weldDetectionSupported = random32() & 1;
+    station.maximumVoltageAvailable = random_value(0, 1000);
+    station.availableCurrent = random_value(0, 255);
+    station.thresholdVoltage = random_value(0, 1000);
+    station.controlProtocolNumber = random_value(0, 255);
+    station.outputVoltage = random_value(0, 1000);
+    station.outputCurrent = random_value(0, 255);
+    station.stationStatus = random32() & 1;
+    station.stationMalfunction = random32() & 1;
+    station.vehicleConnectorLock = random32() & 1;
+    station.batteryIncompatability = random32() & 1;
+    station.chargingSystemMalfunction = random32() & 1;
+    station.chargerStopControl = random32() & 1;
+    station.timeRemainingSeconds = random_value(0, 2550, 10);
+    station.timeRemainingMinutes = random_value(0, 255);
+    return station;
+}
+
+// Encode the fields a codec covers, decode them into a blank struct and compare
+template <typename CODEC, typename S>
+static void check_round_trip(const S *in, S *out) {
+    struct can_frame frame;
+    CODEC::encode(in, &frame);
+    CHECK_EQUAL(frame.can_id, CODEC::id);
+    CHECK(CODEC::valid(&frame));
+    memset(out, 0, sizeof(*out));
+    CODEC::decode(&frame, out);
+}
+
+#define CHECK_FIELD(field) CHECK_EQUAL(out.field, in.field)
+
+static void bms_round_trip() {
+    for ( int i = 0; i < ROUND_TRIPS; i++ ) {
+        BMS in = random_bms();
+        BMS out;
+
+        check_round_trip<BMSLimitsCodec>(&in, &out);
+        CHECK_FIELD(maximumVoltage);
+        CHECK_FIELD(maximumChargeCurrent);
+        CHECK_FIELD(maximumDischargeCurrent);
+        CHECK_FIELD(minimumVoltage);
+
+        check_round_trip<BMSSocCodec>(&in, &out);
+        CHECK_FIELD(soc);
+
+        check_round_trip<BMSStatusCodec>(&in, &out);
+        CHECK_FIELD(voltage);
+        CHECK_FIELD(batteryCurrent);
+        CHECK_FIELD(batteryTemperature);
+        CHECK_FIELD(measuredVoltage);
+
+        check_round_trip<BMSAlarmCodec>(&in, &out);
+        CHECK_FIELD(highCellAlarm);
+        CHECK_FIELD(lowCellAlarm);
+        CHECK_FIELD(highTempAlarm);
+        CHECK_FIELD(lowTempAlarm);
+        CHECK_FIELD(cellDeltaAlarm);
+        CHECK_FIELD(highCellWarn);
+        CHECK_FIELD(lowCellWarn);
+        CHECK_FIELD(highTempWarn);
+        CHECK_FIELD(lowTempWarn);
+
+        if ( checkFailures ) {
+            return;
+        }
+    }
+}
+
+static void station_round_trip() {
+    for ( int i = 0; i < ROUND_TRIPS; i++ ) {
+        Station in = random_station();
+        Station out;
+
+        check_round_trip<EVSECapabilitiesCodec>(&in, &out);
+        CHECK_FIELD(weldDetectionSupported);
+        CHECK_FIELD(maximumVoltageAvailable);
+        CHECK_FIELD(availableCurrent);
+        CHECK_FIELD(thresholdVoltage);
+
+        check_round_trip<EVSEStatusCodec>(&in, &out);
+        CHECK_FIELD(controlProtocolNumber);
+        CHECK_FIELD(outputVoltage);
+        CHECK_FIELD(outputCurrent);
+        CHECK_FIELD(stationStatus);
+        CHECK_FIELD(stationMalfunction);
+        CHECK_FIELD(vehicleConnectorLock);
+        CHECK_FIELD(batteryIncompatability);
+        CHECK_FIELD(chargingSystemMalfunction);
+        CHECK_FIELD(chargerStopControl);
+        CHECK_FIELD(timeRemainingSeconds);
+        CHECK_FIELD(timeRemainingMinutes);
+
+        if ( checkFailures ) {
+            return;
+        }
+    }
+}
+
+static void car_round_trip() {
+    for ( int i = 0; i < ROUND_TRIPS; i++ ) {
+        ChademoLimitsMessage limitsIn = { (uint16_t)random_value(0, 65535), (uint8_t)random_value(0, 255) };
+        ChademoLimitsMessage limitsOut;
+        check_round_trip<ChademoLimitsCodec>(&limitsIn, &limitsOut);
+        CHECK_EQUAL(limitsOut.maximumBatteryVoltage, limitsIn.maximumBatteryVoltage);
+        CHECK_EQUAL(limitsOut.chargingRateIndication, limitsIn.chargingRateIndication);
+
+        ChademoChargeTimeMessage timeIn = {
+            (uint16_t)random_value(0, 2550, 10), (uint8_t)random_value(0, 255),
+            (uint8_t)random_value(0, 255), (uint16_t)random_value(0, 65450, 110)
+        };
+        ChademoChargeTimeMessage timeOut;
+        check_round_trip<ChademoChargeTimeCodec>(&timeIn, &timeOut);
+        CHECK_EQUAL(timeOut.chargingTimeSecondsMax, timeIn.chargingTimeSecondsMax);
+        CHECK_EQUAL(timeOut.chargingTimeMinutesMax, timeIn.chargingTimeMinutesMax);
+        CHECK_EQUAL(timeOut.chargingTimeMinutes, timeIn.chargingTimeMinutes);
+        CHECK_EQUAL(timeOut.batteryCapacityWH, timeIn.batteryCapacityWH);
+
+        ChademoStatusMessage statusIn = {
+            (uint8_t)random_value(0, 255), (uint16_t)random_value(0, 65535), (uint8_t)random_value(0, 255),
+            (uint8_t)random_value(0, 255), (uint8_t)random_value(0, 255), (uint8_t)random_value(0, 255)
+        };
+        ChademoStatusMessage statusOut;
+        check_round_trip<ChademoStatusCodec>(&statusIn, &statusOut);
+        CHECK_EQUAL(statusOut.controlProtocolNumber, statusIn.controlProtocolNumber);
+        CHECK_EQUAL(statusOut.targetVoltage, statusIn.targetVoltage);
+        CHECK_EQUAL(statusOut.chargingCurrentRequest, statusIn.chargingCurrentRequest);
+        CHECK_EQUAL(statusOut.batteryStatus, statusIn.batteryStatus);
+        CHECK_EQUAL(statusOut.vehicleStatus, statusIn.vehicleStatus);
+        CHECK_EQUAL(statusOut.chargedRate, statusIn.chargedRate);
+
+        if ( checkFailures ) {
+            return;
+        }
+    }
+}
+
+/*
+ * Any frame that's valid decodes to values that encode to a frame that
+ * decodes the same. The frame itself needn't come back the same: bits outside
+ * every field are dropped, 0.01 V rounds to 0.1 V, and a multi bit alarm
+ * comes back as 1.
+ */
+template <typename CODEC, typename S>
+static uint32_t check_frames_settle(canid_t id) {
+    uint32_t valid = 0;
+    for ( int i = 0; i < ROUND_TRIPS; i++ ) {
+        struct can_frame frame = random_frame(id);
+        if ( ! CODEC::valid(&frame) ) {
+            continue;
+        }
+        valid++;
+
+        S first = {};
+        CODEC::decode(&frame, &first);
+        struct can_frame again;
+        CODEC::encode(&first, &again);
+        CHECK(CODEC::valid(&again));
+        S second = first;
+        CHECK_EQUAL(CODEC::decode(&again, &second), 0);
+
+        if ( checkFailures ) {
+            break;
+        }
+    }
+    return valid;
+}
+
+static void bms_frames_settle() {
+    CHECK(( check_frames_settle<BMSLimitsCodec, BMS>(0x351) ) > 0);
+    CHECK(( check_frames_settle<BMSSocCodec, BMS>(0x355) ) > 0);
+    CHECK(( check_frames_settle<BMSStatusCodec, BMS>(0x356) ) > 0);
+    CHECK(( check_frames_settle<BMSAlarmCodec, BMS>(0x35A) ) > 0);
+}
+
+static void station_frames_settle() {
+    CHECK(( check_frames_settle<EVSECapabilitiesCodec, Station>(0x108) ) > 0);
+    CHECK(( check_frames_settle<EVSEStatusCodec, Station>(0x109) ) > 0);
+}
+
+
+//// ----
+//
+// Limits
+//
+//// ----
+
+static void short_frames_are_invalid() {
+    struct can_frame frame = frame_of(0x356, { 0xEF, 0x8A, 0x83, 0xFF, 0xFD, 0x00, 0xE9, 0x8A });
+    for ( frame.can_dlc = 0; frame.can_dlc < 8; frame.can_dlc++ ) {
+        CHECK(! BMSStatusCodec::valid(&frame));
+    }
+    frame.can_dlc = 9;
+    CHECK(! BMSStatusCodec::valid(&frame));
+
+    // SoC only needs its first two bytes
+    frame = frame_of(0x355, { 50, 0, 0, 0, 0, 0, 0, 0 });
+    frame.can_dlc = 2;
+    CHECK(BMSSocCodec::valid(&frame));
+    frame.can_dlc = 1;
+    CHECK(! BMSSocCodec::valid(&frame));
+}
+
+static void out_of_range_frames_are_invalid() {
+    struct can_frame frame = frame_of(0x355, { 101, 0, 0, 0, 0, 0, 0, 0 });
+    CHECK(! BMSSocCodec::valid(&frame));
+
+    // 1001 V from the station
+    frame = frame_of(0x109, { 0x02, 0xE9, 0x03, 0, 0, 0, 0, 0 });
+    CHECK(! EVSEStatusCodec::valid(&frame));
+    frame.data[1] = 0xE8;
+    CHECK(EVSEStatusCodec::valid(&frame));
+
+    // -40.1 C and 150.1 C
+    frame = frame_of(0x356, { 0, 0, 0, 0, 0x6F, 0xFE, 0, 0 });
+    CHECK(! BMSStatusCodec::valid(&frame));
+    frame.data[4] = 0xDD;
+    frame.data[5] = 0x05;
+    CHECK(! BMSStatusCodec::valid(&frame));
+}
+
+static void encode_saturates() {
+    ChademoChargeTimeMessage message = { 65535, 255, 255, 65535 };
+    struct can_frame frame;
+    ChademoChargeTimeCodec::encode(&message, &frame);
+    CHECK_EQUAL(frame.data[1], 0xFF);
+    CHECK_EQUAL(frame.data[5] | frame.data[6] << 8, 596);
+
+    BMS bms = {};
+    bms.batteryCurrent = -40000;
+    bms.voltage = 7000;
+    BMSStatusCodec::encode(&bms, &frame);
+    CHECK_EQUAL((int16_t)( frame.data[2] | frame.data[3] << 8 ), -32768);
+    CHECK_EQUAL(frame.data[0] | frame.data[1] << 8, 65535);
+}
+
+static void decode_reports_changes() {
+    struct can_frame frame = frame_of(0x351, { 0xA0, 0x0F, 0xE2, 0x04, 0xD0, 0x07, 0xB8, 0x0B });
+    BMS bms = {};
+    BMSLimitsCodec::decode(&frame, &bms);
+    CHECK_EQUAL(BMSLimitsCodec::decode(&frame, &bms), 0);
+    frame.data[2] = 0xE3;
+    CHECK_EQUAL(BMSLimitsCodec::decode(&frame, &bms), BMS_FIELD_MAXIMUM_CHARGE_CURRENT);
+    CHECK_EQUAL(bms.maximumChargeCurrent, 1251);
+}
+
+
+int main() {
+    RUN(bms_limits_frame);
+    RUN(bms_soc_frame);
+    RUN(bms_status_frame);
+    RUN(bms_alarm_frame);
+    RUN(station_capabilities_frame);
+    RUN(station_status_frame);
+    RUN(car_limits_frame);
+    RUN(car_charge_time_frame);
+    RUN(car_status_frame);
+    RUN(bms_round_trip);
+    RUN(station_round_trip);
+    RUN(car_round_trip);
+    RUN(bms_frames_settle);
+    RUN(station_frames_settle);
+    RUN(short_frames_are_invalid);
+    RUN(out_of_range_frames_are_invalid);
+    RUN(encode_saturates);
+    RUN(decode_reports_changes);
+    return check_result();
+}
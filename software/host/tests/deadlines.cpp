@@ -0,0 +1,220 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+extern "C" {
+#include "settings.h"
+#include "util.h"
+#include "sim.h"
+}
+
+#include "world.h"
+#include "check.h"
+
+/*
+ * Timestamps and deadlines against the simulated clock, including across the
+ * points where a 32 bit count of us or ms would wrap, and the state and
+ * liveness deadlines built on them.
+ */
+
+#define MS 1000ull
+
+// Where 32 bit counts of us and ms since boot wrap
+#define US_WRAP ( (uint64_t)UINT32_MAX + 1 )
+#define MS_WRAP ( ( (uint64_t)UINT32_MAX + 1 ) * MS )
+
+// The longest after a deadline that the scheduler can take to notice it
+#define NOTICED_WITHIN(interval) ( (interval) * MS + SCHEDULER_TICK * MS + 2 * MS )
+
+// Step the world until the car's in the given state. Returns the time, or 0.
+static uint64_t run_until(World *world, State state, uint32_t limitMs) {
+    for ( uint32_t i = 0; i < limitMs; i++ ) {
+        world_step(world);
+        if ( get_state() == state ) {
+            return sim_time_us();
+        }
+    }
+    return 0;
+}
+
+static uint64_t run_until_state_changes(World *world, uint32_t limitMs) {
+    State state = get_state();
+    for ( uint32_t i = 0; i < limitMs; i++ ) {
+        world_step(world);
+        if ( get_state() != state ) {
+            return sim_time_us();
+        }
+    }
+    return 0;
+}
+
+
+//// ----
+//
+// Timestamps
+//
+//// ----
+
+static void deadline_passes_at_the_deadline() {
+    sim_reset();
+    Timestamp deadline = deadline_in_ms(5);
+    sim_sleep_us(5 * MS - 1);
+    CHECK(! deadline_passed(deadline));
+    sim_sleep_us(1);
+    CHECK(deadline_passed(deadline));
+}
+
+static void deadline_across_us_wrap() {
+    sim_reset();
+    sim_sleep_us(US_WRAP - 500);
+    Timestamp deadline = deadline_in_ms(1);
+    CHECK(deadline > US_WRAP);
+    sim_sleep_us(999);
+    CHECK(! deadline_passed(deadline));
+    sim_sleep_us(1);
+    CHECK(deadline_passed(deadline));
+}
+
+static void ms_since_across_us_wrap() {
+    sim_reset();
+    sim_sleep_us(US_WRAP - 1500);
+    Timestamp then = get_time();
+    sim_sleep_us(3 * MS);
+    CHECK_EQUAL(ms_since(then), 3);
+    CHECK_EQUAL(us_since(then), 3 * MS);
+}
+
+static void ms_since_saturates() {
+    sim_reset();
+    Timestamp then = get_time();
+    sim_sleep_us(MS_WRAP + 5000 * MS);
+    CHECK_EQUAL(ms_since(then), UINT32_MAX);
+}
+
+static void since_the_future_is_zero() {
+    sim_reset();
+    sim_sleep_us(10 * MS);
+    Timestamp later = get_time() + 5 * MS;
+    CHECK_EQUAL(us_since(later), 0);
+    CHECK_EQUAL(ms_since(later), 0);
+}
+
+static void timestamp_store_and_load() {
+    sim_reset();
+    init_timestamps();
+    volatile Timestamp shared = 0;
+    Timestamp value = 0x123456789ABCull;
+    timestamp_store(&shared, value);
+    CHECK(timestamp_load(&shared) == value);
+}
+
+
+//// ----
+//
+// State deadlines
+//
+//// ----
+
+/*
+ * A station that never reports the connector locked. The car should give up
+ * CONNECTOR_LOCK_TIMEOUT after it started waiting, give or take the deadline
+ * check's interval.
+ */
+static void check_connector_lock_timeout(uint64_t startAt) {
+
+    World world;
+    world_init(&world);
+    world.startAt = startAt;
+    world.evse.lockDelay = CONNECTOR_LOCK_TIMEOUT + 5000;
+    world_start(&world);
+
+    uint64_t waiting = run_until(&world, S_AWAIT_CONNECTOR_LOCK, 5000);
+    CHECK(waiting != 0);
+    uint64_t left = run_until_state_changes(&world, CONNECTOR_LOCK_TIMEOUT + 1000);
+    CHECK_EQUAL(get_state(), S_ERROR);
+    CHECK(left - waiting >= CONNECTOR_LOCK_TIMEOUT * MS);
+    CHECK(left - waiting <= CONNECTOR_LOCK_TIMEOUT * MS + NOTICED_WITHIN(STATE_DEADLINE_CHECK_INTERVAL));
+}
+
+static void state_times_out() {
+    check_connector_lock_timeout(0);
+}
+
+// The deadline falls after a 32 bit count of ms since boot would have wrapped
+static void state_times_out_across_ms_wrap() {
+    check_connector_lock_timeout(MS_WRAP - 5000 * MS);
+}
+
+// Locked just in time. The timeout mustn't follow us into the next state.
+static void state_deadline_met() {
+
+    World world;
+    world_init(&world);
+    world.startAt = MS_WRAP - 5000 * MS;
+    world.evse.lockDelay = CONNECTOR_LOCK_TIMEOUT - 500;
+    world_start(&world);
+
+    CHECK(run_until(&world, S_ENERGY_TRANSFER, 30000) != 0);
+    for ( uint32_t i = 0; i < CONNECTOR_LOCK_TIMEOUT; i++ ) {
+        world_step(&world);
+    }
+    CHECK_EQUAL(get_state(), S_ENERGY_TRANSFER);
+    CHECK(! ( world.statesVisited & 1 << S_ERROR ));
+}
+
+
+//// ----
+//
+// Liveness
+//
+//// ----
+
+// The BMS goes quiet mid charge
+static void bms_liveness_deadline() {
+
+    World world;
+    world_init(&world);
+    world_start(&world);
+
+    CHECK(run_until(&world, S_ENERGY_TRANSFER, 30000) != 0);
+    // Let the BMS model send whatever it's due to, then silence it
+    world_step(&world);
+    uint64_t silent = sim_time_us();
+    world.bms.send = NULL;
+
+    uint64_t failed = run_until(&world, S_ERROR, BMS_TTL + 5000);
+    CHECK(failed != 0);
+    CHECK(failed - silent >= BMS_TTL * MS - 100 * MS);
+    CHECK(failed - silent <= BMS_TTL * MS + NOTICED_WITHIN(1000));
+}
+
+int main() {
+    RUN(deadline_passes_at_the_deadline);
+    RUN(deadline_across_us_wrap);
+    RUN(ms_since_across_us_wrap);
+    RUN(ms_since_saturates);
+    RUN(since_the_future_is_zero);
+    RUN(timestamp_store_and_load);
+    RUN(state_times_out);
+    RUN(state_times_out_across_ms_wrap);
+    RUN(state_deadline_met);
+    RUN(bms_liveness_deadline);
+    return check_result();
+}
@@ -0,0 +1,205 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "sim.h"
+}
+
+#include "canbus.h"
+#include "types.h"
+#include "board.h"
+#include "check.h"
+
+/*
+ * The DMA path, against the SDK mock's DMA model: reads and sends queued on
+ * the SPI bus, handed back from the DMA IRQ as each transfer completes, a
+ * blocking transaction finishing off the transfer in flight ahead of the IRQ,
+ * and a frame arriving mid read, which leaves INT low with no edge for it.
+ * The board is built with CAN_DMA 0, so the tests switch the main bus over
+ * themselves and do what its RX poll does in a CAN_DMA build.
+ */
+
+// First bytes of the SPI instructions, as counted by MCP2515Sim
+#define RX_STATUS   0xB0
+#define READ_RX0    0x90
+#define READ_RX1    0x94
+
+#define MAX_FRAMES 8
+
+extern MCP2515 mainCAN;
+extern CANStats mainCANStats;
+
+static struct can_frame received[MAX_FRAMES];
+static int nReceived;
+
+static void collect(struct can_frame *frame) {
+    if ( nReceived < MAX_FRAMES ) {
+        received[nReceived] = *frame;
+    }
+    nReceived++;
+}
+
+static void start() {
+    sim_reset();
+    board_start();
+    mainCANChip.setInterruptPin(MAIN_CAN_INT);
+    mainCAN.setInterruptPin(MAIN_CAN_INT);
+    CHECK_EQUAL(mainCAN.enableDMA(collect), MCP2515::ERROR_OK);
+    memset(mainCANChip.instructions, 0, sizeof(mainCANChip.instructions));
+    sdk_spi_reset_stats();
+    nReceived = 0;
+}
+
+static struct can_frame frame(uint8_t n) {
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = 0x351;
+    frame.can_dlc = 8;
+    for ( int i = 0; i < 8; i++ ) {
+        frame.data[i] = n + i;
+    }
+    return frame;
+}
+
+static void receive(uint8_t n) {
+    struct can_frame in = frame(n);
+    CHECK(mainCANChip.receive(&in));
+}
+
+static void check_received(int i, uint8_t n) {
+    struct can_frame want = frame(n);
+    CHECK_EQUAL(received[i].can_id, want.can_id);
+    CHECK_EQUAL(received[i].can_dlc, want.can_dlc);
+    CHECK(memcmp(received[i].data, want.data, 8) == 0);
+}
+
+// The RX poll in a CAN_DMA build. Its overflow check is a blocking register
+// read, so it finishes off whatever it queued before it returns.
+static void poll() {
+    if ( mainCAN.interruptPending() ) {
+        queue_CAN_messages(&mainCAN, &mainCANStats);
+    }
+}
+
+
+//// ----
+//
+// Tests
+//
+//// ----
+
+// One read per full buffer, handed back in order as each completes
+static void reads_complete_in_order() {
+    start();
+    receive(1);
+    receive(2);
+
+    CHECK_EQUAL(mainCAN.queueReadMessages(), MCP2515::ERROR_OK);
+    CHECK_EQUAL(mainCANChip.instructions[RX_STATUS], 1);
+    CHECK_EQUAL(mainCAN.busStats.queued, 2);
+    CHECK_EQUAL(nReceived, 0);
+
+    CHECK(sdk_dma_complete());
+    CHECK_EQUAL(nReceived, 1);
+    check_received(0, 1);
+
+    CHECK(sdk_dma_complete());
+    CHECK_EQUAL(nReceived, 2);
+    check_received(1, 2);
+
+    CHECK(! sdk_dma_complete());
+    CHECK(mainCAN.dmaIdle());
+    CHECK_EQUAL(mainCAN.busStats.queued, 0);
+    CHECK_EQUAL(mainCANChip.instructions[READ_RX0], 1);
+    CHECK_EQUAL(mainCANChip.instructions[READ_RX1], 1);
+    CHECK_EQUAL(mainCANChip.instructions[RX_STATUS], 1);
+    CHECK(gpio_get(MAIN_CAN_INT));
+}
+
+// The frame's loaded by DMA and the RTS follows once the transfer's done.
+// READ STATUS, to pick a free buffer, goes first.
+static void send_requests_once_loaded() {
+    start();
+    struct can_frame out = frame(3);
+
+    CHECK_EQUAL(mainCAN.sendMessage(&out), MCP2515::ERROR_OK);
+    CHECK_EQUAL(mainCANChip.framesSent, 0);
+
+    CHECK(sdk_dma_complete());
+    CHECK_EQUAL(mainCANChip.framesSent, 1);
+    CHECK(mainCAN.dmaIdle());
+    CHECK_EQUAL(sdk_spi_stats(MAIN_CAN_CS)->transactions, 3);
+}
+
+// A blocking transaction polls the transfer in flight to completion. The
+// IRQ that follows finds the bus idle, and still hands the frame back once.
+static void blocking_transaction_finishes_transfer() {
+    start();
+    receive(1);
+    CHECK_EQUAL(mainCAN.queueReadMessages(), MCP2515::ERROR_OK);
+    CHECK_EQUAL(nReceived, 0);
+
+    mainCAN.getErrorFlags();
+    CHECK_EQUAL(nReceived, 1);
+    check_received(0, 1);
+
+    CHECK(! sdk_dma_complete());
+    CHECK_EQUAL(nReceived, 1);
+    CHECK(mainCAN.dmaIdle());
+    CHECK_EQUAL(sdk_spi_stats(MAIN_CAN_CS)->overlaps, 0);
+}
+
+// A second frame lands while the first is being read, so INT never goes
+// high. The DMA IRQ leaves it to the poll rather than asking over SPI.
+static void frame_during_read_left_to_the_poll() {
+    start();
+    receive(1);
+    CHECK_EQUAL(mainCAN.queueReadMessages(), MCP2515::ERROR_OK);
+    receive(2);
+    CHECK(! gpio_get(MAIN_CAN_INT));
+
+    uint32_t transactions = sdk_spi_stats(MAIN_CAN_CS)->transactions;
+    CHECK(sdk_dma_complete());
+    CHECK_EQUAL(nReceived, 1);
+    CHECK_EQUAL(sdk_spi_stats(MAIN_CAN_CS)->transactions, transactions);
+    CHECK(! gpio_get(MAIN_CAN_INT));
+    CHECK(mainCAN.dmaIdle());
+
+    poll();
+    CHECK_EQUAL(mainCANChip.instructions[RX_STATUS], 2);
+    CHECK_EQUAL(nReceived, 2);
+    check_received(1, 2);
+    CHECK(gpio_get(MAIN_CAN_INT));
+}
+
+
+int main() {
+    RUN(reads_complete_in_order);
+    RUN(send_requests_once_loaded);
+    RUN(blocking_transaction_finishes_transfer);
+    RUN(frame_during_read_left_to_the_poll);
+    return check_result();
+}
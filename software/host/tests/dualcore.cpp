@@ -0,0 +1,163 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "sim.h"
+#include "hal.h"
+#include "chademo.h"
+#include "chademocomms.h"
+#include "scheduler.h"
+#include "statemachine.h"
+}
+
+#include "picosdk.h"
+#include "types.h"
+#include "board.h"
+#include "world.h"
+#include "check.h"
+
+/*
+ * CAN_DUAL_CORE on the host. The CAN tasks run from core 1's ticker, apart
+ * from the main loop on core 0, so these check what crosses between the two:
+ * the CAN I/O stays on core 1, the outbound frames are what core 0 last
+ * published, and core 0 can start the outbound cycle on core 1.
+ */
+
+#define MS 1000
+
+#define STATUS_ID 0x102
+
+extern Chademo chademo;
+
+static uint32_t bytesOffCore1;
+
+static void check_on_CAN_core() {
+    if ( hal_core_num() != 1 ) {
+        bytesOffCore1++;
+    }
+}
+
+// The 0x102 frames the ChaDeMo controller puts on the wire
+typedef struct {
+    uint32_t sent;
+    uint32_t sentOffCore1;
+    struct can_frame last;
+} StatusFrames;
+
+static void record_status(const struct can_frame *frame, void *context) {
+    StatusFrames *frames = (StatusFrames *)context;
+    if ( frame->can_id != STATUS_ID ) {
+        return;
+    }
+    frames->sent++;
+    if ( hal_core_num() != 1 ) {
+        frames->sentOffCore1++;
+    }
+    frames->last = *frame;
+}
+
+// The board on its own, nothing on either bus, with the outbound cycle started from core 0
+static void start_outbound(StatusFrames *frames) {
+    sim_reset();
+    board_start();
+    memset(frames, 0, sizeof(*frames));
+    chademoCANChip.onTransmit = record_status;
+    chademoCANChip.onTransmitContext = frames;
+    enable_send_outbound_CAN_messages();
+}
+
+
+//// ----
+//
+// Tests
+//
+//// ----
+
+// A whole session, with every byte on the SPI bus clocked by core 1
+static void session_does_CAN_on_core_1() {
+
+    World world;
+    world_init(&world);
+    world.pack.soc = 75;
+    world_start(&world);
+
+    bytesOffCore1 = 0;
+    sdk_set_transfer_hook(check_on_CAN_core);
+    CHECK(world_run(&world, 1200000));
+    sdk_set_transfer_hook(NULL);
+
+    CHECK(world.energyTransferAt != 0);
+    CHECK_EQUAL(world.contactorViolations, 0);
+    CHECK(sdk_spi_stats(CHADEMO_CAN_CS)->bytes > 0);
+    CHECK_EQUAL(bytesOffCore1, 0);
+}
+
+// enable_task() on core 0 for a core 1 task, and disable_task() to stop it
+static void core_0_starts_and_stops_outbound() {
+
+    StatusFrames frames;
+    start_outbound(&frames);
+
+    sim_advance_us(10 * CHADEMO_OUTBOUND_INTERVAL * MS);
+    CHECK(frames.sent >= 9);
+    CHECK_EQUAL(frames.sentOffCore1, 0);
+
+    disable_send_outbound_CAN_messages();
+    uint32_t sent = frames.sent;
+    sim_advance_us(10 * CHADEMO_OUTBOUND_INTERVAL * MS);
+    CHECK_EQUAL(frames.sent, sent);
+}
+
+// Core 1 sends what core 0 published, not what core 0 is in the middle of changing
+static void outbound_frames_are_core_0s_snapshot() {
+
+    StatusFrames frames;
+    start_outbound(&frames);
+    board_poll();
+    sim_advance_us(2 * CHADEMO_OUTBOUND_INTERVAL * MS);
+    CHECK(frames.sent > 0);
+    uint8_t published = frames.last.data[3];
+
+    // Core 1 keeps sending the old request while core 0 hasn't been round its loop
+    chademo.chargingCurrentRequest = published + 10;
+    uint32_t sent = frames.sent;
+    sim_advance_us(5 * CHADEMO_OUTBOUND_INTERVAL * MS);
+    CHECK(frames.sent > sent);
+    CHECK_EQUAL(frames.last.data[3], published);
+
+    // Then picks up the new one once it has
+    board_poll();
+    sim_advance_us(2 * CHADEMO_OUTBOUND_INTERVAL * MS);
+    CHECK_EQUAL(frames.last.data[3], published + 10);
+}
+
+
+int main() {
+    RUN(session_does_CAN_on_core_1);
+    RUN(core_0_starts_and_stops_outbound);
+    RUN(outbound_frames_are_core_0s_snapshot);
+    return check_result();
+}
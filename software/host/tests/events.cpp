@@ -0,0 +1,138 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+extern "C" {
+#include "settings.h"
+#include "sim.h"
+#include "statemachine.h"
+#include "types.h"
+}
+
+#include "world.h"
+#include "check.h"
+
+/*
+ * The order events come off the queues. Anything that stops a charge jumps
+ * ahead of the routine ones, but the two edges of an input have to come off
+ * in the order they went on, or a bounce that ends with the input off is
+ * dispatched as one that ends with it on.
+ */
+
+extern BMS bms;
+
+static void drain_events() {
+    while ( dispatch_events() > 0 ) {
+    }
+}
+
+// Step a normal session until the car's in the given state, with the BMS heard from
+static bool run_until(World *world, State state) {
+    for ( int ms = 0; ms < 10000; ms++ ) {
+        if ( get_state() == state && bms.maximumVoltage > 0 ) {
+            return true;
+        }
+        world_step(world);
+    }
+    return false;
+}
+
+
+//// ----
+//
+// Tests
+//
+//// ----
+
+// IN1 comes on and goes off again before the main loop gets to either
+static void in1_bounce_leaves_charge_enable_off() {
+
+    World world;
+    world_init(&world);
+    world_start(&world);
+    CHECK(run_until(&world, S_PLUG_IN));
+    uint8_t out1 = sim_get_pin(CHADEMO_OUT1_PIN);
+
+    // With something routine queued ahead of them
+    post_event(E_BMS_UPDATE_RECEIVED);
+    post_event(E_IN1_ACTIVATED);
+    post_event(E_IN1_DEACTIVATED);
+    drain_events();
+
+    CHECK_EQUAL(get_state(), S_PLUG_IN);
+    CHECK_EQUAL(sim_get_pin(CHADEMO_OUT1_PIN), out1);
+}
+
+static void plug_bounce_leaves_car_idle() {
+
+    World world;
+    world_init(&world);
+    world_start(&world);
+    CHECK(run_until(&world, S_IDLE));
+
+    post_event(E_BMS_UPDATE_RECEIVED);
+    post_event(E_PLUG_INSERTED);
+    post_event(E_PLUG_REMOVED);
+    drain_events();
+
+    CHECK_EQUAL(get_state(), S_IDLE);
+}
+
+// And the other way round, off and back on, ends up on
+static void plug_bounce_leaves_car_plugged_in() {
+
+    World world;
+    world_init(&world);
+    world_start(&world);
+    CHECK(run_until(&world, S_PLUG_IN));
+
+    post_event(E_BMS_UPDATE_RECEIVED);
+    post_event(E_PLUG_REMOVED);
+    post_event(E_PLUG_INSERTED);
+    drain_events();
+
+    CHECK_EQUAL(get_state(), S_PLUG_IN);
+}
+
+// A fault posted after a routine event is still dispatched first
+static void safety_events_jump_the_queue() {
+
+    World world;
+    world_init(&world);
+    world_start(&world);
+    CHECK(run_until(&world, S_PLUG_IN));
+
+    post_event(E_IN1_ACTIVATED);
+    post_event(E_STATION_CAPABILITIES_UPDATED);
+    post_event(E_CAN_BUS_FAULT);
+
+    // One at a time: the edge, then the fault, and the capabilities last
+    CHECK_EQUAL(dispatch_events(), 3);
+    CHECK_EQUAL(get_state(), S_ERROR);
+}
+
+
+int main() {
+    RUN(in1_bounce_leaves_charge_enable_off);
+    RUN(plug_bounce_leaves_car_idle);
+    RUN(plug_bounce_leaves_car_plugged_in);
+    RUN(safety_events_jump_the_queue);
+    return check_result();
+}
@@ -0,0 +1,180 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+extern "C" {
+#include "settings.h"
+#include "battery.h"
+}
+
+#include "types.h"
+#include "cansignal.h"
+#include "check.h"
+
+/*
+ * The integer charging maths against the float it replaced. Each float
+ * reference is the calculation as it would be in real numbers, and the
+ * integer version has to come within a step of it everywhere in the range
+ * the car will see.
+ */
+
+extern BMS bms;
+extern Battery battery;
+
+static void set_bms_voltages(double minimum, double maximum) {
+    bms.minimumVoltage = (DeciVolts)lround(minimum * 10);
+    bms.maximumVoltage = (DeciVolts)lround(maximum * 10);
+}
+
+static double voltage_from_soc(double minimum, double maximum, int soc) {
+    return minimum + ( maximum - minimum ) * soc / 100;
+}
+
+static void voltage_from_soc_matches_float() {
+    for ( double minimum = 250; minimum <= 350; minimum += 12.3 ) {
+        for ( double maximum = minimum + 50; maximum <= 500; maximum += 17.1 ) {
+            set_bms_voltages(minimum, maximum);
+            for ( int soc = 0; soc <= 100; soc++ ) {
+                double expected = voltage_from_soc(bms.minimumVoltage / 10.0, bms.maximumVoltage / 10.0, soc);
+                uint16_t actual = battery_get_voltage_from_soc(soc);
+                // Rounded down to whole volts
+                CHECK(actual <= expected + 1e-9 && actual > expected - 1);
+            }
+        }
+    }
+}
+
+// What 0x101 should carry for an estimate of minutes, as the float code did it
+static uint8_t minutes_byte(double minutes) {
+    return minutes >= 255 ? 255 : (uint8_t)minutes;
+}
+
+static void check_minutes(double minutes) {
+    double minutesMax = minutes * MAX_CHARGING_TIME_SCALING_PERCENT / 100;
+    int actual = get_charging_time_minutes();
+    int actualMax = get_charging_time_minutes_max();
+    if ( abs(actual - minutes_byte(minutes)) > 1 || abs(actualMax - minutes_byte(minutesMax)) > 1 ) {
+        fprintf(stderr, "  soc %u, %u Ah, %u Wh: %d and %d minutes, expected %.2f and %.2f\n", bms.soc,
+            battery.capacityAH, battery.capacityWH, actual, actualMax, minutes, minutesMax);
+        checkFailures++;
+    }
+}
+
+static void charging_time_by_ah_matches_float() {
+    static const uint16_t capacities[] = { 20, 60, 120, 160, 400, 1000 };
+    for ( uint16_t capacity : capacities ) {
+        battery.capacityAH = capacity;
+        for ( uint8_t soc = 0; soc <= 100; soc += 3 ) {
+            bms.soc = soc;
+            for ( uint8_t target = 50; target <= 100; target += 10 ) {
+                for ( int current = 1; current <= 255; current += 6 ) {
+                    battery_recalculate_charging_time_minutes_by_ah(current, target);
+                    double ah = capacity * ( target > soc ? target - soc : 0 ) / 100.0;
+                    check_minutes(ah / current * 60);
+                }
+            }
+        }
+    }
+}
+
+static void charging_time_by_wh_matches_float() {
+    static const uint16_t capacities[] = { 8000, 24000, 42000, 65000 };
+    set_bms_voltages(300, 400);
+    for ( uint16_t capacity : capacities ) {
+        battery.capacityWH = capacity;
+        for ( uint8_t soc = 0; soc <= 100; soc += 3 ) {
+            bms.soc = soc;
+            for ( uint8_t target = 50; target <= 100; target += 10 ) {
+                for ( int current = 1; current <= 255; current += 6 ) {
+                    battery_recalculate_charging_time_minutes_by_wh(current, target);
+                    double wh = capacity * ( target > soc ? target - soc : 0 ) / 100.0;
+                    double volts = voltage_from_soc(300, 400, ( soc + target ) / 2);
+                    check_minutes(wh / ( current * volts ) * 60);
+                }
+            }
+        }
+    }
+}
+
+// Past 255 minutes, both bytes stay at 255 rather than wrapping
+static void charging_time_saturates() {
+    battery.capacityAH = 1000;
+    bms.soc = 0;
+    battery_recalculate_charging_time_minutes_by_ah(1, 100);
+    CHECK_EQUAL(get_charging_time_minutes(), 255);
+    CHECK_EQUAL(get_charging_time_minutes_max(), 255);
+
+    // 220 minutes fits, but 120% of it doesn't
+    battery.capacityAH = 110;
+    bms.soc = 0;
+    battery_recalculate_charging_time_minutes_by_ah(30, 100);
+    CHECK_EQUAL(get_charging_time_minutes(), 220);
+    CHECK_EQUAL(get_charging_time_minutes_max(), 255);
+}
+
+/*
+ * The codec scales a signal in integer maths for an integer member, and in
+ * float for a float one. Both should land on the same step.
+ */
+template <typename SIGNAL>
+static void check_signal_decode(int64_t first, int64_t last, int64_t step) {
+    for ( int64_t raw = first; raw <= last; raw += step ) {
+        uint64_t payload = (uint64_t)raw & SIGNAL::MASK;
+        int32_t integer = SIGNAL::template decode<int32_t>(payload);
+        float real = SIGNAL::template decode<float>(payload);
+        if ( fabs(integer - real) > 0.5 + 1e-3 ) {
+            fprintf(stderr, "  raw %lld decodes to %d, expected %.3f\n", (long long)raw, integer, real);
+            checkFailures++;
+        }
+    }
+}
+
+template <typename SIGNAL>
+static void check_signal_encode(int32_t first, int32_t last, int32_t step) {
+    for ( int32_t value = first; value <= last; value += step ) {
+        int64_t integer = SIGNAL::raw(SIGNAL::encode(0, value));
+        int64_t real = SIGNAL::raw(SIGNAL::encode(0, (float)value));
+        if ( llabs(integer - real) > 1 ) {
+            fprintf(stderr, "  %d encodes to %lld, expected %lld\n", value, (long long)integer, (long long)real);
+            checkFailures++;
+        }
+    }
+}
+
+static void codec_scaling_matches_float() {
+    // 0x356 pack voltage, 0.01 V/bit into 0.1 V
+    check_signal_decode<CANSignal<0, 16, false, 1, 10>>(0, 65535, 1);
+    // 0x356 current, signed 0.1 A/bit
+    check_signal_decode<CANSignal<16, 16, true>>(-32768, 32767, 1);
+    // 0x101 time, 10 s/bit
+    check_signal_encode<CANSignal<8, 8, false, 10>>(0, 3000, 1);
+    // 0x101 capacity, 110 Wh/bit
+    check_signal_encode<CANSignal<40, 16, false, 110>>(0, 65535, 1);
+}
+
+int main() {
+    RUN(voltage_from_soc_matches_float);
+    RUN(charging_time_by_ah_matches_float);
+    RUN(charging_time_by_wh_matches_float);
+    RUN(charging_time_saturates);
+    RUN(codec_scaling_matches_float);
+    return check_result();
+}
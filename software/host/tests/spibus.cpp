@@ -0,0 +1,175 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcp2515/mcp2515.h"
+
+extern "C" {
+#include "settings.h"
+#include "sim.h"
+#include "chademocomms.h"
+}
+
+#include "types.h"
+#include "board.h"
+#include "check.h"
+
+/*
+ * The two MCP2515s sharing the SPI bus. The main loop keeps the main bus
+ * controller busy while an interrupt fires partway through its transactions
+ * and talks to the ChaDeMo controller. The arbiter has to hold the interrupt
+ * off until the main bus transaction is done, so the two chip selects are
+ * never low at once.
+ */
+
+#define FRAMES 2000
+
+// Raise the interrupt after every this many bytes on the bus
+#define HOOK_EVERY 3
+
+extern MCP2515 mainCAN;
+extern MCP2515 chademoCAN;
+extern CANStats chademoCANStats;
+
+static void (*onInterrupt)();
+static bool interruptQueued;
+static uint32_t interruptsRaised;
+static uint32_t bytesSeen;
+
+static void run_interrupt(void *context) {
+    onInterrupt();
+    interruptQueued = false;
+}
+
+static void transfer_hook() {
+    if ( interruptQueued || ++bytesSeen % HOOK_EVERY != 0 ) {
+        return;
+    }
+    interruptQueued = true;
+    interruptsRaised++;
+    sim_raise_irq(run_interrupt, NULL);
+}
+
+static struct can_frame frame(canid_t id) {
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = id;
+    frame.can_dlc = 8;
+    return frame;
+}
+
+static void start(void (*interrupt)()) {
+    sim_reset();
+    board_start();
+    onInterrupt = interrupt;
+    interruptQueued = false;
+    interruptsRaised = 0;
+    bytesSeen = 0;
+    sdk_spi_reset_stats();
+    sdk_set_transfer_hook(transfer_hook);
+}
+
+// Frames in and out on the main bus, through the driver and the arbiter
+static void main_bus_load() {
+    struct can_frame in = frame(0x351);
+    struct can_frame out;
+    for ( int i = 0; i < FRAMES; i++ ) {
+        mainCANChip.receive(&in);
+        CHECK_EQUAL(mainCAN.readMessage(&out), MCP2515::ERROR_OK);
+        CHECK_EQUAL(mainCAN.sendMessage(&out), MCP2515::ERROR_OK);
+    }
+    sdk_set_transfer_hook(NULL);
+}
+
+static void check_no_overlap() {
+    CHECK_EQUAL(sdk_spi_stats(MAIN_CAN_CS)->overlaps, 0);
+    CHECK_EQUAL(sdk_spi_stats(CHADEMO_CAN_CS)->overlaps, 0);
+    CHECK(sdk_spi_stats(CHADEMO_CAN_CS)->transactions > 0);
+}
+
+
+//// ----
+//
+// Tests
+//
+//// ----
+
+static void send_on_chademo_bus() {
+    struct can_frame out = frame(0x100);
+    chademoCAN.sendMessage(&out);
+}
+
+static void receive_on_chademo_bus() {
+    struct can_frame in = frame(0x108);
+    chademoCANChip.receive(&in);
+    handle_chademo_CAN_messages();
+}
+
+// A send from interrupt context, as the outbound ChaDeMo timers do
+static void interrupt_sends_mid_transaction() {
+    start(send_on_chademo_bus);
+    main_bus_load();
+    check_no_overlap();
+    CHECK(interruptsRaised > FRAMES);
+    CHECK_EQUAL(chademoCANChip.framesSent, interruptsRaised);
+    CHECK_EQUAL(mainCANChip.framesSent, FRAMES);
+}
+
+// A receive from interrupt context, as the INT handler does
+static void interrupt_receives_mid_transaction() {
+    start(receive_on_chademo_bus);
+    main_bus_load();
+    check_no_overlap();
+    CHECK(interruptsRaised > FRAMES);
+    CHECK_EQUAL(chademoCANStats.framesReceived, interruptsRaised);
+    CHECK_EQUAL(mainCANChip.framesSent, FRAMES);
+}
+
+// Without the arbiter, the same interrupt does select both at once
+static void raw_chademo_transaction() {
+    uint8_t readStatus = 0xA0;
+    uint8_t status;
+    gpio_put(CHADEMO_CAN_CS, 0);
+    spi_write_blocking(SPI_PORT, &readStatus, 1);
+    spi_read_blocking(SPI_PORT, 0x00, &status, 1);
+    gpio_put(CHADEMO_CAN_CS, 1);
+}
+
+static void unarbitrated_interrupt() {
+    sim_reset();
+    board_start();
+    sdk_spi_reset_stats();
+
+    gpio_put(MAIN_CAN_CS, 0);
+    sim_raise_irq([](void *context) { raw_chademo_transaction(); }, NULL);
+    gpio_put(MAIN_CAN_CS, 1);
+
+    CHECK_EQUAL(sdk_spi_stats(CHADEMO_CAN_CS)->overlaps, 1);
+}
+
+
+int main() {
+    RUN(interrupt_sends_mid_transaction);
+    RUN(interrupt_receives_mid_transaction);
+    RUN(unarbitrated_interrupt);
+    return check_result();
+}
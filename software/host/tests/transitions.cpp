@@ -0,0 +1,294 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include "settings.h"
+#include "sim.h"
+#include "statemachine.h"
+#include "types.h"
+}
+
+#include "world.h"
+#include "check.h"
+
+/*
+ * Every event in every state. A session runs as normal, and the first time
+ * the car reaches each state we fork once per event, post that event on its
+ * own, with the inputs and the BMS and station data as they stand, and see
+ * where the car ends up. The expected table below is written from the
+ * ChaDeMo sequence and what each state is for, not read back from
+ * statemachine.c, so a change to either shows up here.
+ *
+ * Every dispatch also runs the safety invariant, so a pair that leaves the
+ * contactors permitted where they mustn't be aborts its child.
+ */
+
+// Handled, but the car stays where it is: ignored, a guard failed, or an
+// action without a state change
+#define STAY S_STAY
+
+// Missing from the table, so the car stays put and warns
+#define WARN N_STATES + 1
+
+// Longer than any state's timeout, so E_STATE_TIMEOUT isn't stale
+#define PAST_ANY_DEADLINE ( ( INSULATION_TEST_TIMEOUT + 1000 ) * 1000ull )
+
+extern BMS bms;
+
+static const int expected[N_STATES][N_EVENTS] = {
+
+    /*              plug_inserted       plug_removed  in1_activated    in1_deactivated  in2_activated      in2_deactivated
+     *              capabilities        status        bms_update       inhibit_enabled  inhibit_disabled   bms_liveness
+     *              station_liveness    can_fault     state_timeout    control_tick
+     */
+
+    // idle, unplugged, once the BMS has reported
+    [S_IDLE] = {    S_PLUG_IN,          WARN,         WARN,            WARN,            WARN,              WARN,
+                    WARN,               WARN,         STAY,            S_CHARGE_INHIBITED, WARN,           S_ERROR,
+                    STAY,               S_ERROR,      STAY,            STAY },
+
+    // plug_in, waiting for IN1
+    [S_PLUG_IN] = { WARN,               S_IDLE,       S_HANDSHAKING,   WARN,            WARN,              WARN,
+                    WARN,               WARN,         STAY,            S_CHARGE_INHIBITED, WARN,           S_ERROR,
+                    STAY,               S_ERROR,      STAY,            STAY },
+
+    // handshaking, as IN1 comes on and before the station has told us anything
+    [S_HANDSHAKING] = {
+                    WARN,               S_IDLE,       WARN,            S_PLUG_IN,       WARN,              WARN,
+                    S_ERROR,            STAY,         STAY,            S_CHARGE_INHIBITED, WARN,           S_ERROR,
+                    STAY,               S_ERROR,      S_ERROR,         STAY },
+
+    // await_connector_lock, before the station reports the lock
+    [S_AWAIT_CONNECTOR_LOCK] = {
+                    WARN,               S_IDLE,       WARN,            S_PLUG_IN,       WARN,              WARN,
+                    STAY,               STAY,         STAY,            S_CHARGE_INHIBITED, WARN,           S_ERROR,
+                    S_ERROR,            S_ERROR,      S_ERROR,         STAY },
+
+    // await_insulation_test, locked, before IN2
+    [S_AWAIT_INSULATION_TEST] = {
+                    WARN,               S_IDLE,       WARN,            S_PLUG_IN,       S_ENERGY_TRANSFER, WARN,
+                    STAY,               STAY,         STAY,            S_CHARGE_INHIBITED, WARN,           S_ERROR,
+                    S_ERROR,            S_ERROR,      S_ERROR,         STAY },
+
+    // energy_transfer, as the current starts to ramp
+    [S_ENERGY_TRANSFER] = {
+                    WARN,               S_IDLE,       WARN,            WARN,            WARN,              WARN,
+                    STAY,               STAY,         STAY,            S_WINDING_DOWN,  WARN,              S_ERROR,
+                    S_ERROR,            S_ERROR,      STAY,            STAY },
+
+    // winding_down, with current still flowing
+    [S_WINDING_DOWN] = {
+                    WARN,               S_IDLE,       WARN,            WARN,            WARN,              WARN,
+                    STAY,               STAY,         STAY,            STAY,            WARN,              STAY,
+                    S_ERROR,            STAY,         STAY,            STAY },
+
+    // weld_detection
+    [S_WELD_DETECTION] = {
+                    WARN,               S_IDLE,       WARN,            WARN,            WARN,              WARN,
+                    STAY,               STAY,         STAY,            STAY,            WARN,              STAY,
+                    STAY,               STAY,         STAY,            STAY },
+
+    // charge_inhibited, unplugged, with CHARGE_INHIBIT still active
+    [S_CHARGE_INHIBITED] = {
+                    STAY,               WARN,         WARN,            WARN,            WARN,              WARN,
+                    WARN,               WARN,         STAY,            WARN,            STAY,              S_ERROR,
+                    S_ERROR,            S_ERROR,      STAY,            STAY },
+
+    // error
+    [S_ERROR] = {   WARN,               S_IDLE,       WARN,            WARN,            WARN,              WARN,
+                    WARN,               WARN,         STAY,            WARN,            WARN,              WARN,
+                    WARN,               STAY,         STAY,            STAY }
+};
+
+static void drain_events() {
+    while ( dispatch_events() > 0 ) {
+    }
+}
+
+// In a child, with stdout going to log
+static void check_pair(State from, Event event, FILE *log) {
+
+    drain_events();
+    if ( get_state() != from ) {
+        fprintf(stderr, "left %s before %s could be posted\n", state_name(from), event_name(event));
+        checkFailures++;
+        return;
+    }
+
+    if ( event == E_STATE_TIMEOUT ) {
+        sim_sleep_us(PAST_ANY_DEADLINE);
+    }
+
+    fflush(stdout);
+    long start = ftell(log);
+    post_event(event);
+    drain_events();
+    fflush(stdout);
+
+    char output[4096] = "";
+    fseek(log, start, SEEK_SET);
+    output[fread(output, 1, sizeof(output) - 1, log)] = '\0';
+    bool warned = strstr(output, "unexpected event") != NULL;
+
+    State after = get_state();
+    int want = expected[from][event];
+
+    if ( want == WARN ) {
+        CHECK(warned);
+        CHECK_EQUAL(after, from);
+    } else {
+        CHECK(! warned);
+        CHECK_EQUAL(after, want == STAY ? from : want);
+    }
+
+    if ( checkFailures ) {
+        fprintf(stderr, "  in %s on %s, ended up in %s\n", state_name(from), event_name(event), state_name(after));
+    }
+}
+
+// Fork once per event from where we are now. Returns the number that failed.
+static int check_every_event() {
+
+    State from = get_state();
+    int failed = 0;
+
+    for ( int event = 0; event < N_EVENTS; event++ ) {
+        fflush(stdout);
+        pid_t child = fork();
+        if ( child == 0 ) {
+            FILE *log = tmpfile();
+            dup2(fileno(log), STDOUT_FILENO);
+            checkFailures = 0;
+            check_pair(from, (Event)event, log);
+            _exit(checkFailures == 0 ? 0 : 1);
+        }
+        int status = 0;
+        if ( child < 0 || waitpid(child, &status, 0) != child || ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+            if ( child > 0 && WIFSIGNALED(status) ) {
+                fprintf(stderr, "  in %s on %s, killed by signal %d\n", state_name(from), event_name((Event)event), WTERMSIG(status));
+            }
+            failed++;
+        }
+    }
+    return failed;
+}
+
+
+//// ----
+//
+// Tests
+//
+//// ----
+
+// Every state a normal session passes through
+static void session_states() {
+
+    World world;
+    world_init(&world);
+    world.pack.soc = 75;    // full with current still flowing, in ten minutes
+    world_start(&world);
+
+    uint32_t checked = 0;
+    for ( uint32_t ms = 0; ms < 1200000 && ! world_finished(&world); ms++ ) {
+        State state = get_state();
+        // Until the BMS reports, a battery with no maximum voltage looks full
+        if ( bms.maximumVoltage > 0 && ! ( checked & 1u << state ) ) {
+            checked |= 1u << state;
+            checkFailures += check_every_event();
+        }
+        world_step(&world);
+    }
+
+    static const State session[] = {
+        S_IDLE, S_PLUG_IN, S_HANDSHAKING, S_AWAIT_CONNECTOR_LOCK, S_AWAIT_INSULATION_TEST,
+        S_ENERGY_TRANSFER, S_WINDING_DOWN, S_WELD_DETECTION
+    };
+    for ( State state : session ) {
+        if ( ! ( checked & 1u << state ) ) {
+            fprintf(stderr, "never saw %s\n", state_name(state));
+            checkFailures++;
+        }
+    }
+}
+
+static void charge_inhibited_state() {
+
+    World world;
+    world_init(&world);
+    world_start(&world);
+
+    world_step(&world);
+
+    // Nothing listens for edges on CHARGE_INHIBIT, the guards read the pin,
+    // so post what a handler would
+    sim_set_pin(CHARGE_INHIBIT_PIN, 0);
+    post_event(E_CHARGE_INHIBIT_ENABLED);
+    drain_events();
+    CHECK_EQUAL(get_state(), S_CHARGE_INHIBITED);
+    checkFailures += check_every_event();
+}
+
+static void error_state() {
+
+    World world;
+    world_init(&world);
+    world_start(&world);
+    world_step(&world);
+
+    post_event(E_CAN_BUS_FAULT);
+    drain_events();
+    CHECK_EQUAL(get_state(), S_ERROR);
+    checkFailures += check_every_event();
+}
+
+// Back to plug_in from any of the states that raised charge enable
+static void in1_off_drops_charge_enable() {
+
+    static const State raised[] = { S_HANDSHAKING, S_AWAIT_CONNECTOR_LOCK, S_AWAIT_INSULATION_TEST };
+
+    for ( State from : raised ) {
+        World world;
+        world_init(&world);
+        world_start(&world);
+        for ( int ms = 0; ms < 10000 && get_state() != from; ms++ ) {
+            world_step(&world);
+        }
+        CHECK_EQUAL(get_state(), from);
+        CHECK_EQUAL(sim_get_pin(CHADEMO_OUT1_PIN), 1);
+
+        post_event(E_IN1_DEACTIVATED);
+        drain_events();
+        CHECK_EQUAL(get_state(), S_PLUG_IN);
+        CHECK_EQUAL(sim_get_pin(CHADEMO_OUT1_PIN), 0);
+    }
+}
+
+
+int main() {
+    RUN(session_states);
+    RUN(charge_inhibited_state);
+    RUN(error_state);
+    RUN(in1_off_drops_charge_enable);
+    return check_result();
+}
@@ -0,0 +1,201 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+extern "C" {
+#include "battery.h"
+#include "chademo.h"
+#include "settings.h"
+#include "sim.h"
+}
+
+#include "types.h"
+#include "board.h"
+#include "world.h"
+
+extern Battery battery;
+
+// xorshift64, so a run depends only on its seed
+static bool drop_frame(World *world) {
+    if ( world->dropPermille == 0 ) {
+        return false;
+    }
+    world->random ^= world->random << 13;
+    world->random ^= world->random >> 7;
+    world->random ^= world->random << 17;
+    if ( world->random % 1000 < world->dropPermille ) {
+        world->framesDropped++;
+        return true;
+    }
+    return false;
+}
+
+static void to_main_bus(const struct can_frame *frame, void *context) {
+    if ( ! drop_frame((World *)context) ) {
+        mainCANChip.receive(frame);
+    }
+}
+
+static void to_chademo_bus(const struct can_frame *frame, void *context) {
+    if ( ! drop_frame((World *)context) ) {
+        chademoCANChip.receive(frame);
+    }
+}
+
+static void from_chademo_bus(const struct can_frame *frame, void *context) {
+    if ( ! drop_frame((World *)context) ) {
+        evse_model_receive(&( (World *)context )->evse, frame, sim_time_us());
+    }
+}
+
+void world_init(World *world) {
+    *world = {};
+    pack_init(&world->pack);
+    bms_model_init(&world->bms, &world->pack);
+    evse_model_init(&world->evse, &world->pack);
+    world->random = 1;
+}
+
+void world_start(World *world) {
+
+    world->bms.send = to_main_bus;
+    world->bms.sendContext = world;
+    world->evse.send = to_chademo_bus;
+    world->evse.sendContext = world;
+    chademoCANChip.onTransmit = from_chademo_bus;
+    chademoCANChip.onTransmitContext = world;
+    mainCANChip.onTransmit = NULL;
+
+    sim_reset();
+    sim_sleep_us(world->startAt);
+    board_start();
+
+    // The car's idea of its battery, from its configuration
+    double nominal = ( world->pack.emptyVoltage + world->pack.fullVoltage ) / 2;
+    battery.capacityAH = (uint16_t)world->pack.capacityAh;
+    battery.capacityWH = (uint16_t)( world->pack.capacityAh * nominal );
+
+    world->state = get_state();
+    world->statesVisited = 1 << world->state;
+}
+
+void world_step(World *world) {
+
+    sim_advance_us(1000);
+    uint64_t now = sim_time_us();
+
+    evse_model_step(&world->evse, now, 0.001);
+    world->bms.current = world->evse.deliveredCurrent;
+    pack_charge(&world->pack, world->evse.deliveredCurrent, 0.001);
+    bms_model_step(&world->bms, now);
+
+    board_poll();
+
+    State state = get_state();
+    if ( state != world->state ) {
+        world->transitions++;
+        world->statesVisited |= 1 << state;
+        if ( state == S_ENERGY_TRANSFER && world->energyTransferAt == 0 ) {
+            world->energyTransferAt = now;
+        }
+        world->state = state;
+    }
+
+    if ( sim_get_pin(CHADEMO_OUT2_PIN) && state != S_ENERGY_TRANSFER && state != S_WINDING_DOWN ) {
+        world->contactorViolations++;
+    }
+
+    double target = world->evse.car.targetVoltage;
+    if ( world->evse.phase == EVSE_CHARGING && world->evse.deliveredCurrent > 0 && target > 0 ) {
+        double voltage = world->evse.outputVoltage;
+        if ( voltage + CC_CV_MARGIN < target ) {
+            world->sawCC = true;
+        } else if ( world->cvAt == 0 && world->sawCC ) {
+            world->cvAt = now;
+            world->cvTarget = target;
+        }
+        if ( world->cvAt != 0 ) {
+            if ( voltage - target > world->overshoot ) {
+                world->overshoot = voltage - target;
+            }
+            if ( fabs(voltage - target) > WORLD_SETTLING_BAND ) {
+                world->unsettledAt = now;
+            }
+        }
+    }
+
+    if ( world->evse.deliveredCurrent > world->peakCurrent ) {
+        world->peakCurrent = world->evse.deliveredCurrent;
+    }
+    if ( world->evse.outputVoltage > world->peakVoltage ) {
+        world->peakVoltage = world->evse.outputVoltage;
+    }
+}
+
+bool world_finished(World *world) {
+    if ( world->finishedAt == 0 && world->evse.phase == EVSE_UNPLUGGED && world->state == S_IDLE ) {
+        world->finishedAt = sim_time_us();
+    }
+    return world->finishedAt != 0;
+}
+
+bool world_run(World *world, uint32_t limitMs) {
+    for ( uint32_t ms = 0; ms < limitMs; ms++ ) {
+        world_step(world);
+        if ( world_finished(world) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t world_settling_time(const World *world) {
+    return world->unsettledAt > world->cvAt ? world->unsettledAt - world->cvAt : 0;
+}
+
+void world_report(const World *world) {
+    printf("Session %s after %.1f s\n", world->finishedAt ? "finished" : "unfinished", sim_time_us() / 1e6);
+    printf("  SoC %.1f%%, %.2f Ah, %.0f Wh in\n", world->pack.soc, world->pack.chargedAh, world->pack.chargedWh);
+    printf("  peak %.1f A at up to %.1f V\n", world->peakCurrent, world->peakVoltage);
+    printf("  station %s%s, car %s after %lu transitions\n", evse_phase_name(world->evse.phase),
+        world->evse.carLost ? " (lost the car)" : "", state_name(world->state), (unsigned long)world->transitions);
+    printf("  states visited:");
+    for ( int state = 0; state < N_STATES; state++ ) {
+        if ( world->statesVisited & 1 << state ) {
+            printf(" %s", state_name((State)state));
+        }
+    }
+    printf("\n");
+    if ( world->cvAt != 0 ) {
+        printf("  CV %.1f s into energy transfer, at %.0f V: overshoot %.1f V, within %.1f V after %.1f s\n",
+            ( world->cvAt - world->energyTransferAt ) / 1e6, world->cvTarget, world->overshoot,
+            WORLD_SETTLING_BAND, world_settling_time(world) / 1e6);
+    }
+    if ( world->evse.overVoltage ) {
+        printf("  station stopped on over voltage\n");
+    }
+    if ( world->framesDropped ) {
+        printf("  %lu frames dropped\n", (unsigned long)world->framesDropped);
+    }
+    if ( world->contactorViolations ) {
+        printf("  OUT2 on outside energy transfer for %lu ms\n", (unsigned long)world->contactorViolations);
+    }
+}
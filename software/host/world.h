@@ -0,0 +1,95 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+extern "C" {
+#include "statemachine.h"
+#include "models/pack.h"
+#include "models/bms.h"
+#include "models/evse.h"
+}
+
+// How close to the target voltage counts as settled, V
+#define WORLD_SETTLING_BAND 1.5
+
+/*
+ * One charging session: the board, wired to a BMS on the main bus and a
+ * station on the ChaDeMo bus, both charging the same pack. Stepped a
+ * millisecond at a time.
+ */
+typedef struct {
+    Pack pack;
+    BMSModel bms;
+    EVSEModel evse;
+
+    // The clock at power on, us. To see the board through a timer wrapping.
+    uint64_t startAt;
+
+    // Faults to inject
+    uint32_t dropPermille;        // frames lost on either bus, per thousand
+    uint64_t random;              // state for choosing which, not zero
+    uint32_t framesDropped;
+
+    // What happened
+    uint32_t statesVisited;       // bitmask of State
+    uint32_t transitions;
+    State state;
+    uint64_t energyTransferAt;    // us, 0 if we never got there
+    double peakCurrent;           // A
+    double peakVoltage;           // V at the station's output
+    uint32_t contactorViolations; // ms with OUT2 on outside energy transfer and winding down
+
+    // The current controller's step response, from when the station's output
+    // first comes up to within CC_CV_MARGIN of the car's target voltage. A
+    // pack that starts over the target never has one.
+    bool sawCC;                   // the output was below that
+    uint64_t cvAt;                // us, 0 if it never got there
+    double cvTarget;              // V
+    double overshoot;             // V over the target, at most
+    uint64_t unsettledAt;         // us, the last time it was more than WORLD_SETTLING_BAND off the target
+    uint64_t finishedAt;          // us, unplugged and back to idle
+} World;
+
+// Set the models to their defaults. Change the parameters before world_start().
+void world_init(World *world);
+
+// Reset the simulation and bring the board up
+void world_start(World *world);
+
+// One millisecond
+void world_step(World *world);
+
+// Unplugged and the car's back to idle
+bool world_finished(World *world);
+
+// Step until the station's been unplugged and the car's back to idle, or for
+// limitMs. Returns true if the session finished.
+bool world_run(World *world, uint32_t limitMs);
+
+// us from reaching CV to staying within WORLD_SETTLING_BAND of the target
+uint64_t world_settling_time(const World *world);
+
+void world_report(const World *world);
+
+#endif
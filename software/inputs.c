@@ -19,9 +19,9 @@
 
 
 #include <stdio.h>
+#include <stdbool.h>
 
-#include "hardware/gpio.h"
-
+#include "hal.h"
 #include "statemachine.h"
 #include "settings.h"
 
@@ -32,60 +32,59 @@
  * CS  (a.k.a 'h'), pilot signal, plug pin 7
  */
 
-void gpio_callback(uint gpio, uint32_t events) {
-    extern State state;
+static void input_changed(uint8_t gpio) {
 
     if ( gpio == CHADEMO_IN1_PIN ) {
-        if ( gpio_get(CHADEMO_IN1_PIN) == 1 ) {
-            state(E_IN1_ACTIVATED);
+        if ( hal_gpio_get(CHADEMO_IN1_PIN) == 1 ) {
+            post_event(E_IN1_ACTIVATED);
         } else {
-            state(E_IN1_DEACTIVATED);
+            post_event(E_IN1_DEACTIVATED);
         }
     }
 
     if ( gpio == CHADEMO_IN2_PIN ) {
-        if ( gpio_get(CHADEMO_IN2_PIN) == 0 ) {
-            state(E_IN2_ACTIVATED);
+        if ( hal_gpio_get(CHADEMO_IN2_PIN) == 0 ) {
+            post_event(E_IN2_ACTIVATED);
         } else {
-            state(E_IN2_DEACTIVATED);
+            post_event(E_IN2_DEACTIVATED);
         }
     }
 
     if ( gpio == CHADEMO_CS_PIN ) {
-        if ( gpio_get(CHADEMO_CS_PIN) == 0 ) {
-            state(E_PLUG_INSERTED);
+        if ( hal_gpio_get(CHADEMO_CS_PIN) == 0 ) {
+            post_event(E_PLUG_INSERTED);
         } else {
-            state(E_PLUG_REMOVED);
+            post_event(E_PLUG_REMOVED);
         }
     }
 
     // Listen to CHARGE_INHIIT signal from BMS
     if ( gpio == CHARGE_INHIBIT_PIN ) {
-        if ( gpio_get(CHARGE_INHIBIT_PIN) == 0 ) {
-            state(E_CHARGE_INHIBIT_ENABLED);
+        if ( hal_gpio_get(CHARGE_INHIBIT_PIN) == 0 ) {
+            post_event(E_CHARGE_INHIBIT_ENABLED);
         } else {
-            state(E_CHARGE_INHIBIT_DISABLED);
+            post_event(E_CHARGE_INHIBIT_DISABLED);
         }
     }
 
 }
 
 void enable_listen_for_IN1_signal() {
-    gpio_set_irq_enabled_with_callback(CHADEMO_IN1_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &gpio_callback);
+    hal_gpio_on_edge(CHADEMO_IN1_PIN, input_changed);
 }
 
 void enable_listen_for_IN2_signal() {
-    gpio_set_irq_enabled(CHADEMO_IN2_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+    hal_gpio_on_edge(CHADEMO_IN2_PIN, input_changed);
 }
 
 void enable_listen_for_CS_signal() {
-    gpio_set_irq_enabled(CHADEMO_CS_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+    hal_gpio_on_edge(CHADEMO_CS_PIN, input_changed);
 }
 
 bool charge_inhibit_enabled() {
-    return gpio_get(CHARGE_INHIBIT_PIN) == 0;
+    return hal_gpio_get(CHARGE_INHIBIT_PIN) == 0;
 }
 
 bool plug_is_inserted() {
-    return gpio_get(CHADEMO_CS_PIN) == 0;
+    return hal_gpio_get(CHADEMO_CS_PIN) == 0;
 }
@@ -21,11 +21,12 @@
 #include "led.h"
 
 #include <stdio.h>
-#include "pico/stdlib.h"
 
 #include "types.h"
+#include "hal.h"
 
 #include "settings.h"
+#include "scheduler.h"
 
 int statusLEDcounter;
 
@@ -67,27 +68,20 @@ void led_blink() {
         if ( led.counter > led.onDuration ) {
             led.counter = 0;
             if ( led.offDuration > 0 ) {
-                gpio_put(PICO_DEFAULT_LED_PIN, 0);                
+                hal_gpio_put(PICO_DEFAULT_LED_PIN, 0);                
                 led.on = false;
             }
         }
     } else {
         if ( led.counter > led.offDuration ) {
-            gpio_put(PICO_DEFAULT_LED_PIN, 1);
+            hal_gpio_put(PICO_DEFAULT_LED_PIN, 1);
             led.counter = 0;
             led.on = true;
         }
     }
 }
 
-bool process_led_blink_step(struct repeating_timer *t) {
-    led_blink();
-    return true;
-}
-
-struct repeating_timer ledBlinkTimer;
-
 void enable_led_blink() {
-    add_repeating_timer_ms(100, process_led_blink_step, NULL, &ledBlinkTimer);
+    enable_task(TASK_LED);
 }
 
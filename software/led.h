@@ -28,7 +28,6 @@
 void enable_led_blink();
 void led_set_mode(LED_MODE newMode);
 void led_blink();
-bool process_led_blink_step();
 
 #endif
 
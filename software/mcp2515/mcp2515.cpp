@@ -2,42 +2,37 @@
 #include "mcp2515.h"
 
 const struct MCP2515::TXBn_REGS MCP2515::TXB[MCP2515::N_TXBUFFERS] = {
-    {MCP_TXB0CTRL, MCP_TXB0SIDH, MCP_TXB0DATA},
-    {MCP_TXB1CTRL, MCP_TXB1SIDH, MCP_TXB1DATA},
-    {MCP_TXB2CTRL, MCP_TXB2SIDH, MCP_TXB2DATA}
+    {MCP_TXB0CTRL, MCP_TXB0SIDH, MCP_TXB0DATA, INSTRUCTION_LOAD_TX0, INSTRUCTION_RTS_TX0, STAT_TX0REQ, CANINTF_TX0IF},
+    {MCP_TXB1CTRL, MCP_TXB1SIDH, MCP_TXB1DATA, INSTRUCTION_LOAD_TX1, INSTRUCTION_RTS_TX1, STAT_TX1REQ, CANINTF_TX1IF},
+    {MCP_TXB2CTRL, MCP_TXB2SIDH, MCP_TXB2DATA, INSTRUCTION_LOAD_TX2, INSTRUCTION_RTS_TX2, STAT_TX2REQ, CANINTF_TX2IF}
 };
 
 const struct MCP2515::RXBn_REGS MCP2515::RXB[N_RXBUFFERS] = {
-    {MCP_RXB0CTRL, MCP_RXB0SIDH, MCP_RXB0DATA, CANINTF_RX0IF},
-    {MCP_RXB1CTRL, MCP_RXB1SIDH, MCP_RXB1DATA, CANINTF_RX1IF}
+    {MCP_RXB0CTRL, MCP_RXB0SIDH, MCP_RXB0DATA, CANINTF_RX0IF, INSTRUCTION_READ_RX0, RXSTAT_RXB0},
+    {MCP_RXB1CTRL, MCP_RXB1SIDH, MCP_RXB1DATA, CANINTF_RX1IF, INSTRUCTION_READ_RX1, RXSTAT_RXB1}
 };
 
-MCP2515::MCP2515(spi_inst_t* CHANNEL, uint8_t CS_PIN, uint8_t TX_PIN, uint8_t RX_PIN, uint8_t SCK_PIN, uint32_t SPI_CLOCK)
+MCP2515::MCP2515(SPIBus *bus, uint8_t CS_PIN, PRIORITY priority)
+    : SPIDevice(bus, CS_PIN, priority)
 {
-    this->SPI_CHANNEL = CHANNEL;
-    spi_init(this->SPI_CHANNEL, SPI_CLOCK);
-    gpio_set_function(TX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(RX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(SCK_PIN, GPIO_FUNC_SPI);
-    spi_set_format(this->SPI_CHANNEL, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    this->SPI_CHANNEL = bus->getChannel();
 
-    this->SPI_CS_PIN = CS_PIN;
-    gpio_init(this->SPI_CS_PIN);
-    gpio_set_dir(this->SPI_CS_PIN, GPIO_OUT);
+    this->INT_PIN = NO_INT_PIN;
+    this->rxPending = 0;
+    this->txInFlight = 0;
 
-    endSPI();
+    this->dmaMode = false;
+    this->dmaCallback = NULL;
+    this->dmaRxQueued = 0;
+    this->dmaTxQueued = 0;
 }
 
 inline void MCP2515::startSPI() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(this->SPI_CS_PIN, 0);
-    asm volatile("nop \n nop \n nop");
+    bus->acquire(this);
 }
 
 inline void MCP2515::endSPI() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(this->SPI_CS_PIN, 1);
-    asm volatile("nop \n nop \n nop");
+    bus->release(this);
 }
 
 MCP2515::ERROR MCP2515::reset(void)
@@ -52,6 +47,9 @@ MCP2515::ERROR MCP2515::reset(void)
     //Depends on oscillator & capacitors used
     sleep_ms(10);
 
+    this->rxPending = 0;
+    this->txInFlight = 0;
+
     uint8_t zeros[14];
     memset(zeros, 0, sizeof(zeros));
     setRegisters(MCP_TXB0CTRL, zeros, 14);
@@ -189,6 +187,21 @@ uint8_t MCP2515::getStatus(void)
     return ret;
 }
 
+uint8_t MCP2515::getRxStatus(void)
+{
+    startSPI();
+
+    uint8_t instruction = INSTRUCTION_RX_STATUS;
+    spi_write_blocking(this->SPI_CHANNEL, &instruction, 1);
+
+    uint8_t ret;
+    spi_read_blocking(this->SPI_CHANNEL, 0x00, &ret, 1);
+
+    endSPI();
+
+    return ret;
+}
+
 MCP2515::ERROR MCP2515::setConfigMode()
 {
     return setMode(CANCTRL_REQOP_CONFIG);
@@ -621,6 +634,60 @@ MCP2515::ERROR MCP2515::setFilter(const RXF num, const bool ext, const uint32_t
     return ERROR_OK;
 }
 
+/*
+ * Only accept frames with the given can_ids. All of them must be standard, or
+ * all extended, as a mask covering standard frames can't also cover the EID
+ * bits without filtering on the first two data bytes.
+ *
+ * Up to six IDs get a filter each, spread over both receive buffers. Spare
+ * filters repeat IDs so that nothing else matches. Beyond six, the masks are
+ * set to the bits that every ID has in common, which lets the handled IDs
+ * through along with anything else that happens to share those bits.
+ *
+ * Leaves the controller in config mode.
+ */
+MCP2515::ERROR MCP2515::setAcceptanceFilters(const uint32_t ids[], const uint8_t n)
+{
+    static const RXF filters[] = {RXF0, RXF1, RXF2, RXF3, RXF4, RXF5};
+    static const uint8_t N_FILTERS = 6;
+
+    if (n == 0) {
+        return ERROR_FAIL;
+    }
+
+    bool ext = (ids[0] & CAN_EFF_FLAG);
+    uint32_t idMask = ext ? CAN_EFF_MASK : CAN_SFF_MASK;
+    uint32_t mask = idMask;
+
+    for (int i=1; i<n; i++) {
+        if ( ((ids[i] & CAN_EFF_FLAG) != 0) != ext ) {
+            return ERROR_FAIL;
+        }
+        if (n > N_FILTERS) {
+            mask &= ~((ids[i] ^ ids[0]) & idMask);
+        }
+    }
+
+    ERROR res = setFilterMask(MASK0, ext, mask);
+    if (res != ERROR_OK) {
+        return res;
+    }
+    res = setFilterMask(MASK1, ext, mask);
+    if (res != ERROR_OK) {
+        return res;
+    }
+
+    for (int i=0; i<N_FILTERS; i++) {
+        uint32_t id = (n > N_FILTERS) ? (ids[0] & mask) : (ids[i % n] & idMask);
+        res = setFilter(filters[i], ext, id);
+        if (res != ERROR_OK) {
+            return res;
+        }
+    }
+
+    return ERROR_OK;
+}
+
 MCP2515::ERROR MCP2515::sendMessage(const TXBn txbn, const struct can_frame *frame)
 {
     if (frame->can_dlc > CAN_MAX_DLEN) {
@@ -641,17 +708,134 @@ MCP2515::ERROR MCP2515::sendMessage(const TXBn txbn, const struct can_frame *fra
 
     memcpy(&data[MCP_DATA], frame->data, frame->can_dlc);
 
-    setRegisters(txbuf->SIDH, data, 5 + frame->can_dlc);
+    if (this->dmaMode) {
+        uint8_t tx[SPIJob::BUFFER_SIZE];
+        tx[0] = txbuf->LOAD;
+        memcpy(&tx[1], data, 5 + frame->can_dlc);
+        return queueDMA(tx, 6 + frame->can_dlc, 0, txbuf->STAT_TXREQ, txbuf->RTS);
+    }
+
+    // LOAD TX BUFFER writes from TXBnSIDH onward without sending an address
+    startSPI();
+    uint8_t instruction = txbuf->LOAD;
+    spi_write_blocking(this->SPI_CHANNEL, &instruction, 1);
+    spi_write_blocking(this->SPI_CHANNEL, data, 5 + frame->can_dlc);
+    endSPI();
+
+    // Setting TXREQ clears ABTF, MLOA and TXERR, so there is nothing useful to
+    // read back from TXBnCTRL at this point.
+    startSPI();
+    instruction = txbuf->RTS;
+    spi_write_blocking(this->SPI_CHANNEL, &instruction, 1);
+    endSPI();
 
-    modifyRegister(txbuf->CTRL, TXB_TXREQ, TXB_TXREQ);
+    return ERROR_OK;
+}
 
-    uint8_t ctrl = readRegister(txbuf->CTRL);
-    if ((ctrl & (TXB_ABTF | TXB_MLOA | TXB_TXERR)) != 0) {
+/*
+ * Send up to three frames as a burst, one per transmit buffer. Each buffer is
+ * loaded with a single WRITE starting at TXBnCTRL, so that its TXP priority
+ * goes in with the frame, and then all of them are sent with one RTS. frames[0]
+ * gets the highest priority, so the frames go onto the wire in the order
+ * given.
+ *
+ * If any of the buffers needed is still sending, nothing is sent and we return
+ * ERROR_ALLTXBUSY. Use checkTransmitted() to find out when the frames are out.
+ */
+MCP2515::ERROR MCP2515::sendMessages(const struct can_frame *frames[], const uint8_t n)
+{
+    if (n == 0 || n > N_TXBUFFERS) {
         return ERROR_FAILTX;
     }
+
+    uint8_t stat = getStatus() | this->dmaTxQueued;
+    uint8_t rts = 0;
+    uint8_t txif = 0;
+
+    for (int i=0; i<n; i++) {
+        if (frames[i]->can_dlc > CAN_MAX_DLEN) {
+            return ERROR_FAILTX;
+        }
+        if (stat & TXB[i].STAT_TXREQ) {
+            return ERROR_ALLTXBUSY;
+        }
+        rts |= TXB[i].RTS;
+        txif |= TXB[i].CANINTF_TXnIF;
+    }
+
+    // Forget any earlier completions so that TXnIF means this burst is out
+    modifyRegister(MCP_CANINTF, txif, 0);
+
+    for (int i=0; i<n; i++) {
+        const struct can_frame *frame = frames[i];
+        const struct TXBn_REGS *txbuf = &TXB[i];
+
+        bool ext = (frame->can_id & CAN_EFF_FLAG);
+        bool rtr = (frame->can_id & CAN_RTR_FLAG);
+        uint32_t id = (frame->can_id & (ext ? CAN_EFF_MASK : CAN_SFF_MASK));
+
+        // WRITE, address, TXBnCTRL, then SIDH..D7
+        uint8_t data[SPIJob::BUFFER_SIZE];
+        data[0] = INSTRUCTION_WRITE;
+        data[1] = txbuf->CTRL;
+        data[2] = (N_TXBUFFERS - 1 - i) & TXB_TXP;
+        prepareId(&data[3], ext, id);
+        data[3 + MCP_DLC] = rtr ? (frame->can_dlc | RTR_MASK) : frame->can_dlc;
+        memcpy(&data[3 + MCP_DATA], frame->data, frame->can_dlc);
+
+        uint8_t len = 3 + 5 + frame->can_dlc;
+
+        if (this->dmaMode) {
+            // RTS goes out once the last buffer is loaded
+            ERROR rc = queueDMA(data, len, 0, txbuf->STAT_TXREQ, (i == n - 1) ? rts : 0);
+            if (rc != ERROR_OK) {
+                return rc;
+            }
+        } else {
+            startSPI();
+            spi_write_blocking(this->SPI_CHANNEL, data, len);
+            endSPI();
+        }
+    }
+
+    if (!this->dmaMode) {
+        startSPI();
+        spi_write_blocking(this->SPI_CHANNEL, &rts, 1);
+        endSPI();
+    }
+
+    this->txInFlight |= txif;
+
     return ERROR_OK;
 }
 
+/*
+ * Number of frames from sendMessages() that have gone out since we last
+ * checked. Their TXnIF flags are cleared as they're counted.
+ */
+uint8_t MCP2515::checkTransmitted(void)
+{
+    if (this->txInFlight == 0) {
+        return 0;
+    }
+
+    uint8_t done = getInterrupts() & this->txInFlight;
+    if (done == 0) {
+        return 0;
+    }
+
+    modifyRegister(MCP_CANINTF, done, 0);
+    this->txInFlight &= ~done;
+
+    uint8_t frames = 0;
+    for (int i=0; i<N_TXBUFFERS; i++) {
+        if (done & TXB[i].CANINTF_TXnIF) {
+            frames++;
+        }
+    }
+    return frames;
+}
+
 MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
 {
     if (frame->can_dlc > CAN_MAX_DLEN) {
@@ -660,10 +844,13 @@ MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
 
     TXBn txBuffers[N_TXBUFFERS] = {TXB0, TXB1, TXB2};
 
+    // READ STATUS has the TXREQ bit of all three buffers. Buffers with a DMA
+    // transfer queued count as busy too.
+    uint8_t stat = getStatus() | this->dmaTxQueued;
+
     for (int i=0; i<N_TXBUFFERS; i++) {
         const struct TXBn_REGS *txbuf = &TXB[txBuffers[i]];
-        uint8_t ctrlval = readRegister(txbuf->CTRL);
-        if ( (ctrlval & TXB_TXREQ) == 0 ) {
+        if ( (stat & txbuf->STAT_TXREQ) == 0 ) {
             return sendMessage(txBuffers[i], frame);
         }
     }
@@ -671,39 +858,63 @@ MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
     return ERROR_ALLTXBUSY;
 }
 
-MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
+/*
+ * Turn the SIDH..DLC bytes of a receive buffer into a can_id, including the
+ * EFF and RTR flags. RTR comes from SIDL.SRR for standard frames and DLC.RTR
+ * for extended frames, which saves reading RXBnCTRL.RXRTR.
+ */
+uint32_t MCP2515::decodeId(const uint8_t *tbufdata)
 {
-    const struct RXBn_REGS *rxb = &RXB[rxbn];
-
-    uint8_t tbufdata[5];
-
-    readRegisters(rxb->SIDH, tbufdata, 5);
-
     uint32_t id = (tbufdata[MCP_SIDH]<<3) + (tbufdata[MCP_SIDL]>>5);
+    bool rtr;
 
     if ( (tbufdata[MCP_SIDL] & TXB_EXIDE_MASK) ==  TXB_EXIDE_MASK ) {
         id = (id<<2) + (tbufdata[MCP_SIDL] & 0x03);
         id = (id<<8) + tbufdata[MCP_EID8];
         id = (id<<8) + tbufdata[MCP_EID0];
         id |= CAN_EFF_FLAG;
+        rtr = tbufdata[MCP_DLC] & RTR_MASK;
+    } else {
+        rtr = tbufdata[MCP_SIDL] & RXBnSIDL_SRR;
+    }
+
+    if (rtr) {
+        id |= CAN_RTR_FLAG;
     }
 
+    return id;
+}
+
+MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
+{
+    const struct RXBn_REGS *rxb = &RXB[rxbn];
+
+    this->rxPending &= ~rxb->RXSTAT_RXBn;
+
+    /*
+     * READ RX BUFFER reads from RXBnSIDH onward in one transaction and clears
+     * RXnIF for us when CS goes high.
+     */
+    startSPI();
+
+    uint8_t instruction = rxb->READ;
+    spi_write_blocking(this->SPI_CHANNEL, &instruction, 1);
+
+    uint8_t tbufdata[5];
+    spi_read_blocking(this->SPI_CHANNEL, 0x00, tbufdata, 5);
+
     uint8_t dlc = (tbufdata[MCP_DLC] & DLC_MASK);
     if (dlc > CAN_MAX_DLEN) {
+        endSPI();
         return ERROR_FAIL;
     }
 
-    uint8_t ctrl = readRegister(rxb->CTRL);
-    if (ctrl & RXBnCTRL_RTR) {
-        id |= CAN_RTR_FLAG;
-    }
-
-    frame->can_id = id;
+    frame->can_id = decodeId(tbufdata);
     frame->can_dlc = dlc;
 
-    readRegisters(rxb->DATA, frame->data, dlc);
+    spi_read_blocking(this->SPI_CHANNEL, 0x00, frame->data, dlc);
 
-    modifyRegister(MCP_CANINTF, rxb->CANINTF_RXnIF, 0);
+    endSPI();
 
     return ERROR_OK;
 }
@@ -711,11 +922,19 @@ MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
 MCP2515::ERROR MCP2515::readMessage(struct can_frame *frame)
 {
     ERROR rc;
-    uint8_t stat = getStatus();
 
-    if ( stat & STAT_RX0IF ) {
+    /*
+     * A buffer stays full until we read it, so if the last RX STATUS said both
+     * were full we can go straight to RXB1 after reading RXB0.
+     */
+    this->rxPending &= ~this->dmaRxQueued;
+    if ( this->rxPending == 0 ) {
+        this->rxPending = getRxStatus() & RXSTAT_MASK & ~this->dmaRxQueued;
+    }
+
+    if ( this->rxPending & RXSTAT_RXB0 ) {
         rc = readMessage(RXB0, frame);
-    } else if ( stat & STAT_RX1IF ) {
+    } else if ( this->rxPending & RXSTAT_RXB1 ) {
         rc = readMessage(RXB1, frame);
     } else {
         rc = ERROR_NOMSG;
@@ -808,4 +1027,173 @@ uint8_t MCP2515::errorCountRX(void)
 uint8_t MCP2515::errorCountTX(void)                             
 {
     return readRegister(MCP_TEC);
-}
\ No newline at end of file
+}
+
+void MCP2515::setInterruptPin(const uint8_t pin)
+{
+    this->INT_PIN = pin;
+    gpio_init(this->INT_PIN);
+    gpio_set_dir(this->INT_PIN, GPIO_IN);
+    gpio_pull_up(this->INT_PIN);
+}
+
+/*
+ * INT stays low for as long as any enabled flag in CANINTF is set, so we only
+ * listen for the falling edge. The handler must call acknowledgeInterrupt() and
+ * then read until both receive buffers are empty, otherwise INT never goes high
+ * again and no further edges will be seen.
+ */
+void MCP2515::enableInterrupt(irq_handler_t handler)
+{
+    gpio_add_raw_irq_handler(this->INT_PIN, handler);
+    gpio_set_irq_enabled(this->INT_PIN, GPIO_IRQ_EDGE_FALL, true);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+/*
+ * The raw GPIO IRQ is shared by every pin in the bank. Return true (and clear
+ * the event) only if it was our INT line that fired.
+ */
+bool MCP2515::acknowledgeInterrupt(void)
+{
+    if (this->INT_PIN == NO_INT_PIN) {
+        return false;
+    }
+
+    if (gpio_get_irq_event_mask(this->INT_PIN) & GPIO_IRQ_EDGE_FALL) {
+        gpio_acknowledge_irq(this->INT_PIN, GPIO_IRQ_EDGE_FALL);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Check the level of INT without touching the SPI bus. If no INT pin has been
+ * configured we can't tell, so report that something may be pending.
+ */
+bool MCP2515::interruptPending(void)
+{
+    if (this->INT_PIN == NO_INT_PIN) {
+        return true;
+    }
+
+    return gpio_get(this->INT_PIN) == 0;
+}
+
+/*
+ * Call once the receive buffers have been read. If INT is still low, it's
+ * being held there by ERRIF or MERRF, which nothing else clears. Clear them so
+ * INT goes high, the next frame gives a fresh edge and the poll goes back to
+ * not touching the SPI bus. Without an INT pin there's no edge to miss, so
+ * don't spend the SPI time.
+ */
+void MCP2515::releaseInterrupt(void)
+{
+    if (this->INT_PIN == NO_INT_PIN || ! interruptPending()) {
+        return;
+    }
+
+    clearERRIF();
+    clearMERR();
+}
+
+
+//
+// DMA
+//
+
+/*
+ * Switch frame transfers over to DMA. sendMessage() then queues the frame and
+ * returns straight away, and queueReadMessages() can be used in place of
+ * readMessage(). Received frames are handed to the callback from the DMA IRQ.
+ * Register access keeps using blocking transfers.
+ */
+MCP2515::ERROR MCP2515::enableDMA(can_frame_callback_t callback)
+{
+    if (!bus->enableDMA()) {
+        return ERROR_FAILINIT;
+    }
+
+    this->dmaCallback = callback;
+    this->dmaMode = true;
+
+    return ERROR_OK;
+}
+
+/*
+ * Queue a DMA read of every receive buffer which is full and not already being
+ * read. READ RX BUFFER clears RXnIF when CS goes high at the end of the read.
+ */
+MCP2515::ERROR MCP2515::queueReadMessages(void)
+{
+    uint8_t full = getRxStatus() & RXSTAT_MASK & ~this->dmaRxQueued;
+    if (full == 0) {
+        return ERROR_NOMSG;
+    }
+
+    for (int i=0; i<N_RXBUFFERS; i++) {
+        const struct RXBn_REGS *rxb = &RXB[i];
+        if (full & rxb->RXSTAT_RXBn) {
+            uint8_t tx[RX_READ_LEN];
+            memset(tx, 0, sizeof(tx));
+            tx[0] = rxb->READ;
+            ERROR rc = queueDMA(tx, RX_READ_LEN, rxb->RXSTAT_RXBn, 0, 0);
+            if (rc != ERROR_OK) {
+                return rc;
+            }
+        }
+    }
+
+    return ERROR_OK;
+}
+
+bool MCP2515::dmaIdle(void)
+{
+    return bus->idle();
+}
+
+MCP2515::ERROR MCP2515::queueDMA(const uint8_t *tx, const uint8_t len, const uint8_t rxbn, const uint8_t txbn, const uint8_t rts)
+{
+    if (!bus->queue(this, tx, len, rts, (rxbn << 8) | txbn)) {
+        return ERROR_QUEUEFULL;
+    }
+    return ERROR_OK;
+}
+
+/*
+ * Called by the bus with the bus locked, as a job is queued and as it
+ * completes. The tag carries the RXSTAT bit of the buffer being read in the
+ * high byte, and the STAT_TXnREQ bit of the buffer being sent in the low byte.
+ */
+void MCP2515::dmaQueued(SPIJob *job)
+{
+    this->dmaRxQueued |= job->tag >> 8;
+    this->dmaTxQueued |= job->tag & 0xFF;
+}
+
+void MCP2515::dmaComplete(SPIJob *job)
+{
+    this->dmaRxQueued &= ~(job->tag >> 8);
+    this->dmaTxQueued &= ~(job->tag & 0xFF);
+}
+
+void MCP2515::dmaDispatch(SPIJob *job)
+{
+    if (job->tag >> 8) {
+        // rx[0] is the byte clocked in while the instruction went out
+        const uint8_t *tbufdata = &job->rx[1];
+        uint8_t dlc = (tbufdata[MCP_DLC] & DLC_MASK);
+        if (dlc <= CAN_MAX_DLEN && this->dmaCallback) {
+            struct can_frame frame;
+            frame.can_id = decodeId(tbufdata);
+            frame.can_dlc = dlc;
+            memcpy(frame.data, &tbufdata[MCP_DATA], dlc);
+            this->dmaCallback(&frame);
+        }
+    }
+
+    // If another frame landed while we were reading, INT never went high and
+    // there won't be an edge for it. It's still low, so the RX poll queues
+    // the read. Asking for RX STATUS from here would take the bus, with
+    // interrupts off, for a blocking transaction inside the DMA IRQ.
+}
@@ -4,10 +4,13 @@
 #include "can.h"
 
 #include "hardware/spi.h"
+#include "hardware/irq.h"
 #include "pico/time.h"
 #include "pico/stdlib.h"
 #include "boards/pico.h"
 
+#include "spibus.h"
+
 /*
  *  Speed 8M
  */
@@ -207,7 +210,9 @@ enum CAN_CLKOUT {
 };
 
 
-class MCP2515 {
+typedef void (*can_frame_callback_t)(struct can_frame *frame);
+
+class MCP2515 : public SPIDevice {
     public:
         enum ERROR {
             ERROR_OK        = 0,
@@ -215,7 +220,8 @@ class MCP2515 {
             ERROR_ALLTXBUSY = 2,
             ERROR_FAILINIT  = 3,
             ERROR_FAILTX    = 4,
-            ERROR_NOMSG     = 5
+            ERROR_NOMSG     = 5,
+            ERROR_QUEUEFULL = 6
         };
 
         enum MASK {
@@ -309,12 +315,27 @@ class MCP2515 {
         static const uint8_t MCP_DATA = 5;
 
         enum /*class*/ STAT : uint8_t {
-            STAT_RX0IF = (1<<0),
-            STAT_RX1IF = (1<<1)
+            STAT_RX0IF  = (1<<0),
+            STAT_RX1IF  = (1<<1),
+            STAT_TX0REQ = (1<<2),
+            STAT_TX0IF  = (1<<3),
+            STAT_TX1REQ = (1<<4),
+            STAT_TX1IF  = (1<<5),
+            STAT_TX2REQ = (1<<6),
+            STAT_TX2IF  = (1<<7)
         };
 
         static const uint8_t STAT_RXIF_MASK = STAT_RX0IF | STAT_RX1IF;
 
+        enum /*class*/ RXSTAT : uint8_t {
+            RXSTAT_RXB0 = (1<<6),
+            RXSTAT_RXB1 = (1<<7)
+        };
+
+        static const uint8_t RXSTAT_MASK = RXSTAT_RXB0 | RXSTAT_RXB1;
+
+        static const uint8_t RXBnSIDL_SRR = 0x10;
+
         enum /*class*/ TXBnCTRL : uint8_t {
             TXB_ABTF   = 0x40,
             TXB_MLOA   = 0x20,
@@ -428,8 +449,6 @@ class MCP2515 {
             MCP_RXB1DATA = 0x76
         };
 
-        static const uint32_t DEFAULT_SPI_CLOCK = 10000000; // 10MHz
-
         static const int N_TXBUFFERS = 3;
         static const int N_RXBUFFERS = 2;
 
@@ -437,6 +456,10 @@ class MCP2515 {
             REGISTER CTRL;
             REGISTER SIDH;
             REGISTER DATA;
+            INSTRUCTION LOAD;
+            INSTRUCTION RTS;
+            STAT STAT_TXREQ;
+            CANINTF CANINTF_TXnIF;
         } TXB[N_TXBUFFERS];
 
         static const struct RXBn_REGS {
@@ -444,16 +467,41 @@ class MCP2515 {
             REGISTER SIDH;
             REGISTER DATA;
             CANINTF  CANINTF_RXnIF;
+            INSTRUCTION READ;
+            RXSTAT RXSTAT_RXBn;
         } RXB[N_RXBUFFERS];
 
+        static const uint8_t NO_INT_PIN = 0xFF;
+
         spi_inst_t* SPI_CHANNEL;
-        uint8_t SPI_CS_PIN;
 
     private:
 
+        // Driver state: the INT line, what's known to be waiting in the
+        // controller, and the DMA transfers queued on the bus
+        uint8_t INT_PIN;
+
+        // Receive buffers known to be full from the last RX STATUS
+        uint8_t rxPending;
+
+        // CANINTF_TXnIF bits of buffers sent by sendMessages() and not yet seen to complete
+        uint8_t txInFlight;
+
+        static const uint8_t RX_READ_LEN = 14; // READ RX BUFFER + SIDH..D7
+
+        bool dmaMode;
+        can_frame_callback_t dmaCallback;
+        volatile uint8_t dmaRxQueued;  // RXSTAT bits of reads queued or in flight
+        volatile uint8_t dmaTxQueued;  // STAT_TXnREQ bits of sends queued or in flight
+
         inline void startSPI();
         inline void endSPI();
 
+        void dmaQueued(SPIJob *job);
+        void dmaComplete(SPIJob *job);
+        void dmaDispatch(SPIJob *job);
+        ERROR queueDMA(const uint8_t *tx, const uint8_t len, const uint8_t rxbn, const uint8_t txbn, const uint8_t rts);
+
         ERROR setMode(const CANCTRL_REQOP_MODE mode);
 
         uint8_t readRegister(const REGISTER reg);
@@ -463,15 +511,15 @@ class MCP2515 {
         void modifyRegister(const REGISTER reg, const uint8_t mask, const uint8_t data);
 
         void prepareId(uint8_t *buffer, const bool ext, const uint32_t id);
+
+        uint8_t getRxStatus(void);
+        uint32_t decodeId(const uint8_t *tbufdata);
     
     public:
         MCP2515(
-            spi_inst_t* CHANNEL = spi0,
+            SPIBus *bus,
             uint8_t CS_PIN = PICO_DEFAULT_SPI_CSN_PIN,
-            uint8_t TX_PIN = PICO_DEFAULT_SPI_TX_PIN,
-            uint8_t RX_PIN = PICO_DEFAULT_SPI_RX_PIN,
-            uint8_t SCK_PIN = PICO_DEFAULT_SPI_SCK_PIN,
-            uint32_t _SPI_CLOCK = DEFAULT_SPI_CLOCK
+            PRIORITY priority = PRIORITY_NORMAL
         );
         ERROR reset(void);
         ERROR setConfigMode();
@@ -484,8 +532,11 @@ class MCP2515 {
         ERROR setBitrate(const CAN_SPEED canSpeed, const CAN_CLOCK canClock);
         ERROR setFilterMask(const MASK num, const bool ext, const uint32_t ulData);
         ERROR setFilter(const RXF num, const bool ext, const uint32_t ulData);
+        ERROR setAcceptanceFilters(const uint32_t ids[], const uint8_t n);
         ERROR sendMessage(const TXBn txbn, const struct can_frame *frame);
         ERROR sendMessage(const struct can_frame *frame);
+        ERROR sendMessages(const struct can_frame *frames[], const uint8_t n);
+        uint8_t checkTransmitted(void);
         ERROR readMessage(const RXBn rxbn, struct can_frame *frame);
         ERROR readMessage(struct can_frame *frame);
         bool checkReceive(void);
@@ -502,6 +553,14 @@ class MCP2515 {
         void clearERRIF();
         uint8_t errorCountRX(void);
         uint8_t errorCountTX(void);
+        void setInterruptPin(const uint8_t pin);
+        void enableInterrupt(irq_handler_t handler);
+        bool acknowledgeInterrupt(void);
+        bool interruptPending(void);
+        void releaseInterrupt(void);
+        ERROR enableDMA(can_frame_callback_t callback);
+        ERROR queueReadMessages(void);
+        bool dmaIdle(void);
 };
 
 #endif
\ No newline at end of file
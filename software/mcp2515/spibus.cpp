@@ -0,0 +1,268 @@
+#include <cstring>
+#include "spibus.h"
+
+SPIBus *SPIBus::dmaBus = NULL;
+
+static void recordWait(SPIDevice::STATS *stats, const uint32_t wait)
+{
+    stats->transactions++;
+    stats->waitTotal += wait;
+    if (wait > stats->waitMax) {
+        stats->waitMax = wait;
+    }
+}
+
+SPIDevice::SPIDevice(SPIBus *bus, uint8_t csPin, PRIORITY priority)
+{
+    this->bus = bus;
+    this->csPin = csPin;
+    this->priority = priority;
+    memset(&this->busStats, 0, sizeof(this->busStats));
+
+    gpio_init(this->csPin);
+    gpio_set_dir(this->csPin, GPIO_OUT);
+    deselect();
+}
+
+SPIBus::SPIBus(spi_inst_t* CHANNEL, uint8_t TX_PIN, uint8_t RX_PIN, uint8_t SCK_PIN, uint32_t SPI_CLOCK)
+{
+    this->channel = CHANNEL;
+    spi_init(this->channel, SPI_CLOCK);
+    gpio_set_function(TX_PIN, GPIO_FUNC_SPI);
+    gpio_set_function(RX_PIN, GPIO_FUNC_SPI);
+    gpio_set_function(SCK_PIN, GPIO_FUNC_SPI);
+    spi_set_format(this->channel, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+
+    this->lock = spin_lock_init(spin_lock_claim_unused(true));
+    this->lockInterrupts = 0;
+
+    for (int p=0; p<SPIDevice::N_PRIORITIES; p++) {
+        this->queues[p].done = 0;
+        this->queues[p].head = 0;
+        this->queues[p].tail = 0;
+    }
+    this->active = NONE;
+    this->dma = false;
+    this->txChannel = 0;
+    this->rxChannel = 0;
+}
+
+spi_inst_t *SPIBus::getChannel(void)
+{
+    return this->channel;
+}
+
+/*
+ * Take the bus for a blocking transaction and select the device. We can't
+ * wait for the DMA IRQ to finish off a transfer in flight, as we may be
+ * running in an IRQ of the same priority, so poll the channel instead.
+ */
+void SPIBus::acquire(SPIDevice *device)
+{
+    uint32_t start = time_us_32();
+    uint32_t interrupts = spin_lock_blocking(this->lock);
+
+    while (this->active != NONE) {
+        if (!dma_channel_is_busy(this->rxChannel)) {
+            complete();
+        }
+    }
+
+    this->lockInterrupts = interrupts;
+    recordWait(&device->busStats, time_us_32() - start);
+
+    device->select();
+}
+
+void SPIBus::release(SPIDevice *device)
+{
+    device->deselect();
+    startNext();
+    spin_unlock(this->lock, this->lockInterrupts);
+}
+
+bool SPIBus::enableDMA(void)
+{
+    if (dmaBus != NULL) {
+        return dmaBus == this;
+    }
+
+    this->txChannel = dma_claim_unused_channel(true);
+    this->rxChannel = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(this->txChannel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_dreq(&c, spi_get_dreq(this->channel, true));
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    dma_channel_configure(this->txChannel, &c, &spi_get_hw(this->channel)->dr, NULL, 0, false);
+
+    c = dma_channel_get_default_config(this->rxChannel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_dreq(&c, spi_get_dreq(this->channel, false));
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    dma_channel_configure(this->rxChannel, &c, NULL, &spi_get_hw(this->channel)->dr, 0, false);
+
+    dmaBus = this;
+    this->dma = true;
+
+    // The RX channel finishes last, so its completion marks the end of a transfer
+    dma_channel_set_irq0_enabled(this->rxChannel, true);
+    irq_add_shared_handler(DMA_IRQ_0, dmaIRQHandler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_0, true);
+
+    return true;
+}
+
+bool SPIBus::dmaEnabled(void)
+{
+    return this->dma;
+}
+
+/*
+ * Queue a DMA transfer for the device. Returns false if DMA isn't enabled or
+ * the device's priority queue is full. Slots stay in use until the device has
+ * had the job back through dmaDispatch().
+ */
+bool SPIBus::queue(SPIDevice *device, const uint8_t *tx, const uint8_t len, const uint8_t followUp, const uint16_t tag)
+{
+    if (!this->dma || len > SPIJob::BUFFER_SIZE) {
+        return false;
+    }
+
+    uint32_t interrupts = spin_lock_blocking(this->lock);
+
+    QUEUE *q = &this->queues[device->priority];
+    uint8_t next = (q->tail + 1) % N_JOBS;
+    if (next == q->done) {
+        spin_unlock(this->lock, interrupts);
+        return false;
+    }
+
+    SPIJob *job = &q->jobs[q->tail];
+    job->device = device;
+    memcpy(job->tx, tx, len);
+    job->len = len;
+    job->followUp = followUp;
+    job->tag = tag;
+    job->queuedAt = time_us_32();
+    device->dmaQueued(job);
+
+    device->busStats.queued++;
+    if (device->busStats.queued > device->busStats.maxQueued) {
+        device->busStats.maxQueued = device->busStats.queued;
+    }
+
+    q->tail = next;
+
+    startNext();
+
+    spin_unlock(this->lock, interrupts);
+
+    return true;
+}
+
+bool SPIBus::idle(void)
+{
+    if (this->active != NONE) {
+        return false;
+    }
+    for (int p=0; p<SPIDevice::N_PRIORITIES; p++) {
+        if (this->queues[p].head != this->queues[p].tail) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Call with the bus locked
+void SPIBus::startNext(void)
+{
+    if (this->active != NONE) {
+        return;
+    }
+
+    for (int8_t p=0; p<SPIDevice::N_PRIORITIES; p++) {
+        QUEUE *q = &this->queues[p];
+        if (q->head == q->tail) {
+            continue;
+        }
+
+        SPIJob *job = &q->jobs[q->head];
+        recordWait(&job->device->busStats, time_us_32() - job->queuedAt);
+
+        this->active = p;
+        job->device->select();
+
+        dma_channel_set_write_addr(this->rxChannel, job->rx, false);
+        dma_channel_set_trans_count(this->rxChannel, job->len, false);
+        dma_channel_set_read_addr(this->txChannel, job->tx, false);
+        dma_channel_set_trans_count(this->txChannel, job->len, false);
+
+        // Start both together so the RX channel can't miss a byte
+        dma_start_channel_mask((1u << this->txChannel) | (1u << this->rxChannel));
+        return;
+    }
+}
+
+// Call with the bus locked, once the RX channel is done
+void SPIBus::complete(void)
+{
+    QUEUE *q = &this->queues[this->active];
+    SPIJob *job = &q->jobs[q->head];
+    SPIDevice *device = job->device;
+
+    device->deselect();
+
+    if (job->followUp) {
+        device->select();
+        spi_write_blocking(this->channel, &job->followUp, 1);
+        device->deselect();
+    }
+
+    device->dmaComplete(job);
+
+    q->head = (q->head + 1) % N_JOBS;
+    this->active = NONE;
+}
+
+// Hand completed jobs back to their devices, high priority first
+void SPIBus::dispatch(void)
+{
+    for (int p=0; p<SPIDevice::N_PRIORITIES; p++) {
+        QUEUE *q = &this->queues[p];
+        while (q->done != q->head) {
+            SPIJob *job = &q->jobs[q->done];
+            SPIDevice *device = job->device;
+
+            device->dmaDispatch(job);
+
+            uint32_t interrupts = spin_lock_blocking(this->lock);
+            device->busStats.queued--;
+            q->done = (q->done + 1) % N_JOBS;
+            spin_unlock(this->lock, interrupts);
+        }
+    }
+}
+
+void SPIBus::dmaIRQHandler(void)
+{
+    SPIBus *bus = dmaBus;
+
+    if (!dma_channel_get_irq0_status(bus->rxChannel)) {
+        return;
+    }
+    dma_channel_acknowledge_irq0(bus->rxChannel);
+
+    // The transfer may already have been finished off by acquire()
+    uint32_t interrupts = spin_lock_blocking(bus->lock);
+    if (bus->active != NONE && !dma_channel_is_busy(bus->rxChannel)) {
+        bus->complete();
+    }
+    // Get the bus busy again before we spend time on the results
+    bus->startNext();
+    spin_unlock(bus->lock, interrupts);
+
+    bus->dispatch();
+}
@@ -0,0 +1,150 @@
+#ifndef _SPIBUS_H_
+#define _SPIBUS_H_
+
+#include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
+#include "hardware/irq.h"
+#include "pico/stdlib.h"
+#include "boards/pico.h"
+
+class SPIBus;
+class SPIDevice;
+
+/*
+ * A DMA transfer queued on an SPIBus. tx is clocked out with CS held low and
+ * whatever comes back lands in rx.
+ */
+struct SPIJob {
+    static const uint8_t BUFFER_SIZE = 16;
+
+    SPIDevice *device;
+    uint8_t tx[BUFFER_SIZE];
+    uint8_t rx[BUFFER_SIZE];
+    uint8_t len;
+    uint8_t followUp;   // one byte command sent in a transaction of its own once the transfer is done, 0 for none
+    uint16_t tag;       // for the device's own use
+    uint32_t queuedAt;  // us
+};
+
+/*
+ * Anything with a chip select on an SPIBus. Drivers derive from this and
+ * bracket every blocking transaction with bus->acquire() / bus->release().
+ */
+class SPIDevice {
+    friend class SPIBus;
+
+    public:
+        enum PRIORITY : uint8_t {
+            PRIORITY_HIGH   = 0,
+            PRIORITY_NORMAL = 1,
+            N_PRIORITIES    = 2
+        };
+
+        struct STATS {
+            uint32_t transactions; // blocking and DMA
+            uint32_t waitTotal;    // us spent waiting for the bus
+            uint32_t waitMax;      // us
+            uint8_t queued;        // DMA transfers not yet handed back to the device
+            uint8_t maxQueued;
+        };
+
+        STATS busStats;
+
+    protected:
+        SPIBus *bus;
+        uint8_t csPin;
+        PRIORITY priority;
+
+        SPIDevice(SPIBus *bus, uint8_t csPin, PRIORITY priority);
+
+        inline void select();
+        inline void deselect();
+
+        /*
+         * DMA hooks. dmaQueued() and dmaComplete() are called with the bus
+         * locked and must not touch it. dmaDispatch() is called from the DMA
+         * IRQ once the bus has moved on. It may queue new transfers, but not
+         * block on the bus.
+         */
+        virtual void dmaQueued(SPIJob *job) {}
+        virtual void dmaComplete(SPIJob *job) {}
+        virtual void dmaDispatch(SPIJob *job) {}
+};
+
+inline void SPIDevice::select() {
+    asm volatile("nop \n nop \n nop");
+    gpio_put(this->csPin, 0);
+    asm volatile("nop \n nop \n nop");
+}
+
+inline void SPIDevice::deselect() {
+    asm volatile("nop \n nop \n nop");
+    gpio_put(this->csPin, 1);
+    asm volatile("nop \n nop \n nop");
+}
+
+/*
+ * Arbiter for an SPI port shared by several devices.
+ *
+ * Blocking transactions take a hardware spinlock with interrupts disabled,
+ * so no timer, GPIO or DMA IRQ on either core can interleave its own chip
+ * select sequence with ours. Any DMA transfer in flight is finished off first.
+ *
+ * DMA transfers are queued per priority. When the bus comes free the oldest
+ * PRIORITY_HIGH transfer goes next, ahead of any PRIORITY_NORMAL ones.
+ * Blocking transactions are served in the order they reach the lock, whatever
+ * the priority of the device.
+ */
+class SPIBus {
+    public:
+        SPIBus(
+            spi_inst_t* CHANNEL = spi0,
+            uint8_t TX_PIN = PICO_DEFAULT_SPI_TX_PIN,
+            uint8_t RX_PIN = PICO_DEFAULT_SPI_RX_PIN,
+            uint8_t SCK_PIN = PICO_DEFAULT_SPI_SCK_PIN,
+            uint32_t SPI_CLOCK = 10000000
+        );
+
+        spi_inst_t *getChannel(void);
+
+        void acquire(SPIDevice *device);
+        void release(SPIDevice *device);
+
+        bool enableDMA(void);
+        bool dmaEnabled(void);
+        bool queue(SPIDevice *device, const uint8_t *tx, const uint8_t len, const uint8_t followUp, const uint16_t tag);
+        bool idle(void);
+
+    private:
+        static const int N_JOBS = 8; // per priority
+
+        struct QUEUE {
+            SPIJob jobs[N_JOBS];
+            volatile uint8_t done;  // next completed job to hand back to its device
+            volatile uint8_t head;  // job in flight, or next to start
+            volatile uint8_t tail;  // next free slot
+        };
+
+        static const int8_t NONE = -1;
+
+        spi_inst_t *channel;
+        spin_lock_t *lock;
+        uint32_t lockInterrupts;
+
+        QUEUE queues[SPIDevice::N_PRIORITIES];
+        volatile int8_t active;  // queue with a transfer in flight, or NONE
+        bool dma;
+        uint txChannel;
+        uint rxChannel;
+
+        // The bus served by the DMA IRQ handler
+        static SPIBus *dmaBus;
+
+        void startNext(void);
+        void complete(void);
+        void dispatch(void);
+        static void dmaIRQHandler(void);
+};
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+extern "C" {
+#include "settings.h"
+#include "hal.h"
+#include "scheduler.h"
+#include "battery.h"
+#include "station.h"
+#include "led.h"
+#include "chademo.h"
+#include "statemachine.h"
+#include "chademocomms.h"
+}
+
+#include "charger.h"
+#include "comms.h"
+#include "canhealth.h"
+
+/*
+ * Cooperative scheduler. Each core that runs tasks has a single repeating
+ * timer ticking every SCHEDULER_TICK ms, and on each tick it runs whichever of
+ * its tasks are due, one after the other, to completion. So there's one alarm
+ * IRQ per core rather than one per task, and no task can preempt another.
+ *
+ * A task is released every period ms, offset by its phase. The phases are
+ * staggered so that tasks with the same period don't all touch the SPI bus on
+ * the same tick. A task that starts a whole period or more late has missed a
+ * deadline. We count it and skip the releases it missed, keeping to its phase.
+ */
+
+typedef struct {
+    uint32_t runs;
+    uint32_t deadlineMisses;
+    uint32_t maxLateness;   // ms
+    uint64_t runTime;       // us, in total
+    uint32_t maxRunTime;    // us
+} TaskStats;
+
+typedef struct {
+    const char *name;
+    void (*run)();
+    uint16_t period;        // ms
+    uint16_t phase;         // ms
+    uint8_t core;
+    volatile bool enabled;
+    uint32_t nextDue;       // ms since boot
+    TaskStats stats;
+} Task;
+
+// The CAN controllers are serviced from whichever core owns them
+#define CAN_CORE CAN_DUAL_CORE
+
+static Task tasks[N_TASKS] = {
+    [TASK_MAIN_CAN_RX]      = { "main CAN rx",      handle_main_CAN_message,     CAN_RX_POLL_INTERVAL,            0,   CAN_CORE },
+    [TASK_CHADEMO_CAN_RX]   = { "ChaDeMo CAN rx",   handle_chademo_CAN_messages, CAN_RX_POLL_INTERVAL,            5,   CAN_CORE },
+    [TASK_CHADEMO_OUTBOUND] = { "ChaDeMo outbound", send_outbound_CAN_messages,  CHADEMO_OUTBOUND_RETRY_INTERVAL, 2,   CAN_CORE },
+    [TASK_CAN_HEALTH]       = { "CAN health",       handle_CAN_health_check,     CAN_HEALTH_INTERVAL,             7,   CAN_CORE },
+    [TASK_LED]              = { "LED",              led_blink,                   100,                             1,   0 },
+    [TASK_BMS_LIVENESS]     = { "BMS liveness",     bms_liveness_check,          1000,                            3,   0 },
+    [TASK_STATION_LIVENESS] = { "station liveness", station_liveness_check,      1000,                            503, 0 },
+    [TASK_WATCHDOG]         = { "watchdog",         watchdog_keepalive,          5000,                            9,   0 },
+    [TASK_STATE_DEADLINE]   = { "state deadline",   check_state_deadline,        STATE_DEADLINE_CHECK_INTERVAL,   11,  0 },
+    [TASK_CURRENT_CONTROL]  = { "current control",  current_control_tick,        CHADEMO_CONTROL_INTERVAL,        13,  0 }
+};
+
+// A tick marks the tasks it releases in a bitmap
+static_assert(N_TASKS <= 32, "too many tasks for the release bitmap");
+
+static uint32_t schedulerStarted;  // ms since boot
+
+// Either core can enable or disable a task while the other is ticking
+static HALLock *taskLock;
+
+static uint32_t now_ms() {
+    return (uint32_t)( hal_time_us() / 1000 );
+}
+
+static void scheduler_tick() {
+
+    uint8_t core = hal_core_num();
+    uint32_t now = now_ms();
+    uint32_t due = 0;
+
+    // Release what's due under the lock, then run it without
+    hal_lock_enter(taskLock);
+    for ( int i = 0; i < N_TASKS; i++ ) {
+
+        Task *task = &tasks[i];
+
+        if ( task->core != core || ! task->enabled ) {
+            continue;
+        }
+
+        int32_t late = (int32_t)( now - task->nextDue );
+        if ( late < 0 ) {
+            continue;
+        }
+
+        if ( (uint32_t)late > task->stats.maxLateness ) {
+            task->stats.maxLateness = late;
+        }
+        if ( late >= task->period ) {
+            task->stats.deadlineMisses++;
+            task->nextDue += ( late / task->period ) * task->period;
+        }
+        task->nextDue += task->period;
+        due |= 1u << i;
+    }
+    hal_lock_exit(taskLock);
+
+    for ( int i = 0; i < N_TASKS; i++ ) {
+
+        Task *task = &tasks[i];
+
+        // One run earlier in the tick may have disabled another
+        if ( ! ( due & ( 1u << i ) ) || ! task->enabled ) {
+            continue;
+        }
+
+        uint64_t start = hal_time_us();
+        task->run();
+        uint32_t runTime = (uint32_t)( hal_time_us() - start );
+
+        task->stats.runs++;
+        task->stats.runTime += runTime;
+        if ( runTime > task->stats.maxRunTime ) {
+            task->stats.maxRunTime = runTime;
+        }
+    }
+}
+
+// Call once at startup, before any task is enabled
+void init_scheduler() {
+    taskLock = hal_lock_create();
+}
+
+/*
+ * Start ticking on the calling core, using the given alarm pool, or the
+ * default one if pool is NULL. Tasks for this core run once they're enabled.
+ */
+void start_scheduler(HALAlarmPool *pool) {
+    if ( schedulerStarted == 0 ) {
+        schedulerStarted = now_ms();
+    }
+    hal_start_ticker(pool, SCHEDULER_TICK, scheduler_tick);
+}
+
+/*
+ * Start running a task from its next release. Can be called from either core,
+ * and does nothing if the task is already running.
+ */
+void enable_task(TaskId id) {
+    Task *task = &tasks[id];
+    hal_lock_enter(taskLock);
+    if ( ! task->enabled ) {
+        uint32_t now = now_ms();
+        task->nextDue = now + ( task->phase + task->period - now % task->period ) % task->period;
+        task->enabled = true;
+    }
+    hal_lock_exit(taskLock);
+}
+
+void disable_task(TaskId id) {
+    hal_lock_enter(taskLock);
+    tasks[id].enabled = false;
+    hal_lock_exit(taskLock);
+}
+
+bool task_enabled(TaskId id) {
+    return tasks[id].enabled;
+}
+
+void print_scheduler_stats() {
+    uint32_t elapsed = now_ms() - schedulerStarted;
+    printf("Task              period phase core state      runs  missed late(ms)  avg(us)  max(us)  cpu(%%)\n");
+    for ( int i = 0; i < N_TASKS; i++ ) {
+        const Task *task = &tasks[i];
+        const TaskStats *stats = &task->stats;
+        printf("%-17s %6u %5u %4u %-5s %9lu %7lu %8lu %8lu %8lu  %6.2f\n",
+            task->name, task->period, task->phase, task->core,
+            task->enabled ? "on" : "off", (unsigned long)stats->runs,
+            (unsigned long)stats->deadlineMisses, (unsigned long)stats->maxLateness,
+            (unsigned long)( stats->runs ? stats->runTime / stats->runs : 0 ),
+            (unsigned long)stats->maxRunTime,
+            elapsed ? stats->runTime / ( elapsed * 10.0 ) : 0.0);
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+
+#include "hal.h"
+
+// Everything that runs periodically. The table itself is in scheduler.cpp.
+typedef enum {
+    TASK_MAIN_CAN_RX,
+    TASK_CHADEMO_CAN_RX,
+    TASK_CHADEMO_OUTBOUND,
+    TASK_CAN_HEALTH,
+    TASK_LED,
+    TASK_BMS_LIVENESS,
+    TASK_STATION_LIVENESS,
+    TASK_WATCHDOG,
+    TASK_STATE_DEADLINE,
+    TASK_CURRENT_CONTROL,
+    N_TASKS
+} TaskId;
+
+void init_scheduler();
+void start_scheduler(HALAlarmPool *pool);
+void enable_task(TaskId id);
+void disable_task(TaskId id);
+bool task_enabled(TaskId id);
+void print_scheduler_stats();
+
+#endif
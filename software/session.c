@@ -0,0 +1,214 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "session.h"
+#include "hal.h"
+#include "settings.h"
+#include "types.h"
+
+extern Chademo chademo;
+extern Station station;
+
+/*
+ * Session bookkeeping. The state machine tells us about every state change, and
+ * the ChaDeMo decode path samples us with each station status message, so this
+ * works the same whether the clock and the station are real or simulated.
+ */
+
+#define UJ_PER_WH 3600000000ULL
+
+static Session session;
+static Session lastSession;
+static SessionStats sessionStats;
+
+// Last sample, for integrating energy and checking the ramp rate
+static uint64_t lastSampleAt;
+static uint8_t lastCurrentRequest;
+static uint64_t lastCurrentRequestAt;
+
+static void count_abort_reason(const char *reason) {
+    for ( int i = 0; i < SESSION_MAX_ABORT_REASONS; i++ ) {
+        AbortReasonCount *entry = &sessionStats.abortReasons[i];
+        if ( entry->reason == NULL ) {
+            entry->reason = reason;
+        }
+        if ( entry->reason == reason ) {
+            entry->count++;
+            return;
+        }
+    }
+}
+
+static void start_session(uint64_t now) {
+    session = (Session) { .active = true, .startedAt = now };
+    lastSampleAt = now;
+    lastCurrentRequest = 0;
+    lastCurrentRequestAt = now;
+    sessionStats.sessions++;
+}
+
+static void end_session(uint64_t now) {
+
+    session.active = false;
+    session.endedAt = now;
+
+    if ( session.abortReason != NULL ) {
+        sessionStats.aborted++;
+        count_abort_reason(session.abortReason);
+    } else {
+        sessionStats.completed++;
+    }
+
+    if ( session.firstAmpAt != 0 ) {
+        uint64_t timeToFirstAmp = session.firstAmpAt - session.startedAt;
+        sessionStats.withCurrent++;
+        sessionStats.timeToFirstAmpTotal += timeToFirstAmp;
+        if ( timeToFirstAmp > sessionStats.timeToFirstAmpMax ) {
+            sessionStats.timeToFirstAmpMax = timeToFirstAmp;
+        }
+    }
+
+    sessionStats.energy += session.energy;
+    sessionStats.rampViolations += session.rampViolations;
+
+    lastSession = session;
+}
+
+/*
+ * Called by the state machine on every change of state. A session starts when
+ * the plug goes in and ends when we're back to idle. Reasons are the string
+ * literals from the transition table, so they can be compared by address.
+ */
+void session_state_changed(State state, const char *reason) {
+
+    uint64_t now = hal_time_us();
+
+    switch ( state ) {
+        case S_PLUG_IN:
+            if ( ! session.active ) {
+                start_session(now);
+            }
+            break;
+        case S_ERROR:
+            if ( session.active && session.abortReason == NULL ) {
+                session.abortReason = reason;
+            }
+            break;
+        case S_IDLE:
+            if ( session.active ) {
+                end_session(now);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Called with each station status message
+ */
+void session_sample() {
+
+    if ( ! session.active ) {
+        return;
+    }
+
+    uint64_t now = hal_time_us();
+
+    if ( station.outputCurrent > 0 && session.firstAmpAt == 0 ) {
+        session.firstAmpAt = now;
+    }
+    if ( station.outputCurrent > session.maxCurrent ) {
+        session.maxCurrent = station.outputCurrent;
+    }
+
+    // V x A x us is uJ, so this needs no division
+    session.energy += (uint64_t)( station.outputVoltage * station.outputCurrent ) * ( now - lastSampleAt );
+    lastSampleAt = now;
+
+    /*
+     * The request may move by CHADEMO_RAMP_RATE each CHADEMO_RAMP_INTERVAL,
+     * and by one whole step however soon after the last change.
+     */
+    if ( chademo.chargingCurrentRequest != lastCurrentRequest ) {
+        uint32_t elapsed = ( now - lastCurrentRequestAt ) / 1000;
+        uint32_t allowed = (uint32_t)CHADEMO_RAMP_RATE * elapsed / CHADEMO_RAMP_INTERVAL;
+        if ( allowed < CHADEMO_RAMP_RATE ) {
+            allowed = CHADEMO_RAMP_RATE;
+        }
+        if ( (uint32_t)abs(chademo.chargingCurrentRequest - lastCurrentRequest) > allowed ) {
+            session.rampViolations++;
+        }
+        lastCurrentRequest = chademo.chargingCurrentRequest;
+        lastCurrentRequestAt = now;
+    }
+}
+
+// The session in progress, if it's active
+const Session *get_current_session() {
+    return &session;
+}
+
+// The last session to end
+const Session *get_last_session() {
+    return &lastSession;
+}
+
+static void print_session(const char *label, const Session *s, uint64_t now) {
+    uint64_t end = s->active ? now : s->endedAt;
+    printf("%s : %s, %lu s, ", label, s->active ? "active" : "ended", (unsigned long)( ( end - s->startedAt ) / 1000000 ));
+    if ( s->firstAmpAt != 0 ) {
+        printf("first amp after %lu ms, ", (unsigned long)( ( s->firstAmpAt - s->startedAt ) / 1000 ));
+    } else {
+        printf("no current, ");
+    }
+    printf("%lu Wh, max %u A, ramp violations %u, abort %s\n",
+        (unsigned long)( s->energy / UJ_PER_WH ), s->maxCurrent, s->rampViolations, s->abortReason != NULL ? s->abortReason : "none");
+}
+
+void print_session_stats() {
+
+    uint64_t now = hal_time_us();
+
+    printf("Sessions : %lu, completed %lu, aborted %lu, energy %lu Wh, ramp violations %lu\n",
+        (unsigned long)sessionStats.sessions, (unsigned long)sessionStats.completed,
+        (unsigned long)sessionStats.aborted, (unsigned long)( sessionStats.energy / UJ_PER_WH ),
+        (unsigned long)sessionStats.rampViolations);
+
+    if ( sessionStats.withCurrent > 0 ) {
+        printf("           time to first amp avg %lu ms, max %lu ms\n",
+            (unsigned long)( sessionStats.timeToFirstAmpTotal / sessionStats.withCurrent / 1000 ),
+            (unsigned long)( sessionStats.timeToFirstAmpMax / 1000 ));
+    }
+
+    for ( int i = 0; i < SESSION_MAX_ABORT_REASONS && sessionStats.abortReasons[i].reason != NULL; i++ ) {
+        printf("           aborted %lu x %s\n",
+            (unsigned long)sessionStats.abortReasons[i].count, sessionStats.abortReasons[i].reason);
+    }
+
+    if ( session.active ) {
+        print_session("Current  ", &session, now);
+    }
+    if ( lastSession.startedAt != 0 ) {
+        print_session("Last     ", &lastSession, now);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the ev mustang charge controller project.
+ *
+ * Copyright (C) 2022 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "statemachine.h"
+
+#define SESSION_MAX_ABORT_REASONS 8
+
+/*
+ * What happened during one charging session, from plug in to plug out
+ */
+typedef struct {
+    bool active;
+    uint64_t startedAt;        // us
+    uint64_t endedAt;          // us
+    uint64_t firstAmpAt;       // us, 0 until the station delivers any current
+    uint64_t energy;           // uJ, as reported by the station, V x A
+    uint8_t maxCurrent;        // A, delivered
+    uint16_t rampViolations;   // Current request changed faster than CHADEMO_RAMP_RATE
+    const char *abortReason;   // Why we went to error, NULL if we didn't
+} Session;
+
+typedef struct {
+    const char *reason;
+    uint32_t count;
+} AbortReasonCount;
+
+/*
+ * Totals over every session since boot
+ */
+typedef struct {
+    uint32_t sessions;
+    uint32_t completed;
+    uint32_t aborted;
+    uint32_t withCurrent;          // Sessions where the station delivered any current
+    uint64_t timeToFirstAmpTotal;  // us, over withCurrent sessions
+    uint64_t timeToFirstAmpMax;    // us
+    uint64_t energy;               // uJ
+    uint32_t rampViolations;
+    AbortReasonCount abortReasons[SESSION_MAX_ABORT_REASONS];
+} SessionStats;
+
+void session_state_changed(State state, const char *reason);
+void session_sample();
+void print_session_stats();
+const Session *get_current_session();
+const Session *get_last_session();
+
+#endif
@@ -37,6 +37,103 @@
 #define MAIN_CAN_CS     17 // pin 22
 #define CHADEMO_CAN_CS  20 // pin 26
 
+/* MCP2515 INT lines. These are not routed on the v1.0 board, so they need to be
+ * jumpered from the MCP2515 INT pins to the pins below before enabling
+ * CAN_RX_INTERRUPTS. With interrupts disabled we poll both controllers over
+ * SPI every CAN_RX_POLL_INTERVAL ms. With interrupts enabled, frames are read
+ * as soon as they arrive and the poll only touches the SPI bus if INT is low.
+ */
+#define CAN_RX_INTERRUPTS     0
+#define MAIN_CAN_INT          6 // pin 9
+#define CHADEMO_CAN_INT       7 // pin 10
+#define CAN_RX_POLL_INTERVAL 10 // units = ms
+
+/* Maximum number of frames to read from a controller each time we service it.
+ * Anything left over is picked up on the next poll.
+ */
+#define CAN_RX_BUDGET 8
+
+/* Received frames are queued for the main loop to decode. This is how many
+ * frames each bus can have waiting. Must be a power of two.
+ */
+#define CAN_RX_QUEUE_SIZE 32
+
+/* Move CAN frames between the MCP2515s and memory with DMA. Frames are queued
+ * on the SPI bus instead of being clocked out by the CPU, and received frames
+ * are processed from the DMA IRQ as each read completes.
+ */
+#define CAN_DMA 0
+
+/* Program the MCP2515 acceptance filters so that only the frames we handle
+ * are received. Filtered frames never reach the receive buffers, so they cost
+ * no SPI or CPU time, but the controller doesn't count them either. Turn this
+ * off to see how much traffic the filters are dropping in the unhandled count.
+ */
+#define CAN_HARDWARE_FILTERS 1
+
+/* Bus health monitoring. Every CAN_HEALTH_INTERVAL we sample each controller's
+ * error counters and flags. The MCP2515 recovers from bus-off by itself once
+ * the bus has been quiet for 128 x 11 bit times (under 3ms at 500kbps). If it
+ * is still bus-off after CAN_BUS_OFF_TIMEOUT we reset and reconfigure it, up to
+ * CAN_MAX_RESETS times, after which we raise E_CAN_BUS_FAULT.
+ */
+#define CAN_HEALTH_INTERVAL  50 // units = ms
+#define CAN_BUS_OFF_TIMEOUT 100 // units = ms
+#define CAN_MAX_RESETS        3
+
+/* Run all CAN I/O on core 1: both controllers, their receive timers and IRQs,
+ * and sending the outbound ChaDeMo messages. Core 0 keeps the state machine,
+ * wifi and the web server, decodes the frames queued by core 1 and builds the
+ * frames it sends. The CAN timers get their own alarm pool on hardware alarm
+ * CAN_CORE_ALARM, as the default pool fires on core 0.
+ */
+#ifndef CAN_DUAL_CORE
+#define CAN_DUAL_CORE  0
+#endif
+#define CAN_CORE_ALARM 2
+
+/* Periodic work is run by a cooperative scheduler ticking every SCHEDULER_TICK
+ * on each core. Task periods and phases are in the task table in scheduler.cpp.
+ */
+#define SCHEDULER_TICK 1 // units = ms
+
+/* Events for the state machine are queued by whoever raises them (input IRQs,
+ * timers, the CAN decode path) and dispatched from the main loop, at most
+ * EVENT_DISPATCH_BUDGET per pass. Each priority has a queue of
+ * EVENT_QUEUE_SIZE events. Must be a power of two.
+ */
+#define EVENT_QUEUE_SIZE      16
+#define EVENT_DISPATCH_BUDGET 16
+
+/* Every state change is kept in the flight recorder, a ring of the last
+ * FLIGHT_RECORDER_SIZE changes. After a change into the error state it records
+ * FLIGHT_RECORDER_POST_TRIGGER more and then holds on to them until dumped.
+ * LOG_STATE_TRANSITIONS also prints each change to the console, which is slow.
+ */
+#define FLIGHT_RECORDER_SIZE         64
+#define FLIGHT_RECORDER_POST_TRIGGER  8
+#define LOG_STATE_TRANSITIONS         1
+
+/* After every event that leaves the contactor relay permitted to close, the
+ * state machine checks it's in energy transfer or winding down with the
+ * connector locked. If not, it inhibits the relay, stops the charge and goes
+ * to the error state. The host and fuzz builds define ASSERT_SAFETY_INVARIANTS
+ * to abort there instead, so the test that found the hole fails.
+ */
+#ifndef ASSERT_SAFETY_INVARIANTS
+#define ASSERT_SAFETY_INVARIANTS 0
+#endif
+
+/* The longest we wait in each of the states where the station could leave us
+ * hanging. Past that we raise E_STATE_TIMEOUT and abort to the error state.
+ * Deadlines are checked every STATE_DEADLINE_CHECK_INTERVAL, so a timeout can
+ * fire up to that much late.
+ */
+#define HANDSHAKING_TIMEOUT           20000 // units = ms
+#define CONNECTOR_LOCK_TIMEOUT        10000 // units = ms
+#define INSULATION_TEST_TIMEOUT       30000 // units = ms
+#define STATE_DEADLINE_CHECK_INTERVAL   100 // units = ms
+
 // Inputs
 #define PROX_PIN 11
 #define CHADEMO_IN1_PIN 14  // pin 19, CP  - contactor +ve, (sensed by 'f'), d1 enable signal, chademo plug pin 2
@@ -67,16 +164,41 @@
 #define EVSE_CAPABILITIES_MESSAGE_ID 0x108
 #define EVSE_STATUS_MESSAGE_ID 0x109
 
+/* We send our three messages (0x100, 0x101, 0x102) to the station every
+ * CHADEMO_OUTBOUND_INTERVAL. If the transmit buffers are still busy, we try
+ * again every CHADEMO_OUTBOUND_RETRY_INTERVAL until they go.
+ */
+#define CHADEMO_OUTBOUND_INTERVAL       100 // units = ms
+#define CHADEMO_OUTBOUND_RETRY_INTERVAL  10 // units = ms
+
 // Spec says current requests from the car should only vary at a rate of +/- 20A/sec
 #define CHADEMO_RAMP_RATE 20
 #define CHADEMO_RAMP_INTERVAL 1000 // units = ms
 
+/* During energy transfer the current request is recalculated every
+ * CHADEMO_CONTROL_INTERVAL by a PI loop on the station's output voltage, see
+ * recalculate_charging_current_request(). The gains are per volt below the
+ * loop's setpoint: CHADEMO_CV_KP in A of request, CHADEMO_CV_KI in A/s.
+ *
+ * The station reports its output in whole volts, so a loop aimed at the target
+ * voltage itself settles up to half a volt over it. The setpoint is
+ * CHADEMO_CV_HEADROOM below the target, to keep the output under it.
+ */
+#define CHADEMO_CONTROL_INTERVAL 100 // units = ms
+#define CHADEMO_CV_KP 2
+#define CHADEMO_CV_KI 2
+#define CHADEMO_CV_HEADROOM 1 // units = V
+
+// If the current or voltage reported by the station deviates from what we
+// expect for longer than this, we flag a deviation error (102.4.2, 102.4.4).
+#define CHADEMO_DEVIATION_TIME 5000 // units = ms
+
 // If we don't receive a CAN message from the ChaDeMo station in this number of
-// seconds, then we must abort charging.
+// ms, then we must abort charging.
 #define CHADEMO_STATION_TTL 2000 // units = ms
 
 // This scaling factor is used to calculate max charging time from the estimated charging time
-#define MAX_CHARGING_TIME_SCALING_FACTOR 1.2
+#define MAX_CHARGING_TIME_SCALING_PERCENT 120
 
 /* Specify whether to use amp-hours (ah) or watt-hours (wh) to estimate how much
  * time is left to complete charging.
@@ -97,8 +219,8 @@
  * General BMS settings
  */
 
-// If we don't receive a CAN message from the BMS in this number of seconds,
-// then we must abort charging.
+// If we don't receive a CAN message from the BMS in this number of ms, then
+// we must abort charging.
 #define BMS_TTL 5000 // units = ms
 
 // BMS CAN message which contains max/min pack voltage, max dis/charge current
@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <assert.h>
 
 #include "statemachine.h"
 #include "battery.h"
@@ -26,865 +27,1143 @@
 #include "chademocomms.h"
 #include "inputs.h"
 #include "settings.h"
+#include "hal.h"
+#include "session.h"
+#include "flightrecorder.h"
+#include "scheduler.h"
+#include "types.h"
+#include "util.h"
 
-extern State state;
+extern BMS bms;
+extern Station station;
 
 
 /*
- * State : idle
+ * The charging state machine, as data. Each state has optional entry and exit
+ * hooks, and each (state, event) pair has a list of guarded transitions. When
+ * an event comes in we look up the list for the current state and take the
+ * first transition whose guard passes:
  *
- * IN1/CP      : deactivated
- * IN2/CP2     : deactivated
- * OUT1/CP3    : deactivated
- * OUT2        : deactivated
- * CS          : deactivated
- * Plug locked : no
+ *   - Moving to another state runs the old state's exit hook, then the
+ *     transition's action, then the new state's entry hook.
+ *   - A transition to S_STAY just runs its action.
+ *   - If no guard passes, the event is ignored.
  *
+ * Pairs marked IGNORE are events we expect and deliberately do nothing with.
+ * Pairs not in the table at all are unexpected, and get a warning.
+ *
+ * Events are never dispatched where they're raised. post_event() queues them,
+ * and the main loop dispatches them one at a time with dispatch_events(), so
+ * transitions never run re-entrantly.
  */
-void state_idle(Event event) {
-
-    switch (event) {
-
-        case E_PLUG_INSERTED:
-
-            printf("Switching to state : plug_in, reason : plugin inserted\n");
-            state = state_plug_in;
-            break;
 
-        case E_BMS_UPDATE_RECEIVED:
-
-            chademo_update_max_voltage_value();
-
-            // Auxiliary check for CHARGE_INHIBIT condition
-            if ( battery_is_full() || battery_is_too_hot() || battery_is_too_cold() ) {
-                printf("Switching to state : charge_inhibited, reason : aux charge_inhibit check fired\n");
-                state = state_charge_inhibited;
-                break;
-            }
-
-            break;
+typedef bool (*Guard)(void);
+typedef void (*Action)(void);
+
+typedef struct {
+    Guard guard;         // NULL to always take it
+    Action action;       // NULL for none
+    State target;
+    const char *reason;  // Logged when we change state
+} Transition;
+
+typedef struct {
+    const Transition *transitions;
+    uint8_t n;
+    bool handled;        // false for pairs missing from the table
+} TransitionList;
+
+typedef struct {
+    const char *name;
+    Action entry;        // Run each time we enter the state
+    Action exit;         // Run each time we leave it
+    Action during;       // Run on every event, before the transition lookup
+    uint32_t timeout;    // Longest we may stay, ms. E_STATE_TIMEOUT fires after that. 0 for no limit.
+} StateHooks;
+
+#define ON(...) { \
+    (const Transition[]){ __VA_ARGS__ }, \
+    sizeof((const Transition[]){ __VA_ARGS__ }) / sizeof(Transition), \
+    true \
+}
+#define IGNORE { NULL, 0, true }
 
-        case E_BMS_LIVENESS_CHECK_FAILED:
+#define GOTO(target, reason)                    { NULL, NULL, target, reason }
+#define GOTO_IF(guard, target, reason)          { guard, NULL, target, reason }
+#define GOTO_DO(action, target, reason)         { NULL, action, target, reason }
+#define GOTO_IF_DO(guard, action, target, reason) { guard, action, target, reason }
+#define DO(action)                              { NULL, action, S_STAY, NULL }
 
-            printf("Switching to state : error, reason : communication timeout with BMS\n");
-            state = state_error;
-            break;
+static State state = S_IDLE;
 
-        case E_CHARGE_INHIBIT_ENABLED:
+/*
+ * Deadline for leaving the current state, 0 if it has none. Set when we enter
+ * a state with a timeout, and watched by the scheduler task that runs
+ * check_state_deadline().
+ */
+static volatile Timestamp stateDeadline = 0;
+static volatile bool stateTimeoutPosted = false;
+static uint32_t stateTimeouts[N_STATES];  // Times each state has timed out
 
-            printf("Switching to state : charge_inhibited, reason : received charge_inhibit input signal\n");
-            signal_charge_stop_digital();
-            state = state_charge_inhibited;
-            break;
+EventQueueStats eventStats;
 
-        case E_STATION_LIVENESS_CHECK_FAILED:
-            // Should never fire
-            break;
 
-        default:
+//// ----
+//
+// Guards
+//
+//// ----
 
-            printf("WARNING : received invalid event [%s]\n", event);
+/*
+ * Guards that only read the BMS and Station structs are cached. A cached
+ * result stands until the decoder marks one of the guard's input fields dirty,
+ * so a flood of BMS frames that change nothing re-evaluates nothing.
+ */
+typedef struct {
+    Guard evaluate;
+    uint32_t bmsInputs;      // BMSFields it reads
+    uint32_t stationInputs;  // StationFields it reads
+    bool valid;
+    bool value;
+} CachedGuard;
+
+typedef enum {
+    G_BATTERY_FULL,
+    G_BATTERY_TOO_HOT,
+    G_BATTERY_TOO_COLD,
+    G_STATION_VOLTAGE_SUFFICIENT,
+    G_PARAMETER_EXCHANGE_COMPLETE,
+    G_CONNECTOR_LOCKED,
+    G_STATION_MALFUNCTION,
+    G_BATTERY_INCOMPATIBLE,
+    G_CHARGING_SYSTEM_MALFUNCTION,
+    G_STATION_ALLOWING_CHARGE,
+    G_STATION_CURRENT_TERMINATED,
+    N_CACHED_GUARDS
+} CachedGuardId;
+
+static bool station_current_terminated() {
+    return station_get_current() <= TERMINATION_CURRENT;
+}
 
+static CachedGuard cachedGuards[N_CACHED_GUARDS] = {
+    [G_BATTERY_FULL] = {
+        battery_is_full, BMS_FIELD_HIGH_CELL_ALARM | BMS_FIELD_VOLTAGE | BMS_FIELD_MAXIMUM_VOLTAGE, 0 },
+    [G_BATTERY_TOO_HOT] = {
+        battery_is_too_hot, BMS_FIELD_HIGH_TEMP_ALARM, 0 },
+    [G_BATTERY_TOO_COLD] = {
+        battery_is_too_cold, BMS_FIELD_LOW_TEMP_WARN | BMS_FIELD_LOW_TEMP_ALARM, 0 },
+    [G_STATION_VOLTAGE_SUFFICIENT] = {
+        chademo_station_voltage_sufficient, BMS_FIELD_MAXIMUM_VOLTAGE, STATION_FIELD_MAXIMUM_VOLTAGE_AVAILABLE },
+    [G_PARAMETER_EXCHANGE_COMPLETE] = {
+        initial_parameter_exchange_with_station_complete, 0,
+        STATION_FIELD_CONTROL_PROTOCOL_NUMBER | STATION_FIELD_MAXIMUM_VOLTAGE_AVAILABLE |
+        STATION_FIELD_AVAILABLE_CURRENT | STATION_FIELD_BATTERY_INCOMPATABILITY },
+    [G_CONNECTOR_LOCKED] = {
+        connector_is_locked, 0, STATION_FIELD_VEHICLE_CONNECTOR_LOCK },
+    [G_STATION_MALFUNCTION] = {
+        station_is_reporting_station_malfunction, 0, STATION_FIELD_STATION_MALFUNCTION },
+    [G_BATTERY_INCOMPATIBLE] = {
+        station_is_reporting_battery_incompatibility, 0, STATION_FIELD_BATTERY_INCOMPATABILITY },
+    [G_CHARGING_SYSTEM_MALFUNCTION] = {
+        station_is_reporting_charging_system_malfunction, 0, STATION_FIELD_CHARGING_SYSTEM_MALFUNCTION },
+    [G_STATION_ALLOWING_CHARGE] = {
+        station_is_allowing_charge, 0, STATION_FIELD_CHARGER_STOP_CONTROL },
+    [G_STATION_CURRENT_TERMINATED] = {
+        station_current_terminated, 0, STATION_FIELD_OUTPUT_CURRENT }
+};
+
+static bool cached_guard(CachedGuardId id) {
+    CachedGuard *guard = &cachedGuards[id];
+    if ( guard->valid ) {
+        eventStats.guardsCached++;
+        return guard->value;
     }
-
+    guard->value = guard->evaluate();
+    guard->valid = true;
+    eventStats.guardsEvaluated++;
+    return guard->value;
 }
 
-
 /*
- * State : plug_in
- *
- * Plug has been inserted. Waiting on station pull IN1/CP high to indicate
- * station is ready to start.
- *
- * Note: possible issue here if IN1/CP and CS activate simultaneously or in the
- *       wrong order. Can this happen?
- *
- * IN1/CP      : deactivated
- * IN2/CP2     : deactivated
- * OUT1/CP3    : deactivated
- * OUT2/cont   : deactivated
- * CS          : activated
- * Plug locked : no
- *
- * Transitions:
- *  => handshaking
- *     - IN1/CP goes high
- *  => idle
- *     - plug removed
+ * Take the fields the decoders have changed since the last event, and drop
+ * any cached guard result that read them.
  */
-void state_plug_in(Event event) {
-
-    switch (event) {
-
-        case E_BMS_UPDATE_RECEIVED:
-
-            chademo_update_max_voltage_value();
-
-            // Auxiliary check for CHARGE_INHIBIT condition
-            if ( battery_is_full() || battery_is_too_hot() || battery_is_too_cold() ) {
-                printf("Switching to state : charge_inhibited, reason : aux charge_inhibit check fired\n");
-                state = state_charge_inhibited;
-                break;
-            }
-
-            break;
-
-        case E_BMS_LIVENESS_CHECK_FAILED:
-
-            printf("Switching to state : error, reason : communication timeout with BMS\n");
-            state = state_error;
-
-            break;
-
-        // Station has activated IN1/CP signal indicating it's ready to start charging
-        case E_IN1_ACTIVATED:
-
-            printf("Switching to state : handshaking, reason : station enabled IN1/CP signal\n");
-            //FIXME validate value of chademo.maximumVoltage before going ahead
-            reinitialise_station();
-            // Begin sending vehicle state over CAN to station
-            enable_send_outbound_CAN_messages();
-            // Signal to station that car gives permission to charge
-            activate_out1();
-            enable_station_liveness_check();
-            state = state_handshaking;
-            break;
-
-        case E_PLUG_REMOVED:
-
-            printf("Switching to state : idle, reason : plug removed\n");
-            chademo_reinitialise();
-            state = state_idle;
-            break;
-
-        case E_CHARGE_INHIBIT_ENABLED:
-
-            printf("Switching to state : charge_inhibited, reason : received charge_inhibit input signal\n");
-            state = state_charge_inhibited;
-            break;
-
-        case E_STATION_LIVENESS_CHECK_FAILED:
-            // Should never fire
-            break;
+static void invalidate_cached_guards() {
 
-        default:
-
-            printf("WARNING : received invalid event [%s]\n", event);
+    uint32_t bmsDirty = bms.dirty;
+    uint32_t stationDirty = station.dirty;
 
+    if ( bmsDirty == 0 && stationDirty == 0 ) {
+        return;
     }
+    bms.dirty = 0;
+    station.dirty = 0;
 
+    for ( int i = 0; i < N_CACHED_GUARDS; i++ ) {
+        if ( ( cachedGuards[i].bmsInputs & bmsDirty ) || ( cachedGuards[i].stationInputs & stationDirty ) ) {
+            cachedGuards[i].valid = false;
+        }
+    }
 }
 
+static bool battery_full() {
+    return cached_guard(G_BATTERY_FULL);
+}
 
-/*
- * State : handshaking
- *  - exchanging params with station over CAN
- *
- * IN1/CP      : activated
- * IN2/CP2     : deactivated
- * OUT1/CP3    : activated
- * OUT2/cont   : deactivated
- * CS          : activated
- * Plug locked : no
- *
- * Charging station sends:
- *  - Control protocol number (0x109)
- *  - Available output voltage (0x108)
- *  - Available output current (0x108)
- *  - Battery incompatability (0x109)
- *
- * Car sends:
- *  - Control protocol number (0x102)
- *  - Rated capacity of battery (0x101)
- *  - Maximum battery voltage (0x100)
- *  - Maximum charging time (0x101)
- *  - Target battery voltage (0x102)
- *  - Vehicle charging enabled (0x102)
- *
- */
-void state_handshaking(Event event) {
-
-    switch (event) {
-
-        case E_IN1_DEACTIVATED:
-
-            printf("Switching to state : plug_in, reason : IN1/CP signal was disabled\n");
-            signal_charge_stop_digital();
-            state = state_plug_in;
-
-        case E_BMS_UPDATE_RECEIVED:
+static bool battery_too_hot() {
+    return cached_guard(G_BATTERY_TOO_HOT);
+}
 
-            // Auxiliary check for CHARGE_INHIBIT condition
-            if ( battery_is_full() || battery_is_too_hot() || battery_is_too_cold() ) {
-                printf("Switching to state : charge_inhibited, reason : aux charge_inhibit check fired\n");
-                state = state_charge_inhibited;
-                break;
-            }
+static bool battery_inhibits_charge() {
+    return battery_full() || battery_too_hot() || cached_guard(G_BATTERY_TOO_COLD);
+}
 
-            break;
+static bool charge_inhibit_cleared() {
+    return ! battery_inhibits_charge() && ! charge_inhibit_enabled();
+}
 
-        case E_BMS_LIVENESS_CHECK_FAILED:
+static bool charge_inhibit_cleared_plug_inserted() {
+    return charge_inhibit_cleared() && plug_is_inserted();
+}
 
-            printf("Switching to state : error, reason : communication timeout with BMS\n");
-            state = state_error;
+static bool station_voltage_insufficient() {
+    return ! cached_guard(G_STATION_VOLTAGE_SUFFICIENT);
+}
 
-            break;
+static bool parameter_exchange_complete() {
+    return cached_guard(G_PARAMETER_EXCHANGE_COMPLETE);
+}
 
-        case E_STATION_CAPABILITIES_UPDATED:
+static bool connector_locked() {
+    return cached_guard(G_CONNECTOR_LOCKED);
+}
 
-            // Can the charger provide us with enough voltage?
-            if ( ! chademo_station_voltage_sufficient() ) {
-                printf("Switching to state : error, reason : station cannot supply sufficient voltage\n");
-                signal_charge_stop_digital();
-                state = state_error;
-                break;
-            }
+static bool connector_unlocked() {
+    return ! connector_locked();
+}
 
-            // If we have received all of the params we need from the station, move to the next step
-            if ( initial_parameter_exchange_with_station_complete() ) {
-                printf("Switching to state : await_connector_lock, reason : initial param exchange complete\n");
-                signal_charge_go_ahead_digital();
-                signal_charge_go_ahead_discrete();
-                state = state_await_connector_lock;
-                break;
-            }
+static bool station_malfunction() {
+    return cached_guard(G_STATION_MALFUNCTION);
+}
 
-            break;
+static bool battery_incompatible() {
+    return cached_guard(G_BATTERY_INCOMPATIBLE);
+}
 
-        case E_STATION_STATUS_UPDATED:
-
-            if ( station_is_reporting_station_malfunction() ) {
-                disable_send_outbound_CAN_messages();
-                printf("Switching to state : error, reason : station reporting station malfunction (electrical, connector lock, or emergency stop button)\n");
-                state = state_error;
-                break;
-            }
-
-            if ( station_is_reporting_battery_incompatibility() ) {
-                disable_send_outbound_CAN_messages();
-                printf("Switching to state : error, reason : station reporting battery incompatiblity\n");
-                state = state_error;
-                break;
-            }
-
-            if ( station_is_reporting_charging_system_malfunction() ) {
-                disable_send_outbound_CAN_messages();
-                printf("Switching to state : error, reason : station reporting 'Charging system malfunction'\n");
-                state = state_error;
-                break;
-            }
+static bool charging_system_malfunction() {
+    return cached_guard(G_CHARGING_SYSTEM_MALFUNCTION);
+}
 
-            // If we have received all of the params we need from the station, move to the next step
-            if ( initial_parameter_exchange_with_station_complete() ) {
-                printf("Switching to state : await_connector_lock, reason : initial param exchange complete\n");
-                signal_charge_go_ahead_digital();
-                signal_charge_go_ahead_discrete();
-                state = state_await_connector_lock;
-                break;
-            }
+static bool station_stopping_charge() {
+    return ! cached_guard(G_STATION_ALLOWING_CHARGE);
+}
 
-            break;
+static bool winding_down_complete() {
+    return cached_guard(G_STATION_CURRENT_TERMINATED);
+}
 
-        case E_PLUG_REMOVED:
+static bool charge_tapered_off() {
+    return chademo_taper_complete();
+}
 
-            chademo_reinitialise();
-            state = state_idle;
-            break;
 
-        case E_CHARGE_INHIBIT_ENABLED:
+//// ----
+//
+// Actions
+//
+//// ----
 
-            // FIXME disable CAN msgs
-            // disable_send_outbound_CAN_messages();
-            state = state_charge_inhibited;
+static void update_max_voltage() {
+    chademo_update_max_voltage_value();
+}
 
-        case E_STATION_LIVENESS_CHECK_FAILED:
-            // Should never fire
-            break;
+static void stop_outbound_CAN_messages() {
+    disable_send_outbound_CAN_messages();
+}
 
-        default:
+static void signal_charge_go_ahead() {
+    signal_charge_go_ahead_digital();
+    signal_charge_go_ahead_discrete();
+}
 
-            printf("WARNING : received invalid event [%s]\n", event);
-    }
+static void signal_charge_stop() {
+    signal_charge_stop_digital();
+    signal_charge_stop_discrete();
+}
 
+static void stop_and_reinitialise() {
+    chademo_reinitialise();
+    signal_charge_stop_digital();
 }
 
+static void finish_winding_down() {
+    signal_charge_stop_discrete();
+    inhibit_contactor_close();
+}
 
 /*
- * State : await_connector_lock
- *
- * IN1/CP      : activated
- * IN2/CP2     : deactivated
- * OUT1/CP3    : activated
- * OUT2/cont   : deactivated
- * CS          : deactivated
- * Plug locked : no
- * 
+ * Giving up on a charge once the contactors may be closed. Every way out of
+ * energy transfer and winding down, other than through weld detection, goes
+ * through one of these.
  */
-void state_await_connector_lock(Event event) {
-
-    switch (event) {
-
-        case E_IN1_DEACTIVATED:
-
-            signal_charge_stop_digital();
-            printf("Switching to state : plug_in, reason : disabled IN1/CP signal\n");
-            state = state_plug_in;
-
-        case E_BMS_UPDATE_RECEIVED:
-
-            // Auxiliary check for CHARGE_INHIBIT condition
-            if ( battery_is_full() || battery_is_too_hot() || battery_is_too_cold() ) {
-                printf("Switching to state : charge_inhibited, reason : aux charge_inhibit check fired\n");
-                state = state_charge_inhibited;
-                break;
-            }
-
-            break;
-
-        case E_BMS_LIVENESS_CHECK_FAILED:
-
-            printf("Switching to state : error, reason : communication timeout with BMS\n");
-            state = state_error;
-
-            break;
-
-        case E_STATION_CAPABILITIES_UPDATED:
-
-            break;
-
-        case E_STATION_STATUS_UPDATED:
-
-            if ( station_is_reporting_station_malfunction() ) {
-                disable_send_outbound_CAN_messages();
-                printf("Switching to state : error, reason : station reporting station malfunction (electrical, connector lock, or emergency stop button)\n");
-                state = state_error;
-                break;
-            }
-
-            if ( station_is_reporting_battery_incompatibility() ) {
-                disable_send_outbound_CAN_messages();
-                printf("Switching to state : error, reason : station reporting battery incompatiblity\n");
-                state = state_error;
-                break;
-            }
-
-            if ( station_is_reporting_charging_system_malfunction() ) {
-                disable_send_outbound_CAN_messages();
-                printf("Switching to state : error, reason : station reporting 'Charging system malfunction'\n");
-                state = state_error;
-                break;
-            }
-
-            // check if lock is complete
-            if ( connector_is_locked() ) {
-                state = state_await_insulation_test;
-                break;
-            }
-
-            break;
-
-        case E_PLUG_REMOVED:
-
-            signal_charge_stop_digital();
-            chademo_reinitialise();
-            state = state_idle;
-            break;
-
-        case E_CHARGE_INHIBIT_ENABLED:
-
-            deactivate_out1();
-            state = state_charge_inhibited;
-
-        case E_STATION_LIVENESS_CHECK_FAILED:
-
-            printf("Switching to state : error, reason : communication timeout with station\n");
-            state = state_error;
-            break;
-
-        default:
-
-            printf("WARNING : received invalid event [%s]\n", event);
-
-    }
-
+static void abort_charge() {
+    signal_charge_stop_digital();
+    inhibit_contactor_close();
 }
 
+static void abort_and_reinitialise() {
+    inhibit_contactor_close();
+    chademo_reinitialise();
+}
 
 /*
- * State : chademo_await_insulation_test
- *
- * IN1/CP      : activated
- * IN2/CP2     : deactivated
- * OUT1/CP3    : activated
- * OUT2/cont   : deactivated
- * CS          : deactivated
- * Plug locked : yes
- *
+ * Entering handshaking. Begin sending vehicle state over CAN to the station
+ * and signal that the car gives permission to charge.
  */
-void state_await_insulation_test(Event event) {
-
-    switch (event) {
-
-        case E_IN1_DEACTIVATED:
-
-            printf("Switching to state : plug_in, reason : disabled IN1/CP signal\n");
-            signal_charge_stop_digital();
-            state = state_plug_in;
-
-        case E_BMS_UPDATE_RECEIVED:
-
-            if ( battery_is_full() || battery_is_too_hot() || battery_is_too_cold() ) {
-                printf("Switching to state : charge_inhibited, reason : aux charge_inhibit check fired\n");
-                signal_charge_stop_digital();
-                state = state_charge_inhibited;
-                break;
-            }
-
-            break;
-
-        case E_BMS_LIVENESS_CHECK_FAILED:
+static void start_handshaking() {
+    //FIXME validate value of chademo.maximumVoltage before going ahead
+    reinitialise_station();
+    enable_send_outbound_CAN_messages();
+    activate_out1();
+    enable_station_liveness_check();
+}
 
-            printf("Switching to state : error, reason : communication timeout with BMS\n");
-            signal_charge_stop_digital();
-            state = state_error;
-
-            break;
 
+//// ----
+//
+// States
+//
+//// ----
+
+static const StateHooks states[N_STATES] = {
+    [S_IDLE]                  = { "idle" },
+    [S_PLUG_IN]               = { "plug_in" },
+    [S_HANDSHAKING]           = { "handshaking", start_handshaking, NULL, NULL, HANDSHAKING_TIMEOUT },
+    [S_AWAIT_CONNECTOR_LOCK]  = { "await_connector_lock", NULL, NULL, NULL, CONNECTOR_LOCK_TIMEOUT },
+    [S_AWAIT_INSULATION_TEST] = { "await_insulation_test", NULL, NULL, NULL, INSULATION_TEST_TIMEOUT },
+    [S_ENERGY_TRANSFER]       = { "energy_transfer", enable_current_control, disable_current_control },
+    [S_WINDING_DOWN]          = { "winding_down", NULL, NULL, ramp_down_current_request },
+    [S_WELD_DETECTION]        = { "weld_detection" },
+    [S_CHARGE_INHIBITED]      = { "charge_inhibited" },
+    [S_ERROR]                 = { "error" }
+};
+
+static const char *const events[N_EVENTS] = {
+    [E_PLUG_INSERTED]                 = "plug_inserted",
+    [E_PLUG_REMOVED]                  = "plug_removed",
+    [E_IN1_ACTIVATED]                 = "in1_activated",
+    [E_IN1_DEACTIVATED]               = "in1_deactivated",
+    [E_IN2_ACTIVATED]                 = "in2_activated",
+    [E_IN2_DEACTIVATED]               = "in2_deactivated",
+    [E_STATION_CAPABILITIES_UPDATED]  = "station_capabilities_updated",
+    [E_STATION_STATUS_UPDATED]        = "station_status_updated",
+    [E_BMS_UPDATE_RECEIVED]           = "bms_update_received",
+    [E_CHARGE_INHIBIT_ENABLED]        = "charge_inhibit_enabled",
+    [E_CHARGE_INHIBIT_DISABLED]       = "charge_inhibit_disabled",
+    [E_BMS_LIVENESS_CHECK_FAILED]     = "bms_liveness_check_failed",
+    [E_STATION_LIVENESS_CHECK_FAILED] = "station_liveness_check_failed",
+    [E_CAN_BUS_FAULT]                 = "can_bus_fault",
+    [E_STATE_TIMEOUT]                 = "state_timeout",
+    [E_CONTROL_TICK]                  = "control_tick"
+};
+
+
+//// ----
+//
+// Transitions
+//
+//// ----
+
+static const TransitionList transitions[N_STATES][N_EVENTS] = {
+
+    /*
+     * State : idle
+     *
+     * IN1/CP      : deactivated
+     * IN2/CP2     : deactivated
+     * OUT1/CP3    : deactivated
+     * OUT2        : deactivated
+     * CS          : deactivated
+     * Plug locked : no
+     */
+    [S_IDLE] = {
+        [E_PLUG_INSERTED] = ON(
+            GOTO(S_PLUG_IN, "plugin inserted")
+        ),
+        [E_BMS_UPDATE_RECEIVED] = ON(
+            // Auxiliary check for CHARGE_INHIBIT condition
+            GOTO_IF_DO(battery_inhibits_charge, update_max_voltage, S_CHARGE_INHIBITED, "aux charge_inhibit check fired"),
+            DO(update_max_voltage)
+        ),
+        [E_CAN_BUS_FAULT] = ON(
+            GOTO(S_ERROR, "CAN bus fault")
+        ),
+        [E_BMS_LIVENESS_CHECK_FAILED] = ON(
+            GOTO(S_ERROR, "communication timeout with BMS")
+        ),
+        [E_CHARGE_INHIBIT_ENABLED] = ON(
+            GOTO_DO(signal_charge_stop_digital, S_CHARGE_INHIBITED, "received charge_inhibit input signal")
+        ),
+        // Should never fire
+        [E_STATION_LIVENESS_CHECK_FAILED] = IGNORE
+    },
+
+    /*
+     * State : plug_in
+     *
+     * Plug has been inserted. Waiting on station pull IN1/CP high to indicate
+     * station is ready to start.
+     *
+     * Note: possible issue here if IN1/CP and CS activate simultaneously or in the
+     *       wrong order. Can this happen?
+     *
+     * IN1/CP      : deactivated
+     * IN2/CP2     : deactivated
+     * OUT1/CP3    : deactivated
+     * OUT2/cont   : deactivated
+     * CS          : activated
+     * Plug locked : no
+     */
+    [S_PLUG_IN] = {
+        [E_BMS_UPDATE_RECEIVED] = ON(
+            // Auxiliary check for CHARGE_INHIBIT condition
+            GOTO_IF_DO(battery_inhibits_charge, update_max_voltage, S_CHARGE_INHIBITED, "aux charge_inhibit check fired"),
+            DO(update_max_voltage)
+        ),
+        [E_CAN_BUS_FAULT] = ON(
+            GOTO(S_ERROR, "CAN bus fault")
+        ),
+        [E_BMS_LIVENESS_CHECK_FAILED] = ON(
+            GOTO(S_ERROR, "communication timeout with BMS")
+        ),
+        // Station has activated IN1/CP signal indicating it's ready to start charging
+        [E_IN1_ACTIVATED] = ON(
+            GOTO(S_HANDSHAKING, "station enabled IN1/CP signal")
+        ),
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(chademo_reinitialise, S_IDLE, "plug removed")
+        ),
+        [E_CHARGE_INHIBIT_ENABLED] = ON(
+            GOTO(S_CHARGE_INHIBITED, "received charge_inhibit input signal")
+        ),
+        // Should never fire
+        [E_STATION_LIVENESS_CHECK_FAILED] = IGNORE
+    },
+
+    /*
+     * State : handshaking
+     *  - exchanging params with station over CAN
+     *
+     * IN1/CP      : activated
+     * IN2/CP2     : deactivated
+     * OUT1/CP3    : activated
+     * OUT2/cont   : deactivated
+     * CS          : activated
+     * Plug locked : no
+     *
+     * Charging station sends:
+     *  - Control protocol number (0x109)
+     *  - Available output voltage (0x108)
+     *  - Available output current (0x108)
+     *  - Battery incompatability (0x109)
+     *
+     * Car sends:
+     *  - Control protocol number (0x102)
+     *  - Rated capacity of battery (0x101)
+     *  - Maximum battery voltage (0x100)
+     *  - Maximum charging time (0x101)
+     *  - Target battery voltage (0x102)
+     *  - Vehicle charging enabled (0x102)
+     */
+    [S_HANDSHAKING] = {
+        [E_IN1_DEACTIVATED] = ON(
+            GOTO_DO(signal_charge_stop, S_PLUG_IN, "IN1/CP signal was disabled")
+        ),
+        [E_BMS_UPDATE_RECEIVED] = ON(
+            // Auxiliary check for CHARGE_INHIBIT condition
+            GOTO_IF(battery_inhibits_charge, S_CHARGE_INHIBITED, "aux charge_inhibit check fired")
+        ),
+        [E_CAN_BUS_FAULT] = ON(
+            GOTO(S_ERROR, "CAN bus fault")
+        ),
+        [E_BMS_LIVENESS_CHECK_FAILED] = ON(
+            GOTO(S_ERROR, "communication timeout with BMS")
+        ),
+        [E_STATION_CAPABILITIES_UPDATED] = ON(
+            // Can the charger provide us with enough voltage?
+            GOTO_IF_DO(station_voltage_insufficient, signal_charge_stop_digital, S_ERROR, "station cannot supply sufficient voltage"),
+            // If we have received all of the params we need from the station, move to the next step
+            GOTO_IF_DO(parameter_exchange_complete, signal_charge_go_ahead, S_AWAIT_CONNECTOR_LOCK, "initial param exchange complete")
+        ),
+        [E_STATION_STATUS_UPDATED] = ON(
+            GOTO_IF_DO(station_malfunction, stop_outbound_CAN_messages, S_ERROR, "station reporting station malfunction (electrical, connector lock, or emergency stop button)"),
+            GOTO_IF_DO(battery_incompatible, stop_outbound_CAN_messages, S_ERROR, "station reporting battery incompatiblity"),
+            GOTO_IF_DO(charging_system_malfunction, stop_outbound_CAN_messages, S_ERROR, "station reporting 'Charging system malfunction'"),
+            // If we have received all of the params we need from the station, move to the next step
+            GOTO_IF_DO(parameter_exchange_complete, signal_charge_go_ahead, S_AWAIT_CONNECTOR_LOCK, "initial param exchange complete")
+        ),
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(chademo_reinitialise, S_IDLE, "plug removed")
+        ),
+        // FIXME disable CAN msgs
+        [E_CHARGE_INHIBIT_ENABLED] = ON(
+            GOTO(S_CHARGE_INHIBITED, "received charge_inhibit input signal")
+        ),
+        // Should never fire
+        [E_STATION_LIVENESS_CHECK_FAILED] = IGNORE,
+        [E_STATE_TIMEOUT] = ON(
+            GOTO_DO(stop_outbound_CAN_messages, S_ERROR, "timed out exchanging parameters with station")
+        )
+    },
+
+    /*
+     * State : await_connector_lock
+     *
+     * IN1/CP      : activated
+     * IN2/CP2     : deactivated
+     * OUT1/CP3    : activated
+     * OUT2/cont   : deactivated
+     * CS          : deactivated
+     * Plug locked : no
+     */
+    [S_AWAIT_CONNECTOR_LOCK] = {
+        [E_IN1_DEACTIVATED] = ON(
+            GOTO_DO(signal_charge_stop, S_PLUG_IN, "disabled IN1/CP signal")
+        ),
+        [E_BMS_UPDATE_RECEIVED] = ON(
+            // Auxiliary check for CHARGE_INHIBIT condition
+            GOTO_IF(battery_inhibits_charge, S_CHARGE_INHIBITED, "aux charge_inhibit check fired")
+        ),
+        [E_CAN_BUS_FAULT] = ON(
+            GOTO(S_ERROR, "CAN bus fault")
+        ),
+        [E_BMS_LIVENESS_CHECK_FAILED] = ON(
+            GOTO(S_ERROR, "communication timeout with BMS")
+        ),
+        [E_STATION_CAPABILITIES_UPDATED] = IGNORE,
+        [E_STATION_STATUS_UPDATED] = ON(
+            GOTO_IF_DO(station_malfunction, stop_outbound_CAN_messages, S_ERROR, "station reporting station malfunction (electrical, connector lock, or emergency stop button)"),
+            GOTO_IF_DO(battery_incompatible, stop_outbound_CAN_messages, S_ERROR, "station reporting battery incompatiblity"),
+            GOTO_IF_DO(charging_system_malfunction, stop_outbound_CAN_messages, S_ERROR, "station reporting 'Charging system malfunction'"),
+            GOTO_IF(connector_locked, S_AWAIT_INSULATION_TEST, "connector locked")
+        ),
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(stop_and_reinitialise, S_IDLE, "plug removed")
+        ),
+        [E_CHARGE_INHIBIT_ENABLED] = ON(
+            GOTO_DO(deactivate_out1, S_CHARGE_INHIBITED, "received charge_inhibit input signal")
+        ),
+        [E_STATE_TIMEOUT] = ON(
+            GOTO_DO(stop_outbound_CAN_messages, S_ERROR, "timed out waiting for connector lock")
+        ),
+        [E_STATION_LIVENESS_CHECK_FAILED] = ON(
+            GOTO(S_ERROR, "communication timeout with station")
+        )
+    },
+
+    /*
+     * State : await_insulation_test
+     *
+     * IN1/CP      : activated
+     * IN2/CP2     : deactivated
+     * OUT1/CP3    : activated
+     * OUT2/cont   : deactivated
+     * CS          : deactivated
+     * Plug locked : yes
+     */
+    [S_AWAIT_INSULATION_TEST] = {
+        [E_IN1_DEACTIVATED] = ON(
+            GOTO_DO(signal_charge_stop, S_PLUG_IN, "disabled IN1/CP signal")
+        ),
+        [E_BMS_UPDATE_RECEIVED] = ON(
+            GOTO_IF_DO(battery_inhibits_charge, signal_charge_stop_digital, S_CHARGE_INHIBITED, "aux charge_inhibit check fired")
+        ),
+        [E_CAN_BUS_FAULT] = ON(
+            GOTO_DO(signal_charge_stop_digital, S_ERROR, "CAN bus fault")
+        ),
+        [E_BMS_LIVENESS_CHECK_FAILED] = ON(
+            GOTO_DO(signal_charge_stop_digital, S_ERROR, "communication timeout with BMS")
+        ),
         /* Station has indicated that insulation test is over and it is now
          * ready to go into energy transfer state by pulling IN2/CP2 low.
          */
-        case E_IN2_ACTIVATED:
-
-            printf("Switching to state : energy_transfer, reason : IN2/CP2 activated\n");
-            permit_contactor_close();
-            state = state_energy_transfer;  
-
+        [E_IN2_ACTIVATED] = ON(
+            GOTO_IF_DO(connector_locked, permit_contactor_close, S_ENERGY_TRANSFER, "IN2/CP2 activated")
+        ),
         /* This shouldn't be possible as the plug connector lock should be
          * engaged here, but deal with this scenario anyway for safety sake.
          */
-        case E_PLUG_REMOVED:
-
-            printf("Switching to state : idle, reason : plug removed\n");
-            chademo_reinitialise();
-            signal_charge_stop_digital();
-            state = state_idle;
-            break;
-
-        case E_STATION_CAPABILITIES_UPDATED:
-            // FIXME
-            break;
-
-        case E_STATION_STATUS_UPDATED:
-
-            if ( station_is_reporting_station_malfunction() ) {
-                printf("Switching to state : error, reason : station reporting station malfunction (electrical, connector lock, or emergency stop button)\n");
-                signal_charge_stop_digital();
-                state = state_error;
-                break;
-            }
-
-            if ( station_is_reporting_battery_incompatibility() ) {
-                printf("Switching to state : error, reason : station reporting battery incompatiblity\n");
-                signal_charge_stop_digital();
-                state = state_error;
-                break;
-            }
-
-            if ( station_is_reporting_charging_system_malfunction() ) {
-                printf("Switching to state : error, reason : station reporting 'Charging system malfunction'\n");
-                signal_charge_stop_digital();
-                state = state_error;
-                break;
-            }
-
-            break;
-
-        case E_CHARGE_INHIBIT_ENABLED:
-
-            printf("Switching to state : charge_inhibited, reason : received charge_inhibit input signal\n");
-            signal_charge_stop_digital();
-            state = state_charge_inhibited;
-            break;
-
-        case E_STATION_LIVENESS_CHECK_FAILED:
-
-            printf("Switching to state : error, reason : communication timeout with station\n");
-            signal_charge_stop_digital();
-            state = state_error;
-            break;
-
-        default:
-
-            printf("WARNING : received invalid event [%s]\n", event);
-
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(stop_and_reinitialise, S_IDLE, "plug removed")
+        ),
+        // FIXME
+        [E_STATION_CAPABILITIES_UPDATED] = IGNORE,
+        [E_STATION_STATUS_UPDATED] = ON(
+            GOTO_IF_DO(station_malfunction, signal_charge_stop_digital, S_ERROR, "station reporting station malfunction (electrical, connector lock, or emergency stop button)"),
+            GOTO_IF_DO(battery_incompatible, signal_charge_stop_digital, S_ERROR, "station reporting battery incompatiblity"),
+            GOTO_IF_DO(charging_system_malfunction, signal_charge_stop_digital, S_ERROR, "station reporting 'Charging system malfunction'"),
+            GOTO_IF_DO(connector_unlocked, signal_charge_stop_digital, S_ERROR, "connector unlocked before energy transfer")
+        ),
+        [E_CHARGE_INHIBIT_ENABLED] = ON(
+            GOTO_DO(signal_charge_stop_digital, S_CHARGE_INHIBITED, "received charge_inhibit input signal")
+        ),
+        [E_STATION_LIVENESS_CHECK_FAILED] = ON(
+            GOTO_DO(signal_charge_stop_digital, S_ERROR, "communication timeout with station")
+        ),
+        [E_STATE_TIMEOUT] = ON(
+            GOTO_DO(signal_charge_stop_digital, S_ERROR, "timed out waiting for insulation test")
+        )
+    },
+
+    /*
+     * State : energy_transfer
+     *
+     * Station is delivering energy to the batteries. The current request is
+     * recalculated on each control tick, until it tapers off at the target
+     * voltage.
+     *
+     * IN1/CP      : activated
+     * IN2/CP2     : activated
+     * OUT1/CP3    : activated
+     * OUT2/cont   : activated
+     * CS          : activated
+     * Plug locked : yes
+     */
+    [S_ENERGY_TRANSFER] = {
+        [E_BMS_UPDATE_RECEIVED] = ON(
+            // Note : 'Battery Overvoltage' flag will also be set automatically here (102.4.0)
+            GOTO_IF_DO(battery_full, signal_charge_stop_digital, S_WINDING_DOWN, "battery full"),
+            // Note : 'High Battery Temperature' flag will also be set automatically here (102.4.3)
+            GOTO_IF_DO(battery_too_hot, signal_charge_stop_digital, S_WINDING_DOWN, "battery is too hot")
+        ),
+        [E_CONTROL_TICK] = ON(
+            GOTO_IF_DO(charge_tapered_off, signal_charge_stop_digital, S_WINDING_DOWN, "charge current tapered off"),
+            DO(recalculate_charging_current_request)
+        ),
+        [E_CAN_BUS_FAULT] = ON(
+            GOTO_DO(abort_charge, S_ERROR, "CAN bus fault")
+        ),
+        [E_BMS_LIVENESS_CHECK_FAILED] = ON(
+            GOTO_DO(abort_charge, S_ERROR, "communication timeout with BMS")
+        ),
+        /* This shouldn't be possible as the plug connector lock should be
+         * engaged here, but deal with this scenario anyway for safety sake.
+         */
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(abort_and_reinitialise, S_IDLE, "plug removed")
+        ),
+        [E_STATION_CAPABILITIES_UPDATED] = ON(
+            // If the current available has changed then the charging time may need updating
+            DO(recalculate_charging_time)
+        ),
+        [E_STATION_STATUS_UPDATED] = ON(
+            GOTO_IF_DO(connector_unlocked, abort_charge, S_ERROR, "connector unlocked during energy transfer"),
+            // Station is signalling over CAN that it wants to stop charging
+            GOTO_IF_DO(station_stopping_charge, signal_charge_stop_digital, S_WINDING_DOWN, "station has requested charge termination"),
+            GOTO_IF_DO(station_malfunction, signal_charge_stop_digital, S_WINDING_DOWN, "station reporting station malfunction (electrical, connector lock, or emergency stop button)"),
+            GOTO_IF_DO(battery_incompatible, signal_charge_stop_digital, S_WINDING_DOWN, "station reporting battery incompatiblity"),
+            GOTO_IF_DO(charging_system_malfunction, signal_charge_stop_digital, S_WINDING_DOWN, "station reporting 'Charging system malfunction'"),
+            DO(check_for_current_deviation_error)
+        ),
+        [E_CHARGE_INHIBIT_ENABLED] = ON(
+            GOTO_DO(signal_charge_stop_digital, S_WINDING_DOWN, "received charge_inhibit input signal")
+        ),
+        [E_STATION_LIVENESS_CHECK_FAILED] = ON(
+            GOTO_DO(abort_charge, S_ERROR, "communication timeout with station")
+        )
+    },
+
+    /*
+     * State : winding_down
+     *
+     * We've told the station we want to stop charging by deactivating OUT1/CP3
+     * and via CAN messaging. All we do here is ramp down the current to zero,
+     * on every event. Once we reach zero, open the contactors.
+     *
+     * IN1/CP      : activated
+     * IN2/CP2     : activated
+     * OUT1/CP3    : deactivated
+     * OUT2/cont   : activated
+     * CS          : activated
+     * Plug locked : yes
+     */
+    [S_WINDING_DOWN] = {
+        [E_BMS_UPDATE_RECEIVED] = IGNORE,
+        [E_CAN_BUS_FAULT] = IGNORE,
+        [E_BMS_LIVENESS_CHECK_FAILED] = IGNORE,
+        [E_STATION_CAPABILITIES_UPDATED] = IGNORE,
+        [E_STATION_STATUS_UPDATED] = ON(
+            GOTO_IF_DO(connector_unlocked, abort_charge, S_ERROR, "connector unlocked while winding down"),
+            GOTO_IF_DO(winding_down_complete, finish_winding_down, S_WELD_DETECTION, "winding down complete")
+        ),
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(abort_and_reinitialise, S_IDLE, "plug removed")
+        ),
+        [E_CHARGE_INHIBIT_ENABLED] = IGNORE,
+        // Without the station we'll never see the current come down
+        [E_STATION_LIVENESS_CHECK_FAILED] = ON(
+            GOTO_DO(abort_charge, S_ERROR, "communication timeout with station")
+        )
+    },
+
+    /*
+     * State : weld_detection
+     *
+     * IN1/CP      : activated
+     * IN2/CP2     : activated
+     * OUT1/CP3    : deactivated
+     * OUT2/cont   : activated
+     * CS          : activated
+     * Plug locked : yes
+     *
+     * FIXME The weld check itself is still to do. Once the contactors have
+     *       opened and closed chademo.weldCheckCycles times with the station
+     *       voltage following, set 102.5.3 and move to plug_in.
+     */
+    [S_WELD_DETECTION] = {
+        [E_BMS_UPDATE_RECEIVED] = IGNORE,
+        [E_CAN_BUS_FAULT] = IGNORE,
+        [E_BMS_LIVENESS_CHECK_FAILED] = IGNORE,
+        [E_STATION_CAPABILITIES_UPDATED] = IGNORE,
+        [E_STATION_STATUS_UPDATED] = IGNORE,
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(chademo_reinitialise, S_IDLE, "plug removed")
+        ),
+        [E_CHARGE_INHIBIT_ENABLED] = IGNORE,
+        [E_STATION_LIVENESS_CHECK_FAILED] = IGNORE
+    },
+
+    /*
+     * State : charge_inhibited
+     *
+     * IN1/CP      : deactivated
+     * IN2/CP2     : deactivated
+     * OUT1/CP3    :
+     * OUT2        :
+     * CS          : deactivated
+     * Plug locked : no
+     *
+     * Reasons we can be inhibited
+     *   - battery is full
+     *   - battery is too hot
+     *   - battery is too cold (warming in progress)
+     *   - CHARGE_INHIBIT signal from BMS has been activated
+     */
+    [S_CHARGE_INHIBITED] = {
+        [E_BMS_UPDATE_RECEIVED] = ON(
+            // Auxiliary CHARGE_INHIBIT check escape
+            GOTO_IF(charge_inhibit_cleared_plug_inserted, S_PLUG_IN, "aux charge_inhibit check passed"),
+            GOTO_IF(charge_inhibit_cleared, S_IDLE, "aux charge_inhibit check passed")
+        ),
+        [E_CAN_BUS_FAULT] = ON(
+            GOTO(S_ERROR, "CAN bus fault")
+        ),
+        [E_BMS_LIVENESS_CHECK_FAILED] = ON(
+            GOTO(S_ERROR, "BMS liveness check failed")
+        ),
+        [E_PLUG_INSERTED] = IGNORE,
+        // We're no longer in an inhibit state, go back to idle or plug_in
+        [E_CHARGE_INHIBIT_DISABLED] = ON(
+            GOTO_IF(charge_inhibit_cleared_plug_inserted, S_PLUG_IN, "charge_inhibit check passed"),
+            GOTO_IF(charge_inhibit_cleared, S_IDLE, "charge_inhibit check passed")
+        ),
+        /* This event should only fire if we were charging and moved into an
+         * inhibited state.
+         */
+        [E_STATION_LIVENESS_CHECK_FAILED] = ON(
+            GOTO(S_ERROR, "communication timeout with station")
+        )
+    },
+
+    /*
+     * State : error
+     *
+     * IN1/CP      : deactivated
+     * IN2/CP2     : deactivated
+     * OUT1/CP3    :
+     * OUT2        :
+     * CS          : deactivated
+     * Plug locked : no
+     *
+     * We can get into an error state when:
+     *   - communication timeout with BMS
+     *   - communication timeout with station
+     *   - station compatability issue (voltage)
+     *   - station reporting a fault
+     *   - CAN bus fault
+     */
+    [S_ERROR] = {
+        [E_BMS_UPDATE_RECEIVED] = IGNORE,
+        // Only way out of error is to remove the plug and start over
+        [E_PLUG_REMOVED] = ON(
+            GOTO_DO(chademo_reinitialise, S_IDLE, "plug removed")
+        ),
+        [E_CAN_BUS_FAULT] = IGNORE
     }
+};
 
-}
 
+//// ----
+//
+// Engine
+//
+//// ----
 
 /*
- * State : energy_transfer
- *
- * Station is delivering energy to the batteries.
- *
- * IN1/CP      : activated
- * IN2/CP2     : activated
- * OUT1/CP3    : activated
- * OUT2/cont   : activated
- * CS          : activated
- * Plug locked : yes
- *
+ * check_state_deadline() runs from the scheduler's alarm IRQ on this core. If
+ * it ran between the two writes it could see the old state's deadline with
+ * the new state's flag, and post a stale timeout that uses the flag up. So
+ * the IRQ sees both or neither.
  */
-void state_energy_transfer(Event event) {
-
-    switch (event) {
-
-        case E_BMS_UPDATE_RECEIVED:
-
-            // Stop charging if the BMS says the battery is full
-            if ( battery_is_full() ) {
-                // Note : 'Battery Overvoltage' flag will also be set automatically here (102.4.0)
-                printf("Switching to state : winding down, reason : battery full\n");
-                signal_charge_stop_digital();
-                state = state_winding_down;
-                break;
-            }
-
-            // Stop charging if the BMS says the battery is too hot
-            if ( battery_is_too_hot() ) {
-                // Note : 'High Battery Temperature' flag will also be set automatically here (102.4.3)
-                printf("Switching to state : charge_inhibited, reason : battery is too hot\n");
-                signal_charge_stop_digital();
-                state = state_winding_down;
-            }
-
-            recalculate_charging_current_request();
-
-            break;
+static void arm_state_deadline() {
+    uint32_t timeout = states[state].timeout;
+    Timestamp deadline = timeout != 0 ? deadline_in_ms(timeout) : 0;
+    uint32_t interrupts = hal_disable_interrupts();
+    stateDeadline = deadline;
+    stateTimeoutPosted = false;
+    hal_restore_interrupts(interrupts);
+}
 
-        case E_BMS_LIVENESS_CHECK_FAILED:
+static bool state_deadline_passed() {
+    Timestamp deadline = timestamp_load(&stateDeadline);
+    return deadline != 0 && deadline_passed(deadline);
+}
 
-            printf("Switching to state : error, reason : communication timeout with BMS\n");
-            state = state_error;
+/*
+ * Called by the scheduler. Raise E_STATE_TIMEOUT once when the current state
+ * runs over its deadline.
+ */
+void check_state_deadline() {
+    if ( ! stateTimeoutPosted && state_deadline_passed() ) {
+        stateTimeoutPosted = true;
+        post_event(E_STATE_TIMEOUT);
+    }
+}
 
-            break;
+static void take_transition(const Transition *transition, Event event) {
 
-        /* This shouldn't be possible as the plug connector lock should be
-         * engaged here, but deal with this scenario anyway for safety sake.
-         */
-        case E_PLUG_REMOVED:
+    if ( transition->target == S_STAY ) {
+        if ( transition->action != NULL ) {
+            transition->action();
+        }
+        return;
+    }
 
-            chademo_reinitialise();
-            // FIXME contactors, etc.
-            state = state_idle;
-            break;
+    #if LOG_STATE_TRANSITIONS
+    printf("Switching to state : %s, reason : %s\n", states[transition->target].name, transition->reason);
+    #endif
 
-        case E_STATION_CAPABILITIES_UPDATED:
+    if ( states[state].exit != NULL ) {
+        states[state].exit();
+    }
+    if ( transition->action != NULL ) {
+        transition->action();
+    }
+    flight_record(state, transition->target, event);
+    state = transition->target;
+    arm_state_deadline();
+    session_state_changed(state, transition->reason);
+    if ( states[state].entry != NULL ) {
+        states[state].entry();
+    }
+}
 
-            // Current available at station may have changed
-            recalculate_charging_current_request();
+static void dispatch_event(Event event) {
 
-            // If current available has changed then the charging time may need updating
-            recalculate_charging_time();
+    if ( event >= N_EVENTS ) {
+        printf("WARNING : received invalid event [%d]\n", event);
+        return;
+    }
 
-            break;
+    /*
+     * The timeout may have been posted just before we left the state it was
+     * for. If the current state isn't over its deadline, it's stale.
+     */
+    if ( event == E_STATE_TIMEOUT ) {
+        if ( ! state_deadline_passed() ) {
+            return;
+        }
+        stateTimeouts[state]++;
+    }
 
-        case E_STATION_STATUS_UPDATED:
+    // A tick posted just before we left energy transfer
+    if ( event == E_CONTROL_TICK && ! task_enabled(TASK_CURRENT_CONTROL) ) {
+        return;
+    }
 
-            // Station is signalling over CAN that it wants to stop charging
-            if ( ! station_is_allowing_charge() ) {
-                printf("Switching to state : winding_down, reason : station has requested charge termination\n");
-                signal_charge_stop_digital();
-                state = state_winding_down;
-            }
-
-            if ( station_is_reporting_station_malfunction() ) {
-                printf("Switching to state : winding_down, reason : station reporting station malfunction (electrical, connector lock, or emergency stop button)\n");
-                signal_charge_stop_digital();
-                state = state_winding_down;
-                break;
-            }
-
-            if ( station_is_reporting_battery_incompatibility() ) {
-                printf("Switching to state : winding_down, reason : station reporting battery incompatiblity\n");
-                signal_charge_stop_digital();
-                state = state_winding_down;
-                break;
-            }
-
-            if ( station_is_reporting_charging_system_malfunction() ) {
-                printf("Switching to state : winding_down, reason : station reporting 'Charging system malfunction'\n");
-                signal_charge_stop_digital();
-                state = state_winding_down;
-                break;
-            }
-
-            check_for_current_deviation_error();
+    invalidate_cached_guards();
 
-            break;
+    if ( states[state].during != NULL ) {
+        states[state].during();
+    }
 
-        case E_CHARGE_INHIBIT_ENABLED:
+    const TransitionList *list = &transitions[state][event];
 
-            printf("Switching to state : winding_down, reason : received charge_inhibit input signal\n");
-            signal_charge_stop_digital();
-            state = state_winding_down;
-            break;
+    if ( ! list->handled ) {
+        printf("WARNING : received unexpected event [%s] in state [%s]\n", events[event], states[state].name);
+        return;
+    }
 
-        case E_STATION_LIVENESS_CHECK_FAILED:
+    for ( int i = 0; i < list->n; i++ ) {
+        const Transition *transition = &list->transitions[i];
+        if ( transition->guard == NULL || transition->guard() ) {
+            take_transition(transition, event);
+            return;
+        }
+    }
+}
 
-            printf("Switching to state : error, reason : communication timeout with station\n");
-            signal_charge_stop_digital();
-            state = state_error;
-            break;
+//// ----
+//
+// Event queue
+//
+//// ----
 
-        default:
-            printf("WARNING : received invalid event [%s]\n", event);
+typedef struct {
+    uint8_t events[EVENT_QUEUE_SIZE];
+    uint32_t postedAt[EVENT_QUEUE_SIZE];  // us
+    uint32_t head;
+    uint32_t tail;
+} EventQueue;
 
-    }
+#define EVENT_BIT(event) ( 1u << (event) )
 
+/* Events that jump the queue. Both edges of an input go in the same queue,
+ * so a bounce is dispatched in the order it happened.
+ */
+static const uint32_t safetyEvents =
+    EVENT_BIT(E_PLUG_INSERTED) |
+    EVENT_BIT(E_PLUG_REMOVED) |
+    EVENT_BIT(E_IN1_ACTIVATED) |
+    EVENT_BIT(E_IN1_DEACTIVATED) |
+    EVENT_BIT(E_IN2_ACTIVATED) |
+    EVENT_BIT(E_IN2_DEACTIVATED) |
+    EVENT_BIT(E_CHARGE_INHIBIT_ENABLED) |
+    EVENT_BIT(E_CHARGE_INHIBIT_DISABLED) |
+    EVENT_BIT(E_BMS_LIVENESS_CHECK_FAILED) |
+    EVENT_BIT(E_STATION_LIVENESS_CHECK_FAILED) |
+    EVENT_BIT(E_CAN_BUS_FAULT) |
+    EVENT_BIT(E_STATE_TIMEOUT);
+
+/* Events that only say "there's fresh data", or that it's time to act on it.
+ * The data is in the BMS and Station structs, so a second one posted before
+ * the first is dispatched adds nothing and is dropped.
+ */
+static const uint32_t coalescedEvents =
+    EVENT_BIT(E_BMS_UPDATE_RECEIVED) |
+    EVENT_BIT(E_STATION_CAPABILITIES_UPDATED) |
+    EVENT_BIT(E_STATION_STATUS_UPDATED) |
+    EVENT_BIT(E_CONTROL_TICK);
+
+static EventQueue eventQueues[N_EVENT_PRIORITIES];
+static uint32_t queuedEvents;  // EVENT_BITs of coalesced events in the queues
+static HALLock *eventQueueLock;
+
+// Call before anything can post an event
+void init_state_machine() {
+    eventQueueLock = hal_lock_create();
+    enable_task(TASK_STATE_DEADLINE);
 }
 
 /*
- * State : winding_down
- *
- * We've told the station we want to stop charging by deactivating OUT1/CP3
- * and via CAN messaging. All we do here is ramp down the current to zero.
- * Once we reach zero, open the contactors.
- *
- * IN1/CP      : activated
- * IN2/CP2     : activated
- * OUT1/CP3    : deactivated
- * OUT2/cont   : activated
- * CS          : activated
- * Plug locked : yes
- *
+ * Queue an event for the state machine. Safe to call from any IRQ or timer,
+ * on either core. Returns false, and counts a drop, if the queue is full.
  */
-void state_winding_down(Event event) {
+bool post_event(Event event) {
 
-    // No matter the event, always process the ramp down
-    ramp_down_current_request();
+    if ( event >= N_EVENTS ) {
+        printf("WARNING : posted invalid event [%d]\n", event);
+        return false;
+    }
 
-    switch (event) {
+    uint32_t bit = EVENT_BIT(event);
+    EventQueue *queue = &eventQueues[( safetyEvents & bit ) ? EVENT_PRIORITY_SAFETY : EVENT_PRIORITY_NORMAL];
 
-        case E_BMS_UPDATE_RECEIVED:
-            break;
+    hal_lock_enter(eventQueueLock);
 
-        case E_BMS_LIVENESS_CHECK_FAILED:
-            break;
-
-        case E_STATION_CAPABILITIES_UPDATED:
-            break;
+    eventStats.posted++;
 
-        case E_STATION_STATUS_UPDATED:
+    if ( queuedEvents & bit ) {
+        eventStats.coalesced++;
+        hal_lock_exit(eventQueueLock);
+        return true;
+    }
 
-            // Winding down is complete
-            if ( station_get_current() <= TERMINATION_CURRENT ) {
-                signal_charge_stop_discrete();
-                //chademo.weldCheckPendingSwitchOn = false;
-                inhibit_contactor_close();
-                //chademo.weldCheckCycles = 0;
-            }
-            break;
+    if ( queue->head - queue->tail >= EVENT_QUEUE_SIZE ) {
+        eventStats.dropped++;
+        hal_lock_exit(eventQueueLock);
+        return false;
+    }
 
-        case E_PLUG_REMOVED:
-            break;
+    uint32_t slot = queue->head & ( EVENT_QUEUE_SIZE - 1 );
+    queue->events[slot] = event;
+    queue->postedAt[slot] = (uint32_t)hal_time_us();
+    queue->head++;
 
-        case E_CHARGE_INHIBIT_ENABLED:
-            break;
+    queuedEvents |= ( coalescedEvents & bit );
 
-        case E_STATION_LIVENESS_CHECK_FAILED:
-            break;
+    eventStats.depth++;
+    if ( eventStats.depth > eventStats.maxDepth ) {
+        eventStats.maxDepth = eventStats.depth;
+    }
 
-        default:
-            printf("WARNING : received invalid event [%s]\n", event);
+    hal_lock_exit(eventQueueLock);
 
-    }
+    // Wake the main loop if it's waiting for work
+    hal_signal_event();
 
+    return true;
 }
 
-
 /*
- * State : weld_detection
- *
- * IN1/CP      : activated
- * IN2/CP2     : activated
- * OUT1/CP3    : deactivated
- * OUT2/cont   : activated
- * CS          : activated
- * Plug locked : yes
- *
+ * Take the next event off the queues, safety events first. Returns false if
+ * there's nothing queued.
  */
-void state_weld_detection(Event event) {
-
-    switch (event) {
-
-        case E_BMS_UPDATE_RECEIVED:
-            break;
-
-        case E_BMS_LIVENESS_CHECK_FAILED:
-            break;
-
-        case E_STATION_CAPABILITIES_UPDATED:
-            break;
-
-        case E_STATION_STATUS_UPDATED:
-
-            /*
-            // We're waiting for the contactors to turn on
-            if ( chademo.weldCheckPendingSwitchOn ) {
-                if ( station_get_voltage() > ( bms.voltage * 0.9 ) ) {
-                    //chademo.weldCheckPendingSwitchOn = false;
-                    //chademo.weldCheckCycles += 1;
-                }
-            }
-
-            // We're waiting for the contactors to turn off
-            else {
-                if ( station_get_voltage() < ( bms.voltage * 0.1 ) ) {
-                    //chademo.weldCheckPendingSwitchOn = true;
-                    //chademo.weldCheckCycles += 1;
-                }
-            }
-
-            
-            if ( chademo.weldCheckCycles > 3 ) {
-                // 102.5.3 high
-                state = state_plug_in;
-            }
-            */
-
-            break;
-
-        case E_PLUG_REMOVED:
-            break;
-
-        case E_CHARGE_INHIBIT_ENABLED:
-            break;
-
-        case E_STATION_LIVENESS_CHECK_FAILED:
+static bool next_event(Event *event, uint32_t *postedAt) {
+
+    bool found = false;
+
+    hal_lock_enter(eventQueueLock);
+
+    for ( int p = 0; p < N_EVENT_PRIORITIES; p++ ) {
+        EventQueue *queue = &eventQueues[p];
+        if ( queue->tail != queue->head ) {
+            uint32_t slot = queue->tail & ( EVENT_QUEUE_SIZE - 1 );
+            *event = (Event)queue->events[slot];
+            *postedAt = queue->postedAt[slot];
+            queue->tail++;
+            // From here on a new one has to be queued again
+            queuedEvents &= ~EVENT_BIT(*event);
+            eventStats.depth--;
+            found = true;
             break;
+        }
+    }
 
-        default:
-            printf("WARNING : received invalid event [%s]\n", event);
+    hal_lock_exit(eventQueueLock);
 
-    }
+    return found;
 }
 
+static bool event_queued(Event event) {
+    hal_lock_enter(eventQueueLock);
+    bool queued = ( queuedEvents & EVENT_BIT(event) ) != 0;
+    hal_lock_exit(eventQueueLock);
+    return queued;
+}
 
 /*
- * State : charge_inhibited
- *
- * IN1/CP      : deactivated
- * IN2/CP2     : deactivated
- * OUT1/CP3    : 
- * OUT2        : 
- * CS          : deactivated
- * Plug locked : no
- *
- * Reasons we can be inhibited
- *   - battery is full
- *   - battery is too hot
- *   - battery is too cold (warming in progress)
- *   - CHARGE_INHIBIT signal from BMS has been activated
+ * Whatever the events and frames that got us here, the contactor relay may
+ * only be permitted to close during energy transfer and winding down, with
+ * the station reporting the connector locked. The table inhibits it on every
+ * way out of those, and leaves them if the lock goes, so this never fails
+ * unless the table has a hole in it.
  *
+ * The decoders update the station struct as frames arrive, ahead of the
+ * status event that tells us, so an unlocked connector only counts once
+ * that's been dispatched.
  */
-void state_charge_inhibited(Event event) {
-
-    switch (event) {
-
-        case E_BMS_UPDATE_RECEIVED:
-
-            // Auxiliary CHARGE_INHIBIT check escape
-            if ( ! battery_is_full() && ! battery_is_too_hot() && ! battery_is_too_cold() && ! charge_inhibit_enabled() ) {
-                if ( plug_is_inserted() ) {
-                    printf("Switching to state : plug_in, reason : aux charge_inhibit check passed\n");
-                    state = state_plug_in;
-                } else {
-                    printf("Switching to state : idle, reason : aux charge_inhibit check passed\n");
-                    state = state_idle;
-                }
-            }
-
-            break;
-
-        case E_BMS_LIVENESS_CHECK_FAILED:
-
-            printf("Switching to state : error, reason : BMS liveness check failed\n");
-            state = state_error;
-
-            break;
-
-        case E_PLUG_INSERTED:
-
-            break;
-
-        case E_CHARGE_INHIBIT_DISABLED:
-
-            // We're no longer in an inhibit state, go back to idle or plug_in
-            if ( ! battery_is_full() && ! battery_is_too_hot() && ! battery_is_too_cold() && ! charge_inhibit_enabled() ) {
-                if ( plug_is_inserted() ) {
-                    printf("Switching to state : plug_in, reason : charge_inhibit check passed\n");
-                    state = state_plug_in;
-                } else {
-                    printf("Switching to state : idle, reason : charge_inhibit check passed\n");
-                    state = state_idle;
-                }
-            }
-
-            break;
-
-        /* This event should only fire if we were charging and moved into an
-         * inhibited state.
-         */
-        case E_STATION_LIVENESS_CHECK_FAILED:
+static bool safety_invariants_hold() {
+    if ( ! contactors_are_allowed_to_close() ) {
+        return true;
+    }
+    if ( state != S_ENERGY_TRANSFER && state != S_WINDING_DOWN ) {
+        return false;
+    }
+    return connector_is_locked() || event_queued(E_STATION_STATUS_UPDATED);
+}
 
-            printf("Switching to state : error, reason : bms liveness check failed\n");
-            state = state_error;
+static const Transition invariantViolated = {
+    NULL, abort_charge, S_ERROR, "contactors permitted to close outside energy transfer, or unlocked"
+};
 
-            break;
+/*
+ * Host and fuzz builds stop at the event that broke the invariant. The
+ * firmware doesn't wait for anyone to notice: it inhibits the relay, stops
+ * the charge and goes to the error state.
+ */
+static void enforce_safety_invariants(Event event) {
 
-        default:
-            printf("WARNING : received invalid event [%s]\n", event);
+    #if ASSERT_SAFETY_INVARIANTS
+    assert( safety_invariants_hold() );
+    #endif
 
+    if ( safety_invariants_hold() ) {
+        return;
     }
+
+    printf("WARNING : contactors permitted to close in state [%s] after [%s], connector %s. Inhibiting.\n",
+        states[state].name, events[event], connector_is_locked() ? "locked" : "unlocked");
+    eventStats.invariantViolations++;
+    take_transition(&invariantViolated, event);
 }
 
 /*
- * State : error
- *
- * IN1/CP      : deactivated
- * IN2/CP2     : deactivated
- * OUT1/CP3    : 
- * OUT2        : 
- * CS          : deactivated
- * Plug locked : no
- *
- * We can get into an error state when:
- *   - communication timeout with BMS
- *   - communication timeout with station
- *   - station compatability issue (voltage)
- *   - station reporting a fault
+ * Dispatch queued events, up to EVENT_DISPATCH_BUDGET. Called from the main
+ * loop, which is the only place the state machine runs. Returns the number of
+ * events dispatched.
  */
-void state_error(Event event) {
+uint8_t dispatch_events() {
 
-    switch (event) {
+    uint8_t n = 0;
+    Event event;
+    uint32_t postedAt;
 
-        case E_BMS_UPDATE_RECEIVED:
-            break;
+    while ( n < EVENT_DISPATCH_BUDGET && next_event(&event, &postedAt) ) {
 
-        // Only way out of error is to remove the plug and start over
-        case E_PLUG_REMOVED:
-            chademo_reinitialise();
-            state = state_idle;
-            break;
+        uint32_t latency = (uint32_t)hal_time_us() - postedAt;
+        if ( latency > eventStats.maxLatency ) {
+            eventStats.maxLatency = latency;
+        }
 
-        default:
-            printf("WARNING : received invalid event [%s]\n", event);
+        dispatch_event(event);
+        if ( contactors_are_allowed_to_close() ) {
+            enforce_safety_invariants(event);
+        }
 
+        eventStats.dispatched++;
+        n++;
     }
-}
 
+    if ( n == EVENT_DISPATCH_BUDGET ) {
+        eventStats.budgetExhausted++;
+    }
 
+    return n;
+}
 
+void print_event_stats() {
+    printf("Events : posted %lu, dispatched %lu, coalesced %lu, dropped %lu, budget exhausted %lu\n",
+        (unsigned long)eventStats.posted, (unsigned long)eventStats.dispatched,
+        (unsigned long)eventStats.coalesced, (unsigned long)eventStats.dropped,
+        (unsigned long)eventStats.budgetExhausted);
+    printf("         depth %u, max depth %u, max latency %lu us, state %s\n",
+        eventStats.depth, eventStats.maxDepth, (unsigned long)eventStats.maxLatency, state_name(state));
+    printf("Guards : evaluated %lu, cached %lu\n",
+        (unsigned long)eventStats.guardsEvaluated, (unsigned long)eventStats.guardsCached);
+    printf("Safety : invariant violations %lu\n", (unsigned long)eventStats.invariantViolations);
+    printf("Timeouts :");
+    for ( int s = 0; s < N_STATES; s++ ) {
+        if ( states[s].timeout != 0 ) {
+            printf(" %s (%lu ms) %lu", states[s].name, (unsigned long)states[s].timeout, (unsigned long)stateTimeouts[s]);
+        }
+    }
+    Timestamp deadline = timestamp_load(&stateDeadline);
+    if ( deadline != 0 ) {
+        printf(", %ld ms left in %s", (long)( (int64_t)( deadline - get_time() ) / 1000 ), states[state].name);
+    }
+    printf("\n");
+}
 
+State get_state() {
+    return state;
+}
+
+const char *state_name(State s) {
+    return s < N_STATES ? states[s].name : "unknown";
+}
 
+const char *event_name(Event event) {
+    return event < N_EVENTS ? events[event] : "unknown";
+}
@@ -20,6 +20,9 @@
 #ifndef STATEMACHINE_H
 #define STATEMACHINE_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 typedef enum {
     E_PLUG_INSERTED,
     E_PLUG_REMOVED,
@@ -33,20 +36,55 @@ typedef enum {
     E_CHARGE_INHIBIT_ENABLED,
     E_CHARGE_INHIBIT_DISABLED,
     E_BMS_LIVENESS_CHECK_FAILED,
-    E_STATION_LIVENESS_CHECK_FAILED
+    E_STATION_LIVENESS_CHECK_FAILED,
+    E_CAN_BUS_FAULT,
+    E_STATE_TIMEOUT,
+    E_CONTROL_TICK,
+    N_EVENTS
 } Event;
 
-// Holds the current state of the state machine.
-typedef void (*State)(Event);
-
-void state_idle(Event event);
-void state_plug_in(Event event);
-void state_handshaking(Event event);
-void state_await_connector_lock(Event event);
-void state_await_insulation_test(Event event);
-void state_energy_transfer(Event event);
-void state_winding_down(Event event);
-void state_charge_inhibited(Event event);
-void state_error(Event event);
+typedef enum {
+    S_IDLE,
+    S_PLUG_IN,
+    S_HANDSHAKING,
+    S_AWAIT_CONNECTOR_LOCK,
+    S_AWAIT_INSULATION_TEST,
+    S_ENERGY_TRANSFER,
+    S_WINDING_DOWN,
+    S_WELD_DETECTION,
+    S_CHARGE_INHIBITED,
+    S_ERROR,
+    N_STATES,
+    S_STAY = N_STATES   // Transition target meaning stay put, without running exit and entry hooks
+} State;
+
+typedef enum {
+    EVENT_PRIORITY_SAFETY,   // Input edges, and anything that stops, or should stop, a charge
+    EVENT_PRIORITY_NORMAL,
+    N_EVENT_PRIORITIES
+} EventPriority;
+
+typedef struct {
+    uint32_t posted;
+    uint32_t dispatched;
+    uint32_t coalesced;       // Posted while the same event was still queued
+    uint32_t dropped;         // Posted while the queue was full
+    uint32_t budgetExhausted; // Times we stopped dispatching at EVENT_DISPATCH_BUDGET
+    uint8_t depth;            // Events queued right now
+    uint8_t maxDepth;
+    uint32_t maxLatency;      // Longest from an event being posted to it being dispatched, us
+    uint32_t guardsEvaluated; // Guards run
+    uint32_t guardsCached;    // Guards answered from the cache, as none of their inputs had changed
+    uint32_t invariantViolations; // Times the safety invariants didn't hold after an event, and were enforced
+} EventQueueStats;
+
+void init_state_machine();
+void check_state_deadline();
+bool post_event(Event event);
+uint8_t dispatch_events();
+void print_event_stats();
+State get_state();
+const char *state_name(State state);
+const char *event_name(Event event);
 
 #endif
\ No newline at end of file
@@ -22,39 +22,38 @@
 
 #include "station.h"
 #include "statemachine.h"
+#include "scheduler.h"
 #include "util.h"
 #include "settings.h"
 #include "types.h"
 
 extern Station station;
-extern State state;
 
 
 /*
- * Record the last time we saw a message from the charging station. If we don't
+ * Each message from the charging station pushes its deadline back. If we don't
  * see one within CHADEMO_STATION_TTL timeframe, we've lost communications with
  * the charging station and must terminate the charing session.
  */
 
 void station_heartbeat() {
-    station.lastHeartbeat = get_clock();
+    timestamp_store(&station.heartbeatDeadline, deadline_in_ms(CHADEMO_STATION_TTL));
 }
 
 bool station_is_alive() {
-    return ( ((double)(get_clock() - station.lastHeartbeat) / CLOCKS_PER_SEC) < CHADEMO_STATION_TTL );
+    return ! deadline_passed(timestamp_load(&station.heartbeatDeadline));
 }
 
-struct repeating_timer stationLivenessCheckTimer;
-
-bool station_liveness_check(struct repeating_timer *t) {
+void station_liveness_check() {
     if ( ! station_is_alive() ) {
-        state(E_STATION_LIVENESS_CHECK_FAILED);
+        post_event(E_STATION_LIVENESS_CHECK_FAILED);
     }
-    return true;
 }
 
+// As for the BMS, the station gets CHADEMO_STATION_TTL from here
 void enable_station_liveness_check() {
-    add_repeating_timer_ms(1000, station_liveness_check, NULL, &stationLivenessCheckTimer);
+    station_heartbeat();
+    enable_task(TASK_STATION_LIVENESS);
 }
 
 
@@ -68,6 +67,8 @@ void reinitialise_station() {
     station.maximumVoltageAvailable = 0;
     station.availableCurrent = 0;
     station.vehicleConnectorLock = false;
+    station.dirty |= STATION_FIELD_CONTROL_PROTOCOL_NUMBER | STATION_FIELD_MAXIMUM_VOLTAGE_AVAILABLE |
+                     STATION_FIELD_AVAILABLE_CURRENT | STATION_FIELD_VEHICLE_CONNECTOR_LOCK;
 }
 
 /*
@@ -20,8 +20,10 @@
 #ifndef CHADEMOSTATION_H
 #define CHADEMOSTATION_H
 
+#include <stdint.h>
 #include <stdbool.h>
 
+void station_liveness_check();
 void enable_station_liveness_check();
 void reinitialise_station();
 bool initial_parameter_exchange_with_station_complete();
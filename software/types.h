@@ -21,16 +21,38 @@
 #define TYPES_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
-#include "pico/cyw43_arch.h"
-#include "lwip/pbuf.h"
-#include "lwip/tcp.h"
+
+// Time
+
+typedef uint64_t Timestamp;  // us since boot, see util.h
+
+
+// Fixed point
+
+/*
+ * Physical quantities are integers counting tenths of a unit, not floats. The
+ * M0+ has no FPU, so every float operation is a library call. Tenths are what
+ * the BMS sends, so those signals decode with no scaling at all. The ChaDeMo
+ * bus works in whole volts and amps, and those stay plain integers.
+ *
+ * They are 32 bit, the M0+'s native width, so sums and differences of them
+ * can't overflow.
+ */
+typedef int32_t DeciVolts;    // 0.1 V
+typedef int32_t DeciAmps;     // 0.1 A
+typedef int32_t DeciCelsius;  // 0.1 C
+
+#define DECI(x)  ( (x) * 10 ) // Whole units to tenths
+#define WHOLE(x) ( (x) / 10 ) // Tenths to whole units, rounded toward zero
 
 
 // Battery
 
 typedef struct {
-    float targetVoltage;  // Max voltage to charge to
+    uint16_t targetVoltage;  // Max voltage to charge to, V
     uint8_t chargingTimeMinutes;
     uint8_t chargingTimeMinutesMax;
 
@@ -42,17 +64,41 @@ typedef struct {
 
 // BMS
 
+// Bits in BMS.dirty
+typedef enum {
+    BMS_FIELD_SOC                       = 1 << 0,
+    BMS_FIELD_MAXIMUM_VOLTAGE           = 1 << 1,
+    BMS_FIELD_MAXIMUM_CHARGE_CURRENT    = 1 << 2,
+    BMS_FIELD_MAXIMUM_DISCHARGE_CURRENT = 1 << 3,
+    BMS_FIELD_MINIMUM_VOLTAGE           = 1 << 4,
+    BMS_FIELD_VOLTAGE                   = 1 << 5,
+    BMS_FIELD_MEASURED_VOLTAGE          = 1 << 6,
+    BMS_FIELD_BATTERY_CURRENT           = 1 << 7,
+    BMS_FIELD_BATTERY_TEMPERATURE       = 1 << 8,
+    BMS_FIELD_HIGH_CELL_ALARM           = 1 << 9,
+    BMS_FIELD_LOW_CELL_ALARM            = 1 << 10,
+    BMS_FIELD_HIGH_TEMP_ALARM           = 1 << 11,
+    BMS_FIELD_LOW_TEMP_ALARM            = 1 << 12,
+    BMS_FIELD_CELL_DELTA_ALARM          = 1 << 13,
+    BMS_FIELD_HIGH_CELL_WARN            = 1 << 14,
+    BMS_FIELD_LOW_CELL_WARN             = 1 << 15,
+    BMS_FIELD_HIGH_TEMP_WARN            = 1 << 16,
+    BMS_FIELD_LOW_TEMP_WARN             = 1 << 17,
+    BMS_FIELD_ALL                       = ( 1 << 18 ) - 1
+} BMSField;
+
 typedef struct {
-    clock_t lastHeartbeat;            // Last time we heard from the BMS
+    volatile Timestamp heartbeatDeadline; // When we give up on the BMS if we don't hear from it again
+    uint32_t dirty;                   // BMSFields changed since the state machine last looked
     uint16_t soc;                     // Battery SoC
-    float maximumVoltage;             // 'Full' battery voltage
-    float maximumChargeCurrent;       // Maximum charge current allowed by BMS
-    float maximumDischargeCurrent;    // Maximum discharge current allowed by BMS
-    float minimumVoltage;             // 'Empty' battery voltage
-    float voltage;                    // Actual voltage of battery right now
-    float measuredVoltage;            // Voltage measured by the shunt
-    float batteryCurrent;             // Current (amps) in/out of the battery right now
-    float batteryTemperature;         // Temperature of hottest cell
+    DeciVolts maximumVoltage;         // 'Full' battery voltage
+    DeciAmps maximumChargeCurrent;    // Maximum charge current allowed by BMS
+    DeciAmps maximumDischargeCurrent; // Maximum discharge current allowed by BMS
+    DeciVolts minimumVoltage;         // 'Empty' battery voltage
+    DeciVolts voltage;                // Actual voltage of battery right now
+    DeciVolts measuredVoltage;        // Voltage measured by the shunt
+    DeciAmps batteryCurrent;          // Current in/out of the battery right now
+    DeciCelsius batteryTemperature;   // Temperature of hottest cell
     bool highCellAlarm;               // 
     bool lowCellAlarm;                // 
     bool highTempAlarm;               // 
@@ -74,9 +120,30 @@ typedef struct {
 
 // Station
 
+// Bits in Station.dirty
+typedef enum {
+    STATION_FIELD_WELD_DETECTION_SUPPORTED    = 1 << 0,
+    STATION_FIELD_MAXIMUM_VOLTAGE_AVAILABLE   = 1 << 1,
+    STATION_FIELD_AVAILABLE_CURRENT           = 1 << 2,
+    STATION_FIELD_THRESHOLD_VOLTAGE           = 1 << 3,
+    STATION_FIELD_CONTROL_PROTOCOL_NUMBER     = 1 << 4,
+    STATION_FIELD_OUTPUT_VOLTAGE              = 1 << 5,
+    STATION_FIELD_OUTPUT_CURRENT              = 1 << 6,
+    STATION_FIELD_TIME_REMAINING_SECONDS      = 1 << 7,
+    STATION_FIELD_TIME_REMAINING_MINUTES      = 1 << 8,
+    STATION_FIELD_STATION_STATUS              = 1 << 9,
+    STATION_FIELD_STATION_MALFUNCTION         = 1 << 10,
+    STATION_FIELD_VEHICLE_CONNECTOR_LOCK      = 1 << 11,
+    STATION_FIELD_BATTERY_INCOMPATABILITY     = 1 << 12,
+    STATION_FIELD_CHARGING_SYSTEM_MALFUNCTION = 1 << 13,
+    STATION_FIELD_CHARGER_STOP_CONTROL        = 1 << 14,
+    STATION_FIELD_ALL                         = ( 1 << 15 ) - 1
+} StationField;
+
 typedef struct {
 
-    clock_t lastHeartbeat;
+    volatile Timestamp heartbeatDeadline;  // When we give up on the station if we don't hear from it again
+    uint32_t dirty;            // StationFields changed since the state machine last looked
 
     /*
      * Station capabilites message fields
@@ -94,7 +161,7 @@ typedef struct {
     uint8_t controlProtocolNumber;
     uint16_t outputVoltage;
     uint8_t outputCurrent;
-    uint8_t timeRemainingSeconds;
+    uint16_t timeRemainingSeconds;
     uint8_t timeRemainingMinutes;
 
     /* Indicates when station is outputting current.
@@ -156,20 +223,27 @@ typedef struct {
     uint8_t chargingCurrentRequest;
 
     /*
-     * The time we last changed chargingCurrentRequest. Used to manage ramping
-     * request up/down.
+     * CHADEMO_RAMP_INTERVAL after we last changed chargingCurrentRequest. The
+     * ramp down doesn't step it again before then.
+     */
+    Timestamp nextRampStep;
+
+    /* The current controller's output, before it's rounded down to whole amps
+     * for chargingCurrentRequest, and its integral term in 0.0001 A.
      */
-    clock_t lastCurrentRequestChange;
+    DeciAmps currentCommand;
+    int32_t currentIntegral;
 
-    // The battery voltage at which to stop charging
-    float targetVoltage;
+    // The battery voltage at which to stop charging, V
+    uint16_t targetVoltage;
 
     /* This is the maximum battery voltage we communicate to the station in
      * message 100.4,5. Used by the station to set 'threshold voltage'. This
      * value should not be updated after switch k is turned on. I.e., after
      * vehicle gives go ahead signal. Value updated from BMS prior to that.
+     * Whole volts.
      */
-    float maximumVoltage;
+    uint16_t maximumVoltage;
 
     // The SoC at which to stop charging.
     uint8_t targetSoc;
@@ -193,16 +267,107 @@ typedef struct {
      * deviate by too much for too long.
      */
     bool currentDeviationError;
-    clock_t currentDeviationErrorTimer;
+    Timestamp currentDeviationDeadline;  // When a deviation going on now becomes an error
 
     /* Track whether "Present output voltage" reported by the station and the
      * voltage measured by the bms (shunt) are within +/- 10V.
      */
     bool voltageDeviationError;
-    clock_t voltageDeviationErrorTimer;
+    Timestamp voltageDeviationDeadline;
 
 } Chademo;
 
+/*
+ * Contents of the messages we send to the station, filled in each cycle and
+ * then packed into frames by the message codec.
+ */
+
+typedef struct {
+    uint16_t maximumBatteryVoltage;  // 100.4,5
+    uint8_t chargingRateIndication;  // 100.6
+} ChademoLimitsMessage;
+
+typedef struct {
+    uint16_t chargingTimeSecondsMax; // 101.1, 2550 means not declared
+    uint8_t chargingTimeMinutesMax;  // 101.2
+    uint8_t chargingTimeMinutes;     // 101.3
+    uint16_t batteryCapacityWH;      // 101.5,6
+} ChademoChargeTimeMessage;
+
+typedef struct {
+    uint8_t controlProtocolNumber;   // 102.0
+    uint16_t targetVoltage;          // 102.1,2
+    uint8_t chargingCurrentRequest;  // 102.3
+    uint8_t batteryStatus;           // 102.4
+    uint8_t vehicleStatus;           // 102.5
+    uint8_t chargedRate;             // 102.6
+} ChademoStatusMessage;
+
+
+// CAN
+
+typedef struct {
+    uint32_t framesReceived;     // Total frames read from the controller
+    uint8_t framesLastTick;      // Frames read the last time we serviced the controller
+    uint8_t maxFramesPerTick;    // Most frames read in one go
+    uint32_t budgetExhausted;    // Times we stopped reading at CAN_RX_BUDGET
+    uint32_t overflows;          // RXnOVR events, i.e. frames dropped by the controller
+    uint32_t unhandled;          // Frames that got past the acceptance filters but that we don't handle
+    uint32_t rejected;           // Frames too short, or with values out of range, so not decoded
+    uint32_t queueFull;          // Frames dropped because the decode queue was full
+    uint8_t maxQueued;           // Deepest the decode queue has been
+    uint32_t maxLatency;         // Longest from a frame arriving to it being decoded, us
+    uint32_t framesQueued;       // Frames loaded into the transmit buffers
+    uint32_t framesSent;         // Frames the controller has reported sent
+    uint32_t txBusy;             // Send attempts put off because the transmit buffers were still busy
+    uint32_t txFailed;           // Send attempts that failed outright
+} CANStats;
+
+typedef enum {
+    CAN_ERROR_ACTIVE,
+    CAN_ERROR_PASSIVE,
+    CAN_BUS_OFF
+} CANErrorState;
+
+typedef struct {
+    const char *name;
+    CANErrorState state;
+    uint8_t tec;                  // Transmit error count, last sample
+    uint8_t rec;                  // Receive error count, last sample
+    uint8_t eflg;                 // EFLG, last sample
+    uint8_t maxTec;
+    uint8_t maxRec;
+    uint32_t errorPassiveEvents;  // Times the controller has gone error passive
+    uint32_t busOffEvents;        // Times the controller has gone bus-off
+    uint32_t resets;              // Times we've reset the controller to get it back
+    uint8_t failedResets;         // Resets since the bus was last error active
+    uint64_t busOffSince;         // us since boot
+    bool faulted;                 // We've given up on the bus
+    volatile bool faultPending;   // Fault not yet passed on to the state machine
+} CANHealth;
+
+/* Log2 histogram buckets of us. Bucket n counts times from 2^n us, so the
+ * last bucket takes anything from about 8 s up.
+ */
+#define CAN_TIMING_BUCKETS 24
+#define CAN_TIMING_MAX_IDS 6   // as many as the acceptance filters let through
+
+typedef struct {
+    uint32_t id;
+    uint32_t frames;
+    uint64_t lastArrival;                    // us since boot
+    uint32_t maxInterval;                    // Longest time between two frames, us
+    uint32_t maxLatency;                     // Longest time from arrival to handled, us
+    uint32_t interval[CAN_TIMING_BUCKETS];   // Time between frames
+    uint32_t latency[CAN_TIMING_BUCKETS];    // Time from arrival to handled
+} CANIdTiming;
+
+typedef struct {
+    const char *name;
+    uint8_t n;
+    CANIdTiming ids[CAN_TIMING_MAX_IDS];
+} CANBusTiming;
+
 
 // LED
 
@@ -17,12 +17,48 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "util.h"
+#include "hal.h"
 
-#include <time.h>
-#include <stdio.h>
-#include <pico/stdlib.h>
+Timestamp get_time() {
+    return hal_time_us();
+}
+
+uint64_t us_since(Timestamp then) {
+    Timestamp now = get_time();
+    return now > then ? now - then : 0;
+}
+
+// Saturates rather than wrapping after 49 days
+uint32_t ms_since(Timestamp then) {
+    uint64_t ms = us_since(then) / 1000;
+    return ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+}
+
+Timestamp deadline_in_ms(uint32_t ms) {
+    return get_time() + (uint64_t)ms * 1000;
+}
 
-clock_t get_clock() {
-    return (clock_t) time_us_64() / 10000;
+bool deadline_passed(Timestamp deadline) {
+    return get_time() >= deadline;
 }
 
+// One lock for every shared Timestamp. They're only held for a copy.
+static HALLock *timestampLock;
+
+void init_timestamps() {
+    timestampLock = hal_lock_create();
+}
+
+void timestamp_store(volatile Timestamp *to, Timestamp value) {
+    hal_lock_enter(timestampLock);
+    *to = value;
+    hal_lock_exit(timestampLock);
+}
+
+Timestamp timestamp_load(const volatile Timestamp *from) {
+    hal_lock_enter(timestampLock);
+    Timestamp value = *from;
+    hal_lock_exit(timestampLock);
+    return value;
+}
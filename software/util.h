@@ -20,6 +20,31 @@
 #ifndef UTIL_H
 #define UTIL_H
 
-clock_t get_clock();
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "types.h"
+
+/*
+ * Time. Everything is measured in us since boot, as a 64 bit Timestamp that
+ * won't wrap in the life of the car. Take the time with get_time() and compare
+ * against it with the helpers below, rather than doing sums on raw values.
+ */
+
+Timestamp get_time();
+uint64_t us_since(Timestamp then);
+uint32_t ms_since(Timestamp then);
+Timestamp deadline_in_ms(uint32_t ms);
+bool deadline_passed(Timestamp deadline);
+
+/*
+ * A Timestamp is two words on the M0+, so one shared between the main loop,
+ * a timer or the other core could be read half updated. Use these for any
+ * that are. Masking interrupts only keeps out this core, so they take a lock,
+ * which init_timestamps() creates at startup before anything else runs.
+ */
+void init_timestamps();
+void timestamp_store(volatile Timestamp *to, Timestamp value);
+Timestamp timestamp_load(const volatile Timestamp *from);
 
 #endif
\ No newline at end of file
@@ -28,6 +28,8 @@
 #include "lwip/init.h"
 
 #include "wifi.h"
+#include "cantiming.h"
+#include "flightrecorder.h"
 #include "htmltemplate.h"
 
 
@@ -71,6 +73,9 @@ static err_t tcp_server_sent(void *arg, struct tcp_pcb *pcb, u16_t len) {
     return ERR_OK;
 }
 
+extern CANBusTiming mainCANTiming;
+extern CANBusTiming chademoCANTiming;
+
 static int generate_content(const char *request, const char *params, char *result, size_t max_result_len) {
     printf("Inside generate content\n");
     int len = 0;
@@ -112,6 +117,30 @@ static int generate_content(const char *request, const char *params, char *resul
             len = snprintf(result, max_result_len, LED_TEST_BODY, "OFF", 1, "ON");
         }
     }
+    // Frame timing histograms for both CAN buses
+    if (strncmp(request, CAN_TIMING_URL, sizeof(CAN_TIMING_URL) - 1) == 0) {
+        len = snprintf(result, max_result_len, "<html><body><pre>");
+        if (len < max_result_len) {
+            len += format_CAN_timing(&mainCANTiming, result + len, max_result_len - len);
+        }
+        if (len < max_result_len) {
+            len += format_CAN_timing(&chademoCANTiming, result + len, max_result_len - len);
+        }
+        if (len < max_result_len) {
+            len += snprintf(result + len, max_result_len - len, "</pre></body></html>");
+        }
+    }
+    // Flight recorder dump
+    if (strncmp(request, FLIGHT_RECORDER_URL, sizeof(FLIGHT_RECORDER_URL) - 1) == 0) {
+        len = snprintf(result, max_result_len, "<html><body><pre>");
+        if (len < max_result_len) {
+            len += format_flight_recorder(result + len, max_result_len - len);
+        }
+        if (len < max_result_len) {
+            len += snprintf(result + len, max_result_len - len, "</pre></body></html>");
+        }
+    }
+
     return len;
 }
 
@@ -12,6 +12,8 @@
 #define LED_PARAM "led=%d"
 #define LED_TEST "/ledtest"
 #define LED_GPIO 0
+#define CAN_TIMING_URL "/can"
+#define FLIGHT_RECORDER_URL "/flight"
 #define HTTP_RESPONSE_REDIRECT "HTTP/1.1 302 Redirect\nLocation: http://%s" LED_TEST "\n\n"
 
 #define CSS ""